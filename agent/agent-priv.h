@@ -126,7 +126,16 @@ struct _NiceAgent
 {
   GObject parent;                 /* gobject pointer */
 
-  GMutex agent_mutex;             /* Mutex used for thread-safe lib */
+  GMutex agent_mutex;             /* Mutex used for thread-safe lib. It
+                                     covers the structure of the agent, its
+                                     streams and components; sends only
+                                     hold it to look up their route, see
+                                     NiceComponent.send_mutex */
+  GRWLock send_components_lock;   /* protects send_components */
+  GHashTable *send_components;    /* stream and component ids packed in a
+                                     guint64 -> owned NiceComponent, to
+                                     find the route of a send without the
+                                     agent lock */
 
   gboolean full_mode;             /* property: full-mode */
   gchar *stun_server_ip;          /* property: STUN server IP */
@@ -150,6 +159,8 @@ struct _NiceAgent
   GSList *local_addresses;        /* list of NiceAddresses for local
 				     interfaces */
   GSList *streams;                /* list of Stream objects */
+  GHashTable *streams_by_id;      /* stream id -> the unowned Stream from
+                                     streams */
   GMainContext *main_context;     /* main context pointer */
   guint next_candidate_id;        /* id of next created candidate */
   guint next_stream_id;           /* id of next created candidate */
@@ -177,7 +188,6 @@ struct _NiceAgent
   gboolean keepalive_conncheck;    /* property: keepalive_conncheck */
 
   GQueue pending_signals;
-  guint16 rfc4571_expecting_length;
   gboolean use_ice_udp;
   gboolean use_ice_tcp;
   gboolean use_ice_trickle;
@@ -185,6 +195,12 @@ struct _NiceAgent
   guint conncheck_ongoing_idle_delay; /* ongoing delay before timer stop */
   gboolean controlling_mode;          /* controlling mode used by the
                                          conncheck */
+  gboolean udp_segmentation_offload;  /* property: udp-segmentation-offload */
+  gboolean udp_receive_offload;       /* property: udp-receive-offload */
+  gboolean io_uring;                  /* property: io-uring */
+  guint ice_tcp_notsent_lowat;        /* property: ice-tcp-notsent-lowat */
+  gboolean ice_tcp_fast_open;         /* property: ice-tcp-fast-open */
+  guint turn_max_transactions;        /* property: turn-max-transactions */
   /* XXX: add pointer to internal data struct for ABI-safe extensions */
 };
 
@@ -201,6 +217,9 @@ NiceStream *agent_find_stream (NiceAgent *agent, guint stream_id);
 void agent_gathering_done (NiceAgent *agent);
 void agent_signal_gathering_done (NiceAgent *agent);
 
+/* Lock order: the agent lock, then a component's send_mutex or io_mutex,
+ * then the locks internal to the sockets. send_components_lock may be taken
+ * with the agent lock held, but no other lock is taken while holding it. */
 void agent_lock (NiceAgent *agent);
 void agent_unlock (NiceAgent *agent);
 void agent_unlock_and_emit (NiceAgent *agent);
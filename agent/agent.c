@@ -50,6 +50,7 @@
 
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 #ifndef G_OS_WIN32
 #include <sys/socket.h>
@@ -82,6 +83,7 @@
 #define DEFAULT_STUN_PORT  3478
 #define DEFAULT_UPNP_TIMEOUT 200  /* milliseconds */
 #define DEFAULT_IDLE_TIMEOUT 5000 /* milliseconds */
+#define DEFAULT_TURN_MAX_TRANSACTIONS 8
 
 #define MAX_TCP_MTU 1400 /* Use 1400 because of VPNs and we assume IEE 802.3 */
 
@@ -123,6 +125,12 @@ enum
   PROP_ICE_TRICKLE,
   PROP_SUPPORT_RENOMINATION,
   PROP_IDLE_TIMEOUT,
+  PROP_UDP_SEGMENTATION_OFFLOAD,
+  PROP_UDP_RECEIVE_OFFLOAD,
+  PROP_IO_URING,
+  PROP_ICE_TCP_NOTSENT_LOWAT,
+  PROP_ICE_TCP_FAST_OPEN,
+  PROP_TURN_MAX_TRANSACTIONS,
 };
 
 
@@ -202,22 +210,45 @@ free_queued_signal (QueuedSignal *sig)
   g_slice_free (QueuedSignal, sig);
 }
 
+static void
+agent_emit_signals (GQueue *queue)
+{
+  QueuedSignal *sig;
+
+  while ((sig = g_queue_pop_head (queue))) {
+    g_signal_emitv (sig->params, sig->signal_id, 0, NULL);
+
+    free_queued_signal (sig);
+  }
+}
+
 void
 agent_unlock_and_emit (NiceAgent *agent)
 {
   GQueue queue = G_QUEUE_INIT;
-  QueuedSignal *sig;
 
   queue = agent->pending_signals;
   g_queue_init (&agent->pending_signals);
 
   agent_unlock (agent);
 
-  while ((sig = g_queue_pop_head (&queue))) {
-    g_signal_emitv (sig->params, sig->signal_id, 0, NULL);
+  agent_emit_signals (&queue);
+}
 
-    free_queued_signal (sig);
-  }
+/* Trade the agent lock for the send lock of @component, which is all a send
+ * on its sockets needs. The signals queued so far are moved to @signals, to
+ * be emitted once the send lock is released too, as their handlers may
+ * send. */
+static void
+agent_unlock_for_send (NiceAgent *agent, NiceComponent *component,
+    GQueue *signals)
+{
+  g_mutex_lock (&component->send_mutex);
+
+  *signals = agent->pending_signals;
+  g_queue_init (&agent->pending_signals);
+
+  agent_unlock (agent);
 }
 
 static void
@@ -307,20 +338,72 @@ agent_to_turn_socket_compatibility (NiceAgent *agent)
 }
 
 NiceStream *agent_find_stream (NiceAgent *agent, guint stream_id)
+{
+  return g_hash_table_lookup (agent->streams_by_id,
+      GUINT_TO_POINTER (stream_id));
+}
+
+
+static gint64 *
+send_component_key_new (guint stream_id, guint component_id)
+{
+  gint64 *key = g_new (gint64, 1);
+
+  *key = ((gint64) stream_id << 32) | component_id;
+
+  return key;
+}
+
+/* Must be called with the agent lock held when @stream is added. */
+static void
+agent_add_send_components (NiceAgent *agent, NiceStream *stream)
 {
   GSList *i;
 
-  for (i = agent->streams; i; i = i->next)
-    {
-      NiceStream *s = i->data;
+  g_rw_lock_writer_lock (&agent->send_components_lock);
+  for (i = stream->components; i; i = i->next) {
+    NiceComponent *component = i->data;
 
-      if (s->id == stream_id)
-        return s;
-    }
+    g_hash_table_insert (agent->send_components,
+        send_component_key_new (stream->id, component->id),
+        g_object_ref (component));
+  }
+  g_rw_lock_writer_unlock (&agent->send_components_lock);
+}
 
-  return NULL;
+/* Must be called with the agent lock held when @stream is removed. */
+static void
+agent_remove_send_components (NiceAgent *agent, NiceStream *stream)
+{
+  GSList *i;
+
+  g_rw_lock_writer_lock (&agent->send_components_lock);
+  for (i = stream->components; i; i = i->next) {
+    NiceComponent *component = i->data;
+    gint64 key = ((gint64) stream->id << 32) | component->id;
+
+    g_hash_table_remove (agent->send_components, &key);
+  }
+  g_rw_lock_writer_unlock (&agent->send_components_lock);
 }
 
+/* Returns a new reference to the component, or %NULL. Does not need the
+ * agent lock. */
+static NiceComponent *
+agent_dup_send_component (NiceAgent *agent, guint stream_id,
+    guint component_id)
+{
+  NiceComponent *component;
+  gint64 key = ((gint64) stream_id << 32) | component_id;
+
+  g_rw_lock_reader_lock (&agent->send_components_lock);
+  component = g_hash_table_lookup (agent->send_components, &key);
+  if (component)
+    g_object_ref (component);
+  g_rw_lock_reader_unlock (&agent->send_components_lock);
+
+  return component;
+}
 
 gboolean
 agent_find_component (
@@ -892,6 +975,141 @@ nice_agent_class_init (NiceAgentClass *klass)
         FALSE,
         G_PARAM_READWRITE));
 
+  /**
+   * NiceAgent:udp-segmentation-offload:
+   *
+   * Whether to let the kernel segment bursts of equally sized messages sent
+   * with nice_agent_send_messages_nonblocking() on a UDP pair (UDP generic
+   * segmentation offload). Each run of messages of the same size is handed
+   * to the kernel as a single super-datagram, which saves the per-packet cost
+   * of routing and filtering. If the kernel or the network device does not
+   * support it, the agent silently falls back to sending the messages one by
+   * one.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class,
+      PROP_UDP_SEGMENTATION_OFFLOAD,
+      g_param_spec_boolean (
+        "udp-segmentation-offload",
+        "UDP segmentation offload",
+        "Whether to send bursts of equally sized UDP messages as a single "
+        "segmented super-datagram when the kernel supports it.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:udp-receive-offload:
+   *
+   * Whether UDP sockets created for new candidates let the kernel coalesce
+   * incoming datagrams from the same source into a single buffer (UDP generic
+   * receive offload). The agent splits each buffer back into individual
+   * datagrams before processing them, so this is transparent to the
+   * application, but it cuts the receive-side per-packet cost. It is ignored
+   * if the kernel does not support it.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class, PROP_UDP_RECEIVE_OFFLOAD,
+      g_param_spec_boolean (
+        "udp-receive-offload",
+        "UDP receive offload",
+        "Whether to let the kernel coalesce incoming UDP datagrams on new "
+        "sockets when it supports it.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:io-uring:
+   *
+   * Whether host UDP candidates use sockets driven by io_uring rather than by
+   * polling. Incoming datagrams are then received by the kernel into buffers
+   * shared with the agent, and outgoing ones are submitted in batches, which
+   * saves a system call per packet. Each receive buffer holds the largest
+   * possible UDP payload, so datagrams are never truncated.
+   *
+   * This only has an effect if libnice was built with io_uring support and
+   * the kernel supports it (Linux 6.0 or later); otherwise ordinary sockets
+   * are used.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class, PROP_IO_URING,
+      g_param_spec_boolean (
+        "io-uring",
+        "Use io_uring",
+        "Whether to use io_uring for host UDP sockets when available.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:ice-tcp-notsent-lowat:
+   *
+   * The most bytes ICE-TCP connections may leave unsent in the kernel send
+   * buffer (TCP_NOTSENT_LOWAT), or 0 to let the kernel buffer as much as it
+   * wants. Past it, the connection is not writable: non-reliable sends are
+   * refused, and #NiceAgent::reliable-transport-writable is emitted once the
+   * kernel has drained below it. This bounds the queueing delay of
+   * interactive media over a congested ICE-TCP path. It only applies to
+   * connections established after it is set, and is ignored on platforms
+   * without TCP_NOTSENT_LOWAT.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class, PROP_ICE_TCP_NOTSENT_LOWAT,
+      g_param_spec_uint (
+        "ice-tcp-notsent-lowat",
+        "ICE-TCP unsent low watermark",
+        "The most bytes ICE-TCP connections may leave unsent in the kernel, "
+        "or 0 for no limit.",
+        0, G_MAXINT,
+        0,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:ice-tcp-fast-open:
+   *
+   * Whether host ICE-TCP candidates use TCP Fast Open. Active candidates
+   * then send their first connectivity check inside the SYN, saving a round
+   * trip before the connection is usable, as soon as the peer has handed
+   * them a cookie on an earlier connection. Passive candidates hand out
+   * such cookies and accept data in the SYN, if the system allows it (the
+   * net.ipv4.tcp_fastopen sysctl on Linux). It only applies to candidates
+   * gathered after it is set, and is ignored on platforms without TCP Fast
+   * Open.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class, PROP_ICE_TCP_FAST_OPEN,
+      g_param_spec_boolean (
+        "ice-tcp-fast-open",
+        "ICE-TCP Fast Open",
+        "Whether host ICE-TCP candidates use TCP Fast Open.",
+        FALSE,
+        G_PARAM_READWRITE));
+
+  /**
+   * NiceAgent:turn-max-transactions:
+   *
+   * The most ChannelBind, and the most CreatePermission, requests that each
+   * TURN relay may have in flight at once. Further ones wait until a
+   * response or a timeout frees a slot. The permissions requested while
+   * waiting are batched, several peers to a CreatePermission request. It
+   * only applies to relays allocated after it is set, and only to the
+   * RFC 5766 and draft 9 dialects of TURN.
+   *
+   * Since: 0.1.17
+   */
+   g_object_class_install_property (gobject_class, PROP_TURN_MAX_TRANSACTIONS,
+      g_param_spec_uint (
+        "turn-max-transactions",
+        "TURN maximum transactions",
+        "The most ChannelBind or CreatePermission requests in flight on a "
+        "TURN relay.",
+        1, G_MAXUINT,
+        DEFAULT_TURN_MAX_TRANSACTIONS,
+        G_PARAM_READWRITE));
+
   /* install signals */
 
   /**
@@ -1252,6 +1470,7 @@ nice_agent_init (NiceAgent *agent)
   agent->nomination_mode = NICE_NOMINATION_MODE_AGGRESSIVE;
   agent->support_renomination = FALSE;
   agent->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  agent->turn_max_transactions = DEFAULT_TURN_MAX_TRANSACTIONS;
 
   agent->discovery_list = NULL;
   agent->discovery_unsched_items = 0;
@@ -1272,7 +1491,13 @@ nice_agent_init (NiceAgent *agent)
 
   g_queue_init (&agent->pending_signals);
 
+  agent->streams_by_id = g_hash_table_new (NULL, NULL);
+
   g_mutex_init (&agent->agent_mutex);
+
+  g_rw_lock_init (&agent->send_components_lock);
+  agent->send_components = g_hash_table_new_full (g_int64_hash,
+      g_int64_equal, g_free, g_object_unref);
 }
 
 
@@ -1466,6 +1691,30 @@ nice_agent_get_property (
       g_value_set_boolean (value, agent->use_ice_trickle);
       break;
 
+    case PROP_UDP_SEGMENTATION_OFFLOAD:
+      g_value_set_boolean (value, agent->udp_segmentation_offload);
+      break;
+
+    case PROP_UDP_RECEIVE_OFFLOAD:
+      g_value_set_boolean (value, agent->udp_receive_offload);
+      break;
+
+    case PROP_IO_URING:
+      g_value_set_boolean (value, agent->io_uring);
+      break;
+
+    case PROP_ICE_TCP_NOTSENT_LOWAT:
+      g_value_set_uint (value, agent->ice_tcp_notsent_lowat);
+      break;
+
+    case PROP_ICE_TCP_FAST_OPEN:
+      g_value_set_boolean (value, agent->ice_tcp_fast_open);
+      break;
+
+    case PROP_TURN_MAX_TRANSACTIONS:
+      g_value_set_uint (value, agent->turn_max_transactions);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -1681,6 +1930,30 @@ nice_agent_set_property (
       agent->use_ice_trickle = g_value_get_boolean (value);
       break;
 
+    case PROP_UDP_SEGMENTATION_OFFLOAD:
+      agent->udp_segmentation_offload = g_value_get_boolean (value);
+      break;
+
+    case PROP_UDP_RECEIVE_OFFLOAD:
+      agent->udp_receive_offload = g_value_get_boolean (value);
+      break;
+
+    case PROP_IO_URING:
+      agent->io_uring = g_value_get_boolean (value);
+      break;
+
+    case PROP_ICE_TCP_NOTSENT_LOWAT:
+      agent->ice_tcp_notsent_lowat = g_value_get_uint (value);
+      break;
+
+    case PROP_ICE_TCP_FAST_OPEN:
+      agent->ice_tcp_fast_open = g_value_get_boolean (value);
+      break;
+
+    case PROP_TURN_MAX_TRANSACTIONS:
+      agent->turn_max_transactions = g_value_get_uint (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
     }
@@ -2421,6 +2694,8 @@ void agent_signal_new_selected_pair (NiceAgent *agent, guint stream_id,
     adjust_tcp_clock (agent, stream, component);
   }
 
+  nice_component_publish_send_route (agent, component);
+
   if (nice_debug_is_enabled ()) {
     gchar ip[100];
     guint port;
@@ -2638,7 +2913,8 @@ priv_add_new_candidate_discovery_turn (NiceAgent *agent,
       NiceSocket *new_socket;
       nice_address_set_port (&addr, 0);
 
-      new_socket = nice_udp_bsd_socket_new (&addr);
+      new_socket = nice_udp_bsd_socket_new_full (&addr,
+          agent->udp_receive_offload);
       if (new_socket) {
         _priv_set_socket_tos (agent, new_socket, stream->tos);
         nice_component_attach_socket (component, new_socket);
@@ -2786,6 +3062,9 @@ nice_agent_add_stream (
   stream = nice_stream_new (agent->next_stream_id++, n_components, agent);
 
   agent->streams = g_slist_append (agent->streams, stream);
+  g_hash_table_insert (agent->streams_by_id, GUINT_TO_POINTER (stream->id),
+      stream);
+  agent_add_send_components (agent, stream);
   nice_debug ("Agent %p : allocating stream id %u (%p)", agent, stream->id, stream);
   if (agent->reliable) {
     nice_debug ("Agent %p : reliable stream", agent);
@@ -3419,6 +3698,8 @@ nice_agent_remove_stream (
 
   /* Remove the stream and signal its removal. */
   agent->streams = g_slist_remove (agent->streams, stream);
+  g_hash_table_remove (agent->streams_by_id, GUINT_TO_POINTER (stream->id));
+  agent_remove_send_components (agent, stream);
 
   if (!agent->streams)
     priv_remove_keepalive_timer (agent);
@@ -3669,8 +3950,6 @@ static gboolean priv_add_remote_candidate (
       return FALSE;
     }
     candidate = nice_candidate_new (type);
-    component->remote_candidates = g_slist_append (component->remote_candidates,
-        candidate);
 
     candidate->stream_id = stream_id;
     candidate->component_id = component_id;
@@ -3715,6 +3994,8 @@ static gboolean priv_add_remote_candidate (
       g_strlcpy (candidate->foundation, foundation,
           NICE_CANDIDATE_MAX_FOUNDATION);
 
+    nice_component_add_remote_candidate (component, candidate);
+
     /* We only create a pair when a candidate is new, and not when
      * updating an existing one.
      */
@@ -3906,235 +4187,42 @@ typedef enum {
 } RecvStatus;
 
 /*
- * agent_recv_message_unlocked:
+ * agent_recv_message_process_unlocked:
  * @agent: a #NiceAgent
- * @stream: the stream to receive from
- * @component: the component to receive from
- * @socket: the socket to receive on
- * @message: the message to write into (must have at least 65536 bytes of buffer
- * space)
+ * @stream: the stream the message was received on
+ * @component: the component the message was received on
+ * @nicesock: the socket the message was received on
+ * @message: a message which has just been read from @nicesock, with its @from
+ * address set
+ * @in_place: %TRUE if @message and its buffers are owned by the agent, so TURN
+ * framing can be stripped by advancing the first buffer rather than moving the
+ * payload
  *
- * Receive a single message of data from the given @stream, @component and
- * @socket tuple, in a non-blocking fashion. The caller must ensure that
- * @message contains enough buffers to provide at least 65536 bytes of buffer
- * space, but the buffers may be split as the caller sees fit.
+ * Handle a single message once it has been read from the socket: unwrap TURN
+ * framing, demultiplex STUN, validate the source against the remote candidates
+ * and hand data to pseudo-TCP if the agent is reliable.
  *
  * This must be called with the agent’s lock held.
  *
- * Returns: number of valid messages received on success (i.e. %RECV_SUCCESS or
- * 1), %RECV_OOB if data was successfully received but was handled out-of-band
- * (e.g. due to being a STUN control packet), %RECV_WOULD_BLOCK if no data is
- * available and the call would block, or %RECV_ERROR on error
+ * Returns: %RECV_SUCCESS if @message contains data for the client, %RECV_OOB if
+ * it was handled internally or dropped, or %RECV_WOULD_BLOCK if it was
+ * dropped because the agent only accepts relayed traffic
  */
 static RecvStatus
-agent_recv_message_unlocked (
+agent_recv_message_process_unlocked (
   NiceAgent *agent,
   NiceStream *stream,
   NiceComponent *component,
   NiceSocket *nicesock,
-  NiceInputMessage *message)
+  NiceInputMessage *message,
+  gboolean in_place)
 {
-  NiceAddress from;
   GList *item;
-  RecvStatus retval;
-  gint sockret;
+  RecvStatus retval = RECV_SUCCESS;
   gboolean is_turn = FALSE;
 
-  /* We need an address for packet parsing, below. */
-  if (message->from == NULL) {
-    message->from = &from;
-  }
-
-  /* ICE-TCP requires that all packets be framed with RFC4571 */
-  if (nice_socket_is_reliable (nicesock)) {
-    /* In the case of OC2007 and OC2007R2 which uses UDP TURN for TCP-ACTIVE
-     * and TCP-PASSIVE candidates, the recv_messages will be packetized and
-     * always return an entire frame, so we must read it as is */
-    if (nicesock->type == NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP ||
-        nicesock->type == NICE_SOCKET_TYPE_UDP_TURN) {
-      GSList *cand_i;
-      GInputVector *local_bufs;
-      NiceInputMessage local_message;
-      guint n_bufs = 0;
-      guint16 rfc4571_frame;
-      guint i;
-
-      /* In case of ICE-TCP on UDP-TURN (OC2007 compat), we need to do the recv
-       * on the UDP_TURN socket, but it's possible we receive the source event
-       * on the UDP_TURN_OVER_TCP socket, so in that case, we need to replace
-       * the socket we do the recv on to the topmost socket
-       */
-      for (cand_i = component->local_candidates; cand_i; cand_i = cand_i->next) {
-        NiceCandidate *cand = cand_i->data;
-
-        if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-            cand->stream_id == stream->id &&
-            cand->component_id == component->id &&
-            nice_socket_is_based_on(cand->sockptr, nicesock)) {
-          nice_debug ("Agent %p : Packet received from a TURN socket.",
-              agent);
-          nicesock = cand->sockptr;
-          break;
-        }
-      }
-      /* Count the number of buffers. */
-      if (message->n_buffers == -1) {
-        for (i = 0; message->buffers[i].buffer != NULL; i++)
-          n_bufs++;
-      } else {
-        n_bufs = message->n_buffers;
-      }
-
-      local_bufs = g_alloca ((n_bufs + 1) * sizeof (GInputVector));
-      local_message.buffers = local_bufs;
-      local_message.n_buffers = n_bufs + 1;
-      local_message.from = message->from;
-      local_message.length = 0;
-
-      local_bufs[0].buffer = &rfc4571_frame;
-      local_bufs[0].size = sizeof (guint16);
-
-      for (i = 0; i < n_bufs; i++) {
-        local_bufs[i + 1].buffer = message->buffers[i].buffer;
-        local_bufs[i + 1].size = message->buffers[i].size;
-      }
-      sockret = nice_socket_recv_messages (nicesock, &local_message, 1);
-      if (sockret == 1 && local_message.length >= sizeof (guint16)) {
-        message->length = ntohs (rfc4571_frame);
-      }
-    } else {
-      if (nicesock->type == NICE_SOCKET_TYPE_TCP_PASSIVE) {
-        NiceSocket *new_socket;
-
-        /* Passive candidates when readable should accept and create a new
-         * socket. When established, the connchecks will create a peer reflexive
-         * candidate for it */
-        new_socket = nice_tcp_passive_socket_accept (nicesock);
-        if (new_socket) {
-          _priv_set_socket_tos (agent, new_socket, stream->tos);
-          nice_debug ("Agent %p: add to tcp-pass socket %p a new "
-              "tcp accept socket %p in s/c %d/%d",
-              agent, nicesock, new_socket, stream->id, component->id);
-          nice_component_attach_socket (component, new_socket);
-        }
-        sockret = 0;
-      } else {
-        /* In the case of a real ICE-TCP connection, we can use the socket as a
-         * bytestream and do the read here with caching of data being read
-         */
-        gssize available = g_socket_get_available_bytes (nicesock->fileno);
-
-        /* TODO: Support bytestream reads */
-        message->length = 0;
-        sockret = 0;
-        if (available <= 0) {
-          sockret = available;
-
-          /* If we don't call check_connect_result on an outbound connection,
-           * then is_connected will always return FALSE. That's why we check
-           * both conditions to make sure g_socket_is_connected returns the
-           * correct result, otherwise we end up closing valid connections
-           */
-          if (g_socket_check_connect_result (nicesock->fileno, NULL) == FALSE ||
-              g_socket_is_connected (nicesock->fileno) == FALSE) {
-            /* If we receive a readable event on a TCP_BSD socket which is
-             * not connected, it means that it failed to connect, so we must
-             * return an error to make the socket fail/closed
-             */
-            sockret = -1;
-          } else {
-            gint flags = G_SOCKET_MSG_PEEK;
-
-            /* If available bytes are 0, but the socket is still considered
-             * connected, then either we're just trying to see if there's more
-             * data available or the peer closed the connection.
-             * The only way to know is to do a read, so we do here a peek and
-             * check the return value, if it's 0, it means the peer has closed
-             * the connection, so we must return an error instead of WOULD_BLOCK
-             */
-            if (g_socket_receive_message (nicesock->fileno, NULL,
-                    NULL, 0, NULL, NULL, &flags, NULL, NULL) == 0)
-              sockret = -1;
-          }
-        } else if (agent->rfc4571_expecting_length == 0) {
-          if ((gsize) available >= sizeof(guint16)) {
-            guint16 rfc4571_frame;
-            GInputVector local_buf = { &rfc4571_frame, sizeof(guint16)};
-            NiceInputMessage local_message = { &local_buf, 1, message->from, 0};
-
-            sockret = nice_socket_recv_messages (nicesock, &local_message, 1);
-            if (sockret == 1 && local_message.length >= sizeof (guint16)) {
-              agent->rfc4571_expecting_length = ntohs (rfc4571_frame);
-              available = g_socket_get_available_bytes (nicesock->fileno);
-            }
-          }
-        }
-        if (agent->rfc4571_expecting_length > 0 &&
-            available >= agent->rfc4571_expecting_length) {
-          GInputVector *local_bufs;
-          NiceInputMessage local_message;
-          gsize off;
-          guint n_bufs = 0;
-          guint i;
-
-          /* Count the number of buffers. */
-          if (message->n_buffers == -1) {
-            for (i = 0; message->buffers[i].buffer != NULL; i++)
-              n_bufs++;
-          } else {
-            n_bufs = message->n_buffers;
-          }
-
-          local_bufs = g_alloca (n_bufs * sizeof (GInputVector));
-          local_message.buffers = local_bufs;
-          local_message.from = message->from;
-          local_message.length = 0;
-          local_message.n_buffers = 0;
-
-          /* Only read up to the expected number of bytes in the frame */
-          off = 0;
-          for (i = 0; i < n_bufs; i++) {
-            if (message->buffers[i].size < agent->rfc4571_expecting_length - off) {
-              local_bufs[i].buffer = message->buffers[i].buffer;
-              local_bufs[i].size = message->buffers[i].size;
-              local_message.n_buffers++;
-              off += message->buffers[i].size;
-            } else {
-              local_bufs[i].buffer = message->buffers[i].buffer;
-              local_bufs[i].size = MIN (message->buffers[i].size,
-                  agent->rfc4571_expecting_length - off);
-              local_message.n_buffers++;
-              off += local_bufs[i].size;
-            }
-          }
-          sockret = nice_socket_recv_messages (nicesock, &local_message, 1);
-          if (sockret == 1) {
-            message->length = local_message.length;
-            agent->rfc4571_expecting_length -= local_message.length;
-          }
-        }
-      }
-    }
-  } else {
-    sockret = nice_socket_recv_messages (nicesock, message, 1);
-  }
-
-  if (sockret == 0) {
-    retval = RECV_WOULD_BLOCK;  /* EWOULDBLOCK */
-    nice_debug_verbose ("%s: Agent %p: no message available on read attempt",
-        G_STRFUNC, agent);
-    goto done;
-  } else if (sockret < 0) {
-    nice_debug ("Agent %p: %s returned %d, errno (%d) : %s",
-        agent, G_STRFUNC, sockret, errno, g_strerror (errno));
+  g_assert (message->from != NULL);
 
-    retval = RECV_ERROR;
-    goto done;
-  } else {
-    retval = sockret;
-  }
-
-  g_assert (retval != RECV_OOB);
   if (message->length == 0) {
     retval = RECV_OOB;
     nice_debug_verbose ("%s: Agent %p: message handled out-of-band", G_STRFUNC,
@@ -4160,13 +4248,13 @@ agent_recv_message_unlocked (
           &component->turn_candidate->turn->server)) {
     is_turn = TRUE;
     retval = nice_udp_turn_socket_parse_recv_message (
-        component->turn_candidate->sockptr, &nicesock, message);
+        component->turn_candidate->sockptr, &nicesock, message, in_place);
   }
 
   for (item = component->turn_servers; item && !is_turn;
        item = g_list_next (item)) {
     TurnServer *turn = item->data;
-    GSList *i = NULL;
+    NiceCandidate *cand;
 
     if (!nice_address_equal (message->from, &turn->server))
       continue;
@@ -4175,18 +4263,10 @@ agent_recv_message_unlocked (
         agent);
     is_turn = TRUE;
 
-    for (i = component->local_candidates; i; i = i->next) {
-      NiceCandidate *cand = i->data;
-
-      if (cand->type == NICE_CANDIDATE_TYPE_RELAYED &&
-          cand->turn == turn &&
-          cand->stream_id == stream->id &&
-          nice_socket_is_based_on (cand->sockptr, nicesock)) {
-        retval = nice_udp_turn_socket_parse_recv_message (cand->sockptr, &nicesock,
-            message);
-        break;
-      }
-    }
+    cand = nice_component_find_relayed_candidate (component, nicesock, turn);
+    if (cand != NULL)
+      retval = nice_udp_turn_socket_parse_recv_message (cand->sockptr, &nicesock,
+          message, in_place);
     break;
   }
 
@@ -4300,6 +4380,153 @@ agent_recv_message_unlocked (
     }
   }
 
+done:
+  return retval;
+}
+
+/* Most connections accepted per wakeup of a passive ICE-TCP socket, so that a
+ * connection storm does not starve the other sources of the main context */
+#define TCP_PASSIVE_ACCEPT_BUDGET 64
+
+/*
+ * agent_recv_message_unlocked:
+ * @agent: a #NiceAgent
+ * @stream: the stream to receive from
+ * @component: the component to receive from
+ * @socket: the socket to receive on
+ * @message: the message to write into (must have at least 65536 bytes of buffer
+ * space)
+ *
+ * Receive a single message of data from the given @stream, @component and
+ * @socket tuple, in a non-blocking fashion. The caller must ensure that
+ * @message contains enough buffers to provide at least 65536 bytes of buffer
+ * space, but the buffers may be split as the caller sees fit.
+ *
+ * This must be called with the agent’s lock held.
+ *
+ * Returns: number of valid messages received on success (i.e. %RECV_SUCCESS or
+ * 1), %RECV_OOB if data was successfully received but was handled out-of-band
+ * (e.g. due to being a STUN control packet), %RECV_WOULD_BLOCK if no data is
+ * available and the call would block, or %RECV_ERROR on error
+ */
+static RecvStatus
+agent_recv_message_unlocked (
+  NiceAgent *agent,
+  NiceStream *stream,
+  NiceComponent *component,
+  NiceSocket *nicesock,
+  NiceInputMessage *message)
+{
+  NiceAddress from;
+  RecvStatus retval;
+  gint sockret;
+
+  /* We need an address for packet parsing, below. */
+  if (message->from == NULL) {
+    message->from = &from;
+  }
+
+  /* ICE-TCP requires that all packets be framed with RFC4571 */
+  if (nice_socket_is_reliable (nicesock)) {
+    /* In the case of OC2007 and OC2007R2 which uses UDP TURN for TCP-ACTIVE
+     * and TCP-PASSIVE candidates, the recv_messages will be packetized and
+     * always return an entire frame, so we must read it as is */
+    if (nicesock->type == NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP ||
+        nicesock->type == NICE_SOCKET_TYPE_UDP_TURN) {
+      NiceCandidate *cand;
+      GInputVector *local_bufs;
+      NiceInputMessage local_message;
+      guint n_bufs = 0;
+      guint16 rfc4571_frame;
+      guint i;
+
+      /* In case of ICE-TCP on UDP-TURN (OC2007 compat), we need to do the recv
+       * on the UDP_TURN socket, but it's possible we receive the source event
+       * on the UDP_TURN_OVER_TCP socket, so in that case, we need to replace
+       * the socket we do the recv on to the topmost socket
+       */
+      cand = nice_component_find_relayed_candidate (component, nicesock, NULL);
+      if (cand != NULL) {
+        nice_debug ("Agent %p : Packet received from a TURN socket.", agent);
+        nicesock = cand->sockptr;
+      }
+      /* Count the number of buffers. */
+      if (message->n_buffers == -1) {
+        for (i = 0; message->buffers[i].buffer != NULL; i++)
+          n_bufs++;
+      } else {
+        n_bufs = message->n_buffers;
+      }
+
+      local_bufs = g_alloca ((n_bufs + 1) * sizeof (GInputVector));
+      local_message.buffers = local_bufs;
+      local_message.n_buffers = n_bufs + 1;
+      local_message.from = message->from;
+      local_message.length = 0;
+
+      local_bufs[0].buffer = &rfc4571_frame;
+      local_bufs[0].size = sizeof (guint16);
+
+      for (i = 0; i < n_bufs; i++) {
+        local_bufs[i + 1].buffer = message->buffers[i].buffer;
+        local_bufs[i + 1].size = message->buffers[i].size;
+      }
+      sockret = nice_socket_recv_messages (nicesock, &local_message, 1);
+      if (sockret == 1 && local_message.length >= sizeof (guint16)) {
+        message->length = ntohs (rfc4571_frame);
+      }
+    } else {
+      if (nicesock->type == NICE_SOCKET_TYPE_TCP_PASSIVE) {
+        NiceSocket *new_socket;
+        guint n_accepted;
+
+        /* Passive candidates when readable should accept and create a new
+         * socket. When established, the connchecks will create a peer reflexive
+         * candidate for it. The whole backlog is accepted at once, within a
+         * budget, as peers tend to connect all together. */
+        for (n_accepted = 0; n_accepted < TCP_PASSIVE_ACCEPT_BUDGET;
+             n_accepted++) {
+          new_socket = nice_tcp_passive_socket_accept (nicesock);
+          if (new_socket == NULL)
+            break;
+
+          _priv_set_socket_tos (agent, new_socket, stream->tos);
+          if (agent->ice_tcp_notsent_lowat > 0)
+            nice_tcp_bsd_socket_set_notsent_lowat (new_socket,
+                agent->ice_tcp_notsent_lowat);
+          nice_debug ("Agent %p: add to tcp-pass socket %p a new "
+              "tcp accept socket %p in s/c %d/%d",
+              agent, nicesock, new_socket, stream->id, component->id);
+          nice_component_attach_socket (component, new_socket);
+        }
+        sockret = 0;
+      } else {
+        /* In the case of a real ICE-TCP connection, the socket is a
+         * bytestream: tcp-bsd reads whatever is available and reassembles the
+         * RFC4571 frames itself, one of which is returned per call. */
+        sockret = nice_tcp_bsd_socket_recv_frame (nicesock, message);
+      }
+    }
+  } else {
+    sockret = nice_socket_recv_messages (nicesock, message, 1);
+  }
+
+  if (sockret == 0) {
+    retval = RECV_WOULD_BLOCK;  /* EWOULDBLOCK */
+    nice_debug_verbose ("%s: Agent %p: no message available on read attempt",
+        G_STRFUNC, agent);
+    goto done;
+  } else if (sockret < 0) {
+    nice_debug ("Agent %p: %s returned %d, errno (%d) : %s",
+        agent, G_STRFUNC, sockret, errno, g_strerror (errno));
+
+    retval = RECV_ERROR;
+    goto done;
+  }
+
+  retval = agent_recv_message_process_unlocked (agent, stream, component,
+      nicesock, message, FALSE);
+
 done:
   /* Clear local modifications. */
   if (message->from == &from) {
@@ -4309,6 +4536,64 @@ done:
   return retval;
 }
 
+/*
+ * agent_recv_messages_unlocked:
+ * @agent: a #NiceAgent
+ * @stream: the stream to receive from
+ * @component: the component to receive from
+ * @socket: the unreliable socket to receive on
+ * @messages: the messages to write into, each with its @from address set
+ * @n_messages: number of elements in @messages
+ *
+ * Receive up to @n_messages datagrams from @socket in as few system calls as
+ * the socket allows, then process each of them as
+ * agent_recv_message_unlocked() would. Messages which were handled
+ * out-of-band or dropped have their length reset to zero.
+ *
+ * @messages and their buffers must be owned by the agent: relayed data is left
+ * where it was received and the first buffer of its message is advanced past
+ * the TURN framing.
+ *
+ * This must be called with the agent’s lock held.
+ *
+ * Returns: number of messages read from the socket (including those handled
+ * out-of-band), %RECV_WOULD_BLOCK if no data is available and the call would
+ * block, or %RECV_ERROR on error
+ */
+static gint
+agent_recv_messages_unlocked (
+  NiceAgent *agent,
+  NiceStream *stream,
+  NiceComponent *component,
+  NiceSocket *nicesock,
+  NiceInputMessage *messages,
+  guint n_messages)
+{
+  gint n_recvd, i;
+
+  g_assert (!nice_socket_is_reliable (nicesock));
+
+  n_recvd = nice_socket_recv_messages (nicesock, messages, n_messages);
+
+  if (n_recvd == 0) {
+    nice_debug_verbose ("%s: Agent %p: no message available on read attempt",
+        G_STRFUNC, agent);
+    return RECV_WOULD_BLOCK;
+  } else if (n_recvd < 0) {
+    nice_debug ("Agent %p: %s returned %d, errno (%d) : %s",
+        agent, G_STRFUNC, n_recvd, errno, g_strerror (errno));
+    return RECV_ERROR;
+  }
+
+  for (i = 0; i < n_recvd; i++) {
+    if (agent_recv_message_process_unlocked (agent, stream, component,
+            nicesock, &messages[i], TRUE) != RECV_SUCCESS)
+      messages[i].length = 0;
+  }
+
+  return n_recvd;
+}
+
 /* Print the composition of an array of messages. No-op if debugging is
  * disabled. */
 static void
@@ -4943,6 +5228,287 @@ nice_agent_recv_nonblocking (NiceAgent *agent, guint stream_id,
   return local_messages.length;
 }
 
+/* Split long messages into 62KB packets, leaving enough space for TURN
+ * overhead as well */
+#define RFC4571_MAX_FRAME_LEN 0xF800
+/* Batches of small messages are framed without allocating */
+#define RFC4571_STACK_FRAMES 32
+
+/* Number of buffers written to a bytestream socket at once: more are
+ * refused by writev() */
+#ifdef IOV_MAX
+#define RFC4571_MAX_BATCH_BUFS IOV_MAX
+#else
+#define RFC4571_MAX_BATCH_BUFS 1024
+#endif
+
+/* Send @messages on the reliable socket @sock, framed with RFC4571. On a
+ * bytestream the frames of the whole batch are handed to the socket as a
+ * single message, so they go out in one vectored write. Other sockets (TURN
+ * relays) get one message per frame, and once part of a message has been
+ * sent the rest of it is sent reliably so it arrives whole. Returns the number
+ * of messages sent, or -1 if none could be sent because of an error. */
+static gint
+priv_send_messages_rfc4571 (NiceSocket *sock, const NiceAddress *addr,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  guint16 stack_headers[RFC4571_STACK_FRAMES];
+  GOutputVector stack_bufs[3 * RFC4571_STACK_FRAMES];
+  NiceOutputMessage stack_frames[RFC4571_STACK_FRAMES];
+  guint16 *headers = stack_headers;
+  GOutputVector *bufs = stack_bufs;
+  NiceOutputMessage *frames = stack_frames;
+  guint n_frames = 0, n_bufs = 0;
+  gboolean bytestream;
+  gint n_sent = 0;
+  guint i, j;
+
+  bytestream = (sock->type == NICE_SOCKET_TYPE_TCP_BSD ||
+      sock->type == NICE_SOCKET_TYPE_TCP_PASSIVE);
+
+  /* Each frame needs a header, and may split one of the message's buffers. */
+  for (i = 0; i < n_messages; i++) {
+    const NiceOutputMessage *message = &messages[i];
+    gsize message_len = output_message_get_size (message);
+
+    for (j = 0;
+         (message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
+         (message->n_buffers < 0 && message->buffers[j].buffer != NULL);
+         j++)
+      n_bufs++;
+
+    n_frames += (message_len + RFC4571_MAX_FRAME_LEN - 1) /
+        RFC4571_MAX_FRAME_LEN;
+  }
+  n_bufs += 2 * n_frames;
+
+  if (n_frames > G_N_ELEMENTS (stack_headers)) {
+    headers = g_new (guint16, n_frames);
+    frames = g_new (NiceOutputMessage, n_frames);
+  }
+  if (n_bufs > G_N_ELEMENTS (stack_bufs))
+    bufs = g_new (GOutputVector, n_bufs);
+
+  n_frames = 0;
+  n_bufs = 0;
+
+  for (i = 0; i < n_messages; i++) {
+    const NiceOutputMessage *message = &messages[i];
+    gsize message_len = output_message_get_size (message);
+    gsize frame_left = 0;
+
+    for (j = 0;
+         message_len > 0 &&
+         ((message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
+          (message->n_buffers < 0 && message->buffers[j].buffer != NULL));
+         j++) {
+      const guint8 *data = message->buffers[j].buffer;
+      gsize size = MIN (message->buffers[j].size, message_len);
+
+      while (size > 0) {
+        gsize chunk;
+
+        if (frame_left == 0) {
+          frame_left = MIN (message_len, RFC4571_MAX_FRAME_LEN);
+          headers[n_frames] = htons ((guint16) frame_left);
+
+          frames[n_frames].buffers = &bufs[n_bufs];
+          frames[n_frames].n_buffers = 0;
+          n_frames++;
+
+          bufs[n_bufs].buffer = &headers[n_frames - 1];
+          bufs[n_bufs].size = sizeof (guint16);
+          n_bufs++;
+          frames[n_frames - 1].n_buffers++;
+        }
+
+        chunk = MIN (size, frame_left);
+        bufs[n_bufs].buffer = data;
+        bufs[n_bufs].size = chunk;
+        n_bufs++;
+        frames[n_frames - 1].n_buffers++;
+
+        data += chunk;
+        size -= chunk;
+        frame_left -= chunk;
+        message_len -= chunk;
+      }
+    }
+  }
+
+  if (n_frames == 0) {
+    /* Nothing but empty messages */
+    n_sent = n_messages;
+  } else if (bytestream) {
+    guint frame = 0, buf = 0;
+
+    /* Write the batch in runs of whole messages which fit in one writev(). */
+    for (i = 0; i < n_messages;) {
+      NiceOutputMessage batch = { &bufs[buf], 0 };
+      guint run = 0, run_frames = 0;
+      gint ret;
+
+      while (i + run < n_messages) {
+        guint message_frames = (output_message_get_size (&messages[i + run]) +
+            RFC4571_MAX_FRAME_LEN - 1) / RFC4571_MAX_FRAME_LEN;
+        guint message_bufs = 0;
+
+        for (j = 0; j < message_frames; j++)
+          message_bufs += frames[frame + run_frames + j].n_buffers;
+
+        if (run > 0 &&
+            batch.n_buffers + message_bufs > RFC4571_MAX_BATCH_BUFS)
+          break;
+
+        batch.n_buffers += message_bufs;
+        run_frames += message_frames;
+        run++;
+      }
+
+      ret = (batch.n_buffers > 0) ?
+          nice_socket_send_messages (sock, addr, &batch, 1) : 1;
+      if (ret != 1) {
+        if (ret < 0 && n_sent == 0)
+          n_sent = ret;
+        break;
+      }
+
+      n_sent += run;
+      i += run;
+      frame += run_frames;
+      buf += batch.n_buffers;
+    }
+  } else {
+    guint frame = 0;
+
+    for (i = 0; i < n_messages; i++) {
+      guint message_frames = (output_message_get_size (&messages[i]) +
+          RFC4571_MAX_FRAME_LEN - 1) / RFC4571_MAX_FRAME_LEN;
+      gint n_sent_framed = 1;
+
+      for (j = 0; j < message_frames && n_sent_framed == 1; j++, frame++) {
+        if (j == 0)
+          n_sent_framed = nice_socket_send_messages (sock, addr,
+              &frames[frame], 1);
+        else
+          n_sent_framed = nice_socket_send_messages_reliable (sock, addr,
+              &frames[frame], 1);
+      }
+
+      if (n_sent_framed < 0 && n_sent == 0)
+        n_sent = n_sent_framed;
+      if (n_sent_framed != 1)
+        break;
+      n_sent++;
+    }
+  }
+
+  if (headers != stack_headers) {
+    g_free (headers);
+    g_free (frames);
+  }
+  if (bufs != stack_bufs)
+    g_free (bufs);
+
+  return n_sent;
+}
+
+/* Send @messages on the UDP socket @sock, handing each run of consecutive
+ * messages of the same size to the kernel as one segmented super-datagram.
+ * Only the last message of a run may be shorter than the others. Returns the
+ * number of messages sent, or -1 if none could be sent because of an error. */
+static gint
+priv_send_messages_segmented (NiceSocket *sock, const NiceAddress *addr,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  guint i = 0;
+  gint n_sent = 0;
+
+  while (i < n_messages) {
+    gsize segment_size = output_message_get_size (&messages[i]);
+    guint run = 1;
+    gint ret;
+
+    while (i + run < n_messages &&
+        run < NICE_UDP_BSD_MAX_SEGMENTS &&
+        (run + 1) * segment_size <= NICE_UDP_BSD_MAX_SEGMENTED_SIZE) {
+      gsize size = output_message_get_size (&messages[i + run]);
+
+      if (size > segment_size)
+        break;
+      run++;
+      if (size < segment_size)
+        break;
+    }
+
+    if (run > 1 && segment_size > 0)
+      ret = nice_udp_bsd_socket_send_segmented (sock, addr, &messages[i], run,
+          segment_size);
+    else
+      ret = nice_socket_send_messages (sock, addr, &messages[i], run);
+
+    if (ret < 0)
+      return (n_sent > 0) ? n_sent : ret;
+
+    n_sent += ret;
+    i += ret;
+
+    if ((guint) ret < run)
+      break;
+  }
+
+  return n_sent;
+}
+
+/* Sends on @route, the send_route of a component whose send lock is held.
+ *
+ * Returns: the same as nice_agent_send_messages_nonblocking_internal(), or 0
+ * if it would block.
+ */
+static gint
+priv_send_on_route (NiceAgent *agent, NiceSendRoute *route,
+    const NiceOutputMessage *messages, guint n_messages,
+    gboolean allow_partial, GError **error)
+{
+  gint n_sent;
+
+  if (nice_debug_is_enabled ()) {
+    gchar tmpbuf[INET6_ADDRSTRLEN];
+    nice_address_to_string (&route->addr, tmpbuf);
+
+    nice_debug_verbose ("Agent %p : sending %u messages to [%s]:%d", agent,
+        n_messages, tmpbuf, nice_address_get_port (&route->addr));
+  }
+
+  if (route->reliable) {
+    /* ICE-TCP requires that all packets be framed with RFC4571 */
+    n_sent = priv_send_messages_rfc4571 (route->sock, &route->addr, messages,
+        n_messages);
+
+    if (route->writable_cancellable &&
+        !nice_socket_can_send (route->sock, &route->addr))
+      g_cancellable_reset (route->writable_cancellable);
+
+  } else if (agent->udp_segmentation_offload && n_messages > 1 &&
+      route->sock->type == NICE_SOCKET_TYPE_UDP_BSD) {
+    n_sent = priv_send_messages_segmented (route->sock, &route->addr,
+        messages, n_messages);
+  } else {
+    n_sent = nice_socket_send_messages (route->sock, &route->addr, messages,
+        n_messages);
+  }
+
+  if (n_sent < 0) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+        "Error writing data to socket.");
+  } else if (n_sent > 0 && allow_partial) {
+    g_assert (n_messages == 1);
+    n_sent = output_message_get_size (messages);
+  }
+
+  return n_sent;
+}
+
 /* nice_agent_send_messages_nonblocking_internal:
  *
  * Returns: number of bytes sent if allow_partial is %TRUE, the number
@@ -4964,9 +5530,28 @@ nice_agent_send_messages_nonblocking_internal (
   gint n_sent = -1; /* is in bytes if allow_partial is TRUE,
                        otherwise in messages */
   GError *child_error = NULL;
+  gboolean locked = TRUE;
+  GQueue signals = G_QUEUE_INIT;
 
   g_assert (n_messages == 1 || !allow_partial);
 
+  /* Fast path: the selected pair has a published route, which only needs
+   * the send lock of the component. */
+  component = agent_dup_send_component (agent, stream_id, component_id);
+  if (component != NULL) {
+    g_mutex_lock (&component->send_mutex);
+    if (component->send_route != NULL) {
+      n_sent = priv_send_on_route (agent, component->send_route, messages,
+          n_messages, allow_partial, &child_error);
+      locked = FALSE;
+    }
+    g_mutex_unlock (&component->send_mutex);
+    g_object_unref (component);
+
+    if (!locked)
+      goto sent;
+  }
+
   agent_lock (agent);
 
   if (!agent_find_component (agent, stream_id, component_id,
@@ -5008,124 +5593,25 @@ nice_agent_send_messages_nonblocking_internal (
             "Pseudo-TCP socket not connected.");
       }
     } else {
-      NiceSocket *sock;
-      NiceAddress *addr;
-
-      sock = component->selected_pair.local->sockptr;
-      addr = &component->selected_pair.remote->addr;
-
-      if (nice_socket_is_reliable (sock)) {
-        guint i;
-
-        /* ICE-TCP requires that all packets be framed with RFC4571 */
-        n_sent = 0;
-        for (i = 0; i < n_messages; i++) {
-          const NiceOutputMessage *message = &messages[i];
-          gsize message_len = output_message_get_size (message);
-          gsize offset = 0;
-          gsize current_offset = 0;
-          gsize offset_in_buffer = 0;
-          gint n_sent_framed;
-          GOutputVector *local_bufs;
-          NiceOutputMessage local_message;
-          guint j;
-          guint n_bufs = 0;
-
-          /* Count the number of buffers. */
-          if (message->n_buffers == -1) {
-            for (j = 0; message->buffers[j].buffer != NULL; j++)
-              n_bufs++;
-          } else {
-            n_bufs = message->n_buffers;
-          }
-
-          local_bufs = g_malloc_n (n_bufs + 1, sizeof (GOutputVector));
-          local_message.buffers = local_bufs;
-
-          while (message_len > 0) {
-            guint16 packet_len;
-            guint16 rfc4571_frame;
-
-            /* Split long messages into 62KB packets, leaving enough space
-             * for TURN overhead as well */
-            if (message_len > 0xF800)
-              packet_len = 0xF800;
-            else
-              packet_len = (guint16) message_len;
-            message_len -= packet_len;
-            rfc4571_frame = htons (packet_len);
-
-            local_bufs[0].buffer = &rfc4571_frame;
-            local_bufs[0].size = sizeof (guint16);
-
-            local_message.n_buffers = 1;
-            /* If we had to split the message, we need to find which buffer
-             * to start copying from and our offset within that buffer */
-            offset_in_buffer = 0;
-            current_offset = 0;
-            for (j = 0; j < n_bufs; j++) {
-              if (message->buffers[j].size < offset - current_offset) {
-                current_offset += message->buffers[j].size;
-                continue;
-              } else {
-                offset_in_buffer = offset - current_offset;
-                current_offset = offset;
-                break;
-              }
-            }
+      if (component->send_route == NULL)
+        nice_component_publish_send_route (agent, component);
 
-            /* Keep j position in array and start copying from there */
-            for (; j < n_bufs; j++) {
-              local_bufs[local_message.n_buffers].buffer =
-                  ((guint8 *) message->buffers[j].buffer) + offset_in_buffer;
-              local_bufs[local_message.n_buffers].size =
-                  MIN (message->buffers[j].size, packet_len);
-              packet_len -= local_bufs[local_message.n_buffers].size;
-              offset += local_bufs[local_message.n_buffers++].size;
-              offset_in_buffer = 0;
-            }
+      /* The route cannot change once the agent lock is released, until the
+       * send lock is too. */
+      agent_unlock_for_send (agent, component, &signals);
+      locked = FALSE;
 
-            /* If we sent part of the message already, then send the rest
-             * reliably so the message is sent as a whole even if it's split */
-            if (current_offset == 0)
-              n_sent_framed = nice_socket_send_messages (sock, addr,
-                  &local_message, 1);
-            else
-              n_sent_framed = nice_socket_send_messages_reliable (sock, addr,
-                  &local_message, 1);
-
-            if (component->tcp_writable_cancellable &&
-                !nice_socket_can_send (sock, addr))
-              g_cancellable_reset (component->tcp_writable_cancellable);
-
-            if (n_sent_framed < 0 && n_sent == 0)
-              n_sent = n_sent_framed;
-            if (n_sent_framed != 1)
-              break;
-            /* This is the last split frame, increment n_sent */
-            if (message_len == 0)
-              n_sent ++;
-          }
-          g_free (local_bufs);
-        }
+      n_sent = priv_send_on_route (agent, component->send_route, messages,
+          n_messages, allow_partial, &child_error);
 
-      } else {
-        n_sent = nice_socket_send_messages (sock, addr, messages, n_messages);
-      }
-
-      if (n_sent < 0) {
-        g_set_error (&child_error, G_IO_ERROR, G_IO_ERROR_FAILED,
-            "Error writing data to socket.");
-      } else if (n_sent > 0 && allow_partial) {
-        g_assert (n_messages == 1);
-        n_sent = output_message_get_size (messages);
-      }
+      g_mutex_unlock (&component->send_mutex);
     }
   } else {
     /* Socket isn’t properly open yet. */
     n_sent = 0;  /* EWOULDBLOCK */
   }
 
+sent:
   /* Handle errors and cancellations. */
   if (n_sent == 0) {
     g_set_error_literal (&child_error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK,
@@ -5147,7 +5633,10 @@ done:
   if (child_error != NULL)
     g_propagate_error (error, child_error);
 
-  agent_unlock_and_emit (agent);
+  if (locked)
+    agent_unlock_and_emit (agent);
+  else
+    agent_emit_signals (&signals);
 
   return n_sent;
 }
@@ -5348,6 +5837,8 @@ nice_agent_dispose (GObject *object)
   while (agent->streams) {
     NiceStream *s = agent->streams->data;
 
+    g_hash_table_remove (agent->streams_by_id, GUINT_TO_POINTER (s->id));
+    agent_remove_send_components (agent, s);
     nice_stream_close (agent, s);
     g_object_unref (s);
 
@@ -5391,11 +5882,172 @@ nice_agent_dispose (GObject *object)
 
   g_mutex_clear (&agent->agent_mutex);
 
+  g_clear_pointer (&agent->send_components, g_hash_table_unref);
+  g_clear_pointer (&agent->streams_by_id, g_hash_table_unref);
+  g_rw_lock_clear (&agent->send_components_lock);
+
   if (G_OBJECT_CLASS (nice_agent_parent_class)->dispose)
     G_OBJECT_CLASS (nice_agent_parent_class)->dispose (object);
 
 }
 
+/*
+ * agent_recv_on_route:
+ * @agent: a #NiceAgent
+ * @component: the component which @socket_source belongs to
+ * @socket_source: the readable socket
+ * @remove_source: (out): set if the source must be removed
+ *
+ * Receives datagrams on the socket of @socket_source without the agent lock,
+ * if it is the socket of the published route of @component (see
+ * nice_component_publish_send_route()) and the component has an I/O
+ * callback. Data from the remote address of the route comes from the
+ * selected remote candidate, so it needs no candidate validation and is
+ * handed to the I/O callback straight away. The send lock of the component
+ * keeps the socket alive while it is read, as it does for sends.
+ *
+ * The first datagram of a batch which is anything else, STUN or data from
+ * another candidate, is processed with the rest of its batch under the agent
+ * lock, as agent_recv_messages_unlocked() would.
+ *
+ * Returns: %TRUE if the socket was drained or the source must be removed,
+ * %FALSE if the caller has to go on reading with the agent lock held
+ */
+static gboolean
+agent_recv_on_route (NiceAgent *agent, NiceComponent *component,
+    SocketSource *socket_source, gboolean *remove_source)
+{
+  NiceSocket *nicesock = socket_source->socket;
+  NiceInputMessage messages[NICE_COMPONENT_RECV_BATCH_SIZE];
+  GInputVector bufs[NICE_COMPONENT_RECV_BATCH_SIZE];
+  NiceAddress from[NICE_COMPONENT_RECV_BATCH_SIZE];
+  NiceComponent *send_component;
+  NiceAddress remote;
+  NiceStream *stream;
+  guint8 *batch_buf;
+  gboolean rfc3489;
+  gboolean drained = FALSE;
+  gint n_recvd, i;
+
+  if (agent->reliable || nice_socket_is_reliable (nicesock) ||
+      !nice_component_has_io_callback (component))
+    return FALSE;
+
+  /* Holds a reference on the component, as long as its stream is there */
+  send_component = agent_dup_send_component (agent, component->stream_id,
+      component->id);
+  if (send_component != component) {
+    g_clear_object (&send_component);
+    return FALSE;
+  }
+
+  rfc3489 = (agent->compatibility != NICE_COMPATIBILITY_OC2007 &&
+      agent->compatibility != NICE_COMPATIBILITY_OC2007R2);
+  batch_buf = nice_component_acquire_recv_batch_buffer (component);
+
+  while (TRUE) {
+    for (i = 0; i < NICE_COMPONENT_RECV_BATCH_SIZE; i++) {
+      bufs[i].buffer = batch_buf + i * NICE_COMPONENT_RECV_SLOT_SIZE;
+      bufs[i].size = NICE_COMPONENT_RECV_SLOT_SIZE;
+      messages[i].buffers = &bufs[i];
+      messages[i].n_buffers = 1;
+      messages[i].from = &from[i];
+      messages[i].length = 0;
+    }
+
+    /* The socket is freed after its source is destroyed, with the send
+     * lock held */
+    g_mutex_lock (&component->send_mutex);
+    if (component->send_route == NULL ||
+        !component->send_route->recv_direct ||
+        component->send_route->sock != nicesock ||
+        g_source_is_destroyed (g_main_current_source ())) {
+      g_mutex_unlock (&component->send_mutex);
+      goto out;
+    }
+    remote = component->send_route->addr;
+    n_recvd = nice_socket_recv_messages (nicesock, messages,
+        NICE_COMPONENT_RECV_BATCH_SIZE);
+    g_mutex_unlock (&component->send_mutex);
+
+    if (n_recvd == 0) {
+      drained = TRUE;
+      goto out;
+    } else if (n_recvd < 0) {
+      break;
+    }
+
+    for (i = 0; i < n_recvd; i++) {
+      if (messages[i].length == 0)
+        continue;
+
+      /* Anything which may be STUN goes through the agent */
+      if (!nice_address_equal (&from[i], &remote) ||
+          stun_message_validate_buffer_length_fast (
+              (StunInputVector *) messages[i].buffers, messages[i].n_buffers,
+              messages[i].length, rfc3489) == (ssize_t) messages[i].length)
+        break;
+
+      g_atomic_int_set (&agent->media_after_tick, TRUE);
+      nice_component_deliver_io_message (agent, component, bufs[i].buffer,
+          messages[i].length);
+
+      if (g_source_is_destroyed (g_main_current_source ())) {
+        nice_debug ("Component IO source disappeared during the callback");
+        *remove_source = TRUE;
+        drained = TRUE;
+        goto out;
+      }
+    }
+
+    if (i < n_recvd)
+      break;
+
+    /* A short batch means the socket has been drained. */
+    if (n_recvd < NICE_COMPONENT_RECV_BATCH_SIZE) {
+      drained = TRUE;
+      goto out;
+    }
+  }
+
+  /* The rest needs the agent lock */
+  agent_lock (agent);
+
+  stream = agent_find_stream (agent, component->stream_id);
+  if (stream == NULL || g_source_is_destroyed (g_main_current_source ())) {
+    *remove_source = TRUE;
+  } else if (n_recvd < 0) {
+    nice_debug ("%s: %p: error receiving message", G_STRFUNC, agent);
+    nice_component_remove_socket (agent, component, nicesock);
+    *remove_source = TRUE;
+  } else {
+    for (; i < n_recvd; i++) {
+      if (agent_recv_message_process_unlocked (agent, stream, component,
+              nicesock, &messages[i], TRUE) != RECV_SUCCESS)
+        continue;
+
+      nice_component_emit_io_callback (agent, component, bufs[i].buffer,
+          messages[i].length);
+
+      if (g_source_is_destroyed (g_main_current_source ())) {
+        nice_debug ("Component IO source disappeared during the callback");
+        *remove_source = TRUE;
+        break;
+      }
+    }
+  }
+
+  agent_unlock_and_emit (agent);
+
+  drained = *remove_source || n_recvd < NICE_COMPONENT_RECV_BATCH_SIZE;
+
+out:
+  nice_component_release_recv_batch_buffer (component, batch_buf);
+  g_object_unref (send_component);
+
+  return drained;
+}
+
 gboolean
 component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
 {
@@ -5412,6 +6064,14 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
   if (agent == NULL)
     return G_SOURCE_REMOVE;
 
+  /* Fast path: data from the selected remote candidate only needs the locks
+   * of the component. */
+  if (!(condition & G_IO_HUP) &&
+      agent_recv_on_route (agent, component, socket_source, &remove_source)) {
+    g_object_unref (agent);
+    return !remove_source;
+  }
+
   agent_lock (agent);
 
   stream = agent_find_stream (agent, component->stream_id);
@@ -5528,6 +6188,74 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
 
       has_io_callback = nice_component_has_io_callback (component);
     }
+  } else if (has_io_callback &&
+      !nice_socket_is_reliable (socket_source->socket)) {
+    /* Datagram sockets can return several messages per system call, so
+     * receive a whole batch at a time and then deliver each message. */
+    NiceInputMessage local_messages[NICE_COMPONENT_RECV_BATCH_SIZE];
+    GInputVector local_bufs[NICE_COMPONENT_RECV_BATCH_SIZE];
+    NiceAddress local_from[NICE_COMPONENT_RECV_BATCH_SIZE];
+    guint8 *batch_buf;
+
+    batch_buf = nice_component_acquire_recv_batch_buffer (component);
+
+    while (has_io_callback) {
+      gint n_recvd, i;
+
+      for (i = 0; i < NICE_COMPONENT_RECV_BATCH_SIZE; i++) {
+        local_bufs[i].buffer = batch_buf + i * NICE_COMPONENT_RECV_SLOT_SIZE;
+        local_bufs[i].size = NICE_COMPONENT_RECV_SLOT_SIZE;
+        local_messages[i].buffers = &local_bufs[i];
+        local_messages[i].n_buffers = 1;
+        local_messages[i].from = &local_from[i];
+        local_messages[i].length = 0;
+      }
+
+      n_recvd = agent_recv_messages_unlocked (agent, stream, component,
+          socket_source->socket, local_messages, NICE_COMPONENT_RECV_BATCH_SIZE);
+
+      if (n_recvd == RECV_WOULD_BLOCK) {
+        /* EWOULDBLOCK. */
+        break;
+      } else if (n_recvd == RECV_ERROR) {
+        /* Other error. */
+        nice_debug ("%s: %p: error receiving message", G_STRFUNC, agent);
+        remove_source = TRUE;
+        break;
+      }
+
+      nice_debug_verbose ("%s: %p: received a batch of %d messages", G_STRFUNC,
+          agent, n_recvd);
+
+      for (i = 0; i < n_recvd; i++) {
+        if (local_messages[i].length == 0)
+          continue;
+
+        if (!has_io_callback) {
+          /* The callback was detached part way through the batch, so keep
+           * the remaining messages for whoever reads next. */
+          nice_component_queue_io_message (component, local_bufs[i].buffer,
+              local_messages[i].length);
+          continue;
+        }
+
+        nice_component_emit_io_callback (agent, component, local_bufs[i].buffer,
+            local_messages[i].length);
+
+        if (g_source_is_destroyed (g_main_current_source ())) {
+          nice_debug ("Component IO source disappeared during the callback");
+          g_free (batch_buf);
+          goto out;
+        }
+        has_io_callback = nice_component_has_io_callback (component);
+      }
+
+      /* A short batch means the socket has been drained. */
+      if (n_recvd < NICE_COMPONENT_RECV_BATCH_SIZE)
+        break;
+    }
+
+    nice_component_release_recv_batch_buffer (component, batch_buf);
   } else if (has_io_callback) {
     while (has_io_callback) {
       guint8 local_buf[MAX_BUFFER_SIZE];
@@ -5608,6 +6336,22 @@ component_io_cb (GSocket *gsocket, GIOCondition condition, gpointer user_data)
         break;
       } /* else if (retval == RECV_OOB) { ignore me and continue; } */
     }
+
+    /* Datagrams already split out of a coalesced receive buffer, or ICE-TCP
+     * and TURN-TCP frames already read from the kernel, will not make the
+     * socket readable again, so queue them for the next read rather than
+     * leaving them behind once the client’s buffers are full. */
+    while (!remove_source &&
+        nice_socket_has_pending_recv (socket_source->socket)) {
+      guint8 local_buf[MAX_BUFFER_SIZE];
+      GInputVector local_bufs = { local_buf, sizeof (local_buf) };
+      NiceInputMessage local_message = { &local_bufs, 1, NULL, 0 };
+
+      if (agent_recv_message_unlocked (agent, stream, component,
+              socket_source->socket, &local_message) == RECV_SUCCESS)
+        nice_component_queue_io_message (component, local_buf,
+            local_message.length);
+    }
   }
 
 done:
@@ -6002,6 +6746,7 @@ nice_agent_set_selected_remote_candidate (
     component->selected_pair.local = local;
     component->selected_pair.remote = remote;
     component->selected_pair.priority = priority;
+    nice_component_publish_send_route (agent, component);
     goto done;
   }
 
@@ -113,8 +113,7 @@ socket_source_attach (SocketSource *socket_source, GMainContext *context)
     return;
 
   /* Create a source. */
-  source = g_socket_create_source (socket_source->socket->fileno,
-      G_IO_IN, NULL);
+  source = nice_socket_create_source (socket_source->socket, G_IO_IN);
   g_source_set_callback (source, (GSourceFunc) G_CALLBACK (component_io_cb),
       socket_source, NULL);
 
@@ -144,11 +143,174 @@ socket_source_detach (SocketSource *source)
   source->source = NULL;
 }
 
+static guint
+address_hash (const NiceAddress *addr)
+{
+  const guint32 *words;
+
+  switch (addr->s.addr.sa_family) {
+    case AF_INET:
+      return addr->s.ip4.sin_addr.s_addr ^ addr->s.ip4.sin_port;
+    case AF_INET6:
+      words = (const guint32 *) &addr->s.ip6.sin6_addr;
+      return words[0] ^ words[1] ^ words[2] ^ words[3] ^
+          addr->s.ip6.sin6_port;
+    default:
+      return 0;
+  }
+}
+
+static guint
+candidate_target_hash (gconstpointer key)
+{
+  const NiceCandidate *candidate = key;
+
+  return address_hash (&candidate->addr) ^ candidate->transport;
+}
+
+/* Valid candidates are matched on their address, and on whether they are
+ * UDP or one of the TCP transports: see
+ * nice_component_verify_remote_candidate(). */
+static guint
+valid_candidate_hash (gconstpointer key)
+{
+  const NiceCandidate *candidate = key;
+
+  return address_hash (&candidate->addr) ^
+      (candidate->transport != NICE_CANDIDATE_TRANSPORT_UDP);
+}
+
+static gboolean
+valid_candidate_equal (gconstpointer a, gconstpointer b)
+{
+  const NiceCandidate *candidate_a = a;
+  const NiceCandidate *candidate_b = b;
+
+  return (candidate_a->transport == NICE_CANDIDATE_TRANSPORT_UDP) ==
+      (candidate_b->transport == NICE_CANDIDATE_TRANSPORT_UDP) &&
+      nice_address_equal (&candidate_a->addr, &candidate_b->addr);
+}
+
+/* Removes @candidate from remote_candidates_by_target, before it is removed
+ * from remote_candidates. Another remote candidate with the same target
+ * takes its place. */
+static void
+remote_candidate_unindex (NiceComponent *cmp, NiceCandidate *candidate)
+{
+  GSList *i;
+
+  if (g_hash_table_lookup (cmp->remote_candidates_by_target,
+          candidate) != candidate)
+    return;
+
+  g_hash_table_remove (cmp->remote_candidates_by_target, candidate);
+
+  for (i = cmp->remote_candidates; i; i = i->next) {
+    NiceCandidate *other = i->data;
+
+    if (other != candidate && nice_candidate_equal_target (other, candidate)) {
+      g_hash_table_insert (cmp->remote_candidates_by_target, other, other);
+      break;
+    }
+  }
+}
+
+/* Same for valid_candidates_by_addr and the @link of valid_candidates. */
 static void
-socket_source_free (SocketSource *source)
+valid_candidate_unindex (NiceComponent *cmp, GList *link)
+{
+  GList *i;
+
+  if (g_hash_table_lookup (cmp->valid_candidates_by_addr, link->data) != link)
+    return;
+
+  g_hash_table_remove (cmp->valid_candidates_by_addr, link->data);
+
+  for (i = cmp->valid_candidates; i; i = i->next) {
+    if (i != link && valid_candidate_equal (i->data, link->data)) {
+      g_hash_table_insert (cmp->valid_candidates_by_addr, i->data, i);
+      break;
+    }
+  }
+}
+
+/* Key of relayed_candidates_by_base: a socket a relayed candidate is based
+ * on, and the TURN server it was looked up for, or NULL for any. */
+typedef struct {
+  NiceSocket *base;
+  TurnServer *turn;
+} RelayedCandidateKey;
+
+static guint
+relayed_candidate_key_hash (gconstpointer key)
 {
+  const RelayedCandidateKey *k = key;
+
+  return g_direct_hash (k->base) ^ g_direct_hash (k->turn);
+}
+
+static gboolean
+relayed_candidate_key_equal (gconstpointer a, gconstpointer b)
+{
+  const RelayedCandidateKey *key_a = a;
+  const RelayedCandidateKey *key_b = b;
+
+  return key_a->base == key_b->base && key_a->turn == key_b->turn;
+}
+
+/* Must be called when a relayed candidate leaves local_candidates, or a
+ * socket is freed. */
+static void
+relayed_candidates_invalidate (NiceComponent *cmp)
+{
+  g_hash_table_remove_all (cmp->relayed_candidates_by_base);
+}
+
+static void
+send_route_free (NiceSendRoute *route)
+{
+  g_clear_object (&route->writable_cancellable);
+  g_slice_free (NiceSendRoute, route);
+}
+
+/* Must be called with the agent lock held. Waits for sends in progress on
+ * the current route to return. */
+static void
+nice_component_set_send_route (NiceComponent *component, NiceSendRoute *route)
+{
+  NiceSendRoute *old_route;
+
+  g_mutex_lock (&component->send_mutex);
+  old_route = component->send_route;
+  component->send_route = route;
+  g_mutex_unlock (&component->send_mutex);
+
+  if (old_route)
+    send_route_free (old_route);
+}
+
+/* Must be called with the agent lock held. Waits for sends in progress on
+ * the socket to return. */
+static void
+socket_source_free (NiceComponent *component, SocketSource *source)
+{
+  NiceSendRoute *route;
+
   socket_source_detach (source);
+  relayed_candidates_invalidate (component);
+
+  g_mutex_lock (&component->send_mutex);
+  route = component->send_route;
+  if (route && (route->sock == source->socket ||
+          nice_socket_is_based_on (route->sock, source->socket)))
+    component->send_route = NULL;
+  else
+    route = NULL;
   nice_socket_free (source->socket);
+  g_mutex_unlock (&component->send_mutex);
+
+  if (route)
+    send_route_free (route);
 
   g_slice_free (SocketSource, source);
 }
@@ -191,6 +353,9 @@ nice_component_remove_socket (NiceAgent *agent, NiceComponent *cmp,
           cmp->id, NICE_COMPONENT_STATE_FAILED);
     }
 
+    if (candidate->type == NICE_CANDIDATE_TYPE_RELAYED)
+      relayed_candidates_invalidate (cmp);
+
     refresh_prune_candidate (agent, candidate);
     if (candidate->sockptr != nsocket && stream) {
       discovery_prune_socket (agent, candidate->sockptr);
@@ -226,6 +391,7 @@ nice_component_remove_socket (NiceAgent *agent, NiceComponent *cmp,
     if (stream)
       conn_check_prune_socket (agent, stream, cmp, candidate->sockptr);
 
+    remote_candidate_unindex (cmp, candidate);
     nice_candidate_free (candidate);
 
     cmp->remote_candidates = g_slist_delete_link (cmp->remote_candidates, i);
@@ -294,6 +460,7 @@ nice_component_clean_turn_servers (NiceAgent *agent, NiceComponent *cmp)
       relay_candidates = g_slist_append(relay_candidates, candidate);
     }
     cmp->local_candidates = g_slist_delete_link (cmp->local_candidates, i);
+    relayed_candidates_invalidate (cmp);
     i = next;
   }
 
@@ -320,6 +487,7 @@ nice_component_clear_selected_pair (NiceComponent *component)
   }
 
   memset (&component->selected_pair, 0, sizeof(CandidatePair));
+  nice_component_set_send_route (component, NULL);
 }
 
 /* Must be called with the agent lock held as it touches internal Component
@@ -353,6 +521,7 @@ nice_component_close (NiceAgent *agent, NiceComponent *cmp)
     nice_candidate_free (cmp->turn_candidate),
         cmp->turn_candidate = NULL;
 
+  relayed_candidates_invalidate (cmp);
   while (cmp->local_candidates) {
     agent_remove_local_candidate (agent, cmp->local_candidates->data);
     nice_candidate_free (cmp->local_candidates->data);
@@ -360,6 +529,7 @@ nice_component_close (NiceAgent *agent, NiceComponent *cmp)
         cmp->local_candidates);
   }
 
+  g_hash_table_remove_all (cmp->remote_candidates_by_target);
   g_slist_free_full (cmp->remote_candidates,
       (GDestroyNotify) nice_candidate_free);
   cmp->remote_candidates = NULL;
@@ -454,6 +624,7 @@ nice_component_restart (NiceComponent *cmp)
     else 
       nice_candidate_free (candidate);
   }
+  g_hash_table_remove_all (cmp->remote_candidates_by_target);
   g_slist_free (cmp->remote_candidates),
     cmp->remote_candidates = NULL;
 
@@ -505,9 +676,65 @@ nice_component_update_selected_pair (NiceAgent *agent, NiceComponent *component,
   component->selected_pair.priority = pair->priority;
   component->selected_pair.prflx_priority = pair->prflx_priority;
 
+  nice_component_publish_send_route (agent, component);
+
   nice_component_add_valid_candidate (agent, component, pair->remote);
 }
 
+/* Whether datagrams from @addr could be TURN messages to be unwrapped, as
+ * agent_recv_message_process_unlocked() decides. */
+static gboolean
+component_is_turn_server (NiceComponent *component, const NiceAddress *addr)
+{
+  GList *item;
+
+  if (component->turn_candidate &&
+      nice_address_equal (addr, &component->turn_candidate->turn->server))
+    return TRUE;
+
+  for (item = component->turn_servers; item; item = item->next) {
+    TurnServer *turn = item->data;
+
+    if (nice_address_equal (addr, &turn->server))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/*
+ * Publishes the route of the selected pair of the component, so that
+ * nice_agent_send_messages_nonblocking() can send on it, and component_io_cb()
+ * can deliver data received from it, without the agent lock. Must be called
+ * with the agent lock held each time selected_pair changes.
+ */
+void
+nice_component_publish_send_route (NiceAgent *agent, NiceComponent *component)
+{
+  NiceSendRoute *route = NULL;
+  NiceSocket *sock;
+
+  if (component->selected_pair.local != NULL &&
+      component->selected_pair.remote != NULL) {
+    sock = component->selected_pair.local->sockptr;
+
+    if (!agent->reliable || nice_socket_is_reliable (sock)) {
+      route = g_slice_new0 (NiceSendRoute);
+      route->sock = sock;
+      route->addr = component->selected_pair.remote->addr;
+      route->reliable = nice_socket_is_reliable (sock);
+      route->recv_direct = !route->reliable && !agent->force_relay &&
+          sock->type != NICE_SOCKET_TYPE_UDP_TURN &&
+          !component_is_turn_server (component, &route->addr);
+      if (component->tcp_writable_cancellable)
+        route->writable_cancellable =
+            g_object_ref (component->tcp_writable_cancellable);
+    }
+  }
+
+  nice_component_set_send_route (component, route);
+}
+
 /*
  * Finds a remote candidate with matching address and 
  * transport.
@@ -517,20 +744,66 @@ nice_component_update_selected_pair (NiceAgent *agent, NiceComponent *component,
 NiceCandidate *
 nice_component_find_remote_candidate (NiceComponent *component, const NiceAddress *addr, NiceCandidateTransport transport)
 {
+  NiceCandidate target;
+
+  target.addr = *addr;
+  target.transport = transport;
+
+  return g_hash_table_lookup (component->remote_candidates_by_target,
+      &target);
+}
+
+/*
+ * Finds the relayed local candidate whose socket is based on @nicesock, and
+ * which was allocated on @turn if it is not %NULL. The result is cached for
+ * the receive path.
+ */
+NiceCandidate *
+nice_component_find_relayed_candidate (NiceComponent *component,
+    NiceSocket *nicesock, TurnServer *turn)
+{
+  RelayedCandidateKey key = { nicesock, turn };
+  NiceCandidate *candidate;
   GSList *i;
 
-  for (i = component->remote_candidates; i; i = i->next) {
-    NiceCandidate *candidate = i->data;
+  candidate = g_hash_table_lookup (component->relayed_candidates_by_base,
+      &key);
+  if (candidate != NULL)
+    return candidate;
 
-    if (nice_address_equal(&candidate->addr, addr) &&
-	candidate->transport == transport)
-      return candidate;
+  for (i = component->local_candidates; i; i = i->next) {
+    candidate = i->data;
 
+    if (candidate->type == NICE_CANDIDATE_TYPE_RELAYED &&
+        (turn == NULL || candidate->turn == turn) &&
+        nice_socket_is_based_on (candidate->sockptr, nicesock)) {
+      g_hash_table_insert (component->relayed_candidates_by_base,
+          g_memdup (&key, sizeof (key)), candidate);
+      return candidate;
+    }
   }
-  
+
   return NULL;
 }
 
+/*
+ * Appends a remote candidate, whose address and transport are set, to the
+ * component and indexes it for nice_component_find_remote_candidate().
+ */
+void
+nice_component_add_remote_candidate (NiceComponent *component,
+    NiceCandidate *candidate)
+{
+  component->remote_candidates = g_slist_append (component->remote_candidates,
+      candidate);
+
+  if (nice_address_is_valid (&candidate->addr) &&
+      !g_hash_table_contains (component->remote_candidates_by_target,
+          candidate))
+    g_hash_table_insert (component->remote_candidates_by_target, candidate,
+        candidate);
+}
+
 /*
  * Sets the desired remote candidate as the selected pair
  *
@@ -574,8 +847,7 @@ nice_component_set_selected_remote_candidate (NiceComponent *component,
 
   if (!remote) {
     remote = nice_candidate_copy (candidate);
-    component->remote_candidates = g_slist_append (component->remote_candidates,
-        remote);
+    nice_component_add_remote_candidate (component, remote);
     agent_signal_new_remote_candidate (agent, remote);
   }
 
@@ -585,6 +857,8 @@ nice_component_set_selected_remote_candidate (NiceComponent *component,
   component->selected_pair.remote = remote;
   component->selected_pair.priority = priority;
 
+  nice_component_publish_send_route (agent, component);
+
   /* Get into fallback mode where packets from any source is accepted once
    * this has been called. This is the expected behavior of pre-ICE SIP.
    */
@@ -701,7 +975,7 @@ nice_component_detach_socket (NiceComponent *component, NiceSocket *nicesock)
   component->socket_sources = g_slist_delete_link (component->socket_sources, s);
   component->socket_sources_age++;
 
-  socket_source_free (socket_source);
+  socket_source_free (component, socket_source);
 }
 
 /*
@@ -729,9 +1003,11 @@ nice_component_free_socket_sources (NiceComponent *component)
 {
   nice_debug ("Free socket sources for component %p.", component);
 
-  g_slist_free_full (component->socket_sources,
-      (GDestroyNotify) socket_source_free);
-  component->socket_sources = NULL;
+  while (component->socket_sources) {
+    socket_source_free (component, component->socket_sources->data);
+    component->socket_sources = g_slist_delete_link (
+        component->socket_sources, component->socket_sources);
+  }
   component->socket_sources_age++;
 
   nice_component_clear_selected_pair (component);
@@ -822,6 +1098,63 @@ nice_component_has_io_callback (NiceComponent *component)
   return has_io_callback;
 }
 
+/* This must be called with the agent lock *held*. Queue @buf for delivery by
+ * the next I/O callback or nice_agent_recv_messages() call, without emitting
+ * it directly. */
+void
+nice_component_queue_io_message (NiceComponent *component,
+    const guint8 *buf, gsize buf_len)
+{
+  g_mutex_lock (&component->io_mutex);
+
+  g_queue_push_tail (&component->pending_io_messages,
+      io_callback_data_new (buf, buf_len));  /* transfer ownership */
+
+  if (component->io_callback != NULL)
+    nice_component_schedule_io_callback (component);
+
+  g_mutex_unlock (&component->io_mutex);
+}
+
+/* This may be called with or without the agent lock, but not with the send
+ * lock held. The returned buffer holds NICE_COMPONENT_RECV_BATCH_SIZE slots
+ * of NICE_COMPONENT_RECV_SLOT_SIZE bytes and must be handed back with
+ * nice_component_release_recv_batch_buffer(). The component’s cached buffer
+ * is taken out while in use, so a nested component_io_cb() (for example from
+ * a main loop iterated inside an I/O callback) gets a buffer of its own. */
+guint8 *
+nice_component_acquire_recv_batch_buffer (NiceComponent *component)
+{
+  guint8 *buf;
+
+  g_mutex_lock (&component->io_mutex);
+  buf = component->recv_batch_buf;
+  component->recv_batch_buf = NULL;
+  g_mutex_unlock (&component->io_mutex);
+
+  if (buf == NULL)
+    buf = g_malloc (NICE_COMPONENT_RECV_BATCH_SIZE *
+        NICE_COMPONENT_RECV_SLOT_SIZE);
+
+  return buf;
+}
+
+/* This may be called with or without the agent lock, but not with the send
+ * lock held. */
+void
+nice_component_release_recv_batch_buffer (NiceComponent *component,
+    guint8 *buf)
+{
+  g_mutex_lock (&component->io_mutex);
+  if (component->recv_batch_buf == NULL) {
+    component->recv_batch_buf = buf;
+    buf = NULL;
+  }
+  g_mutex_unlock (&component->io_mutex);
+
+  g_free (buf);
+}
+
 IOCallbackData *
 io_callback_data_new (const guint8 *buf, gsize buf_len)
 {
@@ -917,10 +1250,11 @@ emit_io_callback_cb (gpointer user_data)
   return G_SOURCE_REMOVE;
 }
 
-/* This must be called with the agent lock *held*. */
-void
-nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
-    const guint8 *buf, gsize buf_len)
+/* Emits the I/O callback of @component for @buf. If @agent_locked, the agent
+ * lock is held by the caller, and released around the callback. */
+static void
+component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
+    const guint8 *buf, gsize buf_len, gboolean agent_locked)
 {
   guint stream_id, component_id;
   NiceAgentRecvFunc io_callback;
@@ -936,6 +1270,13 @@ nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
   g_mutex_lock (&component->io_mutex);
   io_callback = component->io_callback;
   io_user_data = component->io_user_data;
+
+  /* Without the agent lock, the callback may be detached by the time a
+   * message is delivered; keep the message for the next reader then. */
+  if (io_callback == NULL && !agent_locked) {
+    g_queue_push_tail (&component->pending_io_messages,
+        io_callback_data_new (buf, buf_len));  /* transfer ownership */
+  }
   g_mutex_unlock (&component->io_mutex);
 
   /* Allow this to be called with a NULL io_callback, since the caller can’t
@@ -952,10 +1293,12 @@ nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
    * handler. */
   if (g_main_context_is_owner (component->ctx)) {
     /* Thread owns the main context, so invoke the callback directly. */
-    agent_unlock_and_emit (agent);
+    if (agent_locked)
+      agent_unlock_and_emit (agent);
     io_callback (agent, stream_id,
         component_id, buf_len, (gchar *) buf, io_user_data);
-    agent_lock (agent);
+    if (agent_locked)
+      agent_lock (agent);
   } else {
     IOCallbackData *data;
 
@@ -975,6 +1318,24 @@ nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
   }
 }
 
+/* This must be called with the agent lock *held*. */
+void
+nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
+    const guint8 *buf, gsize buf_len)
+{
+  component_emit_io_callback (agent, component, buf, buf_len, TRUE);
+}
+
+/* This must be called with the agent lock *not held*. Unlike
+ * nice_component_emit_io_callback(), @buf is queued for the next reader if no
+ * callback is attached any more. */
+void
+nice_component_deliver_io_message (NiceAgent *agent,
+    NiceComponent *component, const guint8 *buf, gsize buf_len)
+{
+  component_emit_io_callback (agent, component, buf, buf_len, FALSE);
+}
+
 /* Note: Must be called with the io_mutex held. */
 static void
 nice_component_schedule_io_callback (NiceComponent *component)
@@ -1091,7 +1452,15 @@ nice_component_init (NiceComponent *component)
   component->tcp = NULL;
   g_weak_ref_init (&component->agent_ref, NULL);
 
+  component->relayed_candidates_by_base = g_hash_table_new_full (
+      relayed_candidate_key_hash, relayed_candidate_key_equal, g_free, NULL);
+  component->remote_candidates_by_target = g_hash_table_new (
+      candidate_target_hash, (GEqualFunc) nice_candidate_equal_target);
+  component->valid_candidates_by_addr = g_hash_table_new (
+      valid_candidate_hash, valid_candidate_equal);
+
   g_mutex_init (&component->io_mutex);
+  g_mutex_init (&component->send_mutex);
   g_queue_init (&component->pending_io_messages);
   component->io_callback_id = 0;
 
@@ -1214,14 +1583,21 @@ nice_component_finalize (GObject *obj)
   g_warn_if_fail (cmp->local_candidates == NULL);
   g_warn_if_fail (cmp->remote_candidates == NULL);
   g_warn_if_fail (g_queue_get_length (&cmp->incoming_checks) == 0);
+  g_warn_if_fail (cmp->send_route == NULL);
 
+  g_hash_table_unref (cmp->relayed_candidates_by_base);
+  g_hash_table_unref (cmp->valid_candidates_by_addr);
   g_list_free_full (cmp->valid_candidates,
       (GDestroyNotify) nice_candidate_free);
+  g_hash_table_unref (cmp->remote_candidates_by_target);
+
+  g_free (cmp->recv_batch_buf);
 
   g_clear_object (&cmp->tcp);
   g_clear_object (&cmp->stop_cancellable);
   g_clear_object (&cmp->iostream);
   g_mutex_clear (&cmp->io_mutex);
+  g_mutex_clear (&cmp->send_mutex);
 
   if (cmp->stop_cancellable_source != NULL) {
     g_source_destroy (cmp->stop_cancellable_source);
@@ -1336,8 +1712,7 @@ component_source_prepare (GSource *source, gint *timeout_)
     child_socket_source = g_slice_new0 (SocketSource);
     child_socket_source->socket = parent_socket_source->socket;
     child_socket_source->source =
-        g_socket_create_source (child_socket_source->socket->fileno, G_IO_IN,
-            NULL);
+        nice_socket_create_source (child_socket_source->socket, G_IO_IN);
     source_set_dummy_callback (child_socket_source->source);
     g_source_add_child_source (source, child_socket_source->source);
     g_source_unref (child_socket_source->source);
@@ -1548,6 +1923,10 @@ nice_component_add_valid_candidate (NiceAgent *agent, NiceComponent *component,
   guint count = 0;
   GList *item, *last = NULL;
 
+  item = g_hash_table_lookup (component->valid_candidates_by_addr, candidate);
+  if (item && nice_candidate_equal_target (item->data, candidate))
+    return;
+
   for (item = component->valid_candidates; item; item = item->next) {
     NiceCandidate *cand = item->data;
 
@@ -1570,6 +1949,11 @@ nice_component_add_valid_candidate (NiceAgent *agent, NiceComponent *component,
 
   component->valid_candidates = g_list_prepend (
       component->valid_candidates, nice_candidate_copy (candidate));
+  if (nice_address_is_valid (&candidate->addr) &&
+      !g_hash_table_contains (component->valid_candidates_by_addr,
+          candidate))
+    g_hash_table_insert (component->valid_candidates_by_addr,
+        component->valid_candidates->data, component->valid_candidates);
 
   /* Delete the last one to make sure we don't have a list that is too long,
    * the candidates are not freed on ICE restart as this would be more complex,
@@ -1578,6 +1962,7 @@ nice_component_add_valid_candidate (NiceAgent *agent, NiceComponent *component,
   if (count > NICE_COMPONENT_MAX_VALID_CANDIDATES) {
     NiceCandidate *cand = last->data;
 
+    valid_candidate_unindex (component, last);
     component->valid_candidates = g_list_delete_link (
         component->valid_candidates, last);
     nice_candidate_free (cand);
@@ -1588,38 +1973,37 @@ gboolean
 nice_component_verify_remote_candidate (NiceComponent *component,
     const NiceAddress *address, NiceSocket *nicesock)
 {
+  NiceCandidate target;
   GList *item;
 
   if (component->fallback_mode)
     return TRUE;
 
-  for (item = component->valid_candidates; item; item = item->next) {
-    NiceCandidate *cand = item->data;
+  /* Packets from UDP candidates are accepted on any socket, those from TCP
+   * candidates only on TCP and TURN sockets. */
+  target.addr = *address;
+  target.transport = NICE_CANDIDATE_TRANSPORT_UDP;
+  item = g_hash_table_lookup (component->valid_candidates_by_addr, &target);
 
-    if ((((nicesock->type == NICE_SOCKET_TYPE_TCP_BSD ||
-                    nicesock->type == NICE_SOCKET_TYPE_UDP_TURN) &&
-                (cand->transport == NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE ||
-                    cand->transport == NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE ||
-                    cand->transport == NICE_CANDIDATE_TRANSPORT_TCP_SO)) ||
-            cand->transport == NICE_CANDIDATE_TRANSPORT_UDP) &&
-        nice_address_equal (address, &cand->addr)) {
-      /* fast return if it's already the first */
-      if (item == component->valid_candidates)
-        return TRUE;
-
-      /* Put the current candidate at the top so that in the normal use-case,
-       * this function becomes O(1).
-       */
-      component->valid_candidates = g_list_remove_link (
-          component->valid_candidates, item);
-      component->valid_candidates = g_list_concat (item,
-          component->valid_candidates);
+  if (item == NULL && (nicesock->type == NICE_SOCKET_TYPE_TCP_BSD ||
+          nicesock->type == NICE_SOCKET_TYPE_UDP_TURN)) {
+    target.transport = NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE;
+    item = g_hash_table_lookup (component->valid_candidates_by_addr, &target);
+  }
 
-      return TRUE;
-    }
+  if (item == NULL)
+    return FALSE;
+
+  /* Put the current candidate at the top, so that the least recently used
+   * ones are dropped first by nice_component_add_valid_candidate(). */
+  if (item != component->valid_candidates) {
+    component->valid_candidates = g_list_remove_link (
+        component->valid_candidates, item);
+    component->valid_candidates = g_list_concat (item,
+        component->valid_candidates);
   }
 
-  return FALSE;
+  return TRUE;
 }
 
 /* Must be called with agent lock held */
@@ -138,6 +138,26 @@ io_callback_data_new (const guint8 *buf, gsize buf_len);
 void
 io_callback_data_free (IOCallbackData *data);
 
+/* Snapshot of where the data of a Component goes: the socket and remote
+ * address of its selected pair. It is immutable once published in
+ * #NiceComponent::send_route, so a send only needs the send lock of the
+ * Component to use it.
+ *
+ * @reliable is set for ICE-TCP sockets, whose packets are framed with
+ * RFC4571. Selected pairs which are sent on through pseudo-TCP have no
+ * route, as pseudo-TCP needs the agent lock.
+ *
+ * @recv_direct is set if data received on @sock from @addr can be handed to
+ * the I/O callback as is: the socket is a plain datagram socket and @addr is
+ * not a TURN server. */
+typedef struct {
+  NiceSocket *sock;
+  NiceAddress addr;
+  gboolean reliable;
+  gboolean recv_direct;
+  GCancellable *writable_cancellable;  /* owned, may be NULL */
+} NiceSendRoute;
+
 #define NICE_TYPE_COMPONENT nice_component_get_type()
 #define NICE_COMPONENT(obj) \
   (G_TYPE_CHECK_INSTANCE_CAST ((obj), NICE_TYPE_COMPONENT, NiceComponent))
@@ -158,8 +178,16 @@ struct _NiceComponent {
   guint id;                    /* component id */
   NiceComponentState state;
   GSList *local_candidates;    /* list of NiceCandidate objs */
+  GHashTable *relayed_candidates_by_base; /* cache of the relayed
+                                             local_candidates found by
+                                             nice_component_find_relayed_candidate() */
   GSList *remote_candidates;   /* list of NiceCandidate objs */
+  GHashTable *remote_candidates_by_target; /* the first of remote_candidates
+                                              with each address and
+                                              transport */
   GList *valid_candidates;     /* list of owned remote NiceCandidates that are part of valid pairs */
+  GHashTable *valid_candidates_by_addr; /* a link of valid_candidates for
+                                           each address, and UDP or TCP */
   GSList *socket_sources;      /* list of SocketSource objs; must only grow monotonically */
   guint socket_sources_age;    /* incremented when socket_sources changes */
   GQueue incoming_checks;     /* list of IncomingCheck objs */
@@ -190,6 +218,19 @@ struct _NiceComponent {
                                          IOCallbackData */
   guint io_callback_id;             /* GSource ID of the I/O callback */
 
+  GMutex send_mutex;                /* held while sending on the sockets of
+                                       selected_pair without the agent lock,
+                                       or reading from the socket of
+                                       send_route, and while freeing sockets,
+                                       so that they outlive the call. It is
+                                       taken after the agent lock, and never
+                                       the other way around */
+  NiceSendRoute *send_route;        /* owned; route of selected_pair, or
+                                       NULL if a send has to go through the
+                                       agent lock. reading it needs either
+                                       send_mutex or the agent lock, changing
+                                       it needs both */
+
   GMainContext *own_ctx;            /* own context for GSources for this
                                        component */
   GMainContext *ctx;                /* context for GSources for this
@@ -224,8 +265,19 @@ struct _NiceComponent {
    * ACKs on. The messages are dequeued to the pseudo-TCP socket once a selected
    * UDP socket is available. This is only used for reliable Components. */
   GQueue queued_tcp_packets;
+
+  /* Scratch buffer of NICE_COMPONENT_RECV_BATCH_SIZE receive slots, used by
+   * component_io_cb() to read several datagrams per system call. Allocated on
+   * first use; NULL while it is in use. Protected by io_mutex. */
+  guint8 *recv_batch_buf;
 };
 
+/* Number of datagrams read per batch in component_io_cb(), and the size of
+ * each receive slot: large enough for any UDP payload. Only the pages which
+ * are actually written to get backed by memory. */
+#define NICE_COMPONENT_RECV_BATCH_SIZE 16
+#define NICE_COMPONENT_RECV_SLOT_SIZE (1 << 16)
+
 typedef struct {
   GObjectClass parent_class;
 } NiceComponentClass;
@@ -253,6 +305,18 @@ NiceCandidate *
 nice_component_find_remote_candidate (NiceComponent *component,
     const NiceAddress *addr, NiceCandidateTransport transport);
 
+void
+nice_component_add_remote_candidate (NiceComponent *component,
+    NiceCandidate *candidate);
+
+NiceCandidate *
+nice_component_find_relayed_candidate (NiceComponent *component,
+    NiceSocket *nicesock, TurnServer *turn);
+
+void
+nice_component_publish_send_route (NiceAgent *agent,
+    NiceComponent *component);
+
 NiceCandidate *
 nice_component_set_selected_remote_candidate (NiceComponent *component,
     NiceAgent *agent, NiceCandidate *candidate);
@@ -286,9 +350,20 @@ nice_component_set_io_callback (NiceComponent *component,
 void
 nice_component_emit_io_callback (NiceAgent *agent, NiceComponent *component,
     const guint8 *buf, gsize buf_len);
+void
+nice_component_deliver_io_message (NiceAgent *agent,
+    NiceComponent *component, const guint8 *buf, gsize buf_len);
 gboolean
 nice_component_has_io_callback (NiceComponent *component);
 void
+nice_component_queue_io_message (NiceComponent *component,
+    const guint8 *buf, gsize buf_len);
+guint8 *
+nice_component_acquire_recv_batch_buffer (NiceComponent *component);
+void
+nice_component_release_recv_batch_buffer (NiceComponent *component,
+    guint8 *buf);
+void
 nice_component_clean_turn_servers (NiceAgent *agent, NiceComponent *component);
 
 
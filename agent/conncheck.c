@@ -203,6 +203,7 @@ priv_socket_type_to_string (NiceSocketType type)
 {
   switch (type) {
     case NICE_SOCKET_TYPE_UDP_BSD:
+    case NICE_SOCKET_TYPE_UDP_URING:
       return "udp";
     case NICE_SOCKET_TYPE_TCP_BSD:
       return "tcp";
@@ -1946,6 +1947,7 @@ nice_socket_has_compatible_transport (NiceSocket *socket,
       *transport = NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE;
       break;
     case NICE_SOCKET_TYPE_UDP_BSD:
+    case NICE_SOCKET_TYPE_UDP_URING:
       *transport = NICE_CANDIDATE_TRANSPORT_UDP;
       break;
     default:
@@ -3125,6 +3127,9 @@ int conn_check_send (NiceAgent *agent, CandidateCheckPair *pair)
             agent, pair->sockptr, new_socket, pair, stream->id, component->id);
         pair->sockptr = new_socket;
         _priv_set_socket_tos (agent, pair->sockptr, stream2->tos);
+        if (agent->ice_tcp_notsent_lowat > 0)
+          nice_tcp_bsd_socket_set_notsent_lowat (pair->sockptr,
+              agent->ice_tcp_notsent_lowat);
 
         nice_socket_set_writable_callback (pair->sockptr, _tcp_sock_is_writable,
             component2);
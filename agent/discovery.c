@@ -653,11 +653,23 @@ HostCandidateResult discovery_add_local_host_candidate (
   /* note: candidate username and password are left NULL as stream
      level ufrag/password are used */
   if (transport == NICE_CANDIDATE_TRANSPORT_UDP) {
-    nicesock = nice_udp_bsd_socket_new (address);
+    if (agent->io_uring)
+      nicesock = nice_udp_uring_socket_new (address);
+    if (nicesock == NULL)
+      nicesock = nice_udp_bsd_socket_new_full (address,
+          agent->udp_receive_offload);
   } else if (transport == NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE) {
     nicesock = nice_tcp_active_socket_new (agent->main_context, address);
+    if (nicesock && agent->ice_tcp_fast_open &&
+        !nice_tcp_active_socket_set_fast_open (nicesock, TRUE))
+      nice_debug ("Agent %p: could not enable TCP Fast Open on %p", agent,
+          nicesock);
   } else if (transport == NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE) {
     nicesock = nice_tcp_passive_socket_new (agent->main_context, address);
+    if (nicesock && agent->ice_tcp_fast_open &&
+        !nice_tcp_passive_socket_set_fast_open (nicesock, TRUE))
+      nice_debug ("Agent %p: could not enable TCP Fast Open on %p", agent,
+          nicesock);
   } else {
     /* TODO: Add TCP-SO */
   }
@@ -840,6 +852,9 @@ discovery_add_relay_candidate (
   if (!relay_socket)
     goto errors;
 
+  nice_udp_turn_socket_set_max_transactions (relay_socket,
+      agent->turn_max_transactions);
+
   candidate->sockptr = relay_socket;
   candidate->base_addr = base_socket->addr;
 
@@ -915,6 +930,7 @@ discovery_add_peer_reflexive_candidate (
     candidate->transport = conn_check_match_transport (remote->transport);
   else {
     if (base_socket->type == NICE_SOCKET_TYPE_UDP_BSD ||
+        base_socket->type == NICE_SOCKET_TYPE_UDP_URING ||
         base_socket->type == NICE_SOCKET_TYPE_UDP_TURN)
       candidate->transport = NICE_CANDIDATE_TRANSPORT_UDP;
     else
@@ -1007,6 +1023,7 @@ NiceCandidate *discovery_learn_remote_peer_reflexive_candidate (
     candidate->transport = conn_check_match_transport (local->transport);
   else {
     if (nicesock->type == NICE_SOCKET_TYPE_UDP_BSD ||
+        nicesock->type == NICE_SOCKET_TYPE_UDP_URING ||
         nicesock->type == NICE_SOCKET_TYPE_UDP_TURN)
       candidate->transport = NICE_CANDIDATE_TRANSPORT_UDP;
     else
@@ -1069,8 +1086,7 @@ NiceCandidate *discovery_learn_remote_peer_reflexive_candidate (
   /* note: candidate username and password are left NULL as stream 
      level ufrag/password are used */
 
-  component->remote_candidates = g_slist_append (component->remote_candidates,
-      candidate);
+  nice_component_add_remote_candidate (component, candidate);
 
   agent_signal_new_remote_candidate (agent, candidate);
 
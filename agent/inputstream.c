@@ -398,7 +398,7 @@ nice_input_stream_is_readable (GPollableInputStream *stream)
     SocketSource *socket_source = i->data;
     NiceSocket *nicesock = socket_source->socket;
 
-    if (g_socket_condition_check (nicesock->fileno, G_IO_IN) != 0) {
+    if (nice_socket_condition_check (nicesock, G_IO_IN) != 0) {
       retval = TRUE;
       break;
     }
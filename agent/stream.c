@@ -66,6 +66,7 @@ nice_stream_new (guint stream_id, guint n_components, NiceAgent *agent)
   stream = g_object_new (NICE_TYPE_STREAM, NULL);
 
   stream->id = stream_id;
+  stream->components_by_id = g_ptr_array_sized_new (n_components);
 
   /* Create the components. */
   for (n = 0; n < n_components; n++) {
@@ -73,6 +74,7 @@ nice_stream_new (guint stream_id, guint n_components, NiceAgent *agent)
 
     component = nice_component_new (n + 1, agent, stream);
     stream->components = g_slist_append (stream->components, component);
+    g_ptr_array_add (stream->components_by_id, component);
   }
 
   stream->n_components = n_components;
@@ -96,15 +98,10 @@ nice_stream_close (NiceAgent *agent, NiceStream *stream)
 NiceComponent *
 nice_stream_find_component_by_id (NiceStream *stream, guint id)
 {
-  GSList *i;
-
-  for (i = stream->components; i; i = i->next) {
-    NiceComponent *component = i->data;
-    if (component && component->id == id)
-      return component;
-  }
+  if (id == 0 || id > stream->components_by_id->len)
+    return NULL;
 
-  return NULL;
+  return g_ptr_array_index (stream->components_by_id, id - 1);
 }
 
 /*
@@ -171,6 +168,7 @@ nice_stream_finalize (GObject *obj)
   stream = NICE_STREAM (obj);
 
   g_free (stream->name);
+  g_ptr_array_unref (stream->components_by_id);
   g_slist_free_full (stream->components, (GDestroyNotify) g_object_unref);
 
   g_atomic_int_inc (&n_streams_destroyed);
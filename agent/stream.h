@@ -80,6 +80,7 @@ struct _NiceStream {
   guint n_components;
   gboolean initial_binding_request_received;
   GSList *components; /* list of 'NiceComponent' objects */
+  GPtrArray *components_by_id; /* the unowned components, indexed by id - 1 */
   GSList *conncheck_list;         /* list of CandidateCheckPair items */
   gchar local_ufrag[NICE_STREAM_MAX_UFRAG];
   gchar local_password[NICE_STREAM_MAX_PWD];
@@ -88,23 +88,6 @@ void nice_socket_queue_send_with_callback (GQueue *send_queue,
  */
 void nice_socket_flush_send_queue (NiceSocket *base_socket, GQueue *send_queue);
 
-/**
- * nice_socket_flush_send_queue_to_socket:
- * @gsock: GSocket to send on
- * @send_queue: Queue to flush
- *
- * Send all the queued messages to the socket. If any message fails to be sent
- * it will be readded to the queue and #FALSE will be returned, in which case
- * the IO source must be kept to allow flushing the next time the socket
- * is writable.
- * If the queue gets flushed, #TRUE will be returned, in which case, the IO
- * source should be destroyed.
- *
- * Returns: #TRUE if the queue was emptied, #FALSE if the socket would block.
- */
-gboolean nice_socket_flush_send_queue_to_socket (GSocket *gsock,
-    GQueue *send_queue);
-
 /**
  * nice_socket_free_send_queue:
  * @send_queue: The send queue
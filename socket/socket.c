@@ -273,6 +273,45 @@ nice_socket_is_based_on (NiceSocket *sock, NiceSocket *other)
   return (sock == other);
 }
 
+/* Whether @sock holds received data in user space, which will not make its
+ * file descriptor readable again. Callers which stop reading before the
+ * socket would block must drain it explicitly. */
+gboolean
+nice_socket_has_pending_recv (NiceSocket *sock)
+{
+  switch (sock->type) {
+    case NICE_SOCKET_TYPE_UDP_BSD:
+      return nice_udp_bsd_socket_has_pending_recv (sock);
+    case NICE_SOCKET_TYPE_TCP_BSD:
+      return nice_tcp_bsd_socket_has_pending_recv (sock);
+    case NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP:
+      return nice_udp_turn_over_tcp_socket_has_pending_recv (sock);
+    case NICE_SOCKET_TYPE_UDP_TURN:
+      return nice_udp_turn_socket_has_pending_recv (sock);
+    default:
+      return FALSE;
+  }
+}
+
+/* Create a source which dispatches a #GSocketSourceFunc when @sock
+ * satisfies @condition. For most sockets this just polls the underlying
+ * #GSocket. */
+GSource *
+nice_socket_create_source (NiceSocket *sock, GIOCondition condition)
+{
+  if (sock->create_source)
+    return sock->create_source (sock, condition);
+  return g_socket_create_source (sock->fileno, condition, NULL);
+}
+
+GIOCondition
+nice_socket_condition_check (NiceSocket *sock, GIOCondition condition)
+{
+  if (sock->condition_check)
+    return sock->condition_check (sock, condition);
+  return g_socket_condition_check (sock->fileno, condition);
+}
+
 void
 nice_socket_free (NiceSocket *sock)
 {
@@ -405,48 +444,6 @@ void nice_socket_flush_send_queue (NiceSocket *base_socket, GQueue *send_queue)
   }
 }
 
-gboolean nice_socket_flush_send_queue_to_socket (GSocket *gsock,
-    GQueue *send_queue)
-{
-  NiceSocketQueuedSend *tbs;
-  GError *gerr = NULL;
-
-
-  while ((tbs = g_queue_pop_head (send_queue)) != NULL) {
-    int ret;
-
-    GOutputVector local_bufs = { tbs->buf, tbs->length };
-    ret = g_socket_send_message (gsock, NULL, &local_bufs, 1, NULL, 0,
-        G_SOCKET_MSG_NONE, NULL, &gerr);
-
-    if (ret < 0) {
-      if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
-        GOutputVector local_buf = { tbs->buf, tbs->length };
-        NiceOutputMessage local_message = {&local_buf, 1};
-
-        nice_socket_queue_send_with_callback (send_queue, &local_message,
-            0, local_buf.size, TRUE, NULL, NULL, NULL, NULL, NULL);
-        nice_socket_free_queued_send (tbs);
-        g_error_free (gerr);
-        return FALSE;
-      }
-      g_clear_error (&gerr);
-    } else if (ret < (int) tbs->length) {
-      GOutputVector local_buf = { tbs->buf + ret, tbs->length - ret };
-      NiceOutputMessage local_message = {&local_buf, 1};
-
-      nice_socket_queue_send_with_callback (send_queue, &local_message,
-          0, local_buf.size, TRUE, NULL, NULL, NULL, NULL, NULL);
-      nice_socket_free_queued_send (tbs);
-      return FALSE;
-    }
-
-    nice_socket_free_queued_send (tbs);
-  }
-
-  return TRUE;
-}
-
 void
 nice_socket_free_send_queue (GQueue *send_queue)
 {
@@ -65,7 +65,8 @@ typedef enum {
   NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP,
   NICE_SOCKET_TYPE_TCP_ACTIVE,
   NICE_SOCKET_TYPE_TCP_PASSIVE,
-  NICE_SOCKET_TYPE_TCP_SO
+  NICE_SOCKET_TYPE_TCP_SO,
+  NICE_SOCKET_TYPE_UDP_URING
 } NiceSocketType;
 
 typedef void (*NiceSocketWritableCb) (NiceSocket *sock, gpointer user_data);
@@ -89,6 +90,10 @@ struct _NiceSocket
   void (*set_writable_callback) (NiceSocket *sock,
       NiceSocketWritableCb callback, gpointer user_data);
   gboolean (*is_based_on) (NiceSocket *sock, NiceSocket *other);
+  /* Optional; for sockets whose readiness is not reported by polling
+   * @fileno. The source must invoke a #GSocketSourceFunc callback. */
+  GSource *(*create_source) (NiceSocket *sock, GIOCondition condition);
+  GIOCondition (*condition_check) (NiceSocket *sock, GIOCondition condition);
   void (*close) (NiceSocket *sock);
   void *priv;
 };
@@ -142,10 +147,20 @@ nice_socket_set_writable_callback (NiceSocket *sock,
 gboolean
 nice_socket_is_based_on (NiceSocket *sock, NiceSocket *other);
 
+gboolean
+nice_socket_has_pending_recv (NiceSocket *sock);
+
+GSource *
+nice_socket_create_source (NiceSocket *sock, GIOCondition condition);
+
+GIOCondition
+nice_socket_condition_check (NiceSocket *sock, GIOCondition condition);
+
 void
 nice_socket_free (NiceSocket *sock);
 
 #include "udp-bsd.h"
+#include "udp-uring.h"
 #include "tcp-bsd.h"
 #include "tcp-active.h"
 #include "tcp-passive.h"
@@ -44,6 +44,9 @@ G_BEGIN_DECLS
 NiceSocket * nice_tcp_active_socket_new (GMainContext *ctx, NiceAddress *addr);
 NiceSocket * nice_tcp_active_socket_connect (NiceSocket *socket, NiceAddress *addr);
 
+gboolean nice_tcp_active_socket_set_fast_open (NiceSocket *socket,
+    gboolean enabled);
+
 
 G_END_DECLS
 
@@ -54,6 +54,8 @@
 
 #ifndef G_OS_WIN32
 #include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #endif
 
 /* FIXME: This should be defined in gio/gnetworking.h, which we should include;
@@ -62,11 +64,14 @@
 #undef TCP_NODELAY
 #define TCP_NODELAY 1
 
-static GMutex mutex;
-
 typedef struct {
+  /* The writable source holds a reference, so that its callback can take the
+   * lock and find out that the socket has been closed. */
+  gint ref_count;  /* atomic */
+  GMutex mutex;
+  NiceSocket *sock;
+
   NiceAddress remote_addr;
-  GQueue send_queue;
   GMainContext *context;
   GSource *io_source;
   gboolean error;
@@ -74,9 +79,32 @@ typedef struct {
   NiceSocketWritableCb writable_cb;
   gpointer writable_data;
   NiceSocket *passive_parent;
+
+  /* RFC 4571 reassembly, see nice_tcp_bsd_socket_recv_frame() */
+  guint8 *recv_buf;
+  gsize recv_buf_offset;  /* start of the first unparsed frame */
+  gsize recv_buf_len;     /* bytes left to parse */
+
+  /* Ring of bytes waiting for the socket to become writable. Sends are
+   * always copied, into the kernel or here: callers may reuse their buffers
+   * as soon as a send returns, which rules out MSG_ZEROCOPY. */
+  guint8 *send_ring;
+  gsize send_ring_size;
+  gsize send_ring_head;
+  gsize send_ring_len;
+
+  /* Latency mode: the socket only counts as writable while fewer bytes than
+   * this wait unsent in the kernel (TCP_NOTSENT_LOWAT), 0 if disabled */
+  guint notsent_lowat;
 } TcpPriv;
 
-#define MAX_QUEUE_LENGTH 20
+/* Bytes which may wait in the send ring. Reliable data is always queued,
+ * growing the ring if needed, other messages are dropped once it is full. */
+#define TCP_SEND_QUEUE_SIZE (256 * 1024)
+
+/* Large enough to complete the biggest RFC 4571 frame after any partial frame
+ * has been moved to the front, and then to read more past it */
+#define RFC4571_RECV_BUFFER_SIZE (2 * (sizeof (guint16) + G_MAXUINT16))
 
 static void socket_close (NiceSocket *sock);
 static gint socket_recv_messages (NiceSocket *sock,
@@ -93,6 +121,22 @@ static void socket_set_writable_callback (NiceSocket *sock,
 static gboolean socket_send_more (GSocket *gsocket, GIOCondition condition,
     gpointer data);
 
+static TcpPriv *
+priv_ref (TcpPriv *priv)
+{
+  g_atomic_int_inc (&priv->ref_count);
+  return priv;
+}
+
+static void
+priv_unref (TcpPriv *priv)
+{
+  if (g_atomic_int_dec_and_test (&priv->ref_count)) {
+    g_mutex_clear (&priv->mutex);
+    g_slice_free (TcpPriv, priv);
+  }
+}
+
 NiceSocket *
 nice_tcp_bsd_socket_new_from_gsock (GMainContext *ctx, GSocket *gsock,
     NiceAddress *local_addr, NiceAddress *remote_addr, gboolean reliable)
@@ -104,6 +148,9 @@ nice_tcp_bsd_socket_new_from_gsock (GMainContext *ctx, GSocket *gsock,
 
   sock = g_slice_new0 (NiceSocket);
   sock->priv = priv = g_slice_new0 (TcpPriv);
+  priv->ref_count = 1;
+  g_mutex_init (&priv->mutex);
+  priv->sock = sock;
 
   if (ctx == NULL)
     ctx = g_main_context_default ();
@@ -218,7 +265,7 @@ socket_close (NiceSocket *sock)
 {
   TcpPriv *priv = sock->priv;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   if (sock->fileno) {
     g_socket_close (sock->fileno, NULL);
@@ -234,14 +281,20 @@ socket_close (NiceSocket *sock)
     nice_tcp_passive_socket_remove_connection (priv->passive_parent, &priv->remote_addr);
   }
 
-  nice_socket_free_send_queue (&priv->send_queue);
+  g_free (priv->send_ring);
+  priv->send_ring = NULL;
+  priv->send_ring_len = 0;
 
   if (priv->context)
     g_main_context_unref (priv->context);
 
-  g_mutex_unlock (&mutex);
+  g_free (priv->recv_buf);
+  priv->recv_buf = NULL;
 
-  g_slice_free(TcpPriv, sock->priv);
+  g_mutex_unlock (&priv->mutex);
+
+  sock->priv = NULL;
+  priv_unref (priv);
 }
 
 static gint
@@ -295,6 +348,222 @@ socket_recv_messages (NiceSocket *sock,
   return i;
 }
 
+/* Returns the length of the RFC 4571 frame at the start of the reassembly
+ * buffer, including its header, or 0 if it has not been completely received
+ * yet. */
+static gsize
+priv_recv_frame_len (TcpPriv *priv)
+{
+  const guint8 *frame = priv->recv_buf + priv->recv_buf_offset;
+  gsize frame_len;
+
+  if (priv->recv_buf_len < sizeof (guint16))
+    return 0;
+
+  frame_len = sizeof (guint16) + ((frame[0] << 8) | frame[1]);
+
+  return (priv->recv_buf_len >= frame_len) ? frame_len : 0;
+}
+
+/**
+ * nice_tcp_bsd_socket_recv_frame:
+ * @sock: a TCP socket
+ * @message: the message to receive the frame into
+ *
+ * Receive the payload of a single RFC 4571 frame, as used by ICE-TCP. Whatever
+ * the kernel has available is read at once into a per-socket buffer, so
+ * back-to-back frames cost a single system call, and any incomplete frame is
+ * kept for the next read.
+ *
+ * Complete frames left in the buffer will not make the socket poll as
+ * readable again; see nice_tcp_bsd_socket_has_pending_recv().
+ *
+ * Returns: 1 if a frame was received, 0 if no complete frame is available yet,
+ * or -1 on error or if the peer closed the connection
+ */
+gint
+nice_tcp_bsd_socket_recv_frame (NiceSocket *sock, NiceInputMessage *message)
+{
+  TcpPriv *priv = sock->priv;
+  gsize frame_len;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_TCP_BSD);
+
+  /* Make sure socket has not been freed: */
+  g_assert (sock->priv != NULL);
+
+  frame_len = priv_recv_frame_len (priv);
+
+  if (frame_len == 0) {
+    GInputVector local_buf;
+    NiceInputMessage local_message = { &local_buf, 1, NULL, 0 };
+    gint ret;
+
+    /* An outbound connection only reports itself as connected once its result
+     * has been checked; if it failed, make the socket fail. */
+    if (!g_socket_is_connected (sock->fileno) &&
+        !g_socket_check_connect_result (sock->fileno, NULL))
+      return -1;
+
+    if (priv->recv_buf == NULL)
+      priv->recv_buf = g_malloc (RFC4571_RECV_BUFFER_SIZE);
+
+    /* Move the incomplete frame to the front so that the rest of it fits. */
+    if (priv->recv_buf_offset > 0) {
+      memmove (priv->recv_buf, priv->recv_buf + priv->recv_buf_offset,
+          priv->recv_buf_len);
+      priv->recv_buf_offset = 0;
+    }
+
+    local_buf.buffer = priv->recv_buf + priv->recv_buf_len;
+    local_buf.size = RFC4571_RECV_BUFFER_SIZE - priv->recv_buf_len;
+
+    ret = socket_recv_messages (sock, &local_message, 1);
+    if (ret <= 0)
+      return ret;
+
+    priv->recv_buf_len += local_message.length;
+
+    frame_len = priv_recv_frame_len (priv);
+    if (frame_len == 0)
+      return 0;
+  }
+
+  memcpy_buffer_to_input_message (message,
+      priv->recv_buf + priv->recv_buf_offset + sizeof (guint16),
+      frame_len - sizeof (guint16));
+  if (message->from)
+    *message->from = priv->remote_addr;
+
+  priv->recv_buf_offset += frame_len;
+  priv->recv_buf_len -= frame_len;
+  if (priv->recv_buf_len == 0)
+    priv->recv_buf_offset = 0;
+
+  return 1;
+}
+
+/**
+ * nice_tcp_bsd_socket_has_pending_recv:
+ * @sock: a TCP socket
+ *
+ * Check whether a complete RFC 4571 frame is already buffered by
+ * nice_tcp_bsd_socket_recv_frame(). Callers which stop reading before the
+ * socket would block must drain such frames explicitly.
+ *
+ * Returns: %TRUE if nice_tcp_bsd_socket_recv_frame() has a frame to return
+ * without reading from the kernel
+ */
+gboolean
+nice_tcp_bsd_socket_has_pending_recv (NiceSocket *sock)
+{
+  TcpPriv *priv = sock->priv;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_TCP_BSD);
+
+  return priv->recv_buf != NULL && priv_recv_frame_len (priv) > 0;
+}
+
+/* Grow the send ring so it can take @len more bytes, moving the queued bytes
+ * to its start. */
+static void
+priv_send_ring_reserve (TcpPriv *priv, gsize len)
+{
+  guint8 *ring;
+  gsize size, first;
+
+  if (priv->send_ring_len + len <= priv->send_ring_size)
+    return;
+
+  size = MAX (priv->send_ring_size, TCP_SEND_QUEUE_SIZE);
+  while (size < priv->send_ring_len + len)
+    size *= 2;
+
+  ring = g_malloc (size);
+  first = MIN (priv->send_ring_len, priv->send_ring_size - priv->send_ring_head);
+  if (first > 0)
+    memcpy (ring, priv->send_ring + priv->send_ring_head, first);
+  if (priv->send_ring_len > first)
+    memcpy (ring + first, priv->send_ring, priv->send_ring_len - first);
+
+  g_free (priv->send_ring);
+  priv->send_ring = ring;
+  priv->send_ring_size = size;
+  priv->send_ring_head = 0;
+}
+
+/* Flush the send ring, and then call the writable callback, once the socket
+ * polls writable */
+static void
+priv_watch_writable (TcpPriv *priv)
+{
+  if (priv->io_source == NULL) {
+    priv->io_source = g_socket_create_source (priv->sock->fileno, G_IO_OUT,
+        NULL);
+    g_source_set_callback (priv->io_source,
+        (GSourceFunc) G_CALLBACK (socket_send_more), priv_ref (priv),
+        (GDestroyNotify) priv_unref);
+    g_source_attach (priv->io_source, priv->context);
+  }
+}
+
+/* Queue @message from @message_offset on, and watch for the socket becoming
+ * writable again to flush it. */
+static void
+priv_queue_send (TcpPriv *priv, const NiceOutputMessage *message,
+    gsize message_offset, gsize message_len)
+{
+  gsize len = message_len - message_offset;
+  guint j;
+
+  priv_send_ring_reserve (priv, len);
+
+  for (j = 0;
+       len > 0 &&
+       ((message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
+        (message->n_buffers < 0 && message->buffers[j].buffer != NULL));
+       j++) {
+    const guint8 *data = message->buffers[j].buffer;
+    gsize size = message->buffers[j].size;
+
+    if (size <= message_offset) {
+      message_offset -= size;
+      continue;
+    }
+
+    data += message_offset;
+    size = MIN (size - message_offset, len);
+    message_offset = 0;
+    len -= size;
+
+    while (size > 0) {
+      gsize tail = (priv->send_ring_head + priv->send_ring_len) %
+          priv->send_ring_size;
+      gsize chunk = MIN (size, priv->send_ring_size - tail);
+
+      memcpy (priv->send_ring + tail, data, chunk);
+      priv->send_ring_len += chunk;
+      data += chunk;
+      size -= chunk;
+    }
+  }
+
+  priv_watch_writable (priv);
+}
+
+/* Whether the kernel holds less unsent data than the latency mode allows.
+ * If not, the writable callback is called once it does. */
+static gboolean
+priv_below_notsent_lowat (TcpPriv *priv)
+{
+  if (priv->notsent_lowat == 0 ||
+      g_socket_condition_check (priv->sock->fileno, G_IO_OUT) & G_IO_OUT)
+    return TRUE;
+
+  priv_watch_writable (priv);
+  return FALSE;
+}
+
 static gssize
 socket_send_message (NiceSocket *sock,
     const NiceOutputMessage *message, gboolean reliable)
@@ -314,44 +583,47 @@ socket_send_message (NiceSocket *sock,
 
   message_len = output_message_get_size (message);
 
-  /* First try to send the data, don't send it later if it can be sent now
-   * this way we avoid allocating memory on every send */
-  if (g_queue_is_empty (&priv->send_queue)) {
+  g_mutex_lock (&priv->mutex);
+
+  if (!reliable && !priv_below_notsent_lowat (priv)) {
+    /* Latency mode: rather drop the message than let it wait behind what
+     * the kernel already has to send */
+    ret = 0;
+  } else if (priv->send_ring_len == 0) {
+    /* First try to send the data, don't send it later if it can be sent now
+     * this way we avoid copying it on every send */
     ret = g_socket_send_message (sock->fileno, NULL, message->buffers,
         message->n_buffers, NULL, 0, G_SOCKET_MSG_NONE, NULL, &gerr);
 
     if (ret < 0) {
+      /* A TCP Fast Open connection whose SYN could not carry the data
+       * reports it as in progress. */
       if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) ||
+          g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_PENDING) ||
           g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_FAILED)) {
         /* Queue the message and send it later. */
-        nice_socket_queue_send_with_callback (&priv->send_queue,
-            message, 0, message_len, FALSE, sock->fileno, &priv->io_source,
-            priv->context, socket_send_more, sock);
+        priv_queue_send (priv, message, 0, message_len);
         ret = message_len;
       }
 
       g_error_free (gerr);
     } else if ((gsize) ret < message_len) {
       /* Partial send. */
-      nice_socket_queue_send_with_callback (&priv->send_queue,
-          message, ret, message_len, TRUE, sock->fileno, &priv->io_source,
-          priv->context, socket_send_more, sock);
+      priv_queue_send (priv, message, ret, message_len);
       ret = message_len;
     }
+  } else if (reliable ||
+      priv->send_ring_len + message_len <= TCP_SEND_QUEUE_SIZE) {
+    /* Queue behind the data already waiting, to keep the stream in order */
+    priv_queue_send (priv, message, 0, message_len);
+    ret = message_len;
   } else {
-    /* Only queue if we're sending reliably  */
-    if (reliable) {
-      /* Queue the message and send it later. */
-      nice_socket_queue_send_with_callback (&priv->send_queue,
-          message, 0, message_len, FALSE, sock->fileno, &priv->io_source,
-          priv->context, socket_send_more, sock);
-      ret = message_len;
-    } else {
-      /* non reliable send, so we shouldn't queue the message */
-      ret = 0;
-    }
+    /* non reliable send and the queue is full, so drop the message */
+    ret = 0;
   }
 
+  g_mutex_unlock (&priv->mutex);
+
   return ret;
 }
 
@@ -415,8 +687,14 @@ static gboolean
 socket_can_send (NiceSocket *sock, NiceAddress *addr)
 {
   TcpPriv *priv = sock->priv;
+  gboolean can_send;
 
-  return g_queue_is_empty (&priv->send_queue);
+  g_mutex_lock (&priv->mutex);
+  can_send = priv->send_ring_len < TCP_SEND_QUEUE_SIZE &&
+      priv_below_notsent_lowat (priv);
+  g_mutex_unlock (&priv->mutex);
+
+  return can_send;
 }
 
 static void
@@ -429,35 +707,90 @@ socket_set_writable_callback (NiceSocket *sock,
   priv->writable_data = user_data;
 }
 
+/* Write as much of the send ring as the socket takes, with a single call.
+ * Returns TRUE once the ring is empty. */
+static gboolean
+priv_flush_send_ring (TcpPriv *priv)
+{
+  GOutputVector buffers[2];
+  guint n_buffers = 1;
+  gsize first;
+  gssize ret;
+  GError *gerr = NULL;
+
+  if (priv->send_ring_len == 0)
+    return TRUE;
+
+  first = MIN (priv->send_ring_len,
+      priv->send_ring_size - priv->send_ring_head);
+  buffers[0].buffer = priv->send_ring + priv->send_ring_head;
+  buffers[0].size = first;
+  if (first < priv->send_ring_len) {
+    buffers[1].buffer = priv->send_ring;
+    buffers[1].size = priv->send_ring_len - first;
+    n_buffers = 2;
+  }
+
+  ret = g_socket_send_message (priv->sock->fileno, NULL, buffers, n_buffers,
+      NULL, 0, G_SOCKET_MSG_NONE, NULL, &gerr);
+
+  if (ret < 0) {
+    if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) ||
+        g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_PENDING)) {
+      g_error_free (gerr);
+      return FALSE;
+    }
+
+    nice_debug ("tcp-bsd: dropping %" G_GSIZE_FORMAT " queued bytes: %s",
+        priv->send_ring_len, gerr->message);
+    g_error_free (gerr);
+    ret = priv->send_ring_len;
+  }
+
+  priv->send_ring_head = (priv->send_ring_head + ret) % priv->send_ring_size;
+  priv->send_ring_len -= ret;
+
+  if (priv->send_ring_len > 0)
+    return FALSE;
+
+  /* Give back the memory of a ring grown by a large reliable burst */
+  priv->send_ring_head = 0;
+  if (priv->send_ring_size > TCP_SEND_QUEUE_SIZE) {
+    g_free (priv->send_ring);
+    priv->send_ring = NULL;
+    priv->send_ring_size = 0;
+  }
+
+  return TRUE;
+}
+
 static gboolean
 socket_send_more (
   GSocket *gsocket,
   GIOCondition condition,
   gpointer data)
 {
-  NiceSocket *sock = (NiceSocket *) data;
-  TcpPriv *priv;
+  TcpPriv *priv = data;
+  NiceSocket *sock;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in tcp-bsd.c:socket_send_more");
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return FALSE;
   }
 
-  priv = sock->priv;
+  sock = priv->sock;
 
   /* connection hangs up or queue was emptied */
-  if (condition & G_IO_HUP ||
-      nice_socket_flush_send_queue_to_socket (sock->fileno,
-          &priv->send_queue)) {
+  if (condition & G_IO_HUP || priv_flush_send_ring (priv)) {
     g_source_destroy (priv->io_source);
     g_source_unref (priv->io_source);
     priv->io_source = NULL;
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
 
     if (priv->writable_cb)
       priv->writable_cb (sock, priv->writable_data);
@@ -465,7 +798,7 @@ socket_send_more (
     return FALSE;
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
   return TRUE;
 }
 
@@ -486,3 +819,56 @@ nice_tcp_bsd_socket_get_passive_parent (NiceSocket *sock)
 
   return priv->passive_parent;
 }
+
+/* Number of bytes accepted by nice_socket_send_messages() which are still
+ * waiting for the socket to become writable. Callers can use it as a
+ * backpressure signal, rather than having their messages dropped. */
+gsize
+nice_tcp_bsd_socket_get_queued_bytes (NiceSocket *sock)
+{
+  TcpPriv *priv = sock->priv;
+  gsize queued;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_TCP_BSD);
+
+  g_mutex_lock (&priv->mutex);
+  queued = priv->send_ring_len;
+  g_mutex_unlock (&priv->mutex);
+
+  return queued;
+}
+
+/**
+ * nice_tcp_bsd_socket_set_notsent_lowat:
+ * @sock: a #NiceSocket of type %NICE_SOCKET_TYPE_TCP_BSD
+ * @lowat: the most unsent bytes the kernel may hold, or 0 to disable
+ *
+ * Bound the latency added by the kernel send buffer: once @lowat bytes wait
+ * unsent in it, nice_socket_can_send() returns %FALSE and non-reliable sends
+ * are dropped, until the kernel has drained below @lowat and the writable
+ * callback is called.
+ *
+ * Returns: %FALSE if the platform does not support it
+ */
+gboolean
+nice_tcp_bsd_socket_set_notsent_lowat (NiceSocket *sock, guint lowat)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  TcpPriv *priv = sock->priv;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_TCP_BSD);
+
+  /* 0 restores the system wide default */
+  if (!g_socket_set_option (sock->fileno, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+          MIN (lowat, G_MAXINT), NULL))
+    return FALSE;
+
+  g_mutex_lock (&priv->mutex);
+  priv->notsent_lowat = lowat;
+  g_mutex_unlock (&priv->mutex);
+
+  return TRUE;
+#else
+  return lowat == 0;
+#endif
+}
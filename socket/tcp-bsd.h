@@ -55,6 +55,18 @@ nice_tcp_bsd_socket_set_passive_parent (NiceSocket *socket, NiceSocket *passive_
 NiceSocket *
 nice_tcp_bsd_socket_get_passive_parent (NiceSocket *socket);
 
+gint
+nice_tcp_bsd_socket_recv_frame (NiceSocket *sock, NiceInputMessage *message);
+
+gboolean
+nice_tcp_bsd_socket_has_pending_recv (NiceSocket *sock);
+
+gsize
+nice_tcp_bsd_socket_get_queued_bytes (NiceSocket *sock);
+
+gboolean
+nice_tcp_bsd_socket_set_notsent_lowat (NiceSocket *sock, guint lowat);
+
 G_END_DECLS
 
 #endif /* _TCP_BSD_H */
@@ -48,6 +48,7 @@
 
 #ifndef G_OS_WIN32
 #include <unistd.h>
+#include <netinet/tcp.h>
 #endif
 
 /* FIXME: This should be defined in gio/gnetworking.h, which we should include;
@@ -56,6 +57,10 @@
 #undef TCP_NODELAY
 #define TCP_NODELAY 1
 
+/* Connections whose SYN data may be accepted before their handshake
+ * completes, with TCP Fast Open */
+#define TCP_FASTOPEN_QUEUE_LEN 256
+
 typedef struct {
   GMainContext *context;
   GHashTable *connections;
@@ -268,6 +273,30 @@ socket_set_writable_callback (NiceSocket *sock,
   priv->writable_data = user_data;
 }
 
+/*
+ * nice_tcp_passive_socket_set_fast_open:
+ * @sock: a #NiceSocket of type %NICE_SOCKET_TYPE_TCP_PASSIVE
+ * @enabled: whether to accept TCP Fast Open connections
+ *
+ * Hand out Fast Open cookies to the peers connecting, and accept the data
+ * carried by the SYN of those presenting one. The system must allow it too:
+ * on Linux, the net.ipv4.tcp_fastopen sysctl must have the server bit set.
+ *
+ * Returns: %FALSE if @enabled is %TRUE but the platform does not support it
+ */
+gboolean
+nice_tcp_passive_socket_set_fast_open (NiceSocket *sock, gboolean enabled)
+{
+  g_assert (sock->type == NICE_SOCKET_TYPE_TCP_PASSIVE);
+
+#ifdef TCP_FASTOPEN
+  return g_socket_set_option (sock->fileno, IPPROTO_TCP, TCP_FASTOPEN,
+      enabled ? TCP_FASTOPEN_QUEUE_LEN : 0, NULL);
+#else
+  return !enabled;
+#endif
+}
+
 NiceSocket *
 nice_tcp_passive_socket_accept (NiceSocket *sock)
 {
@@ -49,6 +49,9 @@ NiceSocket * nice_tcp_passive_socket_accept (NiceSocket *socket);
 void nice_tcp_passive_socket_remove_connection (NiceSocket *socket,
     const NiceAddress *to);
 
+gboolean nice_tcp_passive_socket_set_fast_open (NiceSocket *socket,
+    gboolean enabled);
+
 
 G_END_DECLS
 
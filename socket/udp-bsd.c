@@ -54,8 +54,21 @@
 
 #ifndef G_OS_WIN32
 #include <unistd.h>
+#include <netinet/udp.h>
 #endif
 
+/* Maximum number of datagrams handed to the kernel in one recvmmsg() or
+ * sendmmsg() call */
+#define UDP_BSD_MAX_BATCH 32
+
+/* Size of each buffer coalesced datagrams are received into when UDP receive
+ * offload is enabled: the kernel never coalesces more than this. */
+#define UDP_BSD_GRO_BUFFER_SIZE (1 << 16)
+
+/* Number of such buffers filled by one recvmmsg() call. Only the pages which
+ * are actually written to get backed by memory. */
+#define UDP_BSD_GRO_BATCH 8
+
 
 static void socket_close (NiceSocket *sock);
 static gint socket_recv_messages (NiceSocket *sock,
@@ -69,27 +82,61 @@ static gboolean socket_can_send (NiceSocket *sock, NiceAddress *addr);
 static void socket_set_writable_callback (NiceSocket *sock,
     NiceSocketWritableCb callback, gpointer user_data);
 
+/* A buffer read from the kernel with UDP receive offload: @len bytes from
+ * @from, made of datagrams of @segment_size bytes, the last one possibly
+ * shorter */
+typedef struct {
+  gsize len;
+  gsize segment_size;
+  NiceAddress from;
+} UdpBsdGroBuffer;
+
 struct UdpBsdSocketPrivate
 {
+#ifdef G_OS_WIN32
   GMutex mutex;
 
-  /* protected by mutex */
+  /* GSocketAddress of the last destination, protected by mutex. Elsewhere
+   * sends use native addresses and need no cache. */
   NiceAddress niceaddr;
   GSocketAddress *gaddr;
+#endif
+
+  /* set once the kernel has refused a segmentation offload send */
+  gboolean gso_unsupported;
+
+  /* UDP receive offload: the buffers last read from the kernel, each holding
+   * one datagram or several coalesced ones, and the position of the next
+   * datagram to hand to the caller */
+  gboolean gro;
+  guint8 *gro_buf;  /* UDP_BSD_GRO_BATCH buffers of UDP_BSD_GRO_BUFFER_SIZE */
+  UdpBsdGroBuffer gro_bufs[UDP_BSD_GRO_BATCH];
+  guint gro_n_bufs;
+  guint gro_index;
+  gsize gro_offset;
 };
 
-NiceSocket *
-nice_udp_bsd_socket_new (NiceAddress *addr)
+/*
+ * nice_udp_bsd_socket_bind:
+ * @addr: (nullable): the local address to bind to
+ * @local_addr: (out): return location for the address actually bound to
+ *
+ * Create a non-blocking UDP #GSocket bound to @addr, or to an ephemeral port
+ * on the IPv4 wildcard address if @addr is %NULL. This is shared with the
+ * other UDP socket implementations.
+ *
+ * Returns: (nullable): a new #GSocket, or %NULL on error
+ */
+GSocket *
+nice_udp_bsd_socket_bind (NiceAddress *addr, NiceAddress *local_addr)
 {
   union {
     struct sockaddr_storage storage;
     struct sockaddr addr;
   } name;
-  NiceSocket *sock = g_slice_new0 (NiceSocket);
   GSocket *gsock = NULL;
   gboolean gret = FALSE;
   GSocketAddress *gaddr;
-  struct UdpBsdSocketPrivate *priv;
 
   if (addr != NULL) {
     nice_address_copy_to_sockaddr(addr, &name.addr);
@@ -114,10 +161,8 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
 #endif
   }
 
-  if (gsock == NULL) {
-    g_slice_free (NiceSocket, sock);
+  if (gsock == NULL)
     return NULL;
-  }
 
   /* GSocket: All socket file descriptors are set to be close-on-exec. */
   g_socket_set_blocking (gsock, false);
@@ -128,7 +173,6 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
   }
 
   if (gret == FALSE) {
-    g_slice_free (NiceSocket, sock);
     g_socket_close (gsock, NULL);
     g_object_unref (gsock);
     return NULL;
@@ -137,7 +181,7 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
   gaddr = g_socket_get_local_address (gsock, NULL);
   if (gaddr == NULL ||
       !g_socket_address_to_native (gaddr, &name, sizeof(name), NULL)) {
-    g_slice_free (NiceSocket, sock);
+    g_clear_object (&gaddr);
     g_socket_close (gsock, NULL);
     g_object_unref (gsock);
     return NULL;
@@ -145,10 +189,59 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
 
   g_object_unref (gaddr);
 
-  nice_address_set_from_sockaddr (&sock->addr, &name.addr);
+  nice_address_set_from_sockaddr (local_addr, &name.addr);
+
+  return gsock;
+}
+
+NiceSocket *
+nice_udp_bsd_socket_new (NiceAddress *addr)
+{
+  return nice_udp_bsd_socket_new_full (addr, FALSE);
+}
+
+/*
+ * nice_udp_bsd_socket_new_full:
+ * @addr: (nullable): the local address to bind to
+ * @receive_offload: whether to let the kernel coalesce incoming datagrams
+ * (UDP_GRO)
+ *
+ * Create a UDP socket. With @receive_offload, the kernel may hand up
+ * several datagrams from the same source as one buffer; the socket splits it
+ * back into one #NiceInputMessage per datagram, so this is transparent to
+ * callers of nice_socket_recv_messages(). It is silently ignored if the
+ * kernel does not support it.
+ *
+ * Returns: (nullable): a new #NiceSocket, or %NULL on error
+ */
+NiceSocket *
+nice_udp_bsd_socket_new_full (NiceAddress *addr, gboolean receive_offload)
+{
+  NiceSocket *sock;
+  GSocket *gsock;
+  NiceAddress local_addr;
+  struct UdpBsdSocketPrivate *priv;
+
+  gsock = nice_udp_bsd_socket_bind (addr, &local_addr);
+  if (gsock == NULL)
+    return NULL;
+
+  sock = g_slice_new0 (NiceSocket);
+  sock->addr = local_addr;
 
   priv = sock->priv = g_slice_new0 (struct UdpBsdSocketPrivate);
+#ifdef G_OS_WIN32
   nice_address_init (&priv->niceaddr);
+  g_mutex_init (&priv->mutex);
+#endif
+
+#ifdef UDP_GRO
+  if (receive_offload &&
+      g_socket_set_option (gsock, SOL_UDP, UDP_GRO, 1, NULL)) {
+    priv->gro = TRUE;
+    priv->gro_buf = g_malloc (UDP_BSD_GRO_BATCH * UDP_BSD_GRO_BUFFER_SIZE);
+  }
+#endif
 
   sock->type = NICE_SOCKET_TYPE_UDP_BSD;
   sock->fileno = gsock;
@@ -160,8 +253,6 @@ nice_udp_bsd_socket_new (NiceAddress *addr)
   sock->set_writable_callback = socket_set_writable_callback;
   sock->close = socket_close;
 
-  g_mutex_init (&priv->mutex);
-
   return sock;
 }
 
@@ -170,8 +261,11 @@ socket_close (NiceSocket *sock)
 {
   struct UdpBsdSocketPrivate *priv = sock->priv;
 
+#ifdef G_OS_WIN32
   g_clear_object (&priv->gaddr);
   g_mutex_clear (&priv->mutex);
+#endif
+  g_free (priv->gro_buf);
   g_slice_free (struct UdpBsdSocketPrivate, sock->priv);
   sock->priv = NULL;
 
@@ -182,6 +276,395 @@ socket_close (NiceSocket *sock)
   }
 }
 
+#ifndef G_OS_WIN32
+static guint
+input_message_count_buffers (const NiceInputMessage *message)
+{
+  guint n_bufs = 0;
+
+  if (message->n_buffers >= 0)
+    return message->n_buffers;
+
+  while (message->buffers[n_bufs].buffer != NULL)
+    n_bufs++;
+
+  return n_bufs;
+}
+
+static guint
+output_message_count_buffers (const NiceOutputMessage *message)
+{
+  guint n_bufs = 0;
+
+  if (message->n_buffers >= 0)
+    return message->n_buffers;
+
+  while (message->buffers[n_bufs].buffer != NULL)
+    n_bufs++;
+
+  return n_bufs;
+}
+
+/* Fill @sa with @addr, returning the length of the native address, or 0 if
+ * @addr is not an IPv4 or IPv6 address. */
+static socklen_t
+sockaddr_from_nice_address (const NiceAddress *addr,
+    struct sockaddr_storage *sa)
+{
+  nice_address_copy_to_sockaddr (addr, (struct sockaddr *) sa);
+
+  switch (sa->ss_family) {
+    case AF_INET:
+      return sizeof (struct sockaddr_in);
+    case AF_INET6:
+      return sizeof (struct sockaddr_in6);
+    default:
+      return 0;
+  }
+}
+
+/* Receive a single datagram straight into @recv_message, converting the
+ * source address without going through a #GSocketAddress. Returns the number
+ * of bytes received, 0 if the read would block, or -1 on error. */
+static gssize
+socket_recv_message_native (NiceSocket *sock, NiceInputMessage *recv_message)
+{
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } name;
+  struct msghdr msg;
+  gssize recvd;
+
+  memset (&msg, 0, sizeof (msg));
+  if (recv_message->from != NULL) {
+    msg.msg_name = &name;
+    msg.msg_namelen = sizeof (name);
+  }
+  /* GInputVector has the same layout as struct iovec; GSocket relies on
+   * this too. */
+  msg.msg_iov = (struct iovec *) recv_message->buffers;
+  msg.msg_iovlen = input_message_count_buffers (recv_message);
+
+  do {
+    recvd = recvmsg (g_socket_get_fd (sock->fileno), &msg, MSG_DONTWAIT);
+  } while (recvd < 0 && errno == EINTR);
+
+  if (recvd < 0) {
+    /* Handle ECONNRESET here as if it were EWOULDBLOCK; see
+     * https://phabricator.freedesktop.org/T121 */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNRESET)
+      return 0;
+    return -1;
+  }
+
+  if (recvd > 0 && recv_message->from != NULL)
+    nice_address_set_from_sockaddr (recv_message->from, &name.addr);
+
+  return recvd;
+}
+#else
+/* Receive a single datagram into @recv_message through GSocket. Returns the
+ * number of bytes received, 0 if the read would block, or -1 on error. */
+static gssize
+socket_recv_message_gsocket (NiceSocket *sock, NiceInputMessage *recv_message)
+{
+  GSocketAddress *gaddr = NULL;
+  GError *gerr = NULL;
+  gssize recvd;
+  gint flags = G_SOCKET_MSG_NONE;
+
+  recvd = g_socket_receive_message (sock->fileno,
+      (recv_message->from != NULL) ? &gaddr : NULL,
+      recv_message->buffers, recv_message->n_buffers, NULL, NULL,
+      &flags, NULL, &gerr);
+
+  if (recvd < 0) {
+    /* Handle ECONNRESET here as if it were EWOULDBLOCK; see
+     * https://phabricator.freedesktop.org/T121 */
+    if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) ||
+        g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
+      recvd = 0;
+    else if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE))
+      recvd = input_message_get_size (recv_message);
+
+    g_error_free (gerr);
+  }
+
+  if (recvd > 0 && recv_message->from != NULL && gaddr != NULL) {
+    union {
+      struct sockaddr_storage storage;
+      struct sockaddr addr;
+    } sa;
+
+    g_socket_address_to_native (gaddr, &sa, sizeof (sa), NULL);
+    nice_address_set_from_sockaddr (recv_message->from, &sa.addr);
+  }
+
+  if (gaddr != NULL)
+    g_object_unref (gaddr);
+
+  return recvd;
+}
+#endif
+
+#ifdef HAVE_RECVMMSG
+/* Receive up to @n_recv_messages datagrams using as few recvmmsg() calls as
+ * possible. Follows the same return value semantics as
+ * socket_recv_messages(). */
+static gint
+socket_recv_messages_batched (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  struct mmsghdr hdrs[UDP_BSD_MAX_BATCH];
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } names[UDP_BSD_MAX_BATCH];
+  gint fd = g_socket_get_fd (sock->fileno);
+  guint n_received = 0;
+
+  while (n_received < n_recv_messages) {
+    guint n_batch = MIN (n_recv_messages - n_received, UDP_BSD_MAX_BATCH);
+    guint i;
+    gint ret;
+
+    for (i = 0; i < n_batch; i++) {
+      NiceInputMessage *recv_message = &recv_messages[n_received + i];
+      struct msghdr *msg = &hdrs[i].msg_hdr;
+
+      memset (msg, 0, sizeof (*msg));
+      if (recv_message->from != NULL) {
+        msg->msg_name = &names[i];
+        msg->msg_namelen = sizeof (names[i]);
+      }
+      /* GInputVector has the same layout as struct iovec; GSocket relies on
+       * this too. */
+      msg->msg_iov = (struct iovec *) recv_message->buffers;
+      msg->msg_iovlen = input_message_count_buffers (recv_message);
+      hdrs[i].msg_len = 0;
+    }
+
+    do {
+      ret = recvmmsg (fd, hdrs, n_batch, MSG_DONTWAIT, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      /* Handle ECONNRESET here as if it were EWOULDBLOCK; see
+       * https://phabricator.freedesktop.org/T121 */
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNRESET &&
+          n_received == 0)
+        return -1;
+      recv_messages[n_received].length = 0;
+      break;
+    }
+
+    for (i = 0; i < (guint) ret; i++) {
+      NiceInputMessage *recv_message = &recv_messages[n_received + i];
+
+      recv_message->length = hdrs[i].msg_len;
+
+      if (recv_message->from != NULL)
+        nice_address_set_from_sockaddr (recv_message->from, &names[i].addr);
+    }
+
+    n_received += ret;
+
+    /* A short batch means the kernel queue has been drained. */
+    if ((guint) ret < n_batch) {
+      if (n_received < n_recv_messages)
+        recv_messages[n_received].length = 0;
+      break;
+    }
+  }
+
+  return n_received;
+}
+#endif
+
+#ifdef UDP_GRO
+/* Read the next buffers, each possibly coalesced, into priv->gro_buf: as many
+ * as one recvmmsg() returns where available, one otherwise. Returns the
+ * number of buffers read, 0 if the read would block, or -1 on error. */
+static gint
+socket_recv_gro_buffers (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } names[UDP_BSD_GRO_BATCH];
+  union {
+    gchar buf[CMSG_SPACE (sizeof (gint))];
+    struct cmsghdr align;
+  } controls[UDP_BSD_GRO_BATCH];
+  struct iovec iovs[UDP_BSD_GRO_BATCH];
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr hdrs[UDP_BSD_GRO_BATCH];
+  const guint n_bufs = UDP_BSD_GRO_BATCH;
+#else
+  struct {
+    struct msghdr msg_hdr;
+    guint msg_len;
+  } hdrs[1];
+  const guint n_bufs = 1;
+#endif
+  gint fd = g_socket_get_fd (sock->fileno);
+  gint ret;
+  guint i;
+
+  for (i = 0; i < n_bufs; i++) {
+    struct msghdr *msg = &hdrs[i].msg_hdr;
+
+    iovs[i].iov_base = priv->gro_buf + i * UDP_BSD_GRO_BUFFER_SIZE;
+    iovs[i].iov_len = UDP_BSD_GRO_BUFFER_SIZE;
+    memset (msg, 0, sizeof (*msg));
+    msg->msg_name = &names[i];
+    msg->msg_namelen = sizeof (names[i]);
+    msg->msg_iov = &iovs[i];
+    msg->msg_iovlen = 1;
+    msg->msg_control = controls[i].buf;
+    msg->msg_controllen = sizeof (controls[i].buf);
+    hdrs[i].msg_len = 0;
+  }
+
+#ifdef HAVE_RECVMMSG
+  do {
+    ret = recvmmsg (fd, hdrs, n_bufs, MSG_DONTWAIT, NULL);
+  } while (ret < 0 && errno == EINTR);
+#else
+  do {
+    ret = recvmsg (fd, &hdrs[0].msg_hdr, MSG_DONTWAIT);
+  } while (ret < 0 && errno == EINTR);
+  if (ret >= 0) {
+    hdrs[0].msg_len = ret;
+    ret = 1;
+  }
+#endif
+
+  if (ret < 0) {
+    /* Handle ECONNRESET here as if it were EWOULDBLOCK; see
+     * https://phabricator.freedesktop.org/T121 */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNRESET)
+      return 0;
+    return -1;
+  }
+
+  for (i = 0; i < (guint) ret; i++) {
+    UdpBsdGroBuffer *buf = &priv->gro_bufs[i];
+    struct msghdr *msg = &hdrs[i].msg_hdr;
+    struct cmsghdr *cmsg;
+
+    buf->len = hdrs[i].msg_len;
+    buf->segment_size = buf->len;
+    nice_address_set_from_sockaddr (&buf->from, &names[i].addr);
+
+    for (cmsg = CMSG_FIRSTHDR (msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR (msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+        gint segment_size;
+
+        memcpy (&segment_size, CMSG_DATA (cmsg), sizeof (segment_size));
+        if (segment_size > 0)
+          buf->segment_size = segment_size;
+      }
+    }
+  }
+
+  priv->gro_n_bufs = ret;
+  priv->gro_index = 0;
+  priv->gro_offset = 0;
+
+  return ret;
+}
+
+/* Receive datagrams on a socket with UDP receive offload enabled, splitting
+ * each coalesced buffer back into one message per datagram. Datagrams which
+ * do not fit in @recv_messages are kept for the next call. Follows the same
+ * return value semantics as socket_recv_messages(). */
+static gint
+socket_recv_messages_gro (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  guint i;
+
+  for (i = 0; i < n_recv_messages; i++) {
+    NiceInputMessage *recv_message = &recv_messages[i];
+    UdpBsdGroBuffer *buf;
+    const guint8 *segment;
+    gsize segment_len;
+    guint j;
+
+    if (priv->gro_index >= priv->gro_n_bufs) {
+      gint ret = socket_recv_gro_buffers (sock);
+
+      if (ret < 0 && i == 0)
+        return -1;
+      if (ret <= 0) {
+        recv_message->length = 0;
+        break;
+      }
+    }
+
+    buf = &priv->gro_bufs[priv->gro_index];
+    segment = priv->gro_buf + priv->gro_index * UDP_BSD_GRO_BUFFER_SIZE +
+        priv->gro_offset;
+    segment_len = MIN (buf->segment_size, buf->len - priv->gro_offset);
+    priv->gro_offset += segment_len;
+
+    /* Move on to the next buffer once this one is split */
+    if (priv->gro_offset >= buf->len) {
+      priv->gro_index++;
+      priv->gro_offset = 0;
+    }
+
+    /* Copy the datagram into the caller’s buffers, truncating it if they
+     * are too small, as the kernel would. */
+    recv_message->length = 0;
+    for (j = 0;
+         segment_len > 0 &&
+         ((recv_message->n_buffers >= 0 && j < (guint) recv_message->n_buffers) ||
+          (recv_message->n_buffers < 0 && recv_message->buffers[j].buffer != NULL));
+         j++) {
+      gsize len = MIN (segment_len, recv_message->buffers[j].size);
+
+      memcpy (recv_message->buffers[j].buffer, segment, len);
+      segment += len;
+      segment_len -= len;
+      recv_message->length += len;
+    }
+
+    if (recv_message->from != NULL)
+      *recv_message->from = buf->from;
+  }
+
+  return i;
+}
+#endif
+
+/*
+ * nice_udp_bsd_socket_has_pending_recv:
+ * @sock: a UDP #NiceSocket
+ *
+ * Check whether datagrams split out of a coalesced receive buffer are still
+ * waiting to be returned. They will not make the socket poll as readable
+ * again, so callers which stop reading before the socket would block must
+ * drain them explicitly.
+ *
+ * Returns: %TRUE if nice_socket_recv_messages() has data to return without
+ * reading from the kernel
+ */
+gboolean
+nice_udp_bsd_socket_has_pending_recv (NiceSocket *sock)
+{
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_UDP_BSD);
+
+  return priv->gro && priv->gro_index < priv->gro_n_bufs;
+}
+
 static gint
 socket_recv_messages (NiceSocket *sock,
     NiceInputMessage *recv_messages, guint n_recv_messages)
@@ -192,49 +675,33 @@ socket_recv_messages (NiceSocket *sock,
   /* Make sure socket has not been freed: */
   g_assert (sock->priv != NULL);
 
+#ifdef UDP_GRO
+  if (((struct UdpBsdSocketPrivate *) sock->priv)->gro)
+    return socket_recv_messages_gro (sock, recv_messages, n_recv_messages);
+#endif
+
+#ifdef HAVE_RECVMMSG
+  if (n_recv_messages > 1)
+    return socket_recv_messages_batched (sock, recv_messages, n_recv_messages);
+#endif
+
   /* Read messages into recv_messages until one fails or would block, or we
    * reach the end. */
   for (i = 0; i < n_recv_messages; i++) {
     NiceInputMessage *recv_message = &recv_messages[i];
-    GSocketAddress *gaddr = NULL;
-    GError *gerr = NULL;
     gssize recvd;
-    gint flags = G_SOCKET_MSG_NONE;
 
-    recvd = g_socket_receive_message (sock->fileno,
-        (recv_message->from != NULL) ? &gaddr : NULL,
-        recv_message->buffers, recv_message->n_buffers, NULL, NULL,
-        &flags, NULL, &gerr);
+#ifndef G_OS_WIN32
+    recvd = socket_recv_message_native (sock, recv_message);
+#else
+    recvd = socket_recv_message_gsocket (sock, recv_message);
+#endif
 
-    if (recvd < 0) {
-      /* Handle ECONNRESET here as if it were EWOULDBLOCK; see
-       * https://phabricator.freedesktop.org/T121 */
-      if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK) ||
-          g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
-        recvd = 0;
-      else if (g_error_matches (gerr, G_IO_ERROR, G_IO_ERROR_MESSAGE_TOO_LARGE))
-        recvd = input_message_get_size (recv_message);
-      else
-        error = TRUE;
-
-      g_error_free (gerr);
-    }
+    if (recvd < 0)
+      error = TRUE;
 
     recv_message->length = MAX (recvd, 0);
 
-    if (recvd > 0 && recv_message->from != NULL && gaddr != NULL) {
-      union {
-        struct sockaddr_storage storage;
-        struct sockaddr addr;
-      } sa;
-
-      g_socket_address_to_native (gaddr, &sa, sizeof (sa), NULL);
-      nice_address_set_from_sockaddr (recv_message->from, &sa.addr);
-    }
-
-    if (gaddr != NULL)
-      g_object_unref (gaddr);
-
     /* Return early on error or EWOULDBLOCK. */
     if (recvd <= 0)
       break;
@@ -247,6 +714,56 @@ socket_recv_messages (NiceSocket *sock,
   return i;
 }
 
+#ifndef G_OS_WIN32
+static gssize
+socket_send_message (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *message)
+{
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  struct msghdr msg;
+  gssize len;
+
+  /* Make sure socket has not been freed: */
+  g_assert (sock->priv != NULL);
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_name = &sa;
+  msg.msg_namelen = sockaddr_from_nice_address (to, &sa.storage);
+  if (msg.msg_namelen == 0)
+    return -1;
+  /* GOutputVector has the same layout as struct iovec; GSocket relies on
+   * this too. */
+  msg.msg_iov = (struct iovec *) message->buffers;
+  msg.msg_iovlen = output_message_count_buffers (message);
+
+  do {
+    len = sendmsg (g_socket_get_fd (sock->fileno), &msg, MSG_DONTWAIT);
+  } while (len < 0 && errno == EINTR);
+
+  if (len < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      len = 0;
+    } else if (nice_debug_is_verbose ()) {
+      gchar local_addr_str[INET6_ADDRSTRLEN];
+      gchar remote_addr_str[INET6_ADDRSTRLEN];
+
+      nice_address_to_string (&sock->addr, local_addr_str);
+      nice_address_to_string (to, remote_addr_str);
+
+      nice_debug_verbose ("%s: udp-bsd socket %p %s:%u -> %s:%u: error: %s",
+          G_STRFUNC, sock,
+          local_addr_str, nice_address_get_port (&sock->addr),
+          remote_addr_str, nice_address_get_port (to),
+          g_strerror (errno));
+    }
+  }
+
+  return len;
+}
+#else
 static gssize
 socket_send_message (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *message)
@@ -327,6 +844,80 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
 
   return len;
 }
+#endif
+
+#ifdef HAVE_SENDMMSG
+/* Send @n_messages datagrams to @to using as few sendmmsg() calls as
+ * possible. Follows the same return value semantics as
+ * socket_send_messages(). */
+static gint
+socket_send_messages_batched (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  struct mmsghdr hdrs[UDP_BSD_MAX_BATCH];
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  socklen_t sa_len;
+  gint fd = g_socket_get_fd (sock->fileno);
+  guint n_sent = 0;
+
+  sa_len = sockaddr_from_nice_address (to, &sa.storage);
+  if (sa_len == 0)
+    return -1;
+
+  while (n_sent < n_messages) {
+    guint n_batch = MIN (n_messages - n_sent, UDP_BSD_MAX_BATCH);
+    guint i;
+    gint ret;
+
+    for (i = 0; i < n_batch; i++) {
+      const NiceOutputMessage *message = &messages[n_sent + i];
+      struct msghdr *msg = &hdrs[i].msg_hdr;
+
+      memset (msg, 0, sizeof (*msg));
+      msg->msg_name = &sa;
+      msg->msg_namelen = sa_len;
+      /* GOutputVector has the same layout as struct iovec; GSocket relies on
+       * this too. */
+      msg->msg_iov = (struct iovec *) message->buffers;
+      msg->msg_iovlen = output_message_count_buffers (message);
+      hdrs[i].msg_len = 0;
+    }
+
+    do {
+      ret = sendmmsg (fd, hdrs, n_batch, MSG_DONTWAIT);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      if (nice_debug_is_verbose ()) {
+        gchar to_str[INET6_ADDRSTRLEN];
+
+        nice_address_to_string (to, to_str);
+        nice_debug_verbose ("%s: udp-bsd socket %p -> %s:%u: error: %s",
+            G_STRFUNC, sock, to_str, nice_address_get_port (to),
+            g_strerror (errno));
+      }
+
+      if (n_sent == 0)
+        return -1;
+      break;
+    }
+
+    n_sent += ret;
+
+    /* The kernel stops at the first message it cannot queue. */
+    if ((guint) ret < n_batch)
+      break;
+  }
+
+  return n_sent;
+}
+#endif
 
 static gint
 socket_send_messages (NiceSocket *sock, const NiceAddress *to,
@@ -337,6 +928,11 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
   /* Make sure socket has not been freed: */
   g_assert (sock->priv != NULL);
 
+#ifdef HAVE_SENDMMSG
+  if (n_messages > 1)
+    return socket_send_messages_batched (sock, to, messages, n_messages);
+#endif
+
   for (i = 0; i < n_messages; i++) {
     const NiceOutputMessage *message = &messages[i];
     gssize len;
@@ -364,6 +960,122 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
   return -1;
 }
 
+/*
+ * nice_udp_bsd_socket_send_segmented:
+ * @sock: a UDP #NiceSocket
+ * @to: destination of all the messages
+ * @messages: messages to send, all of @segment_size bytes except the last
+ * one, which may be shorter
+ * @n_messages: number of elements in @messages
+ * @segment_size: size of each message
+ *
+ * Send @messages as a single super-datagram which the kernel splits into one
+ * datagram per message (UDP_SEGMENT). If the kernel or the network device
+ * refuses it, offload is disabled on @sock and the messages are sent
+ * individually instead.
+ *
+ * Returns: the number of messages sent, 0 if the send would block, or -1 on
+ * error
+ */
+gint
+nice_udp_bsd_socket_send_segmented (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages, gsize segment_size)
+{
+#ifdef UDP_SEGMENT
+  struct UdpBsdSocketPrivate *priv = sock->priv;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  union {
+    gchar buf[CMSG_SPACE (sizeof (guint16))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec *iov;
+  guint16 gso_size = segment_size;
+  guint n_iov = 0;
+  guint i, j;
+  gssize ret;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_UDP_BSD);
+  g_assert (sock->priv != NULL);
+
+  if (priv->gso_unsupported || n_messages < 2 || segment_size == 0 ||
+      segment_size > G_MAXUINT16)
+    return socket_send_messages (sock, to, messages, n_messages);
+
+  for (i = 0; i < n_messages; i++) {
+    for (j = 0;
+         (messages[i].n_buffers >= 0 && j < (guint) messages[i].n_buffers) ||
+         (messages[i].n_buffers < 0 && messages[i].buffers[j].buffer != NULL);
+         j++)
+      n_iov++;
+  }
+
+  iov = g_alloca (n_iov * sizeof (struct iovec));
+  n_iov = 0;
+  for (i = 0; i < n_messages; i++) {
+    for (j = 0;
+         (messages[i].n_buffers >= 0 && j < (guint) messages[i].n_buffers) ||
+         (messages[i].n_buffers < 0 && messages[i].buffers[j].buffer != NULL);
+         j++) {
+      iov[n_iov].iov_base = (gpointer) messages[i].buffers[j].buffer;
+      iov[n_iov].iov_len = messages[i].buffers[j].size;
+      n_iov++;
+    }
+  }
+
+  memset (&msg, 0, sizeof (msg));
+  memset (&control, 0, sizeof (control));
+  msg.msg_name = &sa;
+  msg.msg_namelen = sockaddr_from_nice_address (to, &sa.storage);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n_iov;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_UDP;
+  cmsg->cmsg_type = UDP_SEGMENT;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (guint16));
+  memcpy (CMSG_DATA (cmsg), &gso_size, sizeof (guint16));
+
+  do {
+    ret = sendmsg (g_socket_get_fd (sock->fileno), &msg, MSG_DONTWAIT);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret >= 0)
+    return n_messages;
+
+  if (errno == EAGAIN || errno == EWOULDBLOCK)
+    return 0;
+
+  /* The kernel or the device cannot segment at all. */
+  if (errno == EIO || errno == ENOPROTOOPT) {
+    nice_debug ("%s: udp-bsd socket %p: segmentation offload unsupported (%s), "
+        "falling back to individual sends", G_STRFUNC, sock,
+        g_strerror (errno));
+    priv->gso_unsupported = TRUE;
+    return socket_send_messages (sock, to, messages, n_messages);
+  }
+
+  /* Only this batch was refused, for example because the segments do not
+   * fit in the MTU or there are too many of them. */
+  if (errno == EINVAL || errno == EMSGSIZE || errno == EOPNOTSUPP) {
+    nice_debug_verbose ("%s: udp-bsd socket %p: segmented send refused (%s), "
+        "sending this batch individually", G_STRFUNC, sock,
+        g_strerror (errno));
+    return socket_send_messages (sock, to, messages, n_messages);
+  }
+
+  return -1;
+#else
+  return socket_send_messages (sock, to, messages, n_messages);
+#endif
+}
+
 static gboolean
 socket_is_reliable (NiceSocket *sock)
 {
@@ -43,9 +43,27 @@
 
 G_BEGIN_DECLS
 
+/* Kernel limits on a UDP generic segmentation offload send: the number of
+ * segments, and the total payload of the super-datagram. */
+#define NICE_UDP_BSD_MAX_SEGMENTS 64
+#define NICE_UDP_BSD_MAX_SEGMENTED_SIZE 65000
+
+GSocket *
+nice_udp_bsd_socket_bind (NiceAddress *addr, NiceAddress *local_addr);
+
 NiceSocket *
 nice_udp_bsd_socket_new (NiceAddress *addr);
 
+NiceSocket *
+nice_udp_bsd_socket_new_full (NiceAddress *addr, gboolean receive_offload);
+
+gboolean
+nice_udp_bsd_socket_has_pending_recv (NiceSocket *sock);
+
+gint
+nice_udp_bsd_socket_send_segmented (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages, gsize segment_size);
+
 G_END_DECLS
 
 #endif /* _UDP_BSD_H */
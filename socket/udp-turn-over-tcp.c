@@ -55,12 +55,12 @@
 
 typedef struct {
   NiceTurnSocketCompatibility compatibility;
-  union {
-    guint8 u8[65536];
-    guint16 u16[32768];
-  } recv_buf;
-  gsize recv_buf_len;  /* in bytes */
-  guint expecting_len;
+  /* Bytes read from the base socket and not returned yet, see
+   * priv_next_frame() */
+  guint8 *recv_buf;
+  gsize recv_buf_offset;  /* start of the first unparsed frame */
+  gsize recv_buf_len;     /* bytes left to parse */
+  NiceAddress recv_from;  /* where they were read from */
   NiceSocket *base_socket;
 } TurnTcpPriv;
 
@@ -71,6 +71,14 @@ typedef enum {
 
 #define MAX_UDP_MESSAGE_SIZE 65535
 
+/* The largest frame: a STUN header and body, or a ChannelData header, body
+ * and padding */
+#define TURN_TCP_MAX_FRAME_LEN (STUN_MESSAGE_HEADER_LENGTH + G_MAXUINT16 + 3)
+
+/* Large enough to complete the biggest frame after any partial frame has been
+ * moved to the front, and then to read more past it */
+#define TURN_TCP_RECV_BUFFER_SIZE (2 * TURN_TCP_MAX_FRAME_LEN)
+
 #define MAGIC_COOKIE_OFFSET \
   STUN_MESSAGE_HEADER_LENGTH + STUN_MESSAGE_TYPE_LEN + \
   STUN_MESSAGE_LENGTH_LEN + sizeof(guint16)
@@ -123,148 +131,203 @@ socket_close (NiceSocket *sock)
   if (priv->base_socket)
     nice_socket_free (priv->base_socket);
 
+  g_free (priv->recv_buf);
+
   g_slice_free(TurnTcpPriv, sock->priv);
   sock->priv = NULL;
 }
 
+/* Find the first complete frame in the receive buffer. On success, returns
+ * the number of bytes it takes in the buffer, and sets @data_offset and
+ * @data_len to the part of it which is returned to the upper socket:
+ *  - DRAFT9 and RFC5766 frames are STUN messages or ChannelData, returned
+ *    whole with their padding to 4 bytes;
+ *  - GOOGLE frames lose their 2-byte length header;
+ *  - OC2007 frames lose their type byte and the zero byte after it, keeping
+ *    the RFC4571 framing for the NiceAgent to unframe.
+ * Returns 0 if no frame is complete yet, or -1 if the stream is corrupt. */
 static gssize
-socket_recv_message (NiceSocket *sock, NiceInputMessage *recv_message)
+priv_next_frame (TurnTcpPriv *priv, gsize *data_offset, gsize *data_len)
 {
-  TurnTcpPriv *priv = sock->priv;
-  gssize ret;
-  guint padlen;
-  GInputVector local_recv_buf;
-  NiceInputMessage local_recv_message;
+  const guint8 *frame = priv->recv_buf + priv->recv_buf_offset;
+  gsize header_len, frame_len;
+  guint16 len;
+
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE)
+    header_len = sizeof (guint16);
+  else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007)
+    header_len = 2 * sizeof (guint16);
+  else
+    return -1;
 
-  /* Make sure socket has not been freed: */
-  g_assert (sock->priv != NULL);
+  if (priv->recv_buf_len < header_len)
+    return 0;
 
-  if (priv->expecting_len == 0) {
-    guint headerlen = 0;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
+    len = (frame[0] << 8) | frame[1];
+    frame_len = header_len + len;
+    *data_offset = header_len;
+    *data_len = len;
+  } else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
+    guint8 pt = frame[0];
 
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007)
-      headerlen = 4;
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE)
-      headerlen = 2;
-    else
+    if (pt != MS_TURN_CONTROL_MESSAGE &&
+        pt != MS_TURN_END_TO_END_DATA) {
+      /* Unexpected data, error in stream */
       return -1;
-
-    local_recv_buf.buffer = priv->recv_buf.u8 + priv->recv_buf_len;
-    local_recv_buf.size = headerlen - priv->recv_buf_len;
-    local_recv_message.buffers = &local_recv_buf;
-    local_recv_message.n_buffers = 1;
-    local_recv_message.from = recv_message->from;
-    local_recv_message.length = 0;
-
-    ret = nice_socket_recv_messages (priv->base_socket, &local_recv_message, 1);
-    if (ret < 0)
-        return ret;
-
-    priv->recv_buf_len += local_recv_message.length;
-
-    if (priv->recv_buf_len < headerlen)
-      return 0;
-
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      guint16 magic = ntohs (*priv->recv_buf.u16);
-      guint16 packetlen = ntohs (*(priv->recv_buf.u16 + 1));
-
-      if (magic < 0x4000) {
-        /* Its STUN */
-        priv->expecting_len = 20 + packetlen;
-      } else {
-        /* Channel data */
-        priv->expecting_len = 4 + packetlen;
-      }
-    }
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
-      guint compat_len = ntohs (*priv->recv_buf.u16);
-      priv->expecting_len = compat_len;
-      priv->recv_buf_len = 0;
     }
-    else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
-      guint8 pt = *priv->recv_buf.u8;
-      guint16 packetlen = ntohs (priv->recv_buf.u16[1]);
 
-      if (pt != MS_TURN_CONTROL_MESSAGE &&
-          pt != MS_TURN_END_TO_END_DATA) {
-        /* Unexpected data, error in stream */
-        return -1;
-      }
-
-      /* Keep the RFC4571 framing for the NiceAgent to unframe */
-      priv->expecting_len = packetlen + sizeof(guint16);
-      priv->recv_buf_len = sizeof(guint16);
-      priv->recv_buf.u16[0] = priv->recv_buf.u16[1];
+    len = (frame[2] << 8) | frame[3];
+    frame_len = header_len + len;
+    *data_offset = sizeof (guint16);
+    *data_len = sizeof (guint16) + len;
+  } else {
+    guint16 magic = (frame[0] << 8) | frame[1];
+
+    len = (frame[2] << 8) | frame[3];
+    if (magic < 0x4000) {
+      /* Its STUN */
+      frame_len = STUN_MESSAGE_HEADER_LENGTH + len;
+    } else {
+      /* Channel data */
+      frame_len = header_len + len;
     }
+    if (frame_len % 4)
+      frame_len += 4 - (frame_len % 4);
+    *data_offset = 0;
+    *data_len = frame_len;
   }
 
-  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
-    padlen = (priv->expecting_len % 4) ?  4 - (priv->expecting_len % 4) : 0;
-  else
-    padlen = 0;
+  if (priv->recv_buf_len < frame_len)
+    return 0;
 
-  local_recv_buf.buffer = priv->recv_buf.u8 + priv->recv_buf_len;
-  local_recv_buf.size = priv->expecting_len + padlen - priv->recv_buf_len;
+  return frame_len;
+}
+
+/* Read whatever the base socket has available into the receive buffer, after
+ * the frames already there. Returns the number of bytes read, or -1 on
+ * error. */
+static gssize
+priv_fill_recv_buf (TurnTcpPriv *priv)
+{
+  GInputVector local_recv_buf;
+  NiceInputMessage local_recv_message;
+  gint ret;
+
+  if (priv->recv_buf == NULL)
+    priv->recv_buf = g_malloc (TURN_TCP_RECV_BUFFER_SIZE);
+
+  /* Move the incomplete frame to the front so that the rest of it fits. */
+  if (priv->recv_buf_offset > 0) {
+    memmove (priv->recv_buf, priv->recv_buf + priv->recv_buf_offset,
+        priv->recv_buf_len);
+    priv->recv_buf_offset = 0;
+  }
+
+  local_recv_buf.buffer = priv->recv_buf + priv->recv_buf_len;
+  local_recv_buf.size = TURN_TCP_RECV_BUFFER_SIZE - priv->recv_buf_len;
   local_recv_message.buffers = &local_recv_buf;
   local_recv_message.n_buffers = 1;
-  local_recv_message.from = recv_message->from;
+  local_recv_message.from = &priv->recv_from;
   local_recv_message.length = 0;
 
   ret = nice_socket_recv_messages (priv->base_socket, &local_recv_message, 1);
   if (ret < 0)
-      return ret;
+    return ret;
 
   priv->recv_buf_len += local_recv_message.length;
 
-  if (priv->recv_buf_len == priv->expecting_len + padlen) {
-    /* FIXME: Eliminate this memcpy(). */
-    ret = memcpy_buffer_to_input_message (recv_message,
-        priv->recv_buf.u8, priv->recv_buf_len);
-
-    priv->expecting_len = 0;
-    priv->recv_buf_len = 0;
-
-    return ret;
-  }
-
-  return 0;
+  return local_recv_message.length;
 }
 
+/* Return every complete frame which fits in @recv_messages, reading from the
+ * base socket at most once. Frames left over stay buffered, see
+ * nice_udp_turn_over_tcp_socket_has_pending_recv(). */
 static gint
-socket_recv_messages (NiceSocket *nicesock,
+socket_recv_messages (NiceSocket *sock,
     NiceInputMessage *recv_messages, guint n_recv_messages)
 {
-  guint i;
-  gboolean error = FALSE;
+  TurnTcpPriv *priv = sock->priv;
+  gboolean has_read = FALSE;
+  guint i = 0;
 
   /* Make sure socket has not been freed: */
-  g_assert (nicesock->priv != NULL);
-
-  for (i = 0; i < n_recv_messages; i++) {
-    gssize len;
+  g_assert (sock->priv != NULL);
 
-    len = socket_recv_message (nicesock, &recv_messages[i]);
-    recv_messages[i].length = MAX (len, 0);
+  while (i < n_recv_messages) {
+    gsize data_offset = 0, data_len = 0;
+    gssize frame_len = 0;
 
-    if (len < 0)
-      error = TRUE;
+    if (priv->recv_buf != NULL)
+      frame_len = priv_next_frame (priv, &data_offset, &data_len);
 
-    if (len <= 0)
+    if (frame_len < 0) {
+      /* Return the frames before the corruption first */
+      if (i == 0)
+        return -1;
       break;
-  }
+    }
 
-  /* Was there an error processing the first message? */
-  if (error && i == 0)
-    return -1;
+    if (frame_len == 0) {
+      gssize ret;
+
+      if (has_read)
+        break;
+
+      ret = priv_fill_recv_buf (priv);
+      has_read = TRUE;
+      if (ret < 0) {
+        /* Was there an error processing the first message? */
+        if (i == 0)
+          return -1;
+        break;
+      } else if (ret == 0) {
+        break;
+      }
+      continue;
+    }
+
+    recv_messages[i].length = memcpy_buffer_to_input_message (
+        &recv_messages[i],
+        priv->recv_buf + priv->recv_buf_offset + data_offset, data_len);
+    if (recv_messages[i].from)
+      *recv_messages[i].from = priv->recv_from;
+
+    priv->recv_buf_offset += frame_len;
+    priv->recv_buf_len -= frame_len;
+    if (priv->recv_buf_len == 0)
+      priv->recv_buf_offset = 0;
+
+    i++;
+  }
 
   return i;
 }
 
+/**
+ * nice_udp_turn_over_tcp_socket_has_pending_recv:
+ * @sock: a TURN-over-TCP socket
+ *
+ * Check whether a complete frame is already buffered. Callers which stop
+ * reading before the socket would block must drain such frames explicitly.
+ *
+ * Returns: %TRUE if nice_socket_recv_messages() has a frame to return without
+ * reading from the base socket
+ */
+gboolean
+nice_udp_turn_over_tcp_socket_has_pending_recv (NiceSocket *sock)
+{
+  TurnTcpPriv *priv = sock->priv;
+  gsize data_offset, data_len;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP);
+
+  return priv->recv_buf != NULL &&
+      priv_next_frame (priv, &data_offset, &data_len) > 0;
+}
+
 static gssize
 socket_send_message (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *message, gboolean reliable)
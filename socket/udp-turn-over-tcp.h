@@ -47,6 +47,9 @@ NiceSocket *
 nice_udp_turn_over_tcp_socket_new (NiceSocket *base_socket,
     NiceTurnSocketCompatibility compatibility);
 
+gboolean
+nice_udp_turn_over_tcp_socket_has_pending_recv (NiceSocket *sock);
+
 
 G_END_DECLS
 
@@ -48,21 +48,47 @@
 
 #include "udp-turn.h"
 #include "stun/stunagent.h"
+#include "stun/utils.h"
 #include "stun/usages/timer.h"
 #include "agent-priv.h"
 
 #define STUN_END_TIMEOUT 8000
 #define STUN_MAX_MS_REALM_LEN 128 // as defined in [MS-TURN]
+/* Send indication header, XOR-PEER-ADDRESS (IPv6) and DATA attribute header */
+#define TURN_SEND_INDICATION_HEADER_LEN (STUN_MESSAGE_HEADER_LENGTH + \
+    STUN_ATTRIBUTE_HEADER_LENGTH + 20 + STUN_ATTRIBUTE_HEADER_LENGTH)
 #define STUN_EXPIRE_TIMEOUT 60 /* Time we refresh before expiration  */
 #define STUN_PERMISSION_TIMEOUT (300 - STUN_EXPIRE_TIMEOUT) /* 240 s */
 #define STUN_BINDING_TIMEOUT (600 - STUN_EXPIRE_TIMEOUT) /* 540 s */
 
-static GMutex mutex;
+/* TURN requests are allocated from MTU-sized slabs unless the credentials
+ * they carry cannot fit in one. */
+#define TURN_MESSAGE_SLAB_SIZE 1280
+/* Room for the header and every attribute but USERNAME, REALM and NONCE */
+#define TURN_MESSAGE_FIXED_LEN 512
+#define TURN_MESSAGE_POOL_SIZE 8
+/* Default number of ChannelBind, and of CreatePermission, transactions that
+ * may be in flight at the same time */
+#define TURN_MAX_TRANSACTIONS 8
+/* Peers carried by one CreatePermission request; their XOR-PEER-ADDRESS
+ * attributes must fit in TURN_MESSAGE_FIXED_LEN. */
+#define TURN_MAX_PERMISSION_PEERS 8
+
+/* Most bytes of data queued on a socket while permissions are pending. The
+ * oldest non-reliable data is dropped to make room for newer, reliable data
+ * is never dropped: sends which do not fit are refused instead. */
+#define TURN_SEND_QUEUE_MAX_BYTES (256 * 1024)
+/* Queued data is copied to pooled MTU-sized slabs unless it is bigger */
+#define TURN_SEND_DATA_SLAB_SIZE 1500
+#define TURN_SEND_DATA_POOL_SIZE 32
+/* Most queued messages handed to the base socket in one call */
+#define TURN_SEND_DATA_BATCH 32
 
 typedef struct {
   StunMessage message;
-  uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
   StunTimer timer;
+  uint8_t *buffer;  /* follows the structure in the same allocation */
+  gsize buffer_len;
 } TURNMessage;
 
 typedef struct {
@@ -72,16 +98,59 @@ typedef struct {
   GSource *timeout_source;
 } ChannelBinding;
 
+/* An in-flight ChannelBind request */
 typedef struct {
+  TURNMessage *msg;
+  ChannelBinding *binding;  /* the new binding, NULL for a refresh */
+  NiceAddress peer;
+  uint16_t channel;
+} BindingRequest;
+
+/* An in-flight CreatePermission request */
+typedef struct {
+  TURNMessage *msg;
+  NiceAddress peers[TURN_MAX_PERMISSION_PEERS];
+  guint n_peers;
+} PermissionRequest;
+
+/* used to store data sent while obtaining a permission */
+typedef struct {
+  GList link;             /* in send_data_queue */
+  GList unreliable_link;  /* in send_data_unreliable, unless reliable */
+  NiceAddress to;
+  guint8 *data;  /* follows the structure in the same allocation */
+  guint data_len;
+  gboolean reliable;
+} SendData;
+
+typedef struct {
+  /* Timeout sources hold a reference, so that their callbacks can take the
+   * lock and find out that the socket has been closed. */
+  gint ref_count;  /* atomic */
+  GMutex mutex;
+
   GMainContext *ctx;
   StunAgent agent;
   GList *channels;
+  GHashTable *channels_by_number; /* channel number -> ChannelBinding */
+  GHashTable *channels_by_peer; /* NiceAddress -> ChannelBinding */
   GList *pending_bindings;
+  /* MSN, OC2007 and Google bind one peer at a time */
   ChannelBinding *current_binding;
   TURNMessage *current_binding_msg;
-  GList *pending_permissions;
+  GList *binding_requests; /* in-flight ChannelBind (BindingRequest) */
+  guint n_binding_requests;
+  GList *pending_permissions; /* in-flight CreatePermission
+                                 (PermissionRequest) */
+  guint n_pending_permissions;
+  GList *permission_peers; /* peers (NiceAddress) waiting to be batched
+                              into a CreatePermission */
+  GSource *queued_requests_source;
+  guint max_transactions;
+  TURNMessage *message_pool[TURN_MESSAGE_POOL_SIZE]; /* free slabs */
+  guint n_pooled_messages;
   GSource *tick_source_channel_bind;
-  GSource *tick_source_create_permission;
+  GSource *tick_source_requests;
   NiceSocket *base_socket;
   NiceAddress server_addr;
   uint8_t *username;
@@ -94,10 +163,19 @@ typedef struct {
   uint8_t ms_connection_id[20];
   uint32_t ms_sequence_num;
   bool ms_connection_id_valid;
-  GList *permissions;           /* the peers (NiceAddress) for which
-                                   there is an installed permission */
-  GList *sent_permissions; /* ongoing permission installed */
-  GHashTable *send_data_queues; /* stores a send data queue for per peer */
+  GHashTable *permissions;      /* set of the peers (NiceAddress) for
+                                   which there is an installed permission */
+  GHashTable *sent_permissions; /* ongoing permission installed */
+  GQueue send_data_queue;       /* SendData waiting for the permission of
+                                   their peer, oldest first */
+  GQueue send_data_unreliable;  /* the non-reliable part of it, which gets
+                                   dropped first when the queue is full */
+  gsize send_data_queued_bytes;
+  gsize send_data_reliable_bytes; /* part of it which may not be dropped */
+  guint64 send_data_dropped;    /* messages dropped from the full queue */
+  guint64 send_data_dropped_bytes;
+  SendData *send_data_pool[TURN_SEND_DATA_POOL_SIZE]; /* free slabs */
+  guint n_pooled_send_data;
   GSource *permission_timeout_source;      /* timer used to invalidate
                                            permissions */
 
@@ -117,12 +195,6 @@ typedef struct {
   UdpTurnPriv *priv;
 } SendRequest;
 
-/* used to store data sent while obtaining a permission */
-typedef struct {
-  gchar *data;
-  guint data_len;
-  gboolean reliable;
-} SendData;
 
 static void socket_close (NiceSocket *sock);
 static gint socket_recv_messages (NiceSocket *sock,
@@ -142,10 +214,14 @@ static gboolean priv_retransmissions_tick_unlocked (UdpTurnPriv *priv);
 static gboolean priv_retransmissions_tick (gpointer pointer);
 static void priv_schedule_tick (UdpTurnPriv *priv);
 static void priv_send_turn_message (UdpTurnPriv *priv, TURNMessage *msg);
-static gboolean priv_send_create_permission (UdpTurnPriv *priv,
+static void priv_queue_create_permission (UdpTurnPriv *priv,
     const NiceAddress *peer);
+static gboolean priv_send_create_permission (UdpTurnPriv *priv,
+    const NiceAddress *peers, guint n_peers);
+static void priv_flush_create_permissions (UdpTurnPriv *priv);
+static void priv_schedule_queued_requests (UdpTurnPriv *priv);
 static gboolean priv_send_channel_bind (UdpTurnPriv *priv,
-    uint16_t channel,
+    ChannelBinding *binding, uint16_t channel,
     const NiceAddress *peer);
 static gboolean priv_add_channel_binding (UdpTurnPriv *priv,
     const NiceAddress *peer);
@@ -163,29 +239,229 @@ send_request_free (SendRequest *r)
     g_slice_free (SendRequest, r);
 }
 
+static UdpTurnPriv *
+priv_ref (UdpTurnPriv *priv)
+{
+  g_atomic_int_inc (&priv->ref_count);
+  return priv;
+}
+
+static void
+priv_unref (UdpTurnPriv *priv)
+{
+  if (g_atomic_int_dec_and_test (&priv->ref_count)) {
+    g_mutex_clear (&priv->mutex);
+    g_free (priv);
+  }
+}
+
+static TURNMessage *
+priv_turn_message_new (UdpTurnPriv *priv)
+{
+  TURNMessage *msg;
+  gsize len;
+
+  len = TURN_MESSAGE_FIXED_LEN + stun_align (priv->username_len) +
+      stun_align (priv->cached_realm_len) + stun_align (priv->cached_nonce_len);
+
+  if (len > TURN_MESSAGE_SLAB_SIZE) {
+    len = MIN (len, STUN_MAX_MESSAGE_SIZE);
+  } else if (priv->n_pooled_messages > 0) {
+    msg = priv->message_pool[--priv->n_pooled_messages];
+    memset (msg, 0, sizeof (TURNMessage));
+    msg->buffer = (uint8_t *) (msg + 1);
+    msg->buffer_len = TURN_MESSAGE_SLAB_SIZE;
+    return msg;
+  } else {
+    len = TURN_MESSAGE_SLAB_SIZE;
+  }
+
+  msg = g_malloc0 (sizeof (TURNMessage) + len);
+  msg->buffer = (uint8_t *) (msg + 1);
+  msg->buffer_len = len;
+
+  return msg;
+}
+
+static void
+priv_turn_message_free (UdpTurnPriv *priv, TURNMessage *msg)
+{
+  if (msg == NULL)
+    return;
+
+  if (msg->buffer_len == TURN_MESSAGE_SLAB_SIZE &&
+      priv->n_pooled_messages < TURN_MESSAGE_POOL_SIZE)
+    priv->message_pool[priv->n_pooled_messages++] = msg;
+  else
+    g_free (msg);
+}
+
+/* Must be consistent with nice_address_equal(), so the IPv6 scope is left
+ * out. */
 static guint
 priv_nice_address_hash (gconstpointer data)
 {
-  gchar address[NICE_ADDRESS_STRING_LEN];
+  const NiceAddress *addr = data;
+  guint hash;
+
+  switch (addr->s.addr.sa_family) {
+    case AF_INET:
+      hash = addr->s.ip4.sin_addr.s_addr;
+      hash = hash * 31 + addr->s.ip4.sin_port;
+      break;
+    case AF_INET6: {
+      guint32 words[4];
+      guint i;
+
+      memcpy (words, &addr->s.ip6.sin6_addr, sizeof (words));
+      hash = 0;
+      for (i = 0; i < G_N_ELEMENTS (words); i++)
+        hash = hash * 31 + words[i];
+      hash = hash * 31 + addr->s.ip6.sin6_port;
+      break;
+    }
+    default:
+      hash = 0;
+  }
+
+  return hash;
+}
+
+static ChannelBinding *
+priv_find_channel_by_peer (UdpTurnPriv *priv, const NiceAddress *peer)
+{
+  return g_hash_table_lookup (priv->channels_by_peer, peer);
+}
+
+static ChannelBinding *
+priv_find_channel_by_number (UdpTurnPriv *priv, uint16_t channel)
+{
+  return g_hash_table_lookup (priv->channels_by_number,
+      GUINT_TO_POINTER (channel));
+}
+
+/* Lookups return the oldest binding for a peer, as a walk of the list
+ * would. */
+static void
+priv_index_channel (UdpTurnPriv *priv, ChannelBinding *b)
+{
+  if (!g_hash_table_contains (priv->channels_by_number,
+          GUINT_TO_POINTER (b->channel)))
+    g_hash_table_insert (priv->channels_by_number,
+        GUINT_TO_POINTER (b->channel), b);
+  if (!g_hash_table_contains (priv->channels_by_peer, &b->peer))
+    g_hash_table_insert (priv->channels_by_peer, &b->peer, b);
+}
+
+static void
+priv_add_channel (UdpTurnPriv *priv, ChannelBinding *b)
+{
+  priv->channels = g_list_append (priv->channels, b);
+  priv_index_channel (priv, b);
+}
+
+/* Remove @b from the list of channels, without freeing it */
+static void
+priv_remove_channel (UdpTurnPriv *priv, ChannelBinding *b)
+{
+  gboolean reindex = FALSE;
+  GList *i;
 
-  nice_address_to_string ((NiceAddress *) data, address);
+  priv->channels = g_list_remove (priv->channels, b);
+
+  if (priv_find_channel_by_number (priv, b->channel) == b) {
+    g_hash_table_remove (priv->channels_by_number,
+        GUINT_TO_POINTER (b->channel));
+    reindex = TRUE;
+  }
+  if (priv_find_channel_by_peer (priv, &b->peer) == b) {
+    g_hash_table_remove (priv->channels_by_peer, &b->peer);
+    reindex = TRUE;
+  }
 
-  return g_str_hash(address);
+  /* Let a later binding with the same number or peer take its place. */
+  if (reindex) {
+    for (i = priv->channels; i; i = i->next)
+      priv_index_channel (priv, i->data);
+  }
 }
 
+/* Free all channels; the caller must have destroyed their timeouts */
 static void
-priv_send_data_queue_destroy (gpointer user_data)
+priv_clear_channels (UdpTurnPriv *priv)
+{
+  g_hash_table_remove_all (priv->channels_by_number);
+  g_hash_table_remove_all (priv->channels_by_peer);
+  g_list_free_full (priv->channels, g_free);
+  priv->channels = NULL;
+}
+
+static BindingRequest *
+priv_find_binding_request (UdpTurnPriv *priv, const NiceAddress *peer)
+{
+  GList *i;
+
+  for (i = priv->binding_requests; i; i = i->next) {
+    BindingRequest *req = i->data;
+
+    if (nice_address_equal (&req->peer, peer))
+      return req;
+  }
+
+  return NULL;
+}
+
+static gboolean
+priv_channel_number_in_use (UdpTurnPriv *priv, uint16_t channel)
 {
-  GQueue *send_queue = (GQueue *) user_data;
   GList *i;
 
-  for (i = g_queue_peek_head_link (send_queue); i; i = i->next) {
-    SendData *data = (SendData *) i->data;
+  if (priv_find_channel_by_number (priv, channel) != NULL)
+    return TRUE;
+
+  for (i = priv->binding_requests; i; i = i->next) {
+    BindingRequest *req = i->data;
 
-    g_free (data->data);
-    g_slice_free (SendData, data);
+    if (req->channel == channel)
+      return TRUE;
   }
-  g_queue_free (send_queue);
+
+  return FALSE;
+}
+
+/* Whether another channel binding may be started right away */
+static gboolean
+priv_can_start_binding (UdpTurnPriv *priv)
+{
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766)
+    return priv->n_binding_requests < priv->max_transactions;
+
+  return priv->current_binding == NULL;
+}
+
+/* Free @req, which must not be in the list anymore, but not the binding it
+ * carries */
+static void
+priv_binding_request_free (UdpTurnPriv *priv, BindingRequest *req)
+{
+  StunTransactionId id;
+
+  stun_message_id (&req->msg->message, id);
+  stun_agent_forget_transaction (&priv->agent, id);
+  priv_turn_message_free (priv, req->msg);
+  g_slice_free (BindingRequest, req);
+}
+
+static void
+priv_permission_request_free (UdpTurnPriv *priv, PermissionRequest *req)
+{
+  StunTransactionId id;
+
+  stun_message_id (&req->msg->message, id);
+  stun_agent_forget_transaction (&priv->agent, id);
+  priv_turn_message_free (priv, req->msg);
+  g_slice_free (PermissionRequest, req);
 }
 
 NiceSocket *
@@ -202,6 +478,8 @@ nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
   }
 
   priv = g_new0 (UdpTurnPriv, 1);
+  priv->ref_count = 1;
+  g_mutex_init (&priv->mutex);
 
   if (compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
       compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
@@ -227,6 +505,7 @@ nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
 
   priv->channels = NULL;
   priv->current_binding = NULL;
+  priv->max_transactions = TURN_MAX_TRANSACTIONS;
   priv->base_socket = base_socket;
   if (ctx)
     priv->ctx = g_main_context_ref (ctx);
@@ -250,11 +529,17 @@ nice_udp_turn_socket_new (GMainContext *ctx, NiceAddress *addr,
   priv->compatibility = compatibility;
   priv->send_requests = g_queue_new ();
 
-  priv->send_data_queues =
-      g_hash_table_new_full (priv_nice_address_hash,
-          (GEqualFunc) nice_address_equal,
-          (GDestroyNotify) nice_address_free,
-          priv_send_data_queue_destroy);
+  g_queue_init (&priv->send_data_queue);
+  g_queue_init (&priv->send_data_unreliable);
+  priv->channels_by_number = g_hash_table_new (NULL, NULL);
+  priv->channels_by_peer = g_hash_table_new (priv_nice_address_hash,
+      (GEqualFunc) nice_address_equal);
+  priv->permissions = g_hash_table_new_full (priv_nice_address_hash,
+      (GEqualFunc) nice_address_equal,
+      (GDestroyNotify) nice_address_free, NULL);
+  priv->sent_permissions = g_hash_table_new_full (priv_nice_address_hash,
+      (GEqualFunc) nice_address_equal,
+      (GDestroyNotify) nice_address_free, NULL);
 
   sock->type = NICE_SOCKET_TYPE_UDP_TURN;
   sock->fileno = NULL;
@@ -280,7 +565,7 @@ socket_close (NiceSocket *sock)
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   GList *i = NULL;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   for (i = priv->channels; i; i = i->next) {
     ChannelBinding *b = i->data;
@@ -288,9 +573,10 @@ socket_close (NiceSocket *sock)
       g_source_destroy (b->timeout_source);
       g_source_unref (b->timeout_source);
     }
-    g_free (b);
   }
-  g_list_free (priv->channels);
+  priv_clear_channels (priv);
+  g_hash_table_destroy (priv->channels_by_number);
+  g_hash_table_destroy (priv->channels_by_peer);
 
   g_list_free_full (priv->pending_bindings, (GDestroyNotify) nice_address_free);
 
@@ -300,17 +586,28 @@ socket_close (NiceSocket *sock)
     priv->tick_source_channel_bind = NULL;
   }
 
-  if (priv->tick_source_create_permission != NULL) {
-    g_source_destroy (priv->tick_source_create_permission);
-    g_source_unref (priv->tick_source_create_permission);
-    priv->tick_source_create_permission = NULL;
+  if (priv->tick_source_requests != NULL) {
+    g_source_destroy (priv->tick_source_requests);
+    g_source_unref (priv->tick_source_requests);
+    priv->tick_source_requests = NULL;
+  }
+
+  if (priv->queued_requests_source != NULL) {
+    g_source_destroy (priv->queued_requests_source);
+    g_source_unref (priv->queued_requests_source);
+    priv->queued_requests_source = NULL;
   }
 
   g_queue_free_full (priv->send_requests, (GDestroyNotify) send_request_free);
 
-  priv_clear_permissions (priv);
-  g_list_free_full (priv->sent_permissions, (GDestroyNotify) nice_address_free);
-  g_hash_table_destroy (priv->send_data_queues);
+  g_hash_table_destroy (priv->permissions);
+  g_hash_table_destroy (priv->sent_permissions);
+  /* The links are part of the SendData they point to */
+  while (!g_queue_is_empty (&priv->send_data_queue))
+    g_free (g_queue_pop_head_link (&priv->send_data_queue)->data);
+  g_queue_init (&priv->send_data_unreliable);
+  while (priv->n_pooled_send_data > 0)
+    g_free (priv->send_data_pool[--priv->n_pooled_send_data]);
 
   if (priv->permission_timeout_source) {
     g_source_destroy (priv->permission_timeout_source);
@@ -323,7 +620,25 @@ socket_close (NiceSocket *sock)
 
   g_free (priv->current_binding);
   g_free (priv->current_binding_msg);
-  g_list_free_full (priv->pending_permissions, g_free);
+  for (i = priv->binding_requests; i; i = i->next) {
+    BindingRequest *req = i->data;
+
+    g_free (req->binding);
+    g_free (req->msg);
+    g_slice_free (BindingRequest, req);
+  }
+  g_list_free (priv->binding_requests);
+  for (i = priv->pending_permissions; i; i = i->next) {
+    PermissionRequest *req = i->data;
+
+    g_free (req->msg);
+    g_slice_free (PermissionRequest, req);
+  }
+  g_list_free (priv->pending_permissions);
+  g_list_free_full (priv->permission_peers,
+      (GDestroyNotify) nice_address_free);
+  while (priv->n_pooled_messages > 0)
+    g_free (priv->message_pool[--priv->n_pooled_messages]);
   g_free (priv->username);
   g_free (priv->password);
   g_free (priv->cached_realm);
@@ -333,11 +648,11 @@ socket_close (NiceSocket *sock)
     g_byte_array_free(priv->fragment_buffer, TRUE);
   }
 
-  g_free (priv);
-
   sock->priv = NULL;
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
+
+  priv_unref (priv);
 }
 
 static gint
@@ -509,7 +824,7 @@ socket_recv_messages (NiceSocket *sock,
 /* interval is given in milliseconds */
 static GSource *
 priv_timeout_add_with_context (UdpTurnPriv *priv, guint interval,
-    GSourceFunc function, gpointer data)
+    GSourceFunc function)
 {
   GSource *source = NULL;
 
@@ -517,7 +832,8 @@ priv_timeout_add_with_context (UdpTurnPriv *priv, guint interval,
 
   source = g_timeout_source_new (interval);
 
-  g_source_set_callback (source, function, data, NULL);
+  g_source_set_callback (source, function, priv_ref (priv),
+      (GDestroyNotify) priv_unref);
   g_source_attach (source, priv->ctx);
 
   return source;
@@ -526,7 +842,7 @@ priv_timeout_add_with_context (UdpTurnPriv *priv, guint interval,
 /* interval is given in seconds */
 static GSource *
 priv_timeout_add_seconds_with_context (UdpTurnPriv *priv, guint interval,
-    GSourceFunc function, gpointer data)
+    GSourceFunc function)
 {
   GSource *source = NULL;
 
@@ -534,7 +850,8 @@ priv_timeout_add_seconds_with_context (UdpTurnPriv *priv, guint interval,
 
   source = g_timeout_source_new_seconds (interval);
 
-  g_source_set_callback (source, function, data, NULL);
+  g_source_set_callback (source, function, priv_ref (priv),
+      (GDestroyNotify) priv_unref);
   g_source_attach (source, priv->ctx);
 
   return source;
@@ -570,81 +887,40 @@ stun_message_ensure_ms_realm(StunMessage *msg, uint8_t *realm)
   }
 }
 
-static gboolean
-priv_is_peer_in_list (const GList *list, const NiceAddress *peer)
-{
-  const GList *iter;
-
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
-
-    if (nice_address_equal (address, peer))
-      return TRUE;
-  }
-
-  return FALSE;
-}
-
 static gboolean
 priv_has_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->permissions, peer);
+  return g_hash_table_contains (priv->permissions, peer);
 }
 
 static gboolean
 priv_has_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  return priv_is_peer_in_list (priv->sent_permissions, peer);
+  return g_hash_table_contains (priv->sent_permissions, peer);
 }
 
 static void
 priv_add_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  priv->permissions =
-      g_list_append (priv->permissions, nice_address_dup (peer));
+  g_hash_table_add (priv->permissions, nice_address_dup (peer));
 }
 
 static void
 priv_add_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  priv->sent_permissions =
-      g_list_append (priv->sent_permissions, nice_address_dup (peer));
-}
-
-static GList *
-priv_remove_peer_from_list (GList *list, const NiceAddress *peer)
-{
-  GList *iter;
-
-  for (iter = list ; iter ; iter = g_list_next (iter)) {
-    NiceAddress *address = (NiceAddress *) iter->data;
-
-    if (nice_address_equal (address, peer)) {
-      GList *prev = iter->prev;
-
-      nice_address_free (address);
-      list = g_list_delete_link (list, iter);
-      iter = prev;
-      if (iter)
-        iter = list;
-    }
-  }
-
-  return list;
+  g_hash_table_add (priv->sent_permissions, nice_address_dup (peer));
 }
 
 static void
 priv_remove_sent_permission_for_peer (UdpTurnPriv *priv, const NiceAddress *peer)
 {
-  priv->sent_permissions =
-      priv_remove_peer_from_list (priv->sent_permissions, peer);
+  g_hash_table_remove (priv->sent_permissions, peer);
 }
 
 static void
 priv_clear_permissions (UdpTurnPriv *priv)
 {
-  g_list_free_full (priv->permissions, (GDestroyNotify) nice_address_free);
-  priv->permissions = NULL;
+  g_hash_table_remove_all (priv->permissions);
 }
 
 static gint
@@ -738,48 +1014,237 @@ _socket_send_wrapped (NiceSocket *sock, const NiceAddress *to,
   }
 }
 
+static SendData *
+priv_send_data_new (UdpTurnPriv *priv, gsize len)
+{
+  SendData *data;
+
+  if (len <= TURN_SEND_DATA_SLAB_SIZE && priv->n_pooled_send_data > 0)
+    data = priv->send_data_pool[--priv->n_pooled_send_data];
+  else
+    data = g_malloc (sizeof (SendData) +
+        MAX (len, TURN_SEND_DATA_SLAB_SIZE));
+
+  data->data = (guint8 *) (data + 1);
+  data->data_len = len;
+  data->link.data = data;
+  data->link.prev = data->link.next = NULL;
+  data->unreliable_link.data = data;
+  data->unreliable_link.prev = data->unreliable_link.next = NULL;
+
+  return data;
+}
+
 static void
+priv_send_data_free (UdpTurnPriv *priv, SendData *data)
+{
+  priv->send_data_queued_bytes -= data->data_len;
+  if (data->reliable)
+    priv->send_data_reliable_bytes -= data->data_len;
+
+  if (data->data_len <= TURN_SEND_DATA_SLAB_SIZE &&
+      priv->n_pooled_send_data < TURN_SEND_DATA_POOL_SIZE)
+    priv->send_data_pool[priv->n_pooled_send_data++] = data;
+  else
+    g_free (data);
+}
+
+/* Returns FALSE if @message does not fit in the queue, even once all the
+ * non-reliable data queued before it is dropped */
+static gboolean
 socket_enqueue_data(UdpTurnPriv *priv, const NiceAddress *to,
-    guint len, const gchar *buf, gboolean reliable)
+    const NiceOutputMessage *message, gboolean reliable)
 {
-  SendData *data = g_slice_new0 (SendData);
-  GQueue *queue = g_hash_table_lookup (priv->send_data_queues, to);
+  gsize len = output_message_get_size (message);
+  SendData *data;
+  GList *l;
+  gsize offset = 0;
+  guint n_bufs = 0;
+  guint i;
 
-  if (queue == NULL) {
-    queue = g_queue_new ();
-    g_hash_table_insert (priv->send_data_queues, nice_address_dup (to),
-        queue);
+  if (priv->send_data_reliable_bytes + len > TURN_SEND_QUEUE_MAX_BYTES) {
+    nice_debug_verbose ("send queue full, refusing %" G_GSIZE_FORMAT " bytes",
+        len);
+    return FALSE;
   }
 
-  data->data = g_memdup(buf, len);
-  data->data_len = len;
+  /* Make room by dropping the oldest non-reliable data, whichever peer it is
+   * for */
+  while (priv->send_data_queued_bytes + len > TURN_SEND_QUEUE_MAX_BYTES &&
+      (l = g_queue_peek_head_link (&priv->send_data_unreliable)) != NULL) {
+    data = l->data;
+
+    g_queue_unlink (&priv->send_data_unreliable, &data->unreliable_link);
+    g_queue_unlink (&priv->send_data_queue, &data->link);
+    priv->send_data_dropped++;
+    priv->send_data_dropped_bytes += data->data_len;
+    nice_debug_verbose ("send queue full, dropping %u bytes", data->data_len);
+
+    priv_send_data_free (priv, data);
+  }
+
+  /* Queued data has to outlive the caller's buffers, so this is the only
+   * place where a framed message gets copied. */
+  data = priv_send_data_new (priv, len);
+  data->to = *to;
   data->reliable = reliable;
-  g_queue_push_tail (queue, data);
+
+  if (message->n_buffers == -1) {
+    for (i = 0; message->buffers[i].buffer != NULL; i++)
+      n_bufs++;
+  } else {
+    n_bufs = message->n_buffers;
+  }
+
+  for (i = 0; i < n_bufs; i++) {
+    memcpy (data->data + offset, message->buffers[i].buffer,
+        message->buffers[i].size);
+    offset += message->buffers[i].size;
+  }
+
+  priv->send_data_queued_bytes += len;
+  if (reliable)
+    priv->send_data_reliable_bytes += len;
+  g_queue_push_tail_link (&priv->send_data_queue, &data->link);
+  if (!reliable)
+    g_queue_push_tail_link (&priv->send_data_unreliable,
+        &data->unreliable_link);
+
+  return TRUE;
+}
+
+/* Send @n_data messages queued with the same reliability in one call */
+static void
+priv_send_data_batch (UdpTurnPriv *priv, SendData **batch, guint n_data)
+{
+  NiceOutputMessage messages[TURN_SEND_DATA_BATCH];
+  GOutputVector vectors[TURN_SEND_DATA_BATCH];
+  guint i;
+
+  /* The RFC4571 framing of a reliable base socket is added one message at a
+   * time */
+  if (nice_socket_is_reliable (priv->base_socket)) {
+    for (i = 0; i < n_data; i++)
+      _socket_send_wrapped (priv->base_socket, &priv->server_addr,
+          batch[i]->data_len, (gchar *) batch[i]->data, batch[i]->reliable);
+    return;
+  }
+
+  for (i = 0; i < n_data; i++) {
+    vectors[i].buffer = batch[i]->data;
+    vectors[i].size = batch[i]->data_len;
+    messages[i].buffers = &vectors[i];
+    messages[i].n_buffers = 1;
+  }
+
+  _socket_send_messages_wrapped (priv->base_socket, &priv->server_addr,
+      messages, n_data, batch[0]->reliable);
 }
 
 static void
 socket_dequeue_all_data (UdpTurnPriv *priv, const NiceAddress *to)
 {
-  GQueue *send_queue = g_hash_table_lookup (priv->send_data_queues, to);
+  SendData *batch[TURN_SEND_DATA_BATCH];
+  guint n_data = 0;
+  GList *i, *next;
+  guint j;
 
-  if (send_queue) {
-    while (!g_queue_is_empty (send_queue)) {
-      SendData *data =
-          (SendData *) g_queue_pop_head(send_queue);
+  for (i = g_queue_peek_head_link (&priv->send_data_queue); i; i = next) {
+    SendData *data = i->data;
 
-      nice_debug_verbose ("dequeuing data");
-      _socket_send_wrapped (priv->base_socket, &priv->server_addr,
-          data->data_len, data->data, data->reliable);
+    next = i->next;
+
+    if (!nice_address_equal (&data->to, to))
+      continue;
 
-      g_free (data->data);
-      g_slice_free (SendData, data);
+    if (n_data == TURN_SEND_DATA_BATCH ||
+        (n_data > 0 && batch[0]->reliable != data->reliable)) {
+      priv_send_data_batch (priv, batch, n_data);
+      for (j = 0; j < n_data; j++)
+        priv_send_data_free (priv, batch[j]);
+      n_data = 0;
     }
 
-    /* remove queue from table */
-    g_hash_table_remove (priv->send_data_queues, to);
+    nice_debug_verbose ("dequeuing data");
+    g_queue_unlink (&priv->send_data_queue, &data->link);
+    if (!data->reliable)
+      g_queue_unlink (&priv->send_data_unreliable, &data->unreliable_link);
+    batch[n_data++] = data;
+  }
+
+  if (n_data > 0) {
+    priv_send_data_batch (priv, batch, n_data);
+    for (j = 0; j < n_data; j++)
+      priv_send_data_free (priv, batch[j]);
   }
 }
 
+/* Send @message to the server behind the @header_len bytes of TURN framing in
+ * @header, followed by @padding bytes of padding. The payload is referenced
+ * rather than copied, unless it has to be queued until a permission for @to
+ * is installed. */
+static gssize
+priv_send_framed_message (UdpTurnPriv *priv, const NiceAddress *to,
+    const guint8 *header, gsize header_len, const NiceOutputMessage *message,
+    gsize message_len, gsize padding, gboolean reliable)
+{
+  static const guint8 zero_padding[4] = { 0, };
+  GOutputVector *local_bufs;
+  NiceOutputMessage local_message;
+  gsize msg_len = header_len + message_len + padding;
+  guint n_bufs = 0;
+  guint i;
+  gint ret;
+
+  g_assert (padding < sizeof (zero_padding));
+
+  /* Count the number of buffers. */
+  if (message->n_buffers == -1) {
+    for (i = 0; message->buffers[i].buffer != NULL; i++)
+      n_bufs++;
+  } else {
+    n_bufs = message->n_buffers;
+  }
+
+  local_bufs = g_alloca ((n_bufs + 2) * sizeof (GOutputVector));
+  local_message.buffers = local_bufs;
+  local_message.n_buffers = n_bufs + 1;
+
+  local_bufs[0].buffer = header;
+  local_bufs[0].size = header_len;
+
+  for (i = 0; i < n_bufs; i++) {
+    local_bufs[i + 1].buffer = message->buffers[i].buffer;
+    local_bufs[i + 1].size = message->buffers[i].size;
+  }
+
+  if (padding > 0) {
+    local_bufs[n_bufs + 1].buffer = zero_padding;
+    local_bufs[n_bufs + 1].size = padding;
+    local_message.n_buffers++;
+  }
+
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
+      !priv_has_permission_for_peer (priv, to)) {
+    if (!priv_has_sent_permission_for_peer (priv, to)) {
+      priv_queue_create_permission (priv, to);
+    }
+
+    /* enque data */
+    nice_debug_verbose ("enqueuing data");
+    if (!socket_enqueue_data (priv, to, &local_message, reliable))
+      return reliable ? -1 : 0;
+
+    return msg_len;
+  }
+
+  ret = _socket_send_messages_wrapped (priv->base_socket,
+      &priv->server_addr, &local_message, 1, reliable);
+
+  if (ret == 1)
+    return msg_len;
+  return ret;
+}
 
 static gssize
 socket_send_message (NiceSocket *sock, const NiceAddress *to,
@@ -787,26 +1252,18 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
 {
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   StunMessage msg;
-  uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
   size_t msg_len;
   union {
     struct sockaddr_storage storage;
     struct sockaddr addr;
   } sa;
-  GList *i;
   ChannelBinding *binding = NULL;
   gint ret;
 
   /* Make sure socket has not been freed: */
   g_assert (sock->priv != NULL);
 
-  for (i = priv->channels; i; i = i->next) {
-    ChannelBinding *b = i->data;
-    if (nice_address_equal (&b->peer, to)) {
-      binding = b;
-      break;
-    }
-  }
+  binding = priv_find_channel_by_peer (priv, to);
 
   nice_address_copy_to_sockaddr (to, &sa.addr);
 
@@ -814,38 +1271,16 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
     if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
         priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
       gsize message_len = output_message_get_size (message);
+      uint16_t header[2];
 
-      if (message_len + sizeof(uint32_t) <= sizeof(buffer)) {
-        guint j;
-        uint16_t len16, channel16;
-        gsize message_offset = 0;
-
-        len16 = htons ((uint16_t) message_len);
-        channel16 = htons (binding->channel);
-
-        memcpy (buffer, &channel16, sizeof(uint16_t));
-        memcpy (buffer + sizeof(uint16_t), &len16, sizeof(uint16_t));
-
-        /* FIXME: Slow path! This should be replaced by code which manipulates
-         * the GOutputVector array, rather than the buffer contents
-         * themselves. */
-        for (j = 0;
-             (message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
-             (message->n_buffers < 0 && message->buffers[j].buffer != NULL);
-             j++) {
-          const GOutputVector *out_buf = &message->buffers[j];
-          gsize out_len;
-
-          out_len = MIN (message_len - message_offset, out_buf->size);
-          memcpy (buffer + sizeof (uint32_t) + message_offset,
-              out_buf->buffer, out_len);
-          message_offset += out_len;
-        }
-
-        msg_len = message_len + sizeof(uint32_t);
-      } else {
+      if (message_len > G_MAXUINT16)
         goto error;
-      }
+
+      header[0] = htons (binding->channel);
+      header[1] = htons ((uint16_t) message_len);
+
+      return priv_send_framed_message (priv, to, (const guint8 *) header,
+          sizeof (header), message, message_len, 0, reliable);
     } else {
       ret = _socket_send_messages_wrapped (priv->base_socket,
           &priv->server_addr, message, 1, reliable);
@@ -855,18 +1290,44 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
       return ret;
     }
   } else {
+    uint8_t buffer[STUN_MAX_MESSAGE_SIZE];
     guint8 *compacted_buf;
     gsize compacted_buf_len;
 
     if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
         priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
+      uint8_t header[TURN_SEND_INDICATION_HEADER_LEN];
+      gsize message_len = output_message_get_size (message);
+      uint8_t *data;
+
       if (!stun_agent_init_indication (&priv->agent, &msg,
-              buffer, sizeof(buffer), STUN_IND_SEND))
+              header, sizeof(header), STUN_IND_SEND))
         goto error;
       if (stun_message_append_xor_addr (&msg, STUN_ATTRIBUTE_PEER_ADDRESS,
               &sa.storage, sizeof(sa)) !=
           STUN_MESSAGE_RETURN_SUCCESS)
         goto error;
+
+      /* In these modes Send indications carry neither MESSAGE-INTEGRITY nor
+       * FINGERPRINT, so nothing follows the DATA attribute and the payload
+       * can be sent from the caller's buffers. Only the attribute header is
+       * built here; its length and the message length are then patched to
+       * cover the payload and its padding. */
+      data = stun_message_append (&msg, STUN_ATTRIBUTE_DATA, 0);
+      if (data == NULL)
+        goto error;
+
+      msg_len = stun_message_length (&msg);
+      if (message_len > G_MAXUINT16 ||
+          msg_len + stun_align (message_len) > STUN_MAX_MESSAGE_SIZE)
+        goto error;
+
+      stun_setw (data - STUN_ATTRIBUTE_LENGTH_LEN, message_len);
+      stun_setw (header + STUN_MESSAGE_LENGTH_POS,
+          msg_len - STUN_MESSAGE_HEADER_LENGTH + stun_align (message_len));
+
+      return priv_send_framed_message (priv, to, header, msg_len, message,
+          message_len, stun_padding (message_len), reliable);
     } else {
       if (!stun_agent_init_request (&priv->agent, &msg,
               buffer, sizeof(buffer), STUN_SEND))
@@ -932,24 +1393,11 @@ socket_send_message (NiceSocket *sock, const NiceAddress *to,
       req->priv = priv;
       stun_message_id (&msg, req->id);
       req->source = priv_timeout_add_with_context (priv,
-          STUN_END_TIMEOUT, priv_forget_send_request_timeout, req);
+          STUN_END_TIMEOUT, priv_forget_send_request_timeout);
       g_queue_push_tail (priv->send_requests, req);
     }
-  }
-
-  if (msg_len > 0) {
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
-        !priv_has_permission_for_peer (priv, to)) {
-      if (!priv_has_sent_permission_for_peer (priv, to)) {
-        priv_send_create_permission (priv, to);
-      }
-
-      /* enque data */
-      nice_debug_verbose ("enqueuing data");
-      socket_enqueue_data(priv, to, msg_len, (gchar *)buffer, reliable);
 
-      return msg_len;
-    } else {
+    if (msg_len > 0) {
       GOutputVector local_buf = { buffer, msg_len };
       NiceOutputMessage local_message = {&local_buf, 1};
 
@@ -976,12 +1424,13 @@ static gint
 socket_send_messages (NiceSocket *sock, const NiceAddress *to,
     const NiceOutputMessage *messages, guint n_messages)
 {
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   guint i;
 
-  g_mutex_lock (&mutex);
-
   /* Make sure socket has not been freed: */
-  g_assert (sock->priv != NULL);
+  g_assert (priv != NULL);
+
+  g_mutex_lock (&priv->mutex);
 
   for (i = 0; i < n_messages; i++) {
     const NiceOutputMessage *message = &messages[i];
@@ -993,7 +1442,7 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
       /* Error. */
       if (i > 0)
         break;
-      g_mutex_unlock (&mutex);
+      g_mutex_unlock (&priv->mutex);
       return len;
     } else if (len == 0) {
       /* EWOULDBLOCK. */
@@ -1001,7 +1450,7 @@ socket_send_messages (NiceSocket *sock, const NiceAddress *to,
     }
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return i;
 }
@@ -1013,15 +1462,16 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   guint i;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   /* TURN can depend either on tcp-turn or udp-bsd as a base socket
    * if we allow reliable send and need to create permissions and we queue the
    * data, then we must be sure that the reliable send will succeed later, so
    * we check for udp-bsd here as the base socket and don't allow it.
    */
-  if (priv->base_socket->type == NICE_SOCKET_TYPE_UDP_BSD) {
-    g_mutex_unlock (&mutex);
+  if (priv->base_socket->type == NICE_SOCKET_TYPE_UDP_BSD ||
+      priv->base_socket->type == NICE_SOCKET_TYPE_UDP_URING) {
+    g_mutex_unlock (&priv->mutex);
     return -1;
   }
 
@@ -1033,7 +1483,7 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
 
     if (len < 0) {
       /* Error. */
-      g_mutex_unlock (&mutex);
+      g_mutex_unlock (&priv->mutex);
       return len;
     } else if (len == 0) {
       /* EWOULDBLOCK. */
@@ -1041,7 +1491,7 @@ socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
     }
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
   return i;
 }
 
@@ -1082,20 +1532,30 @@ socket_is_based_on (NiceSocket *sock, NiceSocket *other)
 static gboolean
 priv_forget_send_request_timeout (gpointer pointer)
 {
-  SendRequest *req = pointer;
+  UdpTurnPriv *priv = pointer;
+  GSource *source;
+  GList *l;
 
-  g_mutex_lock (&mutex);
-  if (g_source_is_destroyed (g_main_current_source ())) {
+  g_mutex_lock (&priv->mutex);
+  source = g_main_current_source ();
+  if (g_source_is_destroyed (source)) {
     nice_debug ("Source was destroyed. "
         "Avoided race condition in turn.c:priv_forget_send_request");
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
-  send_request_free (req);
-  g_queue_remove (req->priv->send_requests, req);
+  for (l = g_queue_peek_head_link (priv->send_requests); l; l = l->next) {
+    SendRequest *req = l->data;
 
-  g_mutex_unlock (&mutex);
+    if (req->source == source) {
+      g_queue_delete_link (priv->send_requests, l);
+      send_request_free (req);
+      break;
+    }
+  }
+
+  g_mutex_unlock (&priv->mutex);
 
   return G_SOURCE_REMOVE;
 }
@@ -1107,13 +1567,13 @@ priv_permission_timeout (gpointer data)
 
   nice_debug ("Permission is about to timeout, schedule renewal");
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "udp-turn.c:priv_permission_timeout");
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
@@ -1121,7 +1581,7 @@ priv_permission_timeout (gpointer data)
   /* remove all permissions for this agent (the permission for the peer
      we are sending to will be renewed) */
   priv_clear_permissions (priv);
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return TRUE;
 }
@@ -1133,44 +1593,37 @@ priv_binding_expired_timeout (gpointer data)
   GList *i;
   GSource *source = NULL;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "udp-turn.c:priv_permission_timeout");
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
   nice_debug ("Permission expired, refresh failed");
+  source = g_main_current_source ();
 
   /* find current binding and destroy it */
   for (i = priv->channels ; i; i = i->next) {
     ChannelBinding *b = i->data;
     if (b->timeout_source == source) {
-      priv->channels = g_list_remove (priv->channels, b);
+      BindingRequest *req;
+
+      priv_remove_channel (priv, b);
+      g_source_unref (b->timeout_source);
+      b->timeout_source = NULL;
+
       /* Make sure we don't free a currently being-refreshed binding */
-      if (priv->current_binding_msg && !priv->current_binding) {
-        union {
-          struct sockaddr_storage storage;
-          struct sockaddr addr;
-        } sa;
-        socklen_t sa_len = sizeof(sa);
-        NiceAddress to;
-
-        /* look up binding associated with peer */
-        stun_message_find_xor_addr (
-            &priv->current_binding_msg->message,
-            STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &sa.storage, &sa_len);
-        nice_address_set_from_sockaddr (&to, &sa.addr);
-
-        /* If the binding is being refreshed, then move it to
-           priv->current_binding so it counts as a 'new' binding and
-           will get readded to the list if it succeeds */
-        if (nice_address_equal (&b->peer, &to)) {
-          priv->current_binding = b;
-          break;
-        }
+      req = priv_find_binding_request (priv, &b->peer);
+
+      /* If the binding is being refreshed, then move it to the request so
+         it counts as a 'new' binding and will get readded to the list if
+         it succeeds */
+      if (req && !req->binding) {
+        req->binding = b;
+        break;
       }
       /* In case the binding timed out before it could be processed, add it to
          the pending list */
@@ -1180,7 +1633,7 @@ priv_binding_expired_timeout (gpointer data)
     }
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
   return G_SOURCE_REMOVE;
 }
 
@@ -1191,12 +1644,12 @@ priv_binding_timeout (gpointer data)
   GList *i;
   GSource *source = NULL;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "udp-turn.c:priv_permission_timeout");
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
@@ -1218,16 +1671,17 @@ priv_binding_timeout (gpointer data)
 
       /* Install timer to expire the permission */
       b->timeout_source = priv_timeout_add_seconds_with_context (priv,
-          STUN_EXPIRE_TIMEOUT, priv_binding_expired_timeout, priv);
+          STUN_EXPIRE_TIMEOUT, priv_binding_expired_timeout);
 
-      /* Send renewal */
-      if (!priv->current_binding_msg)
-        priv_send_channel_bind (priv, b->channel, &b->peer);
+      /* Send renewal, unless it has to wait for a free transaction */
+      if (priv_can_start_binding (priv) &&
+          !priv_find_binding_request (priv, &b->peer))
+        priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
       break;
     }
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return G_SOURCE_REMOVE;
 }
@@ -1263,14 +1717,24 @@ void
 nice_udp_turn_socket_cache_realm_nonce (NiceSocket *sock,
     StunMessage *msg)
 {
-  g_mutex_lock (&mutex);
+  UdpTurnPriv *priv = sock->priv;
+
+  g_mutex_lock (&priv->mutex);
   nice_udp_turn_socket_cache_realm_nonce_locked (sock, msg);
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 }
 
+static gsize
+priv_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
+    NiceAddress *from, const NiceAddress *recv_from, const guint8 *_recv_buf,
+    gsize recv_len, gsize *payload_offset);
+
+/* Unwrap the TURN framing of @message. If @in_place is %TRUE and @message has
+ * a single buffer, the payload is not moved: the buffer is advanced to point
+ * at it instead, so the caller must own @message's #GInputVector. */
 guint
 nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_sock,
-    NiceInputMessage *message)
+    NiceInputMessage *message, gboolean in_place)
 {
   /* TODO: Speed this up in the common reliable case of having a 24-byte header
    * buffer to begin with, followed by one or more massive buffers. */
@@ -1282,11 +1746,19 @@ nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_soc
        message->buffers[0].buffer != NULL &&
        message->buffers[1].buffer == NULL)) {
     /* Fast path. Single massive buffer. */
-    len = nice_udp_turn_socket_parse_recv (sock, from_sock,
-        message->from, message->length, message->buffers[0].buffer,
-        message->from, message->buffers[0].buffer, message->length);
-
-    g_assert_cmpuint (len, <=, message->length);
+    gsize offset = 0;
+
+    buf = message->buffers[0].buffer;
+    len = priv_parse_recv (sock, from_sock, message->from, message->from,
+        buf, message->length, &offset);
+    len = (offset < message->length) ? MIN (len, message->length - offset) : 0;
+
+    if (in_place) {
+      message->buffers[0].buffer = buf + offset;
+      message->buffers[0].size -= offset;
+    } else if (len > 0 && offset > 0) {
+      memmove (buf, buf + offset, len);
+    }
 
     message->length = len;
 
@@ -1309,13 +1781,35 @@ nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_soc
 gsize
 nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
     NiceAddress *from, gsize len, guint8 *buf,
-    const NiceAddress *recv_from, const guint8 *_recv_buf, gsize recv_len)
+    const NiceAddress *recv_from, const guint8 *recv_buf, gsize recv_len)
+{
+  gsize payload_len, offset = 0;
+
+  payload_len = priv_parse_recv (sock, from_sock, from, recv_from,
+      recv_buf, recv_len, &offset);
+  if (offset >= recv_len)
+    return 0;
+  payload_len = MIN (payload_len, MIN (len, recv_len - offset));
+
+  if (payload_len > 0)
+    memmove (buf, recv_buf + offset, payload_len);
+
+  return payload_len;
+}
+
+/* Parse a message received from @recv_from. Returns the length of the payload
+ * it carries, which starts @payload_offset bytes into @_recv_buf, or 0 if it
+ * was handled internally. The length is as stated by the framing and may
+ * exceed the received data. */
+static gsize
+priv_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
+    NiceAddress *from, const NiceAddress *recv_from, const guint8 *_recv_buf,
+    gsize recv_len, gsize *payload_offset)
 {
 
   UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   StunValidationStatus valid;
   StunMessage msg;
-  GList *l;
   ChannelBinding *binding = NULL;
 
   union {
@@ -1323,7 +1817,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
     const guint16 *u16;
   } recv_buf;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
 
   /* In the case of a reliable UDP-TURN-OVER-TCP (which means MS-TURN)
    * we must use RFC4571 framing */
@@ -1388,7 +1882,7 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
           stun_message_id (&priv->current_binding_msg->message, request_id);
           if (memcmp (request_id, response_id,
                   sizeof(StunTransactionId)) == 0) {
-            g_free (priv->current_binding_msg);
+            priv_turn_message_free (priv, priv->current_binding_msg);
             priv->current_binding_msg = NULL;
 
             if (stun_message_get_class (&msg) == STUN_RESPONSE &&
@@ -1406,209 +1900,189 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
       } else if (stun_message_get_method (&msg) == STUN_CHANNELBIND) {
         StunTransactionId request_id;
         StunTransactionId response_id;
+        BindingRequest *req = NULL;
+        GList *i;
 
-        if (priv->current_binding_msg) {
-          stun_message_id (&msg, response_id);
-          stun_message_id (&priv->current_binding_msg->message, request_id);
+        stun_message_id (&msg, response_id);
+        for (i = priv->binding_requests; i; i = i->next) {
+          BindingRequest *r = i->data;
+
+          stun_message_id (&r->msg->message, request_id);
           if (memcmp (request_id, response_id,
                   sizeof(StunTransactionId)) == 0) {
+            req = r;
+            break;
+          }
+        }
+
+        if (req) {
+          priv->binding_requests = g_list_remove (priv->binding_requests,
+              req);
+          priv->n_binding_requests--;
+
+          if (req->binding) {
+            /* New channel binding */
+            binding = req->binding;
+          } else {
+            /* Existing binding refresh */
+            binding = priv_find_channel_by_peer (priv, &req->peer);
+          }
 
-            if (priv->current_binding) {
-              /* New channel binding */
-              binding = priv->current_binding;
+          if (stun_message_get_class (&msg) == STUN_ERROR) {
+            int code = -1;
+            uint8_t *sent_realm = NULL;
+            uint8_t *recv_realm = NULL;
+            uint16_t sent_realm_len = 0;
+            uint16_t recv_realm_len = 0;
+
+            sent_realm =
+                (uint8_t *) stun_message_find (&req->msg->message,
+                    STUN_ATTRIBUTE_REALM, &sent_realm_len);
+            recv_realm =
+                (uint8_t *) stun_message_find (&msg,
+                    STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+            /* check for unauthorized error response */
+            if (stun_message_find_error (&msg, &code) ==
+                STUN_MESSAGE_RETURN_SUCCESS &&
+                (code == STUN_ERROR_STALE_NONCE ||
+                    (code == STUN_ERROR_UNAUTHORIZED &&
+                        !(recv_realm != NULL &&
+                            recv_realm_len > 0 &&
+                            recv_realm_len == sent_realm_len &&
+                            sent_realm != NULL &&
+                            memcmp (sent_realm, recv_realm,
+                                sent_realm_len) == 0)))) {
+
+              nice_udp_turn_socket_cache_realm_nonce_locked (sock, &msg);
+              if (binding)
+                priv_send_channel_bind (priv, req->binding, binding->channel,
+                    &binding->peer);
             } else {
-              /* Existing binding refresh */
-              GList *i;
-              union {
-                struct sockaddr_storage storage;
-                struct sockaddr addr;
-              } sa;
-              socklen_t sa_len = sizeof(sa);
-              NiceAddress to;
-
-              /* look up binding associated with peer */
-              stun_message_find_xor_addr (
-                  &priv->current_binding_msg->message,
-                  STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &sa.storage, &sa_len);
-              nice_address_set_from_sockaddr (&to, &sa.addr);
-
-              for (i = priv->channels; i; i = i->next) {
-                ChannelBinding *b = i->data;
-                if (nice_address_equal (&b->peer, &to)) {
-                  binding = b;
-                  break;
-                }
-              }
+              g_free (req->binding);
+              priv_process_pending_bindings (priv);
             }
-
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &priv->current_binding_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == STUN_ERROR_STALE_NONCE ||
-                      (code == STUN_ERROR_UNAUTHORIZED &&
-                          !(recv_realm != NULL &&
-                              recv_realm_len > 0 &&
-                              recv_realm_len == sent_realm_len &&
-                              sent_realm != NULL &&
-                              memcmp (sent_realm, recv_realm,
-                                  sent_realm_len) == 0)))) {
-
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
-                nice_udp_turn_socket_cache_realm_nonce_locked (sock, &msg);
-                if (binding)
-                  priv_send_channel_bind (priv, binding->channel,
-                      &binding->peer);
-              } else {
-                g_free (priv->current_binding);
-                priv->current_binding = NULL;
-                g_free (priv->current_binding_msg);
-                priv->current_binding_msg = NULL;
-                priv_process_pending_bindings (priv);
-              }
-            } else if (stun_message_get_class (&msg) == STUN_RESPONSE) {
-              g_free (priv->current_binding_msg);
-              priv->current_binding_msg = NULL;
-
-              /* If it's a new channel binding, then add it to the list */
-              if (priv->current_binding)
-                priv->channels = g_list_append (priv->channels,
-                    priv->current_binding);
-              priv->current_binding = NULL;
-
-              if (binding) {
-                binding->renew = FALSE;
-
-                /* Remove any existing timer */
-                if (binding->timeout_source) {
-                  g_source_destroy (binding->timeout_source);
-                  g_source_unref (binding->timeout_source);
-                }
-                /* Install timer to schedule refresh of the permission */
-                binding->timeout_source =
-                    priv_timeout_add_seconds_with_context (priv,
-                    STUN_BINDING_TIMEOUT, priv_binding_timeout, priv);
+          } else {
+            /* If it's a new channel binding, then add it to the list */
+            if (req->binding)
+              priv_add_channel (priv, req->binding);
+
+            if (binding) {
+              binding->renew = FALSE;
+
+              /* Remove any existing timer */
+              if (binding->timeout_source) {
+                g_source_destroy (binding->timeout_source);
+                g_source_unref (binding->timeout_source);
               }
-              priv_process_pending_bindings (priv);
+              /* Install timer to schedule refresh of the permission */
+              binding->timeout_source =
+                  priv_timeout_add_seconds_with_context (priv,
+                  STUN_BINDING_TIMEOUT, priv_binding_timeout);
             }
+            priv_process_pending_bindings (priv);
           }
+
+          priv_binding_request_free (priv, req);
         }
         goto done;
       } else if (stun_message_get_method (&msg) == STUN_CREATEPERMISSION) {
         StunTransactionId request_id;
         StunTransactionId response_id;
-        GList *i, *next;
-        TURNMessage *current_create_permission_msg;
-
-        for (i = priv->pending_permissions; i; i = next) {
-          current_create_permission_msg = (TURNMessage *) i->data;
-          next = i->next;
+        PermissionRequest *req = NULL;
+        GList *i;
+        guint j;
 
-          stun_message_id (&msg, response_id);
-          stun_message_id (&current_create_permission_msg->message, request_id);
+        stun_message_id (&msg, response_id);
+        for (i = priv->pending_permissions; i; i = i->next) {
+          PermissionRequest *r = i->data;
 
+          stun_message_id (&r->msg->message, request_id);
           if (memcmp (request_id, response_id,
                   sizeof(StunTransactionId)) == 0) {
-            union {
-              struct sockaddr_storage storage;
-              struct sockaddr addr;
-            } peer;
-            socklen_t peer_len = sizeof(peer);
-            NiceAddress to;
-            gchar tmpbuf[INET6_ADDRSTRLEN];
-
-            stun_message_find_xor_addr (
-                &current_create_permission_msg->message,
-                STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &peer.storage, &peer_len);
-            nice_address_set_from_sockaddr (&to, &peer.addr);
-            nice_address_to_string (&to, tmpbuf);
-            nice_debug ("TURN: got response for CreatePermission "
-                "with XOR_PEER_ADDRESS=[%s]:%u : %s",
-                tmpbuf, nice_address_get_port (&to),
-                stun_message_get_class (&msg) == STUN_ERROR ? "unauthorized" : "ok");
-
-            /* unathorized => resend with realm and nonce */
-            if (stun_message_get_class (&msg) == STUN_ERROR) {
-              int code = -1;
-              uint8_t *sent_realm = NULL;
-              uint8_t *recv_realm = NULL;
-              uint16_t sent_realm_len = 0;
-              uint16_t recv_realm_len = 0;
-
-              sent_realm =
-                  (uint8_t *) stun_message_find (
-                      &current_create_permission_msg->message,
-                      STUN_ATTRIBUTE_REALM, &sent_realm_len);
-              recv_realm =
-                  (uint8_t *) stun_message_find (&msg,
-                      STUN_ATTRIBUTE_REALM, &recv_realm_len);
-
-              /* check for unauthorized error response */
-              if (stun_message_find_error (&msg, &code) ==
-                  STUN_MESSAGE_RETURN_SUCCESS &&
-                  (code == STUN_ERROR_STALE_NONCE ||
-                      (code == STUN_ERROR_UNAUTHORIZED &&
-                          !(recv_realm != NULL &&
-                              recv_realm_len > 0 &&
-                              recv_realm_len == sent_realm_len &&
-                              sent_realm != NULL &&
-                              memcmp (sent_realm, recv_realm,
-                                  sent_realm_len) == 0)))) {
-
-                priv->pending_permissions = g_list_delete_link (
-                    priv->pending_permissions, i);
-                g_free (current_create_permission_msg);
-                current_create_permission_msg = NULL;
-
-                nice_udp_turn_socket_cache_realm_nonce_locked (sock, &msg);
-                /* resend CreatePermission */
-                priv_send_create_permission (priv, &to);
-                goto done;
-              }
-            }
-            /* If we get an error, we just assume the server somehow
-               doesn't support permissions and we ignore the error and
-               fake a successful completion. If the server needs a permission
-               but it failed to create it, then the connchecks will fail. */
-            priv_remove_sent_permission_for_peer (priv, &to);
-            priv_add_permission_for_peer (priv, &to);
-
-            /* install timer to schedule refresh of the permission */
-            /* (will not schedule refresh if we got an error) */
-            if (stun_message_get_class (&msg) == STUN_RESPONSE &&
-                !priv->permission_timeout_source) {
-              priv->permission_timeout_source =
-                  priv_timeout_add_seconds_with_context (priv,
-                      STUN_PERMISSION_TIMEOUT, priv_permission_timeout,
-                      priv);
-            }
+            req = r;
+            break;
+          }
+        }
 
-            /* send enqued data */
-            socket_dequeue_all_data (priv, &to);
+        if (req == NULL)
+          goto done;
 
-            priv->pending_permissions = g_list_delete_link (
-                priv->pending_permissions, i);
-            g_free (current_create_permission_msg);
-            current_create_permission_msg = NULL;
+        priv->pending_permissions = g_list_remove (priv->pending_permissions,
+            req);
+        priv->n_pending_permissions--;
 
-            break;
+        for (j = 0; j < req->n_peers; j++) {
+          gchar tmpbuf[INET6_ADDRSTRLEN];
+
+          nice_address_to_string (&req->peers[j], tmpbuf);
+          nice_debug ("TURN: got response for CreatePermission "
+              "with XOR_PEER_ADDRESS=[%s]:%u : %s",
+              tmpbuf, nice_address_get_port (&req->peers[j]),
+              stun_message_get_class (&msg) == STUN_ERROR ? "unauthorized" : "ok");
+        }
+
+        /* unathorized => resend with realm and nonce */
+        if (stun_message_get_class (&msg) == STUN_ERROR) {
+          int code = -1;
+          uint8_t *sent_realm = NULL;
+          uint8_t *recv_realm = NULL;
+          uint16_t sent_realm_len = 0;
+          uint16_t recv_realm_len = 0;
+
+          sent_realm =
+              (uint8_t *) stun_message_find (&req->msg->message,
+                  STUN_ATTRIBUTE_REALM, &sent_realm_len);
+          recv_realm =
+              (uint8_t *) stun_message_find (&msg,
+                  STUN_ATTRIBUTE_REALM, &recv_realm_len);
+
+          /* check for unauthorized error response */
+          if (stun_message_find_error (&msg, &code) ==
+              STUN_MESSAGE_RETURN_SUCCESS &&
+              (code == STUN_ERROR_STALE_NONCE ||
+                  (code == STUN_ERROR_UNAUTHORIZED &&
+                      !(recv_realm != NULL &&
+                          recv_realm_len > 0 &&
+                          recv_realm_len == sent_realm_len &&
+                          sent_realm != NULL &&
+                          memcmp (sent_realm, recv_realm,
+                              sent_realm_len) == 0)))) {
+
+            nice_udp_turn_socket_cache_realm_nonce_locked (sock, &msg);
+            /* resend CreatePermission */
+            priv_send_create_permission (priv, req->peers, req->n_peers);
+            priv_permission_request_free (priv, req);
+            goto done;
           }
         }
+        /* If we get an error, we just assume the server somehow
+           doesn't support permissions and we ignore the error and
+           fake a successful completion. If the server needs a permission
+           but it failed to create it, then the connchecks will fail. */
+        for (j = 0; j < req->n_peers; j++) {
+          priv_remove_sent_permission_for_peer (priv, &req->peers[j]);
+          priv_add_permission_for_peer (priv, &req->peers[j]);
+        }
+
+        /* install timer to schedule refresh of the permission */
+        /* (will not schedule refresh if we got an error) */
+        if (stun_message_get_class (&msg) == STUN_RESPONSE &&
+            !priv->permission_timeout_source) {
+          priv->permission_timeout_source =
+              priv_timeout_add_seconds_with_context (priv,
+                  STUN_PERMISSION_TIMEOUT, priv_permission_timeout);
+        }
+
+        /* send enqued data */
+        for (j = 0; j < req->n_peers; j++)
+          socket_dequeue_all_data (priv, &req->peers[j]);
+
+        priv_permission_request_free (priv, req);
+
+        /* A transaction slot is free for the peers still queued */
+        if (priv->permission_peers)
+          priv_flush_create_permissions (priv);
 
         goto done;
       } else if (stun_message_get_class (&msg) == STUN_INDICATION &&
@@ -1645,14 +2119,14 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
         if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766 &&
                 !priv_has_permission_for_peer (priv, from)) {
           if (!priv_has_sent_permission_for_peer (priv, from)) {
-            priv_send_create_permission (priv, from);
+            priv_queue_create_permission (priv, from);
           }
         }
 
         *from_sock = sock;
-        memmove (buf, data, len > data_len ? data_len : len);
-        g_mutex_unlock (&mutex);
-        return len > data_len ? data_len : len;
+        *payload_offset = data - _recv_buf;
+        g_mutex_unlock (&priv->mutex);
+        return data_len;
       } else {
         goto recv;
       }
@@ -1660,20 +2134,15 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
   }
 
  recv:
-  for (l = priv->channels; l; l = l->next) {
-    ChannelBinding *b = l->data;
-    if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
-        priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
-      if (b->channel == ntohs(recv_buf.u16[0])) {
-        recv_len = ntohs (recv_buf.u16[1]);
-        recv_buf.u8 += sizeof(uint32_t);
-        binding = b;
-        break;
-      }
-    } else {
-      binding = b;
-      break;
+  if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
+      priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
+    binding = priv_find_channel_by_number (priv, ntohs (recv_buf.u16[0]));
+    if (binding) {
+      recv_len = ntohs (recv_buf.u16[1]);
+      recv_buf.u8 += sizeof(uint32_t);
     }
+  } else if (priv->channels) {
+    binding = priv->channels->data;
   }
 
   if (binding) {
@@ -1683,42 +2152,35 @@ nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
     *from = *recv_from;
   }
 
-  memmove (buf, recv_buf.u8, len > recv_len ? recv_len : len);
-  g_mutex_unlock (&mutex);
-  return len > recv_len ? recv_len : len;
+  *payload_offset = recv_buf.u8 - _recv_buf;
+  g_mutex_unlock (&priv->mutex);
+  return recv_len;
 
  msn_google_lock:
 
   if (priv->current_binding) {
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      g_free (b);
-    }
-    g_list_free (priv->channels);
-    priv->channels = g_list_append (NULL, priv->current_binding);
+    priv_clear_channels (priv);
+    priv_add_channel (priv, priv->current_binding);
     priv->current_binding = NULL;
     priv_process_pending_bindings (priv);
   }
 
  done:
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
   return 0;
 }
 
 gboolean
 nice_udp_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer)
 {
-  UdpTurnPriv *priv;
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
   gboolean ret;
 
-  g_mutex_lock (&mutex);
-
-  priv = (UdpTurnPriv *) sock->priv;
+  g_mutex_lock (&priv->mutex);
 
   ret = priv_add_channel_binding (priv, peer);
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return ret;
 }
@@ -1726,31 +2188,62 @@ nice_udp_turn_socket_set_peer (NiceSocket *sock, NiceAddress *peer)
 static void
 priv_process_pending_bindings (UdpTurnPriv *priv)
 {
-  gboolean ret = FALSE;
+  GList *i;
 
-  while (priv->pending_bindings != NULL && ret == FALSE) {
+  while (priv->pending_bindings != NULL && priv_can_start_binding (priv)) {
     NiceAddress *peer = priv->pending_bindings->data;
-    ret = priv_add_channel_binding (priv, peer);
     priv->pending_bindings = g_list_remove (priv->pending_bindings, peer);
+    priv_add_channel_binding (priv, peer);
     nice_address_free (peer);
   }
 
-  /* If no new channel bindings are in progress and there are no
-     pending bindings, then renew the soon to be expired bindings */
-  if (priv->pending_bindings == NULL && priv->current_binding_msg == NULL) {
-    GList *i = NULL;
+  /* If there are no pending bindings, then renew the soon to be expired
+     bindings, as many at a time as transactions are allowed */
+  if (priv->pending_bindings != NULL)
+    return;
 
-    /* find binding to renew */
-    for (i = priv->channels ; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (b->renew) {
-        priv_send_channel_bind (priv, b->channel, &b->peer);
-        break;
-      }
-    }
+  for (i = priv->channels; i && priv_can_start_binding (priv); i = i->next) {
+    ChannelBinding *b = i->data;
+
+    if (b->renew && !priv_find_binding_request (priv, &b->peer))
+      priv_send_channel_bind (priv, NULL, b->channel, &b->peer);
   }
 }
 
+static gboolean
+priv_queued_requests_cb (gpointer pointer)
+{
+  UdpTurnPriv *priv = pointer;
+
+  g_mutex_lock (&priv->mutex);
+  if (g_source_is_destroyed (g_main_current_source ())) {
+    nice_debug ("Source was destroyed. Avoided race condition in "
+                "udp-turn.c:priv_queued_requests_cb");
+
+    g_mutex_unlock (&priv->mutex);
+    return G_SOURCE_REMOVE;
+  }
+
+  g_source_unref (priv->queued_requests_source);
+  priv->queued_requests_source = NULL;
+
+  priv_process_pending_bindings (priv);
+  priv_flush_create_permissions (priv);
+
+  g_mutex_unlock (&priv->mutex);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Start the queued requests from the main loop. Permissions requested
+ * until then are sent together. */
+static void
+priv_schedule_queued_requests (UdpTurnPriv *priv)
+{
+  if (priv->queued_requests_source == NULL)
+    priv->queued_requests_source =
+        priv_timeout_add_with_context (priv, 0, priv_queued_requests_cb);
+}
 
 static gboolean
 priv_retransmissions_tick_unlocked (UdpTurnPriv *priv)
@@ -1769,7 +2262,7 @@ priv_retransmissions_tick_unlocked (UdpTurnPriv *priv)
 
           g_free (priv->current_binding);
           priv->current_binding = NULL;
-          g_free (priv->current_binding_msg);
+          priv_turn_message_free (priv, priv->current_binding_msg);
           priv->current_binding_msg = NULL;
 
 
@@ -1798,63 +2291,86 @@ priv_retransmissions_tick_unlocked (UdpTurnPriv *priv)
 }
 
 static gboolean
-priv_retransmissions_create_permission_tick_unlocked (UdpTurnPriv *priv, GList *list_element)
+priv_retransmissions_channel_bind_tick_unlocked (UdpTurnPriv *priv,
+    GList *list_element)
 {
+  BindingRequest *req = list_element->data;
   gboolean ret = FALSE;
-  TURNMessage *current_create_permission_msg;
 
-  current_create_permission_msg = (TURNMessage *)list_element->data;
-
-  if (current_create_permission_msg) {
-    switch (stun_timer_refresh (&current_create_permission_msg->timer)) {
-      case STUN_USAGE_TIMER_RETURN_TIMEOUT:
-        {
-          /* Time out */
-          StunTransactionId id;
-          NiceAddress to;
-          union {
-            struct sockaddr_storage storage;
-            struct sockaddr addr;
-          } addr;
-          socklen_t addr_len = sizeof(addr);
-
-          stun_message_id (&current_create_permission_msg->message, id);
-          stun_agent_forget_transaction (&priv->agent, id);
-          stun_message_find_xor_addr (
-              &current_create_permission_msg->message,
-              STUN_ATTRIBUTE_XOR_PEER_ADDRESS, &addr.storage, &addr_len);
-          nice_address_set_from_sockaddr (&to, &addr.addr);
+  switch (stun_timer_refresh (&req->msg->timer)) {
+    case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+      /* Time out */
+      priv->binding_requests = g_list_delete_link (priv->binding_requests,
+          list_element);
+      priv->n_binding_requests--;
+      g_free (req->binding);
+      priv_binding_request_free (priv, req);
+
+      /* Not from here, priv_schedule_tick() is walking the list */
+      if (priv->pending_bindings)
+        priv_schedule_queued_requests (priv);
+      break;
+    case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+      /* Retransmit */
+      _socket_send_wrapped (priv->base_socket, &priv->server_addr,
+          stun_message_length (&req->msg->message),
+          (gchar *)req->msg->buffer, FALSE);
+      ret = TRUE;
+      break;
+    case STUN_USAGE_TIMER_RETURN_SUCCESS:
+      ret = TRUE;
+      break;
+    default:
+      /* Nothing to do. */
+      break;
+  }
 
-          priv_remove_sent_permission_for_peer (priv, &to);
-          priv->pending_permissions = g_list_delete_link (
-              priv->pending_permissions, list_element);
-          g_free (current_create_permission_msg);
-          current_create_permission_msg = NULL;
+  return ret;
+}
 
-          /* we got a timeout when retransmitting a CreatePermission
-             message, assume we can just send the data, the server
-             might not support RFC TURN, or connectivity check will
-             fail eventually anyway */
-          priv_add_permission_for_peer (priv, &to);
+static gboolean
+priv_retransmissions_create_permission_tick_unlocked (UdpTurnPriv *priv,
+    GList *list_element)
+{
+  PermissionRequest *req = list_element->data;
+  gboolean ret = FALSE;
+  guint j;
+
+  switch (stun_timer_refresh (&req->msg->timer)) {
+    case STUN_USAGE_TIMER_RETURN_TIMEOUT:
+      /* Time out */
+      priv->pending_permissions = g_list_delete_link (
+          priv->pending_permissions, list_element);
+      priv->n_pending_permissions--;
+
+      /* we got a timeout when retransmitting a CreatePermission
+         message, assume we can just send the data, the server
+         might not support RFC TURN, or connectivity check will
+         fail eventually anyway */
+      for (j = 0; j < req->n_peers; j++) {
+        priv_remove_sent_permission_for_peer (priv, &req->peers[j]);
+        priv_add_permission_for_peer (priv, &req->peers[j]);
+        socket_dequeue_all_data (priv, &req->peers[j]);
+      }
 
-          socket_dequeue_all_data (priv, &to);
+      priv_permission_request_free (priv, req);
 
-          break;
-        }
-      case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
-        /* Retransmit */
-        _socket_send_wrapped (priv->base_socket, &priv->server_addr,
-            stun_message_length (&current_create_permission_msg->message),
-            (gchar *)current_create_permission_msg->buffer, FALSE);
-        ret = TRUE;
-        break;
-      case STUN_USAGE_TIMER_RETURN_SUCCESS:
-        ret = TRUE;
-        break;
-      default:
-        /* Nothing to do. */
-        break;
-    }
+      if (priv->permission_peers)
+        priv_schedule_queued_requests (priv);
+      break;
+    case STUN_USAGE_TIMER_RETURN_RETRANSMIT:
+      /* Retransmit */
+      _socket_send_wrapped (priv->base_socket, &priv->server_addr,
+          stun_message_length (&req->msg->message),
+          (gchar *)req->msg->buffer, FALSE);
+      ret = TRUE;
+      break;
+    case STUN_USAGE_TIMER_RETURN_SUCCESS:
+      ret = TRUE;
+      break;
+    default:
+      /* Nothing to do. */
+      break;
   }
 
   return ret;
@@ -1865,12 +2381,12 @@ priv_retransmissions_tick (gpointer pointer)
 {
   UdpTurnPriv *priv = pointer;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "udp-turn.c:priv_permission_timeout");
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
@@ -1882,31 +2398,31 @@ priv_retransmissions_tick (gpointer pointer)
     }
   }
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return G_SOURCE_REMOVE;
 }
 
 static gboolean
-priv_retransmissions_create_permission_tick (gpointer pointer)
+priv_retransmissions_requests_tick (gpointer pointer)
 {
   UdpTurnPriv *priv = pointer;
 
-  g_mutex_lock (&mutex);
+  g_mutex_lock (&priv->mutex);
   if (g_source_is_destroyed (g_main_current_source ())) {
     nice_debug ("Source was destroyed. Avoided race condition in "
                 "udp-turn.c:priv_permission_timeout");
 
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
     return G_SOURCE_REMOVE;
   }
 
-  /* This will call priv_retransmissions_create_permission_tick_unlocked() for
-   * every pending permission with an expired timer and will create a new timer
-   * if there are pending permissions that require it */
+  /* This will call the retransmission tick for every pending ChannelBind or
+   * CreatePermission with an expired timer and will create a new timer if
+   * there are pending requests that require it */
   priv_schedule_tick (priv);
 
-  g_mutex_unlock (&mutex);
+  g_mutex_unlock (&priv->mutex);
 
   return G_SOURCE_REMOVE;
 }
@@ -1915,7 +2431,6 @@ static void
 priv_schedule_tick (UdpTurnPriv *priv)
 {
   GList *i, *next, *prev;
-  TURNMessage *current_create_permission_msg;
   guint min_timeout = G_MAXUINT;
 
   if (priv->tick_source_channel_bind != NULL) {
@@ -1929,25 +2444,47 @@ priv_schedule_tick (UdpTurnPriv *priv)
     if (timeout > 0) {
       priv->tick_source_channel_bind =
           priv_timeout_add_with_context (priv, timeout,
-              priv_retransmissions_tick, priv);
+              priv_retransmissions_tick);
     } else {
       priv_retransmissions_tick_unlocked (priv);
     }
   }
 
-  if (priv->tick_source_create_permission != NULL) {
-    g_source_destroy (priv->tick_source_create_permission);
-    g_source_unref (priv->tick_source_create_permission);
-    priv->tick_source_create_permission = NULL;
+  if (priv->tick_source_requests != NULL) {
+    g_source_destroy (priv->tick_source_requests);
+    g_source_unref (priv->tick_source_requests);
+    priv->tick_source_requests = NULL;
+  }
+
+  for (i = priv->binding_requests, prev = NULL; i; i = next) {
+    BindingRequest *req = i->data;
+    guint timeout;
+
+    next = i->next;
+
+    timeout = stun_timer_remainder (&req->msg->timer);
+
+    if (timeout > 0) {
+      min_timeout = MIN (min_timeout, timeout);
+      prev = i;
+    } else {
+      /* This could either delete the request from the list, or it could
+       * refresh it, changing its timeout value */
+      priv_retransmissions_channel_bind_tick_unlocked (priv, i);
+      if (prev == NULL)
+        next = priv->binding_requests;
+      else
+        next = prev->next;
+    }
   }
 
   for (i = priv->pending_permissions, prev = NULL; i; i = next) {
+    PermissionRequest *req = i->data;
     guint timeout;
 
-    current_create_permission_msg = (TURNMessage *)i->data;
     next = i->next;
 
-    timeout = stun_timer_remainder (&current_create_permission_msg->timer);
+    timeout = stun_timer_remainder (&req->msg->timer);
 
     if (timeout > 0) {
       min_timeout = MIN (min_timeout, timeout);
@@ -1965,23 +2502,18 @@ priv_schedule_tick (UdpTurnPriv *priv)
 
   /* We create one timer for the minimal timeout we need */
   if (min_timeout != G_MAXUINT) {
-    priv->tick_source_create_permission =
+    priv->tick_source_requests =
         priv_timeout_add_with_context (priv, min_timeout,
-            priv_retransmissions_create_permission_tick,
-            priv);
+            priv_retransmissions_requests_tick);
   }
 }
 
+/* Send the request @msg to the server and start its retransmission timer */
 static void
-priv_send_turn_message (UdpTurnPriv *priv, TURNMessage *msg)
+priv_start_transaction (UdpTurnPriv *priv, TURNMessage *msg)
 {
   size_t stun_len = stun_message_length (&msg->message);
 
-  if (priv->current_binding_msg) {
-    g_free (priv->current_binding_msg);
-    priv->current_binding_msg = NULL;
-  }
-
   if (nice_socket_is_reliable (priv->base_socket)) {
     _socket_send_wrapped (priv->base_socket, &priv->server_addr,
         stun_len, (gchar *)msg->buffer, TRUE);
@@ -1995,75 +2527,118 @@ priv_send_turn_message (UdpTurnPriv *priv, TURNMessage *msg)
     stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
         STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
   }
+}
+
+static void
+priv_send_turn_message (UdpTurnPriv *priv, TURNMessage *msg)
+{
+  if (priv->current_binding_msg) {
+    priv_turn_message_free (priv, priv->current_binding_msg);
+    priv->current_binding_msg = NULL;
+  }
+
+  priv_start_transaction (priv, msg);
 
   priv->current_binding_msg = msg;
   priv_schedule_tick (priv);
 }
 
+/* Queue a CreatePermission for @peer, to be sent along with the ones for the
+ * other peers queued before the next main loop iteration */
+static void
+priv_queue_create_permission (UdpTurnPriv *priv, const NiceAddress *peer)
+{
+  if (priv_has_sent_permission_for_peer (priv, peer))
+    return;
+
+  /* register this peer as being pending a permission */
+  priv_add_sent_permission_for_peer (priv, peer);
+  priv->permission_peers = g_list_append (priv->permission_peers,
+      nice_address_dup (peer));
+  priv_schedule_queued_requests (priv);
+}
+
+/* Send the queued permissions in as few requests as possible, as long as the
+ * number of transactions in flight allows */
+static void
+priv_flush_create_permissions (UdpTurnPriv *priv)
+{
+  while (priv->permission_peers != NULL &&
+      priv->n_pending_permissions < priv->max_transactions) {
+    NiceAddress peers[TURN_MAX_PERMISSION_PEERS];
+    guint n_peers = 0;
+
+    while (priv->permission_peers != NULL &&
+        n_peers < TURN_MAX_PERMISSION_PEERS) {
+      NiceAddress *peer = priv->permission_peers->data;
+
+      peers[n_peers++] = *peer;
+      priv->permission_peers = g_list_delete_link (priv->permission_peers,
+          priv->permission_peers);
+      nice_address_free (peer);
+    }
+
+    priv_send_create_permission (priv, peers, n_peers);
+  }
+}
+
+/* Send one CreatePermission request, with an XOR-PEER-ADDRESS attribute for
+ * each of the @n_peers @peers */
 static gboolean
-priv_send_create_permission(UdpTurnPriv *priv,
-    const NiceAddress *peer)
+priv_send_create_permission (UdpTurnPriv *priv,
+    const NiceAddress *peers, guint n_peers)
 {
-  guint msg_buf_len;
-  gboolean res = FALSE;
-  TURNMessage *msg = g_new0 (TURNMessage, 1);
-  union {
-    struct sockaddr_storage storage;
-    struct sockaddr addr;
-  } addr;
+  PermissionRequest *req;
+  TURNMessage *msg;
+  struct sockaddr_storage addrs[TURN_MAX_PERMISSION_PEERS];
+  size_t stun_len;
+  guint i;
 
-  /* register this peer as being pening a permission (if not already pending) */
-  if (!priv_has_sent_permission_for_peer (priv, peer)) {
-    priv_add_sent_permission_for_peer (priv, peer);
+  g_assert (n_peers > 0 && n_peers <= TURN_MAX_PERMISSION_PEERS);
+
+  for (i = 0; i < n_peers; i++) {
+    /* register this peer as being pending a permission (if not already
+     * pending) */
+    if (!priv_has_sent_permission_for_peer (priv, &peers[i]))
+      priv_add_sent_permission_for_peer (priv, &peers[i]);
+
+    nice_address_copy_to_sockaddr (&peers[i], (struct sockaddr *) &addrs[i]);
   }
 
-  nice_address_copy_to_sockaddr (peer, &addr.addr);
+  msg = priv_turn_message_new (priv);
 
-  /* send CreatePermission */
-  msg_buf_len = stun_usage_turn_create_permission(&priv->agent, &msg->message,
-      msg->buffer,
-      sizeof(msg->buffer),
-      priv->username,
-      priv->username_len,
-      priv->password,
-      priv->password_len,
+  stun_len = stun_usage_turn_create_permissions (&priv->agent, &msg->message,
+      msg->buffer, msg->buffer_len,
+      priv->username, priv->username_len,
+      priv->password, priv->password_len,
       priv->cached_realm, priv->cached_realm_len,
       priv->cached_nonce, priv->cached_nonce_len,
-      &addr.storage,
+      addrs, n_peers,
       STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
 
-  if (msg_buf_len > 0) {
-    if (nice_socket_is_reliable (priv->base_socket)) {
-      res = _socket_send_wrapped (priv->base_socket, &priv->server_addr,
-          msg_buf_len, (gchar *) msg->buffer, TRUE);
-    } else {
-      res = _socket_send_wrapped (priv->base_socket, &priv->server_addr,
-          msg_buf_len, (gchar *) msg->buffer, TRUE);
-      if (res < 0)
-        res = _socket_send_wrapped (priv->base_socket, &priv->server_addr,
-            msg_buf_len, (gchar *) msg->buffer, FALSE);
-    }
+  if (stun_len == 0) {
+    priv_turn_message_free (priv, msg);
+    return FALSE;
+  }
 
-    if (nice_socket_is_reliable (priv->base_socket)) {
-      stun_timer_start_reliable (&msg->timer,
-        STUN_TIMER_DEFAULT_RELIABLE_TIMEOUT);
-    } else {
-      stun_timer_start (&msg->timer, STUN_TIMER_DEFAULT_TIMEOUT,
-        STUN_TIMER_DEFAULT_MAX_RETRANSMISSIONS);
-    }
+  req = g_slice_new0 (PermissionRequest);
+  req->msg = msg;
+  memcpy (req->peers, peers, n_peers * sizeof (NiceAddress));
+  req->n_peers = n_peers;
 
-    priv->pending_permissions = g_list_append (priv->pending_permissions, msg);
-    priv_schedule_tick (priv);
-  } else {
-    g_free(msg);
-  }
+  priv_start_transaction (priv, msg);
+  priv->pending_permissions = g_list_append (priv->pending_permissions, req);
+  priv->n_pending_permissions++;
+  priv_schedule_tick (priv);
 
-  return res;
+  return TRUE;
 }
 
+/* Takes ownership of @binding, the channel binding being created, or NULL if
+ * an existing one is refreshed */
 static gboolean
-priv_send_channel_bind (UdpTurnPriv *priv, uint16_t channel,
-    const NiceAddress *peer)
+priv_send_channel_bind (UdpTurnPriv *priv, ChannelBinding *binding,
+    uint16_t channel, const NiceAddress *peer)
 {
   uint32_t channel_attr = channel << 16;
   size_t stun_len;
@@ -2071,30 +2646,25 @@ priv_send_channel_bind (UdpTurnPriv *priv, uint16_t channel,
     struct sockaddr_storage storage;
     struct sockaddr addr;
   } sa;
-  TURNMessage *msg = g_new0 (TURNMessage, 1);
+  TURNMessage *msg = priv_turn_message_new (priv);
+  BindingRequest *req;
 
   nice_address_copy_to_sockaddr (peer, &sa.addr);
 
   if (!stun_agent_init_request (&priv->agent, &msg->message,
-          msg->buffer, sizeof(msg->buffer),
-          STUN_CHANNELBIND)) {
-    g_free (msg);
-    return FALSE;
-  }
+          msg->buffer, msg->buffer_len,
+          STUN_CHANNELBIND))
+    goto error;
 
   if (stun_message_append32 (&msg->message, STUN_ATTRIBUTE_CHANNEL_NUMBER,
-          channel_attr) != STUN_MESSAGE_RETURN_SUCCESS) {
-    g_free (msg);
-    return FALSE;
-  }
+          channel_attr) != STUN_MESSAGE_RETURN_SUCCESS)
+    goto error;
 
   if (stun_message_append_xor_addr (&msg->message, STUN_ATTRIBUTE_PEER_ADDRESS,
           &sa.storage,
           sizeof(sa))
-      != STUN_MESSAGE_RETURN_SUCCESS) {
-    g_free (msg);
-    return FALSE;
-  }
+      != STUN_MESSAGE_RETURN_SUCCESS)
+    goto error;
 
   if (priv->username != NULL && priv->username_len > 0 &&
       priv->cached_realm != NULL && priv->cached_realm_len > 0 &&
@@ -2102,35 +2672,42 @@ priv_send_channel_bind (UdpTurnPriv *priv, uint16_t channel,
 
     if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_USERNAME,
             priv->username, priv->username_len)
-        != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
-      return FALSE;
-    }
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      goto error;
 
     if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_REALM,
             priv->cached_realm,  priv->cached_realm_len)
-        != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
-      return 0;
-    }
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      goto error;
 
     if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_NONCE,
             priv->cached_nonce, priv->cached_nonce_len)
-        != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
-      return 0;
-    }
+        != STUN_MESSAGE_RETURN_SUCCESS)
+      goto error;
   }
 
   stun_len = stun_agent_finish_message (&priv->agent, &msg->message,
       priv->password, priv->password_len);
 
-  if (stun_len > 0) {
-    priv_send_turn_message (priv, msg);
-    return TRUE;
-  }
+  if (stun_len == 0)
+    goto error;
+
+  req = g_slice_new0 (BindingRequest);
+  req->msg = msg;
+  req->binding = binding;
+  req->peer = *peer;
+  req->channel = channel;
+
+  priv_start_transaction (priv, msg);
+  priv->binding_requests = g_list_append (priv->binding_requests, req);
+  priv->n_binding_requests++;
+  priv_schedule_tick (priv);
+
+  return TRUE;
 
-  g_free (msg);
+ error:
+  priv_turn_message_free (priv, msg);
+  g_free (binding);
   return FALSE;
 }
 
@@ -2145,7 +2722,7 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
 
   nice_address_copy_to_sockaddr (peer, &sa.addr);
 
-  if (priv->current_binding) {
+  if (!priv_can_start_binding (priv)) {
     NiceAddress * pending= nice_address_new ();
     *pending = *peer;
     priv->pending_bindings = g_list_append (priv->pending_bindings, pending);
@@ -2155,40 +2732,32 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
   if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9 ||
       priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_RFC5766) {
     uint16_t channel = 0x4000;
-    GList *i = priv->channels;
-    for (; i; i = i->next) {
-      ChannelBinding *b = i->data;
-      if (channel == b->channel) {
-        i = priv->channels;
-        channel++;
-        continue;
-      }
-    }
+
+    while (priv_channel_number_in_use (priv, channel))
+      channel++;
 
     if (channel >= 0x4000 && channel < 0xffff) {
-      gboolean ret = priv_send_channel_bind (priv, channel, peer);
-      if (ret) {
-        priv->current_binding = g_new0 (ChannelBinding, 1);
-        priv->current_binding->channel = channel;
-        priv->current_binding->peer = *peer;
-      }
-      return ret;
+      ChannelBinding *binding = g_new0 (ChannelBinding, 1);
+
+      binding->channel = channel;
+      binding->peer = *peer;
+      return priv_send_channel_bind (priv, binding, channel, peer);
     }
     return FALSE;
   } else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_MSN ||
       priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_OC2007) {
-    TURNMessage *msg = g_new0 (TURNMessage, 1);
+    TURNMessage *msg = priv_turn_message_new (priv);
     if (!stun_agent_init_request (&priv->agent, &msg->message,
-            msg->buffer, sizeof(msg->buffer),
+            msg->buffer, msg->buffer_len,
             STUN_OLD_SET_ACTIVE_DST)) {
-      g_free (msg);
+      priv_turn_message_free (priv, msg);
       return FALSE;
     }
 
     if (stun_message_append32 (&msg->message, STUN_ATTRIBUTE_MAGIC_COOKIE,
             TURN_MAGIC_COOKIE)
         != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
+      priv_turn_message_free (priv, msg);
       return FALSE;
     }
 
@@ -2196,7 +2765,7 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
       if (stun_message_append_bytes (&msg->message, STUN_ATTRIBUTE_USERNAME,
               priv->username, priv->username_len)
           != STUN_MESSAGE_RETURN_SUCCESS) {
-        g_free (msg);
+        priv_turn_message_free (priv, msg);
         return FALSE;
       }
     }
@@ -2213,7 +2782,7 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
             STUN_ATTRIBUTE_DESTINATION_ADDRESS,
             &sa.addr, sizeof(sa))
         != STUN_MESSAGE_RETURN_SUCCESS) {
-      g_free (msg);
+      priv_turn_message_free (priv, msg);
       return FALSE;
     }
 
@@ -2227,7 +2796,7 @@ priv_add_channel_binding (UdpTurnPriv *priv, const NiceAddress *peer)
       priv_send_turn_message (priv, msg);
       return TRUE;
     }
-    g_free (msg);
+    priv_turn_message_free (priv, msg);
     return FALSE;
   } else if (priv->compatibility == NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE) {
     priv->current_binding = g_new0 (ChannelBinding, 1);
@@ -2249,10 +2818,10 @@ nice_udp_turn_socket_set_ms_realm(NiceSocket *sock, StunMessage *msg)
   const uint8_t *realm = stun_message_find(msg, STUN_ATTRIBUTE_REALM, &alen);
 
   if (realm && alen <= STUN_MAX_MS_REALM_LEN) {
-    g_mutex_lock (&mutex);
+    g_mutex_lock (&priv->mutex);
     memcpy(priv->ms_realm, realm, alen);
     priv->ms_realm[alen] = '\0';
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
   }
 }
 
@@ -2266,10 +2835,102 @@ nice_udp_turn_socket_set_ms_connection_id (NiceSocket *sock, StunMessage *msg)
 
 
   if (ms_seq_num && alen == 24) {
-    g_mutex_lock (&mutex);
+    g_mutex_lock (&priv->mutex);
     memcpy (priv->ms_connection_id, ms_seq_num, 20);
     priv->ms_sequence_num = ntohl((uint32_t)*(ms_seq_num + 20));
     priv->ms_connection_id_valid = TRUE;
-    g_mutex_unlock (&mutex);
+    g_mutex_unlock (&priv->mutex);
   }
 }
+
+/*
+ * nice_udp_turn_socket_set_max_transactions:
+ * @sock: a TURN #NiceSocket
+ * @max_transactions: the most ChannelBind, and separately CreatePermission,
+ * transactions which may be in flight at once
+ *
+ * Bound how many requests are pipelined to the TURN server. Bindings and
+ * permissions beyond it are queued and sent as earlier transactions
+ * complete.
+ */
+void
+nice_udp_turn_socket_set_max_transactions (NiceSocket *sock,
+    guint max_transactions)
+{
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+
+  g_return_if_fail (max_transactions > 0);
+
+  g_mutex_lock (&priv->mutex);
+
+  priv->max_transactions = max_transactions;
+  /* Start whatever the new limit lets through */
+  if (priv->pending_bindings || priv->permission_peers)
+    priv_schedule_queued_requests (priv);
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/*
+ * nice_udp_turn_socket_get_send_queue_stats:
+ * @sock: a TURN #NiceSocket
+ * @queued_bytes: (out) (optional): return location for the bytes waiting
+ * for a permission or channel binding to be installed
+ * @dropped: (out) (optional): return location for the number of messages
+ * dropped because the queue was full
+ * @dropped_bytes: (out) (optional): return location for the bytes of those
+ * messages
+ *
+ * Get the state of the queue of data sent before the permission or channel
+ * binding for its peer was installed.
+ */
+void
+nice_udp_turn_socket_get_send_queue_stats (NiceSocket *sock,
+    gsize *queued_bytes, guint64 *dropped, guint64 *dropped_bytes)
+{
+  UdpTurnPriv *priv = (UdpTurnPriv *) sock->priv;
+
+  g_mutex_lock (&priv->mutex);
+
+  if (queued_bytes)
+    *queued_bytes = priv->send_data_queued_bytes;
+  if (dropped)
+    *dropped = priv->send_data_dropped;
+  if (dropped_bytes)
+    *dropped_bytes = priv->send_data_dropped_bytes;
+
+  g_mutex_unlock (&priv->mutex);
+}
+
+/*
+ * nice_udp_turn_socket_has_pending_recv:
+ * @sock: a TURN #NiceSocket
+ *
+ * Check whether a complete message is already buffered, either as an
+ * RFC4571 frame reassembled here or by the base socket.
+ *
+ * Returns: %TRUE if nice_socket_recv_messages() has data to return without
+ * reading from the kernel
+ */
+gboolean
+nice_udp_turn_socket_has_pending_recv (NiceSocket *sock)
+{
+  UdpTurnPriv *priv = sock->priv;
+  gboolean has_frame = FALSE;
+
+  g_assert (sock->type == NICE_SOCKET_TYPE_UDP_TURN);
+
+  g_mutex_lock (&priv->mutex);
+  if (priv->fragment_buffer && priv->fragment_buffer->len >= sizeof (guint16)) {
+    const guint8 *f_buffer = priv->fragment_buffer->data;
+    guint32 msg_len = ((f_buffer[0] << 8) | f_buffer[1]) + sizeof (guint16);
+
+    has_frame = msg_len <= priv->fragment_buffer->len;
+  }
+  g_mutex_unlock (&priv->mutex);
+
+  if (has_frame)
+    return TRUE;
+
+  return nice_socket_has_pending_recv (priv->base_socket);
+}
@@ -54,7 +54,7 @@ G_BEGIN_DECLS
 
 guint
 nice_udp_turn_socket_parse_recv_message (NiceSocket *sock, NiceSocket **from_sock,
-    NiceInputMessage *message);
+    NiceInputMessage *message, gboolean in_place);
 
 gsize
 nice_udp_turn_socket_parse_recv (NiceSocket *sock, NiceSocket **from_sock,
@@ -79,6 +79,17 @@ nice_udp_turn_socket_set_ms_connection_id (NiceSocket *sock, StunMessage *msg);
 void
 nice_udp_turn_socket_cache_realm_nonce (NiceSocket *sock, StunMessage *msg);
 
+void
+nice_udp_turn_socket_set_max_transactions (NiceSocket *sock,
+    guint max_transactions);
+
+void
+nice_udp_turn_socket_get_send_queue_stats (NiceSocket *sock,
+    gsize *queued_bytes, guint64 *dropped, guint64 *dropped_bytes);
+
+gboolean
+nice_udp_turn_socket_has_pending_recv (NiceSocket *sock);
+
 
 G_END_DECLS
 
@@ -0,0 +1,770 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * (C) 2006-2009 Collabora Ltd.
+ *  Contact: Youness Alaoui
+ * (C) 2006-2009 Nokia Corporation. All rights reserved.
+ *  Contact: Kai Vehmanen
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Contributors:
+ *   Dafydd Harries, Collabora Ltd.
+ *   Youness Alaoui, Collabora Ltd.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+/*
+ * Implementation of the UDP socket interface on top of io_uring. Incoming
+ * datagrams are received by a single multishot recvmsg() request into a ring
+ * of buffers provided to the kernel, so reading them costs no system call;
+ * outgoing datagrams are batched through the submission queue of a second
+ * ring, so that senders never wait on the lock of the receive path.
+ *
+ * Since the kernel consumes the data itself, the underlying #GSocket never
+ * polls as readable: readiness is signalled on an eventfd registered with the
+ * ring instead, see nice_socket_create_source().
+ */
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#include "udp-uring.h"
+#include "agent-priv.h"
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <liburing.h>
+
+/* Number of entries in the submission queue of the receive ring; the
+ * completion queue is twice as large, which leaves room for a completion for
+ * every receive buffer. */
+#define UDP_URING_QUEUE_DEPTH 64
+
+/* Number of receive buffers provided to the kernel; a power of two */
+#define UDP_URING_N_BUFFERS 64
+
+/* Size of each receive buffer: the largest UDP payload, after the
+ * io_uring_recvmsg_out header and the source address. Only the pages which
+ * are actually written to get backed by memory. */
+#define UDP_URING_BUFFER_SIZE \
+  ((1 << 16) + sizeof (struct io_uring_recvmsg_out) + \
+      sizeof (struct sockaddr_storage))
+
+#define UDP_URING_BUFFER_GROUP 0
+
+/* Maximum number of datagrams submitted in one io_uring_enter() call, and
+ * size of the send ring */
+#define UDP_URING_MAX_BATCH 32
+
+/* User data of the multishot receive request; sends carry the index of the
+ * message in the batch. */
+#define UDP_URING_TAG_RECV ((guint64) 1 << 32)
+
+static void socket_close (NiceSocket *sock);
+static gint socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages);
+static gint socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages);
+static gint socket_send_messages_reliable (NiceSocket *sock,
+    const NiceAddress *to, const NiceOutputMessage *messages, guint n_messages);
+static gboolean socket_is_reliable (NiceSocket *sock);
+static gboolean socket_can_send (NiceSocket *sock, NiceAddress *addr);
+static void socket_set_writable_callback (NiceSocket *sock,
+    NiceSocketWritableCb callback, gpointer user_data);
+static GSource *socket_create_source (NiceSocket *sock,
+    GIOCondition condition);
+static GIOCondition socket_condition_check (NiceSocket *sock,
+    GIOCondition condition);
+
+typedef struct {
+  gint32 res;
+  guint16 bid;
+} UdpUringCompletion;
+
+/* Shared with the sources created for the socket, which may outlive it. */
+struct UdpUringSocketPrivate
+{
+  gint ref_count;  /* atomic */
+  GMutex mutex;
+  gint event_fd;
+
+  /* protected by mutex */
+  gboolean closed;
+  struct io_uring ring;
+  struct io_uring_buf_ring *buf_ring;
+  guint8 *bufs;
+
+  /* layout of the receive buffers, as given to the multishot request */
+  struct msghdr recv_msg;
+  gboolean recv_armed;
+  gboolean recv_error;
+
+  /* received datagrams not yet returned to the caller, oldest first; each
+   * holds a receive buffer, so there can never be more than
+   * UDP_URING_N_BUFFERS */
+  UdpUringCompletion pending[UDP_URING_N_BUFFERS];
+  guint pending_head;
+  guint n_pending;
+
+  /* Sends go through their own ring, which is not registered with the
+   * eventfd, so they neither wake up nor wait for the receive path. */
+  GMutex send_mutex;
+
+  /* protected by send_mutex */
+  struct io_uring send_ring;
+  gboolean send_failed;
+};
+
+typedef struct {
+  GSource source;
+  struct UdpUringSocketPrivate *priv;  /* owned */
+  GSocket *gsock;  /* owned */
+  gpointer fd_tag;
+} UdpUringSource;
+
+static struct UdpUringSocketPrivate *
+udp_uring_priv_ref (struct UdpUringSocketPrivate *priv)
+{
+  g_atomic_int_inc (&priv->ref_count);
+  return priv;
+}
+
+static void
+udp_uring_priv_unref (struct UdpUringSocketPrivate *priv)
+{
+  if (!g_atomic_int_dec_and_test (&priv->ref_count))
+    return;
+
+  if (priv->event_fd >= 0)
+    close (priv->event_fd);
+  g_mutex_clear (&priv->mutex);
+  g_mutex_clear (&priv->send_mutex);
+  g_slice_free (struct UdpUringSocketPrivate, priv);
+}
+
+/* Must be called with the mutex held. */
+static void
+udp_uring_recycle_buffer (struct UdpUringSocketPrivate *priv, guint16 bid)
+{
+  io_uring_buf_ring_add (priv->buf_ring,
+      priv->bufs + (gsize) bid * UDP_URING_BUFFER_SIZE, UDP_URING_BUFFER_SIZE,
+      bid, io_uring_buf_ring_mask (UDP_URING_N_BUFFERS), 0);
+  io_uring_buf_ring_advance (priv->buf_ring, 1);
+}
+
+/* Queue the multishot receive request; it is submitted with the next
+ * io_uring_submit(). Must be called with the mutex held. */
+static void
+udp_uring_arm_recv (struct UdpUringSocketPrivate *priv, gint fd)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = io_uring_get_sqe (&priv->ring);
+  if (sqe == NULL)
+    return;
+
+  io_uring_prep_recvmsg_multishot (sqe, fd, &priv->recv_msg, 0);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->buf_group = UDP_URING_BUFFER_GROUP;
+  io_uring_sqe_set_data64 (sqe, UDP_URING_TAG_RECV);
+
+  priv->recv_armed = TRUE;
+}
+
+/* Consume all posted completions, queueing the received datagrams in
+ * priv->pending. Must be called with the mutex held. */
+static void
+udp_uring_reap (struct UdpUringSocketPrivate *priv)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  guint n_seen = 0;
+
+  io_uring_for_each_cqe (&priv->ring, head, cqe) {
+    guint64 data = io_uring_cqe_get_data64 (cqe);
+
+    n_seen++;
+
+    if (data != UDP_URING_TAG_RECV)
+      continue;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      guint16 bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+      if (cqe->res >= 0) {
+        UdpUringCompletion *completion = &priv->pending[
+            (priv->pending_head + priv->n_pending) % UDP_URING_N_BUFFERS];
+
+        completion->res = cqe->res;
+        completion->bid = bid;
+        priv->n_pending++;
+      } else {
+        udp_uring_recycle_buffer (priv, bid);
+      }
+    }
+
+    /* The request stops when it runs out of buffers, which is expected if
+     * the caller is slow; it is re-armed on the next receive. */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+      priv->recv_armed = FALSE;
+      if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EAGAIN &&
+          cqe->res != -EINTR && cqe->res != -ECONNRESET &&
+          cqe->res != -ECANCELED)
+        priv->recv_error = TRUE;
+    }
+  }
+
+  io_uring_cq_advance (&priv->ring, n_seen);
+}
+
+static gboolean
+udp_uring_has_pending_recv (struct UdpUringSocketPrivate *priv)
+{
+  gboolean ret;
+
+  g_mutex_lock (&priv->mutex);
+  ret = !priv->closed &&
+      (priv->n_pending > 0 || io_uring_cq_ready (&priv->ring) > 0);
+  g_mutex_unlock (&priv->mutex);
+
+  return ret;
+}
+
+/*
+ * nice_udp_uring_socket_new:
+ * @addr: (nullable): the local address to bind to
+ *
+ * Create a UDP socket driven by io_uring. This needs Linux 6.0 or later for
+ * multishot recvmsg() and provided buffer rings; on older kernels, or if the
+ * ring cannot be set up, %NULL is returned and callers should fall back to
+ * nice_udp_bsd_socket_new().
+ *
+ * Returns: (nullable): a new #NiceSocket, or %NULL on error
+ */
+NiceSocket *
+nice_udp_uring_socket_new (NiceAddress *addr)
+{
+  NiceSocket *sock;
+  GSocket *gsock;
+  NiceAddress local_addr;
+  struct UdpUringSocketPrivate *priv;
+  struct io_uring_cqe *cqe;
+  gint ret;
+  guint i;
+
+  gsock = nice_udp_bsd_socket_bind (addr, &local_addr);
+  if (gsock == NULL)
+    return NULL;
+
+  priv = g_slice_new0 (struct UdpUringSocketPrivate);
+  priv->ref_count = 1;
+  priv->event_fd = -1;
+  g_mutex_init (&priv->mutex);
+  g_mutex_init (&priv->send_mutex);
+
+  ret = io_uring_queue_init (UDP_URING_QUEUE_DEPTH, &priv->ring, 0);
+  if (ret < 0) {
+    nice_debug ("Could not create io_uring: %s", g_strerror (-ret));
+    goto error_ring;
+  }
+
+  ret = io_uring_queue_init (UDP_URING_MAX_BATCH, &priv->send_ring, 0);
+  if (ret < 0) {
+    nice_debug ("Could not create io_uring: %s", g_strerror (-ret));
+    goto error_send_ring;
+  }
+
+  priv->buf_ring = io_uring_setup_buf_ring (&priv->ring, UDP_URING_N_BUFFERS,
+      UDP_URING_BUFFER_GROUP, 0, &ret);
+  if (priv->buf_ring == NULL) {
+    nice_debug ("Could not register io_uring buffers: %s", g_strerror (-ret));
+    goto error_buf_ring;
+  }
+
+  priv->bufs = g_malloc ((gsize) UDP_URING_N_BUFFERS * UDP_URING_BUFFER_SIZE);
+  for (i = 0; i < UDP_URING_N_BUFFERS; i++)
+    io_uring_buf_ring_add (priv->buf_ring,
+        priv->bufs + (gsize) i * UDP_URING_BUFFER_SIZE, UDP_URING_BUFFER_SIZE,
+        i, io_uring_buf_ring_mask (UDP_URING_N_BUFFERS), i);
+  io_uring_buf_ring_advance (priv->buf_ring, UDP_URING_N_BUFFERS);
+
+  priv->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (priv->event_fd < 0 ||
+      io_uring_register_eventfd (&priv->ring, priv->event_fd) < 0)
+    goto error_event_fd;
+
+  priv->recv_msg.msg_namelen = sizeof (struct sockaddr_storage);
+  udp_uring_arm_recv (priv, g_socket_get_fd (gsock));
+  io_uring_submit (&priv->ring);
+
+  /* Kernels without multishot recvmsg() reject the request straight away. */
+  if (io_uring_peek_cqe (&priv->ring, &cqe) == 0 &&
+      !(cqe->flags & IORING_CQE_F_MORE) && cqe->res == -EINVAL) {
+    nice_debug ("Kernel does not support multishot recvmsg() on io_uring");
+    goto error_event_fd;
+  }
+
+  sock = g_slice_new0 (NiceSocket);
+  sock->addr = local_addr;
+  sock->type = NICE_SOCKET_TYPE_UDP_URING;
+  sock->fileno = gsock;
+  sock->send_messages = socket_send_messages;
+  sock->send_messages_reliable = socket_send_messages_reliable;
+  sock->recv_messages = socket_recv_messages;
+  sock->is_reliable = socket_is_reliable;
+  sock->can_send = socket_can_send;
+  sock->set_writable_callback = socket_set_writable_callback;
+  sock->create_source = socket_create_source;
+  sock->condition_check = socket_condition_check;
+  sock->close = socket_close;
+  sock->priv = priv;
+
+  return sock;
+
+error_event_fd:
+  g_free (priv->bufs);
+  io_uring_free_buf_ring (&priv->ring, priv->buf_ring, UDP_URING_N_BUFFERS,
+      UDP_URING_BUFFER_GROUP);
+error_buf_ring:
+  io_uring_queue_exit (&priv->send_ring);
+error_send_ring:
+  io_uring_queue_exit (&priv->ring);
+error_ring:
+  udp_uring_priv_unref (priv);
+  g_socket_close (gsock, NULL);
+  g_object_unref (gsock);
+
+  return NULL;
+}
+
+static void
+socket_close (NiceSocket *sock)
+{
+  struct UdpUringSocketPrivate *priv = sock->priv;
+
+  g_mutex_lock (&priv->mutex);
+  if (!priv->closed) {
+    struct io_uring_sync_cancel_reg reg;
+
+    /* Make sure the kernel is done with the receive buffers before freeing
+     * them. */
+    memset (&reg, 0, sizeof (reg));
+    reg.addr = UDP_URING_TAG_RECV;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+    io_uring_register_sync_cancel (&priv->ring, &reg);
+
+    io_uring_free_buf_ring (&priv->ring, priv->buf_ring, UDP_URING_N_BUFFERS,
+        UDP_URING_BUFFER_GROUP);
+    io_uring_queue_exit (&priv->ring);
+    g_free (priv->bufs);
+    priv->bufs = NULL;
+    priv->closed = TRUE;
+  }
+  g_mutex_unlock (&priv->mutex);
+
+  g_mutex_lock (&priv->send_mutex);
+  if (!priv->send_failed) {
+    io_uring_queue_exit (&priv->send_ring);
+    priv->send_failed = TRUE;
+  }
+  g_mutex_unlock (&priv->send_mutex);
+
+  udp_uring_priv_unref (priv);
+  sock->priv = NULL;
+
+  if (sock->fileno) {
+    g_socket_close (sock->fileno, NULL);
+    g_object_unref (sock->fileno);
+    sock->fileno = NULL;
+  }
+}
+
+/* Copy @len bytes of @data into the buffers of @message, truncating it if
+ * they are too small, as the kernel would. Returns the number of bytes
+ * copied. */
+static gsize
+input_message_scatter (NiceInputMessage *message, const guint8 *data,
+    gsize len)
+{
+  gsize offset = 0;
+  guint j;
+
+  for (j = 0;
+       offset < len &&
+       ((message->n_buffers >= 0 && j < (guint) message->n_buffers) ||
+        (message->n_buffers < 0 && message->buffers[j].buffer != NULL));
+       j++) {
+    gsize n = MIN (len - offset, message->buffers[j].size);
+
+    memcpy (message->buffers[j].buffer, data + offset, n);
+    offset += n;
+  }
+
+  return offset;
+}
+
+static gint
+socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  struct UdpUringSocketPrivate *priv = sock->priv;
+  guint i = 0;
+  gint ret;
+
+  /* Make sure socket has not been freed: */
+  g_assert (sock->priv != NULL);
+
+  g_mutex_lock (&priv->mutex);
+
+  if (priv->closed) {
+    g_mutex_unlock (&priv->mutex);
+    return -1;
+  }
+
+  udp_uring_reap (priv);
+
+  while (i < n_recv_messages && priv->n_pending > 0) {
+    NiceInputMessage *recv_message = &recv_messages[i];
+    UdpUringCompletion *completion = &priv->pending[priv->pending_head];
+    guint8 *buf = priv->bufs + (gsize) completion->bid * UDP_URING_BUFFER_SIZE;
+    struct io_uring_recvmsg_out *out;
+
+    priv->pending_head = (priv->pending_head + 1) % UDP_URING_N_BUFFERS;
+    priv->n_pending--;
+
+    out = io_uring_recvmsg_validate (buf, completion->res, &priv->recv_msg);
+    if (out != NULL) {
+      recv_message->length = input_message_scatter (recv_message,
+          io_uring_recvmsg_payload (out, &priv->recv_msg),
+          io_uring_recvmsg_payload_length (out, completion->res,
+              &priv->recv_msg));
+
+      if (recv_message->from != NULL)
+        nice_address_set_from_sockaddr (recv_message->from,
+            io_uring_recvmsg_name (out));
+      i++;
+    }
+
+    udp_uring_recycle_buffer (priv, completion->bid);
+  }
+
+  if (i < n_recv_messages)
+    recv_messages[i].length = 0;
+
+  /* Buffers have been handed back, so a request which ran out of them can be
+   * restarted. */
+  if (!priv->recv_armed) {
+    udp_uring_arm_recv (priv, g_socket_get_fd (sock->fileno));
+    io_uring_submit (&priv->ring);
+  }
+
+  ret = i;
+  if (i == 0 && priv->recv_error) {
+    priv->recv_error = FALSE;
+    ret = -1;
+  }
+
+  g_mutex_unlock (&priv->mutex);
+
+  return ret;
+}
+
+static guint
+output_message_count_buffers (const NiceOutputMessage *message)
+{
+  guint n_bufs = 0;
+
+  if (message->n_buffers >= 0)
+    return message->n_buffers;
+
+  while (message->buffers[n_bufs].buffer != NULL)
+    n_bufs++;
+
+  return n_bufs;
+}
+
+/* Submit the queued sends and collect their completions, with a single
+ * io_uring_enter() call. They are issued with MSG_DONTWAIT, so the kernel
+ * completes them inline rather than holding on to the caller’s buffers, and
+ * the wait does not block. Must be called with the send mutex held.
+ * Returns %FALSE if the ring is unusable. */
+static gboolean
+udp_uring_submit_sends (struct UdpUringSocketPrivate *priv, gint *results,
+    guint n_sends)
+{
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  guint n_seen = 0;
+  gint ret;
+
+  do {
+    ret = io_uring_submit_and_wait (&priv->send_ring, n_sends);
+  } while (ret == -EINTR || ret == -EAGAIN);
+
+  /* The completion queue is large enough for any batch, so nothing else can
+   * be left in it. */
+  io_uring_for_each_cqe (&priv->send_ring, head, cqe) {
+    results[io_uring_cqe_get_data64 (cqe)] = cqe->res;
+    n_seen++;
+  }
+  io_uring_cq_advance (&priv->send_ring, n_seen);
+
+  if (ret < 0 || n_seen < n_sends) {
+    /* The prepared requests point into the caller’s stack, so the ring must
+     * never be submitted again. */
+    nice_debug ("io_uring submission failed: %s",
+        g_strerror (ret < 0 ? -ret : EIO));
+    priv->send_failed = TRUE;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gint
+socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  struct UdpUringSocketPrivate *priv = sock->priv;
+  union {
+    struct sockaddr_storage storage;
+    struct sockaddr addr;
+  } sa;
+  socklen_t sa_len;
+  struct msghdr hdrs[UDP_URING_MAX_BATCH];
+  gint results[UDP_URING_MAX_BATCH];
+  gint fd;
+  guint n_sent = 0;
+  gboolean error = FALSE;
+
+  /* Make sure socket has not been freed: */
+  g_assert (sock->priv != NULL);
+
+  nice_address_copy_to_sockaddr (to, &sa.addr);
+  sa_len = (sa.storage.ss_family == AF_INET6) ?
+      sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+  fd = g_socket_get_fd (sock->fileno);
+
+  g_mutex_lock (&priv->send_mutex);
+
+  while (n_sent < n_messages && !priv->send_failed) {
+    guint n_batch = MIN (n_messages - n_sent, UDP_URING_MAX_BATCH);
+    guint i;
+
+    for (i = 0; i < n_batch; i++) {
+      const NiceOutputMessage *message = &messages[n_sent + i];
+      struct io_uring_sqe *sqe = io_uring_get_sqe (&priv->send_ring);
+
+      if (sqe == NULL)
+        break;
+
+      memset (&hdrs[i], 0, sizeof (hdrs[i]));
+      hdrs[i].msg_name = &sa;
+      hdrs[i].msg_namelen = sa_len;
+      /* GOutputVector has the same layout as struct iovec; GSocket relies on
+       * this too. */
+      hdrs[i].msg_iov = (struct iovec *) message->buffers;
+      hdrs[i].msg_iovlen = output_message_count_buffers (message);
+
+      io_uring_prep_sendmsg (sqe, fd, &hdrs[i], MSG_DONTWAIT);
+      io_uring_sqe_set_data64 (sqe, i);
+      results[i] = 0;
+    }
+
+    n_batch = i;
+    if (n_batch == 0 || !udp_uring_submit_sends (priv, results, n_batch)) {
+      error = (n_sent == 0);
+      break;
+    }
+
+    for (i = 0; i < n_batch; i++) {
+      if (results[i] < 0)
+        break;
+    }
+
+    if (i < n_batch && results[i] != -EAGAIN) {
+      if (nice_debug_is_verbose ()) {
+        gchar to_str[INET6_ADDRSTRLEN];
+
+        nice_address_to_string (to, to_str);
+        nice_debug_verbose ("%s: udp-uring socket %p -> %s:%u: error: %s",
+            G_STRFUNC, sock, to_str, nice_address_get_port (to),
+            g_strerror (-results[i]));
+      }
+      error = (n_sent + i == 0);
+    }
+
+    n_sent += i;
+
+    /* Stop at the first message the kernel could not queue. */
+    if (i < n_batch)
+      break;
+  }
+
+  if (priv->send_failed && n_sent == 0)
+    error = TRUE;
+
+  g_mutex_unlock (&priv->send_mutex);
+
+  return error ? -1 : (gint) n_sent;
+}
+
+static gint
+socket_send_messages_reliable (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  return -1;
+}
+
+static gboolean
+socket_is_reliable (NiceSocket *sock)
+{
+  return FALSE;
+}
+
+static gboolean
+socket_can_send (NiceSocket *sock, NiceAddress *addr)
+{
+  return TRUE;
+}
+
+static void
+socket_set_writable_callback (NiceSocket *sock,
+    NiceSocketWritableCb callback, gpointer user_data)
+{
+}
+
+static gboolean
+udp_uring_source_prepare (GSource *source, gint *timeout)
+{
+  UdpUringSource *self = (UdpUringSource *) source;
+
+  *timeout = -1;
+
+  /* Completions which have already been posted, or datagrams the last reader
+   * left behind, do not signal the eventfd again. */
+  return udp_uring_has_pending_recv (self->priv);
+}
+
+static gboolean
+udp_uring_source_check (GSource *source)
+{
+  UdpUringSource *self = (UdpUringSource *) source;
+
+  if (g_source_query_unix_fd (source, self->fd_tag) & G_IO_IN)
+    return TRUE;
+
+  return udp_uring_has_pending_recv (self->priv);
+}
+
+static gboolean
+udp_uring_source_dispatch (GSource *source, GSourceFunc callback,
+    gpointer user_data)
+{
+  UdpUringSource *self = (UdpUringSource *) source;
+
+  if (g_source_query_unix_fd (source, self->fd_tag) & G_IO_IN) {
+    guint64 count;
+
+    while (read (self->priv->event_fd, &count, sizeof (count)) < 0 &&
+        errno == EINTR);
+  }
+
+  if (callback == NULL)
+    return G_SOURCE_CONTINUE;
+
+  return ((GSocketSourceFunc) callback) (self->gsock, G_IO_IN, user_data);
+}
+
+static void
+udp_uring_source_finalize (GSource *source)
+{
+  UdpUringSource *self = (UdpUringSource *) source;
+
+  udp_uring_priv_unref (self->priv);
+  g_object_unref (self->gsock);
+}
+
+static GSourceFuncs udp_uring_source_funcs = {
+  udp_uring_source_prepare,
+  udp_uring_source_check,
+  udp_uring_source_dispatch,
+  udp_uring_source_finalize,
+  NULL,
+  NULL
+};
+
+static GSource *
+socket_create_source (NiceSocket *sock, GIOCondition condition)
+{
+  struct UdpUringSocketPrivate *priv = sock->priv;
+  UdpUringSource *self;
+  GSource *source;
+
+  /* Only readability is reported through the ring. */
+  if (!(condition & G_IO_IN))
+    return g_socket_create_source (sock->fileno, condition, NULL);
+
+  source = g_source_new (&udp_uring_source_funcs, sizeof (UdpUringSource));
+  g_source_set_name (source, "NiceUdpUringSource");
+
+  self = (UdpUringSource *) source;
+  self->priv = udp_uring_priv_ref (priv);
+  self->gsock = g_object_ref (sock->fileno);
+  self->fd_tag = g_source_add_unix_fd (source, priv->event_fd, G_IO_IN);
+
+  return source;
+}
+
+static GIOCondition
+socket_condition_check (NiceSocket *sock, GIOCondition condition)
+{
+  GIOCondition ret = 0;
+
+  if (condition & ~G_IO_IN)
+    ret = g_socket_condition_check (sock->fileno, condition & ~G_IO_IN);
+
+  if ((condition & G_IO_IN) && udp_uring_has_pending_recv (sock->priv))
+    ret |= G_IO_IN;
+
+  return ret;
+}
+
+#else /* HAVE_IO_URING */
+
+NiceSocket *
+nice_udp_uring_socket_new (NiceAddress *addr)
+{
+  return NULL;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,180 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * (C) 2007 Nokia Corporation. All rights reserved.
+ *  Contact: Rémi Denis-Courmont
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Contributors:
+ *   Rémi Denis-Courmont, Nokia
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include <sys/types.h>
+#include "stun/stunagent.h"
+#include "stun/usages/turn.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+#undef NDEBUG /* ensure assertions are built-in */
+#include <assert.h>
+
+#define N_PEERS 3
+
+static uint8_t username[] = "user";
+static uint8_t password[] = "pass";
+static uint8_t realm[] = "realm";
+static uint8_t nonce[] = "nonce";
+
+static void
+set_peer (struct sockaddr_storage *peer, unsigned int i)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *) peer;
+
+  memset (peer, 0, sizeof (*peer));
+  sin->sin_family = AF_INET;
+#ifdef HAVE_SA_LEN
+  sin->sin_len = sizeof (*sin);
+#endif
+  sin->sin_port = htons (5000 + i);
+  sin->sin_addr.s_addr = htonl (0xc0000200 + i); /* 192.0.2.i */
+}
+
+/* Check that the XOR-PEER-ADDRESS attributes of @msg are @n_peers
+ * addresses set by set_peer(), in order */
+static void
+check_peers (StunMessage *msg, unsigned int n_peers)
+{
+  size_t len = stun_message_length (msg);
+  size_t offset = STUN_MESSAGE_ATTRIBUTES_POS;
+  unsigned int n = 0;
+
+  while (offset + STUN_ATTRIBUTE_HEADER_LENGTH <= len) {
+    const uint8_t *attr = msg->buffer + offset;
+    uint16_t type = (attr[0] << 8) | attr[1];
+    uint16_t alen = (attr[2] << 8) | attr[3];
+    const uint8_t *value = attr + STUN_ATTRIBUTE_HEADER_LENGTH;
+
+    if (type == STUN_ATTRIBUTE_XOR_PEER_ADDRESS) {
+      uint16_t port = ((value[2] << 8) | value[3]) ^ (STUN_MAGIC_COOKIE >> 16);
+      uint32_t ip = (((uint32_t) value[4] << 24) | (value[5] << 16) |
+          (value[6] << 8) | value[7]) ^ STUN_MAGIC_COOKIE;
+
+      assert (alen == 8);
+      assert (value[1] == 1); /* IPv4 */
+      assert (port == 5000 + n);
+      assert (ip == 0xc0000200 + n);
+      n++;
+    }
+
+    offset += STUN_ATTRIBUTE_HEADER_LENGTH + ((alen + 3) & ~3);
+  }
+
+  assert (n == n_peers);
+}
+
+int main (void)
+{
+  struct sockaddr_storage peers[N_PEERS];
+  uint8_t buf[STUN_MAX_MESSAGE_SIZE];
+  uint8_t small_buf[80];
+  uint8_t recv_buf[STUN_MAX_MESSAGE_SIZE];
+  StunAgent agent, server;
+  StunMessage msg, recv_msg;
+  size_t len;
+  unsigned int i;
+
+  stun_agent_init (&agent, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_LONG_TERM_CREDENTIALS);
+  stun_agent_init (&server, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  for (i = 0; i < N_PEERS; i++)
+    set_peer (&peers[i], i);
+
+  /* One XOR-PEER-ADDRESS per peer, in a single request */
+  len = stun_usage_turn_create_permissions (&agent, &msg, buf, sizeof (buf),
+      username, strlen ((char *) username),
+      password, strlen ((char *) password),
+      realm, strlen ((char *) realm), nonce, strlen ((char *) nonce),
+      peers, N_PEERS, STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  assert (len > 0);
+
+  memcpy (recv_buf, buf, len);
+  assert (stun_agent_validate (&server, &recv_msg, recv_buf, len, NULL, NULL)
+      == STUN_VALIDATION_SUCCESS);
+  assert (stun_message_get_class (&recv_msg) == STUN_REQUEST);
+  assert (stun_message_get_method (&recv_msg) == STUN_CREATEPERMISSION);
+  check_peers (&recv_msg, N_PEERS);
+  assert (stun_message_has_attribute (&recv_msg, STUN_ATTRIBUTE_USERNAME));
+  assert (stun_message_has_attribute (&recv_msg, STUN_ATTRIBUTE_REALM));
+  assert (stun_message_has_attribute (&recv_msg, STUN_ATTRIBUTE_NONCE));
+  assert (stun_message_has_attribute (&recv_msg,
+      STUN_ATTRIBUTE_MESSAGE_INTEGRITY));
+
+  /* The single peer variant builds the same request for one peer */
+  len = stun_usage_turn_create_permission (&agent, &msg, buf, sizeof (buf),
+      username, strlen ((char *) username),
+      password, strlen ((char *) password),
+      realm, strlen ((char *) realm), nonce, strlen ((char *) nonce),
+      &peers[0], STUN_USAGE_TURN_COMPATIBILITY_RFC5766);
+  assert (len > 0);
+
+  memcpy (recv_buf, buf, len);
+  assert (stun_agent_validate (&server, &recv_msg, recv_buf, len, NULL, NULL)
+      == STUN_VALIDATION_SUCCESS);
+  check_peers (&recv_msg, 1);
+
+  /* No peer, or more peers than fit in the buffer */
+  assert (stun_usage_turn_create_permissions (&agent, &msg, buf, sizeof (buf),
+      username, strlen ((char *) username),
+      password, strlen ((char *) password),
+      realm, strlen ((char *) realm), nonce, strlen ((char *) nonce),
+      peers, 0, STUN_USAGE_TURN_COMPATIBILITY_RFC5766) == 0);
+  assert (stun_usage_turn_create_permissions (&agent, &msg, small_buf,
+      sizeof (small_buf), username, strlen ((char *) username),
+      password, strlen ((char *) password),
+      realm, strlen ((char *) realm), nonce, strlen ((char *) nonce),
+      peers, N_PEERS, STUN_USAGE_TURN_COMPATIBILITY_RFC5766) == 0);
+
+  return 0;
+}
@@ -233,13 +233,34 @@ size_t stun_usage_turn_create_permission (StunAgent *agent, StunMessage *msg,
   if (!peer)
     return 0;
 
+  return stun_usage_turn_create_permissions (agent, msg, buffer, buffer_len,
+      username, username_len, password, password_len, realm, realm_len,
+      nonce, nonce_len, peer, 1, compatibility);
+}
+
+size_t stun_usage_turn_create_permissions (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    uint8_t *username, size_t username_len,
+    uint8_t *password, size_t password_len,
+    uint8_t *realm, size_t realm_len,
+    uint8_t *nonce, size_t nonce_len,
+    const struct sockaddr_storage *peers, unsigned int n_peers,
+    StunUsageTurnCompatibility compatibility)
+{
+  unsigned int i;
+
+  if (!peers || n_peers == 0)
+    return 0;
+
   stun_agent_init_request (agent, msg, buffer, buffer_len,
       STUN_CREATEPERMISSION);
 
-  /* PEER address */
-  if (stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
-          peer, sizeof(*peer)) != STUN_MESSAGE_RETURN_SUCCESS) {
-    return 0;
+  /* PEER addresses */
+  for (i = 0; i < n_peers; i++) {
+    if (stun_message_append_xor_addr (msg, STUN_ATTRIBUTE_XOR_PEER_ADDRESS,
+            &peers[i], sizeof(peers[i])) != STUN_MESSAGE_RETURN_SUCCESS) {
+      return 0;
+    }
   }
 
   /* nonce */
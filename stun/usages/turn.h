@@ -240,6 +240,40 @@ size_t stun_usage_turn_create_permission (StunAgent *agent, StunMessage *msg,
     struct sockaddr_storage *peer,
     StunUsageTurnCompatibility compatibility);
 
+/**
+ * stun_usage_turn_create_permissions:
+ * @agent: The #StunAgent to use to build the request
+ * @msg: The #StunMessage to build
+ * @buffer: The buffer to use for creating the #StunMessage
+ * @buffer_len: The size of the @buffer
+ * @username: The username to use in the request
+ * @username_len: The length of @username
+ * @password: The key to use for building the MESSAGE-INTEGRITY
+ * @password_len: The length of @password
+ * @realm: The realm identifier to use in the request
+ * @realm_len: The length of @realm
+ * @nonce: Unique and securely random nonce to use in the request
+ * @nonce_len: The length of @nonce
+ * @peers: Server-reflexive host addresses to request permissions for
+ * @n_peers: The number of addresses in @peers
+ * @compatibility: The compatibility mode to use for building the
+ * CreatePermission request
+ *
+ * Create a new TURN CreatePermission request installing permissions for all
+ * of @peers at once, with one XOR-PEER-ADDRESS attribute for each of them.
+ * See stun_usage_turn_create_permission().
+ *
+ * Returns: The length of the message to send
+ */
+size_t stun_usage_turn_create_permissions (StunAgent *agent, StunMessage *msg,
+    uint8_t *buffer, size_t buffer_len,
+    uint8_t *username, size_t username_len,
+    uint8_t *password, size_t password_len,
+    uint8_t *realm, size_t realm_len,
+    uint8_t *nonce, size_t nonce_len,
+    const struct sockaddr_storage *peers, unsigned int n_peers,
+    StunUsageTurnCompatibility compatibility);
+
 /**
  * stun_usage_turn_process:
  * @msg: The message containing the response
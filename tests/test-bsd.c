@@ -217,6 +217,307 @@ test_multi_buffer_recv (void)
   nice_socket_free (server);
 }
 
+/* Test that a segmented send arrives as one datagram per message, whether or
+ * not the kernel supports segmentation offload. */
+static void
+test_segmented_send (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp;
+  guint8 send_buf[5][100];
+  GOutputVector send_bufs[5];
+  NiceOutputMessage send_messages[5];
+  guint8 recv_buf[5][200];
+  GInputVector recv_bufs[5];
+  NiceInputMessage recv_messages[5];
+  guint i;
+
+  server = nice_udp_bsd_socket_new (NULL);
+  g_assert (server != NULL);
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    memset (send_buf[i], 'a' + i, sizeof (send_buf[i]));
+    send_bufs[i].buffer = send_buf[i];
+    /* Only the last segment may be shorter. */
+    send_bufs[i].size = (i == G_N_ELEMENTS (send_messages) - 1) ? 50 : 100;
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = sizeof (recv_buf[i]);
+    recv_messages[i].buffers = &recv_bufs[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].from = NULL;
+    recv_messages[i].length = 0;
+  }
+
+  g_assert_cmpint (nice_udp_bsd_socket_send_segmented (client, &tmp,
+      send_messages, G_N_ELEMENTS (send_messages), 100), ==,
+      G_N_ELEMENTS (send_messages));
+  g_assert_cmpint (nice_socket_recv_messages (server, recv_messages,
+      G_N_ELEMENTS (recv_messages)), ==, G_N_ELEMENTS (recv_messages));
+
+  for (i = 0; i < G_N_ELEMENTS (recv_messages); i++) {
+    g_assert_cmpuint (recv_messages[i].length, ==, send_bufs[i].size);
+    g_assert_cmpint (memcmp (recv_buf[i], send_buf[i], send_bufs[i].size), ==,
+        0);
+  }
+
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
+/* Test that a socket with receive offload enabled still returns one message
+ * per datagram, including when the caller reads them one at a time. */
+static void
+test_receive_offload (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceSocket *other_client;
+  NiceAddress tmp, from;
+  guint8 send_buf[5][100];
+  GOutputVector send_bufs[5];
+  NiceOutputMessage send_messages[5];
+  guint8 recv_buf[200];
+  GInputVector recv_vec = { recv_buf, sizeof (recv_buf) };
+  NiceInputMessage recv_message = { &recv_vec, 1, NULL, 0 };
+  guint8 batch_buf[4][200];
+  GInputVector batch_vecs[4];
+  NiceAddress batch_from[4];
+  NiceInputMessage batch_messages[4];
+  guint i;
+
+  server = nice_udp_bsd_socket_new_full (NULL, TRUE);
+  g_assert (server != NULL);
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    memset (send_buf[i], 'a' + i, sizeof (send_buf[i]));
+    send_bufs[i].buffer = send_buf[i];
+    send_bufs[i].size = (i == G_N_ELEMENTS (send_messages) - 1) ? 50 : 100;
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+  }
+
+  g_assert_cmpint (nice_udp_bsd_socket_send_segmented (client, &tmp,
+      send_messages, G_N_ELEMENTS (send_messages), 100), ==,
+      G_N_ELEMENTS (send_messages));
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    g_assert_cmpint (nice_socket_recv_messages (server, &recv_message, 1), ==,
+        1);
+    g_assert_cmpuint (recv_message.length, ==, send_bufs[i].size);
+    g_assert_cmpint (memcmp (recv_buf, send_buf[i], send_bufs[i].size), ==,
+        0);
+  }
+
+  g_assert (!nice_udp_bsd_socket_has_pending_recv (server));
+  g_assert_cmpint (nice_socket_recv_messages (server, &recv_message, 1), ==,
+      0);
+
+  /* Datagrams from different senders are never coalesced, so these arrive in
+   * separate buffers, which must still be handed out in order and with their
+   * own source address. */
+  other_client = nice_udp_bsd_socket_new (NULL);
+  g_assert (other_client != NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (batch_messages); i++) {
+    g_assert_cmpint (nice_socket_send (i % 2 ? other_client : client, &tmp,
+        100, (gchar *) send_buf[i]), ==, 100);
+
+    batch_vecs[i].buffer = batch_buf[i];
+    batch_vecs[i].size = sizeof (batch_buf[i]);
+    batch_messages[i].buffers = &batch_vecs[i];
+    batch_messages[i].n_buffers = 1;
+    batch_messages[i].from = &batch_from[i];
+    batch_messages[i].length = 0;
+  }
+
+  /* Take the first one on its own so the rest are left pending */
+  recv_message.from = &from;
+  g_assert_cmpint (nice_socket_recv_messages (server, &recv_message, 1), ==,
+      1);
+  g_assert_cmpuint (recv_message.length, ==, 100);
+  g_assert_cmpint (memcmp (recv_buf, send_buf[0], 100), ==, 0);
+  g_assert_cmpuint (nice_address_get_port (&from), ==,
+      nice_address_get_port (&client->addr));
+
+  i = 1;
+  while (i < G_N_ELEMENTS (batch_messages)) {
+    gint ret, j;
+
+    ret = nice_socket_recv_messages (server, batch_messages + i,
+        G_N_ELEMENTS (batch_messages) - i);
+    g_assert_cmpint (ret, >, 0);
+
+    for (j = 0; j < ret; j++, i++) {
+      g_assert_cmpuint (batch_messages[i].length, ==, 100);
+      g_assert_cmpint (memcmp (batch_buf[i], send_buf[i], 100), ==, 0);
+      g_assert_cmpuint (nice_address_get_port (&batch_from[i]), ==,
+          nice_address_get_port (i % 2 ? &other_client->addr : &client->addr));
+    }
+  }
+
+  g_assert (!nice_udp_bsd_socket_has_pending_recv (server));
+
+  nice_socket_free (other_client);
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
+static gboolean
+io_uring_readable_cb (GSocket *gsock, GIOCondition condition,
+    gpointer user_data)
+{
+  gboolean *readable = user_data;
+
+  *readable = TRUE;
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+test_io_uring (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp, from;
+  guint8 send_buf[3][100];
+  GOutputVector send_bufs[3];
+  NiceOutputMessage send_messages[3];
+  guint8 recv_buf[3][200];
+  GInputVector recv_bufs[3];
+  NiceInputMessage recv_messages[3];
+  GMainContext *context;
+  GSource *source;
+  gboolean readable = FALSE;
+  guint i;
+
+  /* Not built in, or not supported by the running kernel. */
+  server = nice_udp_uring_socket_new (NULL);
+  if (server == NULL)
+    return;
+
+  g_assert (server->type == NICE_SOCKET_TYPE_UDP_URING);
+  g_assert (!nice_socket_is_reliable (server));
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  context = g_main_context_new ();
+  source = nice_socket_create_source (server, G_IO_IN);
+  g_source_set_callback (source, (GSourceFunc) G_CALLBACK (io_uring_readable_cb),
+      &readable, NULL);
+  g_source_attach (source, context);
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    memset (send_buf[i], 'a' + i, sizeof (send_buf[i]));
+    send_bufs[i].buffer = send_buf[i];
+    send_bufs[i].size = sizeof (send_buf[i]) - i;
+    send_messages[i].buffers = &send_bufs[i];
+    send_messages[i].n_buffers = 1;
+
+    recv_bufs[i].buffer = recv_buf[i];
+    recv_bufs[i].size = sizeof (recv_buf[i]);
+    recv_messages[i].buffers = &recv_bufs[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].from = &from;
+    recv_messages[i].length = 0;
+  }
+
+  /* Nothing has been received yet. */
+  g_assert_cmpint (nice_socket_recv_messages (server, recv_messages, 3), ==,
+      0);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+  g_assert_cmpint (nice_socket_send_messages (client, &tmp, send_messages, 3),
+      ==, 3);
+
+  while (!readable)
+    g_main_context_iteration (context, TRUE);
+  g_assert (nice_socket_condition_check (server, G_IO_IN) & G_IO_IN);
+
+  /* The datagrams may be completed one at a time. */
+  for (i = 0; i < G_N_ELEMENTS (recv_messages);) {
+    gint ret = nice_socket_recv_messages (server, &recv_messages[i], 3 - i);
+
+    g_assert_cmpint (ret, >=, 0);
+    if (ret == 0)
+      g_main_context_iteration (context, TRUE);
+    i += ret;
+  }
+
+  for (i = 0; i < G_N_ELEMENTS (recv_messages); i++) {
+    g_assert_cmpuint (recv_messages[i].length, ==, send_bufs[i].size);
+    g_assert_cmpint (memcmp (recv_buf[i], send_buf[i], send_bufs[i].size), ==,
+        0);
+  }
+  g_assert_cmpuint (nice_address_get_port (&from), ==,
+      nice_address_get_port (&client->addr));
+
+  /* And back again, as one batch. */
+  nice_address_set_port (&tmp, nice_address_get_port (&client->addr));
+  g_assert_cmpint (nice_socket_send_messages (server, &tmp, send_messages, 3),
+      ==, 3);
+
+  for (i = 0; i < G_N_ELEMENTS (send_messages); i++) {
+    g_assert_cmpint (nice_socket_recv_messages (client, &recv_messages[i], 1),
+        ==, 1);
+    g_assert_cmpuint (recv_messages[i].length, ==, send_bufs[i].size);
+  }
+
+  /* Datagrams larger than a page must not be truncated. */
+  {
+    gsize big_len = 60000;
+    guint8 *big_send = g_malloc (big_len);
+    guint8 *big_recv = g_malloc0 (big_len + 1);
+    GOutputVector big_send_buf = { big_send, big_len };
+    NiceOutputMessage big_send_message = { &big_send_buf, 1 };
+    GInputVector big_recv_buf = { big_recv, big_len + 1 };
+    NiceInputMessage big_recv_message = { &big_recv_buf, 1, &from, 0 };
+    gint ret;
+
+    for (i = 0; i < big_len; i++)
+      big_send[i] = i % 251;
+
+    nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+    g_assert_cmpint (nice_socket_send_messages (client, &tmp,
+        &big_send_message, 1), ==, 1);
+
+    while ((ret = nice_socket_recv_messages (server, &big_recv_message,
+                1)) == 0)
+      g_main_context_iteration (context, TRUE);
+
+    g_assert_cmpint (ret, ==, 1);
+    g_assert_cmpuint (big_recv_message.length, ==, big_len);
+    g_assert_cmpint (memcmp (big_recv, big_send, big_len), ==, 0);
+
+    g_free (big_send);
+    g_free (big_recv);
+  }
+
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_main_context_unref (context);
+
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
 /* Fill a buffer with deterministic but non-repeated data, so that transmission
  * and reception corruption is more likely to be detected. */
 static void
@@ -230,6 +531,261 @@ fill_send_buf (guint8 *buf, gsize buf_len, guint seed)
   }
 }
 
+#define TIMING_ROUNDS 64
+#define TIMING_ROUND_LEN 64  /* datagrams, well within the receive buffer */
+#define TIMING_DATAGRAM_LEN 100
+#define TIMING_BATCH 32  /* UDP_BSD_MAX_BATCH in udp-bsd.c */
+
+/* Sends a round of datagrams to @to, numbered from @seq */
+static void
+send_timing_round (NiceSocket *client, const NiceAddress *to, guint32 seq)
+{
+  guint8 bufs[TIMING_ROUND_LEN][TIMING_DATAGRAM_LEN];
+  GOutputVector vecs[TIMING_ROUND_LEN];
+  NiceOutputMessage messages[TIMING_ROUND_LEN];
+  guint i;
+
+  for (i = 0; i < TIMING_ROUND_LEN; i++) {
+    guint32 n = seq + i;
+
+    fill_send_buf (bufs[i], TIMING_DATAGRAM_LEN, n);
+    memcpy (bufs[i], &n, sizeof (n));
+    vecs[i].buffer = bufs[i];
+    vecs[i].size = TIMING_DATAGRAM_LEN;
+    messages[i].buffers = &vecs[i];
+    messages[i].n_buffers = 1;
+  }
+
+  g_assert_cmpint (nice_socket_send_messages (client, to, messages,
+      TIMING_ROUND_LEN), ==, TIMING_ROUND_LEN);
+}
+
+/* Receives a round of datagrams numbered from @seq, @batch at a time, and
+ * returns how long it took, in microseconds */
+static gint64
+recv_timing_round (NiceSocket *server, guint32 seq, guint batch)
+{
+  guint8 bufs[TIMING_BATCH][TIMING_DATAGRAM_LEN];
+  guint8 expected[TIMING_DATAGRAM_LEN];
+  GInputVector vecs[TIMING_BATCH];
+  NiceInputMessage messages[TIMING_BATCH];
+  NiceAddress from[TIMING_BATCH];
+  guint n_received = 0;
+  gint64 start;
+  guint i;
+
+  for (i = 0; i < TIMING_BATCH; i++) {
+    vecs[i].buffer = bufs[i];
+    vecs[i].size = TIMING_DATAGRAM_LEN;
+    messages[i].buffers = &vecs[i];
+    messages[i].n_buffers = 1;
+    messages[i].from = &from[i];
+    messages[i].length = 0;
+  }
+
+  start = g_get_monotonic_time ();
+
+  while (n_received < TIMING_ROUND_LEN) {
+    gint ret;
+
+    ret = nice_socket_recv_messages (server, messages,
+        MIN (batch, TIMING_ROUND_LEN - n_received));
+    g_assert_cmpint (ret, >, 0);
+
+    for (i = 0; i < (guint) ret; i++) {
+      guint32 n = seq + n_received + i;
+
+      fill_send_buf (expected, TIMING_DATAGRAM_LEN, n);
+      memcpy (expected, &n, sizeof (n));
+      g_assert_cmpuint (messages[i].length, ==, TIMING_DATAGRAM_LEN);
+      g_assert_cmpint (memcmp (bufs[i], expected, TIMING_DATAGRAM_LEN), ==,
+          0);
+    }
+    n_received += ret;
+  }
+
+  return g_get_monotonic_time () - start;
+}
+
+/* Time receiving datagrams one per call, as the agent used to, against
+ * receiving them in batches, which is one recvmmsg() where available */
+static void
+test_recv_batch_timing (void)
+{
+  NiceSocket *server;
+  NiceSocket *client;
+  NiceAddress tmp;
+  const guint batches[] = { 1, TIMING_BATCH };
+  gint64 elapsed[G_N_ELEMENTS (batches)] = { 0, };
+  guint32 seq = 0;
+  guint i, round;
+
+  server = nice_udp_bsd_socket_new (NULL);
+  g_assert (server != NULL);
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  g_assert (nice_address_set_from_string (&tmp, "127.0.0.1"));
+  nice_address_set_port (&tmp, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < G_N_ELEMENTS (batches); i++) {
+    for (round = 0; round < TIMING_ROUNDS; round++) {
+      send_timing_round (client, &tmp, seq);
+      elapsed[i] += recv_timing_round (server, seq, batches[i]);
+      seq += TIMING_ROUND_LEN;
+    }
+
+    g_test_maximized_result (TIMING_ROUNDS * TIMING_ROUND_LEN *
+        (gdouble) G_USEC_PER_SEC / MAX (elapsed[i], 1),
+        "udp-bsd: %u datagrams received %u per call: datagrams/s",
+        TIMING_ROUNDS * TIMING_ROUND_LEN, batches[i]);
+  }
+
+#ifdef HAVE_RECVMMSG
+  /* One recvmmsg() per batch must beat one recvmsg() per datagram */
+  g_assert_cmpint (elapsed[1], <, elapsed[0]);
+#endif
+
+  nice_socket_free (client);
+  nice_socket_free (server);
+}
+
+/* Time single sends which alternate between two destinations, and single
+ * receives which return their source address: per packet, both used to
+ * allocate a GSocketAddress */
+static void
+test_native_addr_timing (void)
+{
+  NiceSocket *servers[2];
+  NiceSocket *client;
+  NiceAddress to[2], from;
+  guint8 buf[TIMING_DATAGRAM_LEN];
+  GInputVector vec = { buf, sizeof (buf) };
+  NiceInputMessage message = { &vec, 1, &from, 0 };
+  gint64 send_time = 0, recv_time = 0, start;
+  guint n_datagrams = TIMING_ROUNDS * TIMING_ROUND_LEN;
+  guint i, round;
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (servers); i++) {
+    servers[i] = nice_udp_bsd_socket_new (NULL);
+    g_assert (servers[i] != NULL);
+
+    g_assert (nice_address_set_from_string (&to[i], "127.0.0.1"));
+    nice_address_set_port (&to[i], nice_address_get_port (&servers[i]->addr));
+  }
+
+  memset (buf, 0, sizeof (buf));
+
+  for (round = 0; round < TIMING_ROUNDS; round++) {
+    start = g_get_monotonic_time ();
+    for (i = 0; i < TIMING_ROUND_LEN; i++) {
+      buf[0] = i;
+      g_assert_cmpint (nice_socket_send (client, &to[i % 2], sizeof (buf),
+          (gchar *) buf), ==, sizeof (buf));
+    }
+    send_time += g_get_monotonic_time () - start;
+
+    start = g_get_monotonic_time ();
+    for (i = 0; i < TIMING_ROUND_LEN; i++) {
+      g_assert_cmpint (nice_socket_recv_messages (servers[i % 2], &message, 1),
+          ==, 1);
+      g_assert_cmpuint (message.length, ==, sizeof (buf));
+      g_assert_cmpuint (buf[0], ==, i);
+      g_assert_cmpuint (nice_address_get_port (&from), ==,
+          nice_address_get_port (&client->addr));
+    }
+    recv_time += g_get_monotonic_time () - start;
+  }
+
+  g_test_minimized_result (send_time * 1000.0 / n_datagrams,
+      "udp-bsd: %u single sends to alternating destinations: ns each",
+      n_datagrams);
+  g_test_minimized_result (recv_time * 1000.0 / n_datagrams,
+      "udp-bsd: %u single receives with their source: ns each", n_datagrams);
+
+  nice_socket_free (client);
+  for (i = 0; i < G_N_ELEMENTS (servers); i++)
+    nice_socket_free (servers[i]);
+}
+
+#ifndef G_OS_WIN32
+static gint n_inet_socket_addresses;
+static void (*inet_socket_address_constructed) (GObject *object);
+
+static void
+count_inet_socket_address (GObject *object)
+{
+  g_atomic_int_inc (&n_inet_socket_addresses);
+  inet_socket_address_constructed (object);
+}
+
+/* Single sends and receives must not create a GInetSocketAddress per
+ * datagram: they go through native addresses. Creations are counted by
+ * hooking the class's constructed vfunc, as the instance count of
+ * GOBJECT_DEBUG=instance-count only covers live objects. */
+static void
+test_native_addr_no_alloc (void)
+{
+  NiceSocket *servers[2];
+  NiceSocket *client;
+  NiceAddress to[2], from;
+  guint8 buf[TIMING_DATAGRAM_LEN];
+  GInputVector vec = { buf, sizeof (buf) };
+  NiceInputMessage message = { &vec, 1, &from, 0 };
+  GObjectClass *klass;
+  guint i;
+
+  client = nice_udp_bsd_socket_new (NULL);
+  g_assert (client != NULL);
+
+  for (i = 0; i < G_N_ELEMENTS (servers); i++) {
+    servers[i] = nice_udp_bsd_socket_new (NULL);
+    g_assert (servers[i] != NULL);
+
+    g_assert (nice_address_set_from_string (&to[i], "127.0.0.1"));
+    nice_address_set_port (&to[i], nice_address_get_port (&servers[i]->addr));
+  }
+
+  klass = g_type_class_ref (G_TYPE_INET_SOCKET_ADDRESS);
+  inet_socket_address_constructed = klass->constructed;
+  klass->constructed = count_inet_socket_address;
+
+  /* The hook itself must see the addresses which are still created */
+  g_object_unref (g_inet_socket_address_new_from_string ("127.0.0.1", 1));
+  g_assert_cmpint (g_atomic_int_get (&n_inet_socket_addresses), ==, 1);
+  g_atomic_int_set (&n_inet_socket_addresses, 0);
+
+  memset (buf, 0, sizeof (buf));
+
+  for (i = 0; i < TIMING_ROUND_LEN; i++) {
+    buf[0] = i;
+    g_assert_cmpint (nice_socket_send (client, &to[i % 2], sizeof (buf),
+        (gchar *) buf), ==, sizeof (buf));
+  }
+
+  for (i = 0; i < TIMING_ROUND_LEN; i++) {
+    g_assert_cmpint (nice_socket_recv_messages (servers[i % 2], &message, 1),
+        ==, 1);
+    g_assert_cmpuint (buf[0], ==, i);
+    g_assert_cmpuint (nice_address_get_port (&from), ==,
+        nice_address_get_port (&client->addr));
+  }
+
+  g_assert_cmpint (g_atomic_int_get (&n_inet_socket_addresses), ==, 0);
+
+  klass->constructed = inet_socket_address_constructed;
+  g_type_class_unref (klass);
+
+  nice_socket_free (client);
+  for (i = 0; i < G_N_ELEMENTS (servers); i++)
+    nice_socket_free (servers[i]);
+}
+#endif
+
 /* Test receiving multiple messages in a single call. */
 static void
 test_multi_message_recv (guint n_sends, guint n_receives,
@@ -366,13 +922,27 @@ test_multi_message_recv (guint n_sends, guint n_receives,
 }
 
 int
-main (void)
+main (int argc, char *argv[])
 {
+  g_test_init (&argc, &argv, NULL);
+
   test_socket_initial_properties ();
   test_socket_address_properties ();
   test_simple_send_recv ();
   test_zero_send_recv ();
   test_multi_buffer_recv ();
+  test_segmented_send ();
+  test_receive_offload ();
+  test_io_uring ();
+
+#ifndef G_OS_WIN32
+  test_native_addr_no_alloc ();
+#endif
+
+  if (g_test_perf ()) {
+    test_recv_batch_timing ();
+    test_native_addr_timing ();
+  }
 
   /* Multi-message testing. Serious business. */
   {
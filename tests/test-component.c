@@ -0,0 +1,245 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+#include "agent-priv.h" /* for testing purposes */
+
+#include <string.h>
+
+/* The component only looks at the type of the sockets it is given here, so
+ * these never need to be opened. */
+static NiceSocket udp_sock = { .type = NICE_SOCKET_TYPE_UDP_BSD };
+static NiceSocket other_udp_sock = { .type = NICE_SOCKET_TYPE_UDP_BSD };
+static NiceSocket tcp_sock = { .type = NICE_SOCKET_TYPE_TCP_BSD };
+static NiceSocket turn_sock = { .type = NICE_SOCKET_TYPE_UDP_TURN };
+
+static NiceAgent *
+component_new (NiceComponent **component)
+{
+  NiceAgent *agent;
+  guint stream_id;
+
+  agent = nice_agent_new (NULL, NICE_COMPATIBILITY_RFC5245);
+  stream_id = nice_agent_add_stream (agent, 1);
+  g_assert_cmpuint (stream_id, !=, 0);
+  g_assert (agent_find_component (agent, stream_id, 1, NULL, component));
+
+  return agent;
+}
+
+static void
+set_address (NiceAddress *addr, guint port)
+{
+  g_assert (nice_address_set_from_string (addr, "192.168.1.1"));
+  nice_address_set_port (addr, port);
+}
+
+static NiceCandidate *
+candidate_new (NiceComponent *component, NiceCandidateTransport transport,
+    guint port, NiceSocket *sock)
+{
+  NiceCandidate *candidate;
+
+  candidate = nice_candidate_new (NICE_CANDIDATE_TYPE_HOST);
+  candidate->transport = transport;
+  candidate->stream_id = component->stream_id;
+  candidate->component_id = component->id;
+  candidate->sockptr = sock;
+  set_address (&candidate->addr, port);
+
+  return candidate;
+}
+
+static void
+add_valid_candidate (NiceAgent *agent, NiceComponent *component,
+    NiceCandidateTransport transport, guint port)
+{
+  NiceCandidate *candidate;
+
+  candidate = candidate_new (component, transport, port, NULL);
+  nice_component_add_valid_candidate (agent, component, candidate);
+  nice_candidate_free (candidate);
+}
+
+static gboolean
+verify (NiceComponent *component, guint port, NiceSocket *sock)
+{
+  NiceAddress addr;
+
+  set_address (&addr, port);
+
+  return nice_component_verify_remote_candidate (component, &addr, sock);
+}
+
+/* Removing the remote candidate a target is indexed by must leave the other
+ * one with the same target findable. */
+static void
+test_remote_same_target (void)
+{
+  NiceAgent *agent;
+  NiceComponent *component;
+  NiceCandidate *first, *second;
+  NiceAddress addr;
+
+  agent = component_new (&component);
+  set_address (&addr, 1000);
+
+  first = candidate_new (component, NICE_CANDIDATE_TRANSPORT_UDP, 1000,
+      &udp_sock);
+  second = candidate_new (component, NICE_CANDIDATE_TRANSPORT_UDP, 1000,
+      &other_udp_sock);
+
+  agent_lock (agent);
+
+  nice_component_add_remote_candidate (component, first);
+  nice_component_add_remote_candidate (component, second);
+  g_assert (nice_component_find_remote_candidate (component, &addr,
+      NICE_CANDIDATE_TRANSPORT_UDP) == first);
+  g_assert (nice_component_find_remote_candidate (component, &addr,
+      NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE) == NULL);
+
+  /* Frees the remote candidates using the socket */
+  nice_component_remove_socket (agent, component, &udp_sock);
+  g_assert (nice_component_find_remote_candidate (component, &addr,
+      NICE_CANDIDATE_TRANSPORT_UDP) == second);
+
+  nice_component_remove_socket (agent, component, &other_udp_sock);
+  g_assert (nice_component_find_remote_candidate (component, &addr,
+      NICE_CANDIDATE_TRANSPORT_UDP) == NULL);
+  g_assert (component->remote_candidates == NULL);
+
+  agent_unlock (agent);
+
+  g_object_unref (agent);
+}
+
+/* Packets from UDP candidates are accepted on any socket, those from TCP
+ * candidates only on TCP and TURN sockets. */
+static void
+test_valid_transport (void)
+{
+  NiceAgent *agent;
+  NiceComponent *component;
+
+  agent = component_new (&component);
+
+  agent_lock (agent);
+
+  add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_UDP, 1000);
+  add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE,
+      2000);
+
+  g_assert (verify (component, 1000, &udp_sock));
+  g_assert (verify (component, 1000, &tcp_sock));
+  g_assert (verify (component, 1000, &turn_sock));
+
+  g_assert (!verify (component, 2000, &udp_sock));
+  g_assert (verify (component, 2000, &tcp_sock));
+  g_assert (verify (component, 2000, &turn_sock));
+
+  g_assert (!verify (component, 3000, &udp_sock));
+  g_assert (!verify (component, 3000, &tcp_sock));
+
+  agent_unlock (agent);
+
+  g_object_unref (agent);
+}
+
+/* Once there are too many valid candidates, the least recently used ones are
+ * evicted, and their index entries with them. */
+static void
+test_valid_eviction (void)
+{
+  NiceAgent *agent;
+  NiceComponent *component;
+  guint i;
+
+  agent = component_new (&component);
+
+  agent_lock (agent);
+
+  /* Two TCP candidates with the same address share an index entry: the
+   * passive one, being the oldest, gets evicted first and must hand its
+   * entry over to the active one. */
+  add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_TCP_PASSIVE,
+      1000);
+  add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE,
+      1000);
+
+  for (i = 0; i < NICE_COMPONENT_MAX_VALID_CANDIDATES; i++)
+    add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_UDP,
+        2000 + i);
+
+  g_assert_cmpuint (g_list_length (component->valid_candidates), ==,
+      NICE_COMPONENT_MAX_VALID_CANDIDATES + 1);
+  g_assert_cmpuint (
+      g_hash_table_size (component->valid_candidates_by_addr), ==,
+      g_list_length (component->valid_candidates));
+  g_assert (verify (component, 1000, &tcp_sock));
+  g_assert (((NiceCandidate *) component->valid_candidates->data)->transport ==
+      NICE_CANDIDATE_TRANSPORT_TCP_ACTIVE);
+
+  /* Having just been verified, it is the most recently used: the next one to
+   * go is the first UDP candidate. */
+  add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_UDP, 3000);
+  g_assert (!verify (component, 2000, &udp_sock));
+  g_assert (verify (component, 2001, &udp_sock));
+  g_assert (verify (component, 3000, &udp_sock));
+  g_assert (verify (component, 1000, &tcp_sock));
+
+  /* The TCP candidate is now at the head, with as many as the maximum behind
+   * it: it goes with the last of these. */
+  for (i = 0; i <= NICE_COMPONENT_MAX_VALID_CANDIDATES; i++)
+    add_valid_candidate (agent, component, NICE_CANDIDATE_TRANSPORT_UDP,
+        4000 + i);
+
+  g_assert (!verify (component, 1000, &tcp_sock));
+  g_assert_cmpuint (
+      g_hash_table_size (component->valid_candidates_by_addr), ==,
+      g_list_length (component->valid_candidates));
+
+  agent_unlock (agent);
+
+  g_object_unref (agent);
+}
+
+int
+main (int argc, char **argv)
+{
+  g_test_init (&argc, &argv, NULL);
+
+  g_test_add_func ("/component/remote/same-target", test_remote_same_target);
+  g_test_add_func ("/component/valid/transport", test_valid_transport);
+  g_test_add_func ("/component/valid/eviction", test_valid_eviction);
+
+  return g_test_run ();
+}
@@ -58,6 +58,11 @@ static gboolean global_ready_reached = FALSE;
 static int global_lagent_cands = 0;
 static int global_ragent_cands = 0;
 static gint global_ragent_read = 0;
+static guint global_ragent_n_read = 0;
+static guint global_ragent_n_read_exit = 0;
+
+/* More messages than fit in one writev(), counting the RFC 4571 headers */
+#define N_BATCH_MESSAGES 1000
 static guint global_exit_when_ibr_received = 0;
 
 static void priv_print_global_status (void)
@@ -102,8 +107,11 @@ static void cb_nice_recv (NiceAgent *agent, guint stream_id, guint component_id,
     return;
 
   if (GPOINTER_TO_UINT (user_data) == 2) {
-    g_debug ("right agent received %d bytes, stopping mainloop", len);
     global_ragent_read = len;
+    global_ragent_n_read++;
+    if (global_ragent_n_read < global_ragent_n_read_exit)
+      return;
+    g_debug ("right agent received %d bytes, stopping mainloop", len);
     g_main_loop_quit (global_mainloop);
   }
 }
@@ -385,6 +393,32 @@ static int run_full_test (NiceAgent *lagent, NiceAgent *ragent, NiceAddress *bas
   g_main_loop_run (global_mainloop);
   g_assert (global_ragent_read == 16);
 
+  /* note: test a batch which must be split into several writes */
+  {
+    GOutputVector *bufs = g_new (GOutputVector, N_BATCH_MESSAGES);
+    NiceOutputMessage *messages = g_new (NiceOutputMessage, N_BATCH_MESSAGES);
+    guint i;
+
+    for (i = 0; i < N_BATCH_MESSAGES; i++) {
+      bufs[i].buffer = "1234567812345678";
+      bufs[i].size = 16;
+      messages[i].buffers = &bufs[i];
+      messages[i].n_buffers = 1;
+    }
+
+    global_ragent_n_read = 0;
+    global_ragent_n_read_exit = N_BATCH_MESSAGES;
+    ret = nice_agent_send_messages_nonblocking (lagent, ls_id, 1, messages,
+        N_BATCH_MESSAGES, NULL, NULL);
+    g_assert_cmpint (ret, ==, N_BATCH_MESSAGES);
+    g_main_loop_run (global_mainloop);
+    g_assert_cmpuint (global_ragent_n_read, ==, N_BATCH_MESSAGES);
+    global_ragent_n_read_exit = 0;
+
+    g_free (messages);
+    g_free (bufs);
+  }
+
   g_debug ("test-icetcp: Ran mainloop, removing streams...");
 
   /* step: clean up resources and exit */
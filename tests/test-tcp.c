@@ -81,12 +81,403 @@ on_client_input_available (gpointer user_data)
   return FALSE;
 }
 
+static void
+wait_for_server_input (void)
+{
+  g_assert (g_socket_condition_timed_wait (server->fileno, G_IO_IN,
+      5 * G_USEC_PER_SEC, NULL, NULL));
+}
+
+static void
+test_rfc4571_frames (void)
+{
+  /* Two complete frames and the start of a third one, in a single write */
+  const guint8 data1[] = { 0, 3, 'o', 'n', 'e', 0, 3, 't', 'w', 'o',
+                           0, 5, 't', 'h' };
+  const guint8 data2[] = { 'r', 'e', 'e' };
+  guint8 frame_buf[16];
+  GInputVector frame_vec = { frame_buf, sizeof (frame_buf) };
+  NiceInputMessage frame = { &frame_vec, 1, &tmp, 0 };
+
+  g_assert (sizeof (data1) == nice_socket_send (client, &tmp, sizeof (data1),
+      (const gchar *) data1));
+  wait_for_server_input ();
+
+  g_assert_cmpint (nice_tcp_bsd_socket_recv_frame (server, &frame), ==, 1);
+  g_assert_cmpuint (frame.length, ==, 3);
+  g_assert (0 == strncmp ((gchar *) frame_buf, "one", 3));
+  g_assert (nice_address_equal (&tmp, &client->addr));
+
+  /* The second frame was read along with the first one. */
+  g_assert (nice_tcp_bsd_socket_has_pending_recv (server));
+  g_assert_cmpint (nice_tcp_bsd_socket_recv_frame (server, &frame), ==, 1);
+  g_assert_cmpuint (frame.length, ==, 3);
+  g_assert (0 == strncmp ((gchar *) frame_buf, "two", 3));
+
+  /* The third one is incomplete until the rest of it arrives. */
+  g_assert (!nice_tcp_bsd_socket_has_pending_recv (server));
+  g_assert_cmpint (nice_tcp_bsd_socket_recv_frame (server, &frame), ==, 0);
+
+  g_assert (sizeof (data2) == nice_socket_send (client, &tmp, sizeof (data2),
+      (const gchar *) data2));
+  wait_for_server_input ();
+
+  g_assert_cmpint (nice_tcp_bsd_socket_recv_frame (server, &frame), ==, 1);
+  g_assert_cmpuint (frame.length, ==, 5);
+  g_assert (0 == strncmp ((gchar *) frame_buf, "three", 5));
+  g_assert (!nice_tcp_bsd_socket_has_pending_recv (server));
+}
+
+/* Reads from the server until @target bytes of the stream were received,
+ * letting the client flush its send ring meanwhile. */
+static guint64
+drain_send_ring (guint64 received, guint64 target)
+{
+  guint8 recv_buf[4096];
+  NiceAddress from;
+
+  while (received < target) {
+    gint ret, i;
+
+    g_main_context_iteration (NULL, FALSE);
+    ret = nice_socket_recv (server, &from, MIN (sizeof (recv_buf),
+        target - received), (gchar *) recv_buf);
+    g_assert_cmpint (ret, >=, 0);
+    for (i = 0; i < ret; i++)
+      g_assert_cmpuint (recv_buf[i], ==, (received + i) % 251);
+    received += ret;
+    if (ret == 0)
+      g_usleep (1000);
+  }
+
+  return received;
+}
+
+static void
+fill_send_buffer (guint8 *data, gsize len, guint64 offset)
+{
+  gsize i;
+
+  for (i = 0; i < len; i++)
+    data[i] = (offset + i) % 251;
+}
+
+static void
+test_send_ring (void)
+{
+  guint8 data[1000];
+  guint8 *reliable_data;
+  const gsize reliable_len = 64 * 1024;
+  GOutputVector vec = { data, sizeof (data) };
+  NiceOutputMessage message = { &vec, 1 };
+  guint64 sent = 0, received = 0;
+  guint round;
+
+  /* Small kernel buffers, so that sends hit EAGAIN and the flushes of the
+   * ring are partial writes. */
+  g_assert (g_socket_set_option (client->fileno, SOL_SOCKET, SO_SNDBUF,
+      4096, NULL));
+  g_assert (g_socket_set_option (server->fileno, SOL_SOCKET, SO_RCVBUF,
+      4096, NULL));
+
+  reliable_data = g_malloc (reliable_len);
+
+  for (round = 0; round < 4; round++) {
+    gint ret;
+
+    /* Fill the kernel buffers and then the ring, until messages get dropped.
+     * From the second round on, the ring was partially flushed, so the
+     * messages are queued past its end and wrap around. */
+    do {
+      fill_send_buffer (data, sizeof (data), sent);
+      ret = nice_socket_send_messages (client, &tmp, &message, 1);
+      g_assert_cmpint (ret, >=, 0);
+      if (ret == 1)
+        sent += sizeof (data);
+      g_assert_cmpuint (sent, <, 64 * 1024 * 1024);
+    } while (ret == 1);
+    g_assert_cmpuint (sent, >, 256 * 1024);
+    g_assert_cmpuint (nice_tcp_bsd_socket_get_queued_bytes (client), >, 0);
+
+    /* Reliable data is queued anyway, growing the full ring while its
+     * content wraps. */
+    if (round >= 2) {
+      vec.buffer = reliable_data;
+      vec.size = reliable_len;
+      fill_send_buffer (reliable_data, reliable_len, sent);
+      g_assert_cmpint (nice_socket_send_messages_reliable (client, &tmp,
+          &message, 1), ==, 1);
+      sent += reliable_len;
+      vec.buffer = data;
+      vec.size = sizeof (data);
+    }
+
+    /* Read half of what is in flight, for a partial flush of the ring */
+    received = drain_send_ring (received, received + (sent - received) / 2);
+  }
+
+  received = drain_send_ring (received, sent);
+  g_assert_cmpuint (received, ==, sent);
+  g_assert_cmpuint (nice_tcp_bsd_socket_get_queued_bytes (client), ==, 0);
+
+  /* Once flushed, non-reliable messages are sent again */
+  fill_send_buffer (data, sizeof (data), sent);
+  g_assert_cmpint (nice_socket_send_messages (client, &tmp, &message, 1), ==,
+      1);
+  sent += sizeof (data);
+  received = drain_send_ring (received, sent);
+
+  g_free (reliable_data);
+}
+
+/* Connects a new client to the passive socket, and accepts it */
+static void
+connect_pair (NiceSocket **new_client, NiceSocket **new_server)
+{
+  NiceAddress bind_addr;
+  NiceSocket *active;
+
+  g_assert (nice_address_set_from_string (&bind_addr, "127.0.0.1"));
+  active = nice_tcp_active_socket_new (g_main_loop_get_context (mainloop),
+      &bind_addr);
+  g_assert (active);
+
+  *new_client = nice_tcp_active_socket_connect (active, &passive_sock->addr);
+  g_assert (*new_client);
+  nice_socket_free (active);
+
+  g_assert (g_socket_condition_timed_wait (passive_sock->fileno, G_IO_IN,
+      5 * G_USEC_PER_SEC, NULL, NULL));
+  *new_server = nice_tcp_passive_socket_accept (passive_sock);
+  g_assert (*new_server);
+}
+
+#define DELAY_RECORD_LEN 1000
+/* Read per millisecond, about 500 kB/s, half of what the sender offers */
+#define DELAY_READ_PER_TICK 500
+#define DELAY_DURATION (500 * 1000)
+
+/* Sends a timestamped record every millisecond the socket can send, while
+ * the other end reads at a limited rate. Returns the mean time a record
+ * waited between being sent and being read, in microseconds. */
+static gint64
+measure_queueing_delay (NiceSocket *sender, NiceSocket *receiver,
+    gint64 *max_delay)
+{
+  guint8 record[DELAY_RECORD_LEN];
+  guint8 read_record[DELAY_RECORD_LEN];
+  gsize read_len = 0;
+  NiceAddress from;
+  gint64 start, now, total_delay = 0;
+  guint n_received = 0;
+
+  /* A small receive window, like a slow link, leaves the backlog in the
+   * kernel of the sender */
+  g_assert (g_socket_set_option (receiver->fileno, SOL_SOCKET, SO_RCVBUF,
+      8192, NULL));
+
+  memset (record, 0, sizeof (record));
+  *max_delay = 0;
+  start = g_get_monotonic_time ();
+
+  while ((now = g_get_monotonic_time ()) - start < DELAY_DURATION) {
+    gint ret;
+
+    if (nice_socket_can_send (sender, &tmp)) {
+      memcpy (record, &now, sizeof (now));
+      ret = nice_socket_send (sender, &tmp, sizeof (record),
+          (gchar *) record);
+      g_assert (ret == 0 || ret == sizeof (record));
+    }
+
+    ret = nice_socket_recv (receiver, &from,
+        MIN (DELAY_READ_PER_TICK, sizeof (read_record) - read_len),
+        (gchar *) read_record + read_len);
+    g_assert_cmpint (ret, >=, 0);
+    read_len += ret;
+
+    if (read_len == sizeof (read_record)) {
+      gint64 sent_time, delay;
+
+      memcpy (&sent_time, read_record, sizeof (sent_time));
+      delay = g_get_monotonic_time () - sent_time;
+      g_assert_cmpint (delay, >=, 0);
+      total_delay += delay;
+      *max_delay = MAX (*max_delay, delay);
+      n_received++;
+      read_len = 0;
+    }
+
+    g_main_context_iteration (NULL, FALSE);
+    g_usleep (1000);
+  }
+
+  g_assert_cmpuint (n_received, >, 0);
+
+  return total_delay / n_received;
+}
+
+/* Compare the delay data waits in the kernel of the sender behind a slow
+ * reader, without and with TCP_NOTSENT_LOWAT */
+static void
+test_notsent_lowat_delay (void)
+{
+  NiceSocket *sender, *receiver;
+  gint64 default_delay, lowat_delay, max_delay;
+
+  connect_pair (&sender, &receiver);
+  default_delay = measure_queueing_delay (sender, receiver, &max_delay);
+  g_test_minimized_result (default_delay / 1000.0,
+      "tcp-bsd: mean queueing delay by default: ms");
+  g_test_minimized_result (max_delay / 1000.0,
+      "tcp-bsd: max queueing delay by default: ms");
+  nice_socket_free (sender);
+  nice_socket_free (receiver);
+
+  connect_pair (&sender, &receiver);
+  if (nice_tcp_bsd_socket_set_notsent_lowat (sender, 4096)) {
+    lowat_delay = measure_queueing_delay (sender, receiver, &max_delay);
+    g_test_minimized_result (lowat_delay / 1000.0,
+        "tcp-bsd: mean queueing delay with TCP_NOTSENT_LOWAT 4096: ms");
+    g_test_minimized_result (max_delay / 1000.0,
+        "tcp-bsd: max queueing delay with TCP_NOTSENT_LOWAT 4096: ms");
+
+    /* The backlog now stays in the sender's hands instead of the kernel */
+    g_assert_cmpint (lowat_delay, <, default_delay);
+  } else {
+    g_test_message ("TCP_NOTSENT_LOWAT is not supported");
+  }
+  nice_socket_free (sender);
+  nice_socket_free (receiver);
+}
+
+#define ACCEPT_ROUNDS 32
+/* Connections per round, within the listen backlog of GSocket */
+#define ACCEPT_PEERS 8
+/* TCP_PASSIVE_ACCEPT_BUDGET in agent.c */
+#define ACCEPT_BUDGET 64
+
+typedef struct {
+  GPtrArray *accepted;
+  guint budget;
+  guint n_wakeups;
+} AcceptData;
+
+static gboolean
+on_accept_available (GSocket *gsock, GIOCondition condition,
+    gpointer user_data)
+{
+  AcceptData *data = user_data;
+  guint i;
+
+  data->n_wakeups++;
+
+  for (i = 0; i < data->budget; i++) {
+    NiceSocket *sock = nice_tcp_passive_socket_accept (passive_sock);
+
+    if (sock == NULL)
+      break;
+    g_ptr_array_add (data->accepted, sock);
+  }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Accepts rounds of simultaneous connections, up to @budget per wakeup of
+ * the passive socket, and returns the time it took in microseconds */
+static gint64
+time_accepts (guint budget, guint *n_wakeups)
+{
+  GMainContext *context;
+  GSource *source;
+  AcceptData data = { NULL, budget, 0 };
+  GPtrArray *clients;
+  gint64 elapsed = 0;
+  guint round, i;
+
+  context = g_main_context_new ();
+  source = g_socket_create_source (passive_sock->fileno, G_IO_IN, NULL);
+  g_source_set_callback (source, (GSourceFunc) G_CALLBACK (on_accept_available),
+      &data, NULL);
+  g_source_attach (source, context);
+
+  data.accepted = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) nice_socket_free);
+  clients = g_ptr_array_new_with_free_func ((GDestroyNotify) nice_socket_free);
+
+  for (round = 0; round < ACCEPT_ROUNDS; round++) {
+    NiceAddress bind_addr;
+    gint64 start;
+
+    g_assert (nice_address_set_from_string (&bind_addr, "127.0.0.1"));
+    for (i = 0; i < ACCEPT_PEERS; i++) {
+      NiceSocket *active = nice_tcp_active_socket_new (
+          g_main_loop_get_context (mainloop), &bind_addr);
+      NiceSocket *sock;
+
+      g_assert (active);
+      sock = nice_tcp_active_socket_connect (active, &passive_sock->addr);
+      g_assert (sock);
+      g_ptr_array_add (clients, sock);
+      nice_socket_free (active);
+    }
+
+    start = g_get_monotonic_time ();
+    while (data.accepted->len < ACCEPT_PEERS)
+      g_main_context_iteration (context, TRUE);
+    elapsed += g_get_monotonic_time () - start;
+
+    g_assert_cmpuint (data.accepted->len, ==, ACCEPT_PEERS);
+    g_ptr_array_set_size (data.accepted, 0);
+    g_ptr_array_set_size (clients, 0);
+  }
+
+  *n_wakeups = data.n_wakeups;
+
+  g_ptr_array_unref (clients);
+  g_ptr_array_unref (data.accepted);
+  g_source_destroy (source);
+  g_source_unref (source);
+  g_main_context_unref (context);
+
+  return elapsed;
+}
+
+/* Compare accepting one connection per wakeup of the passive socket with
+ * draining its backlog, as the agent does */
+static void
+test_accept_rate (void)
+{
+  const guint budgets[] = { 1, ACCEPT_BUDGET };
+  guint n_wakeups[G_N_ELEMENTS (budgets)];
+  guint n_connections = ACCEPT_ROUNDS * ACCEPT_PEERS;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (budgets); i++) {
+    gint64 elapsed = time_accepts (budgets[i], &n_wakeups[i]);
+
+    g_test_maximized_result (
+        n_connections * (gdouble) G_USEC_PER_SEC / MAX (elapsed, 1),
+        "tcp-passive: connections/s accepted up to %u per wakeup",
+        budgets[i]);
+    g_test_minimized_result (n_wakeups[i],
+        "tcp-passive: wakeups for %u connections accepted up to %u per "
+        "wakeup", n_connections, budgets[i]);
+    g_assert_cmpuint (n_wakeups[i], <=, n_connections);
+  }
+
+  /* Draining the backlog takes connections which arrived together in one
+   * wakeup */
+  g_assert_cmpuint (n_wakeups[1], <, n_wakeups[0]);
+}
+
 int
-main (void)
+main (int argc, char *argv[])
 {
   NiceAddress active_bind_addr, passive_bind_addr;
   GSource *srv_listen_source, *srv_input_source, *cli_input_source;
 
+  g_test_init (&argc, &argv, NULL);
   g_networking_init ();
 
   mainloop = g_main_loop_new (NULL, FALSE);
@@ -147,6 +538,17 @@ main (void)
   g_main_loop_run (mainloop); /* -> on_client_input_available */
   g_assert (0 == strncmp (buf, "uryyb", 5));
 
+  test_rfc4571_frames ();
+
+  /* Read the server side directly from now on */
+  g_source_destroy (srv_input_source);
+  test_send_ring ();
+
+  if (g_test_perf ()) {
+    test_notsent_lowat_delay ();
+    test_accept_rate ();
+  }
+
   nice_socket_free (client);
   nice_socket_free (server);
   nice_socket_free (passive_sock);
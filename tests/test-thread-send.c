@@ -0,0 +1,495 @@
+/*
+ * This file is part of the Nice GLib ICE library.
+ *
+ * Stress test of sends from several threads, concurrent with receives
+ * and changes of the candidates and selected pairs.
+ *
+ * (C) 2026 Collabora Ltd.
+ *
+ * The contents of this file are subject to the Mozilla Public License Version
+ * 1.1 (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/MPL/
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied. See the License
+ * for the specific language governing rights and limitations under the
+ * License.
+ *
+ * The Original Code is the Nice GLib ICE library.
+ *
+ * The Initial Developers of the Original Code are Collabora Ltd and Nokia
+ * Corporation. All Rights Reserved.
+ *
+ * Contributors:
+ *
+ * Alternatively, the contents of this file may be used under the terms of the
+ * the GNU Lesser General Public License Version 2.1 (the "LGPL"), in which
+ * case the provisions of LGPL are applicable instead of those above. If you
+ * wish to allow use of your version of this file only under the terms of the
+ * LGPL and not to allow others to use your version of this file under the
+ * MPL, indicate your decision by deleting the provisions above and replace
+ * them with the notice and other provisions required by the LGPL. If you do
+ * not delete the provisions above, a recipient may use your version of this
+ * file under either the MPL or the LGPL.
+ */
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
+#include "agent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Sending threads per agent */
+#define N_SENDERS 2
+#define PAYLOAD_LEN 64
+/* Remote candidates added while the senders run */
+#define N_CANDIDATE_CHANGES 100
+/* Switches of the selected pair while the senders run */
+#define N_PAIR_CHANGES 100
+
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+  guint8 id;
+  volatile gint sent;
+  volatile gint failed;
+} Sender;
+
+static volatile gint senders_stop = 0;
+
+static volatile gint global_lagent_ready = 0;
+static volatile gint global_ragent_ready = 0;
+
+static volatile gint global_lagent_buffers = 0;
+static volatile gint global_ragent_buffers = 0;
+
+/* Waits about 30 seconds for @cond to become TRUE */
+#define WAIT_UNTIL(cond)                                \
+  {                                                     \
+    int _i;                                             \
+                                                        \
+    for (_i = 0; _i < 3000 && !(cond); _i++)            \
+      g_usleep (10 * 1000);                             \
+                                                        \
+    g_assert (cond);                                    \
+  }
+
+static gpointer
+mainloop_thread (gpointer data)
+{
+  GMainLoop *loop = data;
+
+  g_main_loop_run (loop);
+
+  return NULL;
+}
+
+static void
+fill_payload (guint8 *buf, guint8 id, guint32 seq)
+{
+  guint i;
+
+  buf[0] = id;
+  memcpy (buf + 1, &seq, sizeof (seq));
+  for (i = 1 + sizeof (seq); i < PAYLOAD_LEN; i++)
+    buf[i] = id + seq + i;
+}
+
+static gpointer
+sender_thread (gpointer data)
+{
+  Sender *sender = data;
+  guint8 buf[PAYLOAD_LEN];
+  guint32 seq = 0;
+
+  while (!g_atomic_int_get (&senders_stop)) {
+    gint ret;
+
+    fill_payload (buf, sender->id, seq++);
+    ret = nice_agent_send (sender->agent, sender->stream_id, 1,
+        sizeof (buf), (gchar *) buf);
+
+    if (ret == sizeof (buf))
+      g_atomic_int_inc (&sender->sent);
+    else
+      g_atomic_int_inc (&sender->failed);
+
+    g_usleep (100);
+  }
+
+  return NULL;
+}
+
+static void
+cb_nice_recv (NiceAgent *agent, guint stream_id, guint component_id,
+    guint len, gchar *buf, gpointer user_data)
+{
+  guint8 expected[PAYLOAD_LEN];
+  guint32 seq;
+
+  /* Every message arrives whole, as one of the senders built it */
+  g_assert_cmpuint (len, ==, PAYLOAD_LEN);
+  memcpy (&seq, buf + 1, sizeof (seq));
+  fill_payload (expected, buf[0], seq);
+  g_assert (memcmp (buf, expected, PAYLOAD_LEN) == 0);
+
+  if (GPOINTER_TO_UINT (user_data) == 1)
+    g_atomic_int_inc (&global_lagent_buffers);
+  else
+    g_atomic_int_inc (&global_ragent_buffers);
+}
+
+static void
+cb_candidate_gathering_done (NiceAgent *agent, guint stream_id, gpointer data)
+{
+  NiceAgent *other = g_object_get_data (G_OBJECT (agent), "other-agent");
+  gchar *ufrag = NULL, *password = NULL;
+  GSList *cands;
+  guint id, other_id;
+
+  id = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (agent), "id"));
+  other_id = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (other), "id"));
+
+  nice_agent_get_local_credentials (agent, id, &ufrag, &password);
+  nice_agent_set_remote_credentials (other, other_id, ufrag, password);
+  g_free (ufrag);
+  g_free (password);
+
+  cands = nice_agent_get_local_candidates (agent, id, 1);
+  g_assert (cands != NULL);
+  nice_agent_set_remote_candidates (other, other_id, 1, cands);
+  g_slist_free_full (cands, (GDestroyNotify) nice_candidate_free);
+}
+
+static void
+cb_component_state_changed (NiceAgent *agent, guint stream_id,
+    guint component_id, guint state, gpointer user_data)
+{
+  if (state != NICE_COMPONENT_STATE_READY)
+    return;
+
+  if (GPOINTER_TO_UINT (user_data) == 1)
+    g_atomic_int_set (&global_lagent_ready, 1);
+  else
+    g_atomic_int_set (&global_ragent_ready, 1);
+}
+
+/* Adds a remote candidate nobody listens on, so that the agent creates
+ * pairs and runs connectivity checks while the senders use the selected
+ * pair */
+static void
+add_remote_candidate (NiceAgent *agent, guint stream_id, guint n)
+{
+  NiceCandidate *cand;
+  GSList *cands;
+
+  cand = nice_candidate_new (NICE_CANDIDATE_TYPE_HOST);
+  cand->stream_id = stream_id;
+  cand->component_id = 1;
+  cand->transport = NICE_CANDIDATE_TRANSPORT_UDP;
+  cand->priority = 1000 + n;
+  g_snprintf (cand->foundation, NICE_CANDIDATE_MAX_FOUNDATION, "stress%u", n);
+  g_assert (nice_address_set_from_string (&cand->addr, "127.0.0.1"));
+  nice_address_set_port (&cand->addr, 20000 + n);
+
+  cands = g_slist_prepend (NULL, cand);
+  g_assert_cmpint (nice_agent_set_remote_candidates (agent, stream_id, 1,
+      cands), ==, 1);
+  g_slist_free_full (cands, (GDestroyNotify) nice_candidate_free);
+}
+
+static NiceAgent *
+agent_new (GMainContext *ctx, guint id, NiceAddress *baseaddr)
+{
+  NiceAgent *agent = nice_agent_new (ctx, NICE_COMPATIBILITY_RFC5245);
+
+  g_object_set (G_OBJECT (agent), "upnp", FALSE, NULL);
+  nice_agent_add_local_address (agent, baseaddr);
+
+  g_signal_connect (G_OBJECT (agent), "candidate-gathering-done",
+      G_CALLBACK (cb_candidate_gathering_done), GUINT_TO_POINTER (id));
+  g_signal_connect (G_OBJECT (agent), "component-state-changed",
+      G_CALLBACK (cb_component_state_changed), GUINT_TO_POINTER (id));
+
+  return agent;
+}
+
+/* Streams, each sent on by a thread of its own, of the scaling test */
+#define N_SCALING_STREAMS 4
+#define N_TIMED_SENDS 20000
+
+typedef struct {
+  NiceAgent *agent;
+  guint stream_id;
+} TimedSender;
+
+static gpointer
+timed_sender_thread (gpointer data)
+{
+  TimedSender *sender = data;
+  gchar buf[PAYLOAD_LEN] = { 0, };
+  guint i;
+
+  for (i = 0; i < N_TIMED_SENDS; i++)
+    g_assert_cmpint (nice_agent_send (sender->agent, sender->stream_id, 1,
+        sizeof (buf), buf), ==, sizeof (buf));
+
+  return NULL;
+}
+
+/* Sends on the first @n_threads streams at once, one thread each, and
+ * returns the aggregate number of sends per second */
+static gdouble
+time_sends (TimedSender *senders, guint n_threads)
+{
+  GThread *threads[N_SCALING_STREAMS];
+  gint64 start, elapsed;
+  guint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < n_threads; i++)
+    threads[i] = g_thread_new ("timed-sender", timed_sender_thread,
+        &senders[i]);
+  for (i = 0; i < n_threads; i++)
+    g_thread_join (threads[i]);
+  elapsed = g_get_monotonic_time () - start;
+
+  return n_threads * N_TIMED_SENDS * (gdouble) G_USEC_PER_SEC /
+      MAX (elapsed, 1);
+}
+
+/* Time sends on independent streams of one agent from one thread, and
+ * then from one thread per stream */
+static void
+time_send_scaling (NiceAddress *baseaddr)
+{
+  GMainContext *ctx;
+  NiceAgent *agent;
+  GSocket *sink;
+  GInetAddress *inet_addr;
+  GSocketAddress *sink_addr;
+  TimedSender senders[N_SCALING_STREAMS];
+  guint n_threads = CLAMP (g_get_num_processors (), 2, N_SCALING_STREAMS);
+  gdouble single_rate, threaded_rate;
+  guint16 sink_port;
+  guint i;
+
+  /* Never read, the kernel drops what does not fit in its receive buffer */
+  sink = g_socket_new (G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM,
+      G_SOCKET_PROTOCOL_UDP, NULL);
+  g_assert (sink != NULL);
+  inet_addr = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+  sink_addr = g_inet_socket_address_new (inet_addr, 0);
+  g_assert (g_socket_bind (sink, sink_addr, TRUE, NULL));
+  g_object_unref (sink_addr);
+  g_object_unref (inet_addr);
+
+  sink_addr = g_socket_get_local_address (sink, NULL);
+  g_assert (sink_addr != NULL);
+  sink_port = g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (sink_addr));
+  g_object_unref (sink_addr);
+
+  /* The selected pairs are set directly, so the context needs no thread */
+  ctx = g_main_context_new ();
+  agent = nice_agent_new (ctx, NICE_COMPATIBILITY_RFC5245);
+  g_object_set (G_OBJECT (agent), "upnp", FALSE, NULL);
+  nice_agent_add_local_address (agent, baseaddr);
+
+  for (i = 0; i < N_SCALING_STREAMS; i++) {
+    NiceCandidate *cand;
+
+    senders[i].agent = agent;
+    senders[i].stream_id = nice_agent_add_stream (agent, 1);
+    g_assert (senders[i].stream_id > 0);
+    g_assert (nice_agent_gather_candidates (agent, senders[i].stream_id));
+
+    cand = nice_candidate_new (NICE_CANDIDATE_TYPE_HOST);
+    cand->stream_id = senders[i].stream_id;
+    cand->component_id = 1;
+    cand->transport = NICE_CANDIDATE_TRANSPORT_UDP;
+    g_assert (nice_address_set_from_string (&cand->addr, "127.0.0.1"));
+    nice_address_set_port (&cand->addr, sink_port);
+    g_assert (nice_agent_set_selected_remote_candidate (agent,
+        senders[i].stream_id, 1, cand));
+    nice_candidate_free (cand);
+  }
+
+  single_rate = time_sends (senders, 1);
+  threaded_rate = time_sends (senders, n_threads);
+
+  g_test_maximized_result (single_rate,
+      "agent: sends/s on independent streams, 1 thread");
+  g_test_maximized_result (threaded_rate,
+      "agent: sends/s on independent streams, %u threads", n_threads);
+
+  /* Sends on different streams take no lock in common */
+  if (g_get_num_processors () > 1)
+    g_assert_cmpfloat (threaded_rate, >, single_rate);
+
+  g_object_unref (agent);
+  g_main_context_unref (ctx);
+  g_socket_close (sink, NULL);
+  g_object_unref (sink);
+}
+
+int main (int argc, char *argv[])
+{
+  NiceAgent *lagent, *ragent;
+  NiceAddress baseaddr;
+  GMainContext *lmainctx, *rmainctx, *ldmainctx, *rdmainctx;
+  GMainLoop *lmainloop, *rmainloop, *ldmainloop, *rdmainloop;
+  GThread *lthread, *rthread, *ldthread, *rdthread;
+  GThread *sender_threads[2 * N_SENDERS];
+  Sender senders[2 * N_SENDERS];
+  gint failed[N_SENDERS];
+  NiceCandidate *local, *remote;
+  gchar lfoundation[NICE_CANDIDATE_MAX_FOUNDATION];
+  gchar rfoundation[NICE_CANDIDATE_MAX_FOUNDATION];
+  guint ls_id, rs_id;
+  gint sent, received;
+  guint i;
+
+  g_test_init (&argc, &argv, NULL);
+
+  lmainctx = g_main_context_new ();
+  rmainctx = g_main_context_new ();
+  ldmainctx = g_main_context_new ();
+  rdmainctx = g_main_context_new ();
+  lmainloop = g_main_loop_new (lmainctx, FALSE);
+  rmainloop = g_main_loop_new (rmainctx, FALSE);
+  ldmainloop = g_main_loop_new (ldmainctx, FALSE);
+  rdmainloop = g_main_loop_new (rdmainctx, FALSE);
+
+  g_assert (nice_address_set_from_string (&baseaddr, "127.0.0.1"));
+
+  if (g_test_perf ())
+    time_send_scaling (&baseaddr);
+
+  lagent = agent_new (lmainctx, 1, &baseaddr);
+  ragent = agent_new (rmainctx, 2, &baseaddr);
+  g_object_set_data (G_OBJECT (lagent), "other-agent", ragent);
+  g_object_set_data (G_OBJECT (ragent), "other-agent", lagent);
+  g_object_set (G_OBJECT (lagent), "controlling-mode", TRUE, NULL);
+  g_object_set (G_OBJECT (ragent), "controlling-mode", FALSE, NULL);
+
+  lthread = g_thread_new ("lthread libnice", mainloop_thread, lmainloop);
+  rthread = g_thread_new ("rthread libnice", mainloop_thread, rmainloop);
+
+  ls_id = nice_agent_add_stream (lagent, 1);
+  rs_id = nice_agent_add_stream (ragent, 1);
+  g_assert (ls_id > 0);
+  g_assert (rs_id > 0);
+  g_object_set_data (G_OBJECT (lagent), "id", GUINT_TO_POINTER (ls_id));
+  g_object_set_data (G_OBJECT (ragent), "id", GUINT_TO_POINTER (rs_id));
+
+  /* Received data is handled in threads of its own */
+  nice_agent_attach_recv (lagent, ls_id, 1, ldmainctx, cb_nice_recv,
+      GUINT_TO_POINTER (1));
+  nice_agent_attach_recv (ragent, rs_id, 1, rdmainctx, cb_nice_recv,
+      GUINT_TO_POINTER (2));
+  ldthread = g_thread_new ("ldthread libnice", mainloop_thread, ldmainloop);
+  rdthread = g_thread_new ("rdthread libnice", mainloop_thread, rdmainloop);
+
+  g_assert (nice_agent_gather_candidates (lagent, ls_id));
+  g_assert (nice_agent_gather_candidates (ragent, rs_id));
+
+  WAIT_UNTIL (g_atomic_int_get (&global_lagent_ready) &&
+      g_atomic_int_get (&global_ragent_ready));
+
+  /* Both agents send from several threads at once */
+  for (i = 0; i < 2 * N_SENDERS; i++) {
+    senders[i].agent = i < N_SENDERS ? lagent : ragent;
+    senders[i].stream_id = i < N_SENDERS ? ls_id : rs_id;
+    senders[i].id = i;
+    senders[i].sent = 0;
+    senders[i].failed = 0;
+    sender_threads[i] = g_thread_new ("sender", sender_thread, &senders[i]);
+  }
+
+  /* Meanwhile, the candidates change under them */
+  for (i = 0; i < N_CANDIDATE_CHANGES; i++) {
+    add_remote_candidate (lagent, ls_id, i);
+    add_remote_candidate (ragent, rs_id, i);
+    g_usleep (1000);
+  }
+
+  /* Data keeps flowing both ways */
+  received = g_atomic_int_get (&global_ragent_buffers);
+  WAIT_UNTIL (g_atomic_int_get (&global_ragent_buffers) > received);
+  received = g_atomic_int_get (&global_lagent_buffers);
+  WAIT_UNTIL (g_atomic_int_get (&global_lagent_buffers) > received);
+
+  /* Switch the selected pair of the left agent between the working pair
+   * and one towards a remote candidate nobody listens on, so that its send
+   * route is replaced under the senders */
+  g_assert (nice_agent_get_selected_pair (lagent, ls_id, 1, &local, &remote));
+  g_strlcpy (lfoundation, local->foundation, sizeof (lfoundation));
+  g_strlcpy (rfoundation, remote->foundation, sizeof (rfoundation));
+  remote = nice_candidate_copy (remote);
+
+  for (i = 0; i < N_PAIR_CHANGES; i++) {
+    g_assert (nice_agent_set_selected_pair (lagent, ls_id, 1, lfoundation,
+        "stress0"));
+    g_usleep (500);
+    if (i % 2 == 0)
+      g_assert (nice_agent_set_selected_pair (lagent, ls_id, 1, lfoundation,
+          rfoundation));
+    else
+      g_assert (nice_agent_set_selected_remote_candidate (lagent, ls_id, 1,
+          remote));
+    g_usleep (500);
+  }
+  nice_candidate_free (remote);
+
+  /* The last switch went back to the working pair */
+  received = g_atomic_int_get (&global_ragent_buffers);
+  WAIT_UNTIL (g_atomic_int_get (&global_ragent_buffers) > received);
+
+  /* Close the component under the senders: their sends must fail from
+   * then on instead of using the freed socket */
+  for (i = 0; i < N_SENDERS; i++)
+    failed[i] = g_atomic_int_get (&senders[i].failed);
+  nice_agent_remove_stream (lagent, ls_id);
+  for (i = 0; i < N_SENDERS; i++)
+    WAIT_UNTIL (g_atomic_int_get (&senders[i].failed) > failed[i]);
+
+  g_atomic_int_set (&senders_stop, 1);
+  for (i = 0; i < 2 * N_SENDERS; i++)
+    g_thread_join (sender_threads[i]);
+
+  for (i = 0; i < 2 * N_SENDERS; i++)
+    g_assert_cmpint (senders[i].sent, >, 0);
+  g_assert_cmpint (nice_agent_send (lagent, ls_id, 1, 1, "x"), ==, -1);
+
+  /* Nothing is received that was not sent */
+  sent = 0;
+  for (i = 0; i < N_SENDERS; i++)
+    sent += senders[i].sent;
+  g_assert_cmpint (g_atomic_int_get (&global_ragent_buffers), <=, sent);
+
+  g_main_loop_quit (ldmainloop);
+  g_main_loop_quit (rdmainloop);
+  g_main_loop_quit (lmainloop);
+  g_main_loop_quit (rmainloop);
+  g_thread_join (ldthread);
+  g_thread_join (rdthread);
+  g_thread_join (lthread);
+  g_thread_join (rthread);
+
+  g_object_unref (lagent);
+  g_object_unref (ragent);
+
+  g_main_loop_unref (lmainloop);
+  g_main_loop_unref (rmainloop);
+  g_main_loop_unref (ldmainloop);
+  g_main_loop_unref (rdmainloop);
+  g_main_context_unref (lmainctx);
+  g_main_context_unref (rmainctx);
+  g_main_context_unref (ldmainctx);
+  g_main_context_unref (rdmainctx);
+
+  return 0;
+}
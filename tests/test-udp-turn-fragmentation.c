@@ -204,6 +204,911 @@ tcp_turn_fragmentation (void)
   nice_socket_free (testsock);
 }
 
+typedef struct {
+  const guint8 *data;
+  gsize len;
+  gsize offset;
+  gsize chunk;  /* most bytes returned by a read */
+} StreamSocketPriv;
+
+static gint
+stream_socket_recv_messages (NiceSocket *sock,
+    NiceInputMessage *recv_messages, guint n_recv_messages)
+{
+  StreamSocketPriv *priv = sock->priv;
+  gsize len;
+
+  len = MIN (priv->chunk, priv->len - priv->offset);
+  if (n_recv_messages == 0 || len == 0)
+    return 0;
+
+  memcpy_buffer_to_input_message (&recv_messages[0], priv->data + priv->offset,
+      len);
+  priv->offset += recv_messages[0].length;
+  nice_address_set_from_string (recv_messages[0].from, "127.0.0.1");
+
+  return 1;
+}
+
+static void
+stream_socket_close (NiceSocket *sock)
+{
+  g_free (sock->priv);
+}
+
+static NiceSocket *
+stream_socket_new (const guint8 *data, gsize len, gsize chunk)
+{
+  NiceSocket *sock = g_slice_new0 (NiceSocket);
+  StreamSocketPriv *priv = g_new0 (StreamSocketPriv, 1);
+
+  priv->data = data;
+  priv->len = len;
+  priv->chunk = chunk;
+
+  sock->type = NICE_SOCKET_TYPE_TCP_BSD;
+  sock->recv_messages = stream_socket_recv_messages;
+  sock->is_reliable = test_socket_is_reliable;
+  sock->close = stream_socket_close;
+  sock->priv = (void *) priv;
+
+  return sock;
+}
+
+static void
+tcp_turn_frames (void)
+{
+  /* A padded ChannelData, a STUN message and another ChannelData, split
+   * across two reads in the middle of the STUN message */
+  const guint8 rfc5766_stream[] = {
+    0x40, 0x00, 0x00, 0x05, 'h', 'e', 'l', 'l', 'o', 0, 0, 0,
+    0x01, 0x01, 0x00, 0x00, 0x21, 0x12, 0xa4, 0x42,
+    1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+    0x40, 0x01, 0x00, 0x04, 'a', 'b', 'c', 'd' };
+  const guint8 google_stream[] = { 0, 3, 'a', 'b', 'c', 0, 2, 'd', 'e' };
+  const guint8 oc2007_stream[] = {
+    2 /* control message */, 0, 0, 3, 'x', 'y', 'z' };
+  NiceInputMessage recv_messages[N_RECV_MESSAGES];
+  GInputVector recv_vectors[N_RECV_MESSAGES];
+  NiceAddress recv_addr[N_RECV_MESSAGES];
+  guint8 recv_buffers[N_RECV_MESSAGES][64];
+  NiceSocket *sock;
+  guint i;
+
+  for (i = 0; i != N_RECV_MESSAGES; ++i) {
+    recv_messages[i].buffers = &recv_vectors[i];
+    recv_messages[i].from = &recv_addr[i];
+    recv_messages[i].n_buffers = 1;
+    recv_messages[i].length = 0;
+    recv_vectors[i].buffer = &recv_buffers[i];
+    recv_vectors[i].size = sizeof (recv_buffers[i]);
+  }
+
+  sock = nice_udp_turn_over_tcp_socket_new (
+      stream_socket_new (rfc5766_stream, sizeof (rfc5766_stream), 30),
+      NICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages,
+      N_RECV_MESSAGES), ==, 1);
+  g_assert_cmpuint (recv_messages[0].length, ==, 12);
+  g_assert (!memcmp (recv_buffers[0], rfc5766_stream, 12));
+  g_assert (!nice_udp_turn_over_tcp_socket_has_pending_recv (sock));
+
+  /* The rest of the STUN message completes it and the next frame */
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages,
+      N_RECV_MESSAGES), ==, 2);
+  g_assert_cmpuint (recv_messages[0].length, ==, 20);
+  g_assert (!memcmp (recv_buffers[0], rfc5766_stream + 12, 20));
+  g_assert_cmpuint (recv_messages[1].length, ==, 8);
+  g_assert (!memcmp (recv_buffers[1], rfc5766_stream + 32, 8));
+
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages,
+      N_RECV_MESSAGES), ==, 0);
+  nice_socket_free (sock);
+
+  /* Frames left over when the messages are full stay buffered */
+  sock = nice_udp_turn_over_tcp_socket_new (
+      stream_socket_new (google_stream, sizeof (google_stream), 64),
+      NICE_TURN_SOCKET_COMPATIBILITY_GOOGLE);
+
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages, 1), ==, 1);
+  g_assert_cmpuint (recv_messages[0].length, ==, 3);
+  g_assert (!memcmp (recv_buffers[0], "abc", 3));
+  g_assert (nice_udp_turn_over_tcp_socket_has_pending_recv (sock));
+
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages, 1), ==, 1);
+  g_assert_cmpuint (recv_messages[0].length, ==, 2);
+  g_assert (!memcmp (recv_buffers[0], "de", 2));
+  g_assert (!nice_udp_turn_over_tcp_socket_has_pending_recv (sock));
+  nice_socket_free (sock);
+
+  /* OC2007 frames keep their RFC4571 length */
+  sock = nice_udp_turn_over_tcp_socket_new (
+      stream_socket_new (oc2007_stream, sizeof (oc2007_stream), 64),
+      NICE_TURN_SOCKET_COMPATIBILITY_OC2007);
+
+  g_assert_cmpint (nice_socket_recv_messages (sock, recv_messages,
+      N_RECV_MESSAGES), ==, 1);
+  g_assert_cmpuint (recv_messages[0].length, ==, 5);
+  g_assert (!memcmp (recv_buffers[0], oc2007_stream + 2, 5));
+  nice_socket_free (sock);
+}
+
+static gboolean
+datagram_socket_is_reliable (NiceSocket *sock)
+{
+  return FALSE;
+}
+
+typedef struct {
+  GQueue sent;  /* GByteArray of each message sent */
+  GArray *batches;  /* number of messages of each send call */
+} RecordSocketPriv;
+
+static gint
+record_socket_send_messages (NiceSocket *sock, const NiceAddress *to,
+    const NiceOutputMessage *messages, guint n_messages)
+{
+  RecordSocketPriv *priv = sock->priv;
+  guint i;
+
+  g_array_append_val (priv->batches, n_messages);
+
+  for (i = 0; i < n_messages; i++) {
+    GByteArray *data = g_byte_array_new ();
+    gint j;
+
+    g_assert_cmpint (messages[i].n_buffers, >=, 0);
+    for (j = 0; j < messages[i].n_buffers; j++)
+      g_byte_array_append (data, messages[i].buffers[j].buffer,
+          messages[i].buffers[j].size);
+    g_queue_push_tail (&priv->sent, data);
+  }
+
+  return n_messages;
+}
+
+static void
+record_socket_close (NiceSocket *sock)
+{
+  RecordSocketPriv *priv = sock->priv;
+
+  g_queue_free_full (&priv->sent, (GDestroyNotify) g_byte_array_unref);
+  g_array_unref (priv->batches);
+  g_free (priv);
+}
+
+static NiceSocket *
+record_socket_new (void)
+{
+  NiceSocket *sock = g_slice_new0 (NiceSocket);
+  RecordSocketPriv *priv = g_new0 (RecordSocketPriv, 1);
+
+  g_queue_init (&priv->sent);
+  priv->batches = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  sock->type = NICE_SOCKET_TYPE_UDP_BSD;
+  sock->send_messages = record_socket_send_messages;
+  sock->send_messages_reliable = record_socket_send_messages;
+  sock->is_reliable = datagram_socket_is_reliable;
+  sock->close = record_socket_close;
+  sock->priv = (void *) priv;
+
+  return sock;
+}
+
+/* Pops the next message sent through @base, which must be a STUN message of
+ * @klass and @method, and parses it into @msg, using @buf as its storage */
+static void
+pop_stun_message (NiceSocket *base, StunAgent *server, StunMessage *msg,
+    guint8 *buf, gsize buf_len, StunClass klass, StunMethod method)
+{
+  RecordSocketPriv *priv = base->priv;
+  GByteArray *data = g_queue_pop_head (&priv->sent);
+
+  g_assert (data != NULL);
+  g_assert_cmpuint (data->len, <=, buf_len);
+  memcpy (buf, data->data, data->len);
+
+  g_assert_cmpint (stun_agent_validate (server, msg, buf, data->len, NULL,
+      NULL), ==, STUN_VALIDATION_SUCCESS);
+  g_assert_cmpint (stun_message_get_class (msg), ==, klass);
+  g_assert_cmpint (stun_message_get_method (msg), ==, method);
+
+  g_byte_array_unref (data);
+}
+
+static guint
+n_sent_messages (NiceSocket *base)
+{
+  RecordSocketPriv *priv = base->priv;
+
+  return g_queue_get_length (&priv->sent);
+}
+
+/* Collects the IPv4 addresses of the XOR-PEER-ADDRESS attributes of @msg,
+ * which stun_message_find_xor_addr() would only return the first of */
+static guint
+get_xor_peer_addresses (StunMessage *msg, NiceAddress *peers, guint n_peers)
+{
+  const guint8 *buf = msg->buffer;
+  gsize len = stun_message_length (msg);
+  gsize offset = STUN_MESSAGE_ATTRIBUTES_POS;
+  guint n = 0;
+
+  while (offset + STUN_ATTRIBUTE_HEADER_LENGTH <= len) {
+    guint16 type = (buf[offset] << 8) | buf[offset + 1];
+    guint16 alen = (buf[offset + 2] << 8) | buf[offset + 3];
+    const guint8 *value = buf + offset + STUN_ATTRIBUTE_HEADER_LENGTH;
+
+    if (type == STUN_ATTRIBUTE_XOR_PEER_ADDRESS) {
+      struct sockaddr_in sin;
+      guint32 ip = ((guint32) value[4] << 24) | (value[5] << 16) |
+          (value[6] << 8) | value[7];
+
+      g_assert_cmpuint (alen, ==, 8);
+      g_assert_cmpuint (value[1], ==, 1); /* IPv4 */
+      g_assert_cmpuint (n, <, n_peers);
+
+      memset (&sin, 0, sizeof (sin));
+      sin.sin_family = AF_INET;
+      sin.sin_port = htons (((value[2] << 8) | value[3]) ^
+          (STUN_MAGIC_COOKIE >> 16));
+      sin.sin_addr.s_addr = htonl (ip ^ STUN_MAGIC_COOKIE);
+      nice_address_set_from_sockaddr (&peers[n++], (struct sockaddr *) &sin);
+    }
+
+    offset += STUN_ATTRIBUTE_HEADER_LENGTH + ((alen + 3) & ~3);
+  }
+
+  return n;
+}
+
+/* Answers @request, as the TURN server at @server_addr, with a success */
+static void
+respond_success (NiceSocket *turnsock, StunAgent *server,
+    const NiceAddress *server_addr, StunMessage *request)
+{
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  guint8 payload[STUN_MAX_MESSAGE_SIZE];
+  StunMessage response;
+  NiceSocket *from_sock = NULL;
+  NiceAddress from;
+  size_t len;
+
+  g_assert (stun_agent_init_response (server, &response, buf, sizeof (buf),
+      request));
+  len = stun_agent_finish_message (server, &response, NULL, 0);
+  g_assert_cmpuint (len, >, 0);
+
+  g_assert_cmpuint (nice_udp_turn_socket_parse_recv (turnsock, &from_sock,
+      &from, sizeof (payload), payload, server_addr, buf, len), ==, 0);
+}
+
+static NiceSocket *
+turn_pipelining_socket_new (NiceSocket *base, NiceAddress *server_addr,
+    StunAgent *server)
+{
+  nice_address_set_from_string (server_addr, "127.0.0.1");
+  nice_address_set_port (server_addr, 3478);
+
+  stun_agent_init (server, STUN_ALL_KNOWN_ATTRIBUTES,
+      STUN_COMPATIBILITY_RFC5389, STUN_AGENT_USAGE_IGNORE_CREDENTIALS);
+
+  /* No credentials, so that the responses need no MESSAGE-INTEGRITY */
+  return nice_udp_turn_socket_new (NULL, server_addr, base, server_addr, "",
+      "", NICE_TURN_SOCKET_COMPATIBILITY_RFC5766);
+}
+
+/* Pops the next ChannelBind sent through @base, which must be for @peer, and
+ * returns its channel number */
+static guint16
+pop_channel_bind (NiceSocket *base, StunAgent *server, StunMessage *msg,
+    guint8 *buf, gsize buf_len, const NiceAddress *peer)
+{
+  NiceAddress bound_peer;
+  uint32_t channel;
+
+  pop_stun_message (base, server, msg, buf, buf_len, STUN_REQUEST,
+      STUN_CHANNELBIND);
+  g_assert_cmpuint (get_xor_peer_addresses (msg, &bound_peer, 1), ==, 1);
+  g_assert (nice_address_equal (&bound_peer, peer));
+  g_assert_cmpint (stun_message_find32 (msg, STUN_ATTRIBUTE_CHANNEL_NUMBER,
+      &channel), ==, STUN_MESSAGE_RETURN_SUCCESS);
+
+  return channel >> 16;
+}
+
+static void
+concurrent_channel_binds (void)
+{
+  /* Channel bindings for several peers are in flight at once, up to the
+   * transaction limit, each with its own channel number */
+  NiceSocket *base, *turnsock;
+  NiceAddress server_addr, peers[3];
+  StunAgent server;
+  StunMessage requests[3];
+  guint8 buffers[3][STUN_MAX_MESSAGE_SIZE];
+  guint16 channels[3];
+  guint i;
+
+  base = record_socket_new ();
+  turnsock = turn_pipelining_socket_new (base, &server_addr, &server);
+  nice_udp_turn_socket_set_max_transactions (turnsock, 2);
+
+  for (i = 0; i < G_N_ELEMENTS (peers); i++) {
+    gchar *ip = g_strdup_printf ("127.0.0.%u", i + 2);
+
+    g_assert (nice_address_set_from_string (&peers[i], ip));
+    nice_address_set_port (&peers[i], 5000);
+    nice_udp_turn_socket_set_peer (turnsock, &peers[i]);
+    g_free (ip);
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  /* The first two are sent without waiting for each other, the third one
+   * waits for a transaction to complete */
+  g_assert_cmpuint (n_sent_messages (base), ==, 2);
+  for (i = 0; i < 2; i++)
+    channels[i] = pop_channel_bind (base, &server, &requests[i], buffers[i],
+        sizeof (buffers[i]), &peers[i]);
+  g_assert_cmpuint (channels[0], !=, channels[1]);
+
+  /* Completing the second one, out of order, lets the third one start */
+  respond_success (turnsock, &server, &server_addr, &requests[1]);
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_assert_cmpuint (n_sent_messages (base), ==, 1);
+  channels[2] = pop_channel_bind (base, &server, &requests[2], buffers[2],
+      sizeof (buffers[2]), &peers[2]);
+  g_assert_cmpuint (channels[2], !=, channels[0]);
+  g_assert_cmpuint (channels[2], !=, channels[1]);
+
+  nice_socket_free (turnsock);
+  nice_socket_free (base);
+}
+
+#define N_PERMISSION_PEERS 10
+
+static void
+multi_peer_permission (void)
+{
+  /* Permissions requested together are sent in a single CreatePermission,
+   * of at most 8 peers, and the data waiting for them is sent once it
+   * succeeds */
+  NiceSocket *base, *turnsock;
+  NiceAddress server_addr, peers[N_PERMISSION_PEERS];
+  NiceAddress request_peers[N_PERMISSION_PEERS];
+  StunAgent server;
+  StunMessage msg;
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  guint i;
+
+  base = record_socket_new ();
+  turnsock = turn_pipelining_socket_new (base, &server_addr, &server);
+  nice_udp_turn_socket_set_max_transactions (turnsock, 1);
+
+  for (i = 0; i < N_PERMISSION_PEERS; i++) {
+    gchar *ip = g_strdup_printf ("127.0.0.%u", i + 2);
+    guint8 payload[] = { 'p', i };
+
+    g_assert (nice_address_set_from_string (&peers[i], ip));
+    nice_address_set_port (&peers[i], 5000);
+    g_assert_cmpint (nice_socket_send (turnsock, &peers[i], sizeof (payload),
+        (gchar *) payload), ==, sizeof (payload));
+    g_free (ip);
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  g_assert_cmpuint (n_sent_messages (base), ==, 1);
+  pop_stun_message (base, &server, &msg, buf, sizeof (buf), STUN_REQUEST,
+      STUN_CREATEPERMISSION);
+  g_assert_cmpuint (get_xor_peer_addresses (&msg, request_peers,
+      N_PERMISSION_PEERS), ==, 8);
+  for (i = 0; i < 8; i++)
+    g_assert (nice_address_equal (&request_peers[i], &peers[i]));
+
+  respond_success (turnsock, &server, &server_addr, &msg);
+
+  /* The queued data of each peer, then the next batch of peers */
+  g_assert_cmpuint (n_sent_messages (base), ==, 9);
+  for (i = 0; i < 8; i++) {
+    const guint8 *data;
+    uint16_t data_len;
+    NiceAddress peer;
+
+    pop_stun_message (base, &server, &msg, buf, sizeof (buf), STUN_INDICATION,
+        STUN_SEND);
+    g_assert_cmpuint (get_xor_peer_addresses (&msg, &peer, 1), ==, 1);
+    g_assert (nice_address_equal (&peer, &peers[i]));
+    data = stun_message_find (&msg, STUN_ATTRIBUTE_DATA, &data_len);
+    g_assert_cmpuint (data_len, ==, 2);
+    g_assert_cmpuint (data[0], ==, 'p');
+    g_assert_cmpuint (data[1], ==, i);
+  }
+
+  pop_stun_message (base, &server, &msg, buf, sizeof (buf), STUN_REQUEST,
+      STUN_CREATEPERMISSION);
+  g_assert_cmpuint (get_xor_peer_addresses (&msg, request_peers,
+      N_PERMISSION_PEERS), ==, 2);
+  g_assert (nice_address_equal (&request_peers[0], &peers[8]));
+  g_assert (nice_address_equal (&request_peers[1], &peers[9]));
+
+  nice_socket_free (turnsock);
+  nice_socket_free (base);
+}
+
+#define N_QUEUED_SENDS 300
+#define N_RELIABLE_SENDS 100
+/* TURN_SEND_DATA_BATCH in udp-turn.c */
+#define SEND_DATA_BATCH 32
+
+/* Sends a message to @peer tagged with @kind and @index, returning what the
+ * socket did */
+static gint
+send_tagged (NiceSocket *turnsock, const NiceAddress *peer, gchar kind,
+    guint index)
+{
+  guint8 payload[1000] = { 0, };
+  GOutputVector vector = { payload, sizeof (payload) };
+  NiceOutputMessage message = { &vector, 1 };
+
+  payload[0] = kind;
+  payload[1] = index >> 8;
+  payload[2] = index & 0xff;
+
+  if (kind == 'r')
+    return nice_socket_send_messages_reliable (turnsock, peer, &message, 1);
+  return nice_socket_send_messages (turnsock, peer, &message, 1);
+}
+
+/* Pops the next Send indication sent through @base, which must be for @peer
+ * and carry the message tagged with @kind and @index */
+static void
+pop_tagged (NiceSocket *base, StunAgent *server, const NiceAddress *peer,
+    gchar kind, guint index)
+{
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  StunMessage msg;
+  NiceAddress to;
+  const guint8 *data;
+  uint16_t data_len;
+
+  pop_stun_message (base, server, &msg, buf, sizeof (buf), STUN_INDICATION,
+      STUN_SEND);
+  g_assert_cmpuint (get_xor_peer_addresses (&msg, &to, 1), ==, 1);
+  g_assert (nice_address_equal (&to, peer));
+  data = stun_message_find (&msg, STUN_ATTRIBUTE_DATA, &data_len);
+  g_assert_cmpuint (data_len, ==, 1000);
+  g_assert_cmpint (data[0], ==, kind);
+  g_assert_cmpuint ((data[1] << 8) | data[2], ==, index);
+}
+
+/* Lets the permission requested for @peer succeed, sending the data queued
+ * for it */
+static void
+grant_permission (NiceSocket *turnsock, NiceSocket *base, StunAgent *server,
+    const NiceAddress *server_addr, const NiceAddress *peer)
+{
+  RecordSocketPriv *base_priv = base->priv;
+  guint8 buf[STUN_MAX_MESSAGE_SIZE];
+  StunMessage msg;
+  NiceAddress permission_peer;
+
+  while (g_main_context_iteration (NULL, FALSE));
+  g_assert_cmpuint (n_sent_messages (base), ==, 1);
+  pop_stun_message (base, server, &msg, buf, sizeof (buf), STUN_REQUEST,
+      STUN_CREATEPERMISSION);
+  g_assert_cmpuint (get_xor_peer_addresses (&msg, &permission_peer, 1), ==, 1);
+  g_assert (nice_address_equal (&permission_peer, peer));
+
+  g_array_set_size (base_priv->batches, 0);
+  respond_success (turnsock, server, server_addr, &msg);
+}
+
+static void
+send_queue_bound (void)
+{
+  /* Without a permission for the peer, data is queued, up to 256 kB per
+   * socket. The oldest non-reliable data is dropped to make room, reliable
+   * data never is: sends which do not fit are refused instead. */
+  NiceSocket *base, *turnsock;
+  RecordSocketPriv *base_priv;
+  NiceAddress server_addr, peers[3];
+  StunAgent server;
+  gsize queued_bytes, framed_len;
+  guint64 dropped, dropped_bytes, total_dropped;
+  guint i, n_queued, n_reliable;
+
+  base = record_socket_new ();
+  base_priv = base->priv;
+  /* Reliable sends are only accepted over a stream base socket */
+  base->type = NICE_SOCKET_TYPE_UDP_TURN_OVER_TCP;
+  turnsock = turn_pipelining_socket_new (base, &server_addr, &server);
+
+  for (i = 0; i < G_N_ELEMENTS (peers); i++) {
+    gchar *ip = g_strdup_printf ("127.0.0.%u", i + 2);
+
+    g_assert (nice_address_set_from_string (&peers[i], ip));
+    nice_address_set_port (&peers[i], 5000);
+    g_free (ip);
+  }
+
+  /* Non-reliable data: the oldest is dropped */
+  for (i = 0; i < N_QUEUED_SENDS; i++)
+    g_assert_cmpint (send_tagged (turnsock, &peers[0], 'u', i), ==, 1);
+
+  nice_udp_turn_socket_get_send_queue_stats (turnsock, &queued_bytes,
+      &dropped, &dropped_bytes);
+  g_assert_cmpuint (queued_bytes, <=, 256 * 1024);
+  g_assert_cmpuint (dropped, >, 0);
+  g_assert_cmpuint (dropped, <, N_QUEUED_SENDS);
+  /* Every message is framed the same, whether it was dropped or not */
+  framed_len = dropped_bytes / dropped;
+  g_assert_cmpuint (queued_bytes + dropped_bytes, ==,
+      N_QUEUED_SENDS * framed_len);
+  n_queued = N_QUEUED_SENDS - dropped;
+  total_dropped = dropped;
+
+  /* The newest data is sent once the permission is installed, in batches */
+  grant_permission (turnsock, base, &server, &server_addr, &peers[0]);
+  g_assert_cmpuint (n_sent_messages (base), ==, n_queued);
+  for (i = dropped; i < N_QUEUED_SENDS; i++)
+    pop_tagged (base, &server, &peers[0], 'u', i);
+  g_assert_cmpuint (base_priv->batches->len, ==,
+      (n_queued + SEND_DATA_BATCH - 1) / SEND_DATA_BATCH);
+  for (i = 0; i + 1 < base_priv->batches->len; i++)
+    g_assert_cmpuint (g_array_index (base_priv->batches, guint, i), ==,
+        SEND_DATA_BATCH);
+
+  /* Reliable data queued first is kept while newer non-reliable data is
+   * dropped */
+  for (i = 0; i < N_RELIABLE_SENDS; i++)
+    g_assert_cmpint (send_tagged (turnsock, &peers[1], 'r', i), ==, 1);
+  for (i = 0; i < N_QUEUED_SENDS; i++)
+    g_assert_cmpint (send_tagged (turnsock, &peers[1], 'u', i), ==, 1);
+
+  nice_udp_turn_socket_get_send_queue_stats (turnsock, &queued_bytes,
+      &dropped, NULL);
+  g_assert_cmpuint (queued_bytes, ==, n_queued * framed_len);
+  g_assert_cmpuint (dropped - total_dropped, ==,
+      N_RELIABLE_SENDS + N_QUEUED_SENDS - n_queued);
+  total_dropped = dropped;
+
+  grant_permission (turnsock, base, &server, &server_addr, &peers[1]);
+  g_assert_cmpuint (n_sent_messages (base), ==, n_queued);
+  for (i = 0; i < N_RELIABLE_SENDS; i++)
+    pop_tagged (base, &server, &peers[1], 'r', i);
+  for (i = N_QUEUED_SENDS - (n_queued - N_RELIABLE_SENDS); i < N_QUEUED_SENDS;
+       i++)
+    pop_tagged (base, &server, &peers[1], 'u', i);
+
+  /* Once the queue is full of reliable data, sends are refused */
+  g_assert_cmpint (send_tagged (turnsock, &peers[2], 'u', 0), ==, 1);
+  for (n_reliable = 0; n_reliable <= n_queued; n_reliable++) {
+    if (send_tagged (turnsock, &peers[2], 'r', n_reliable) < 0)
+      break;
+  }
+  g_assert_cmpuint (n_reliable, ==, n_queued);
+  g_assert_cmpint (send_tagged (turnsock, &peers[2], 'u', 1), ==, 0);
+
+  nice_udp_turn_socket_get_send_queue_stats (turnsock, &queued_bytes,
+      &dropped, NULL);
+  g_assert_cmpuint (queued_bytes, ==, n_queued * framed_len);
+  /* Only the non-reliable message sent first made room */
+  g_assert_cmpuint (dropped - total_dropped, ==, 1);
+
+  grant_permission (turnsock, base, &server, &server_addr, &peers[2]);
+  g_assert_cmpuint (n_sent_messages (base), ==, n_queued);
+  for (i = 0; i < n_queued; i++)
+    pop_tagged (base, &server, &peers[2], 'r', i);
+
+  nice_socket_free (turnsock);
+  nice_socket_free (base);
+}
+
+/* Answers each request sent through @base with a success, and drops the
+ * other messages, until @base has nothing left */
+static void
+answer_requests (NiceSocket *turnsock, NiceSocket *base, StunAgent *server,
+    const NiceAddress *server_addr)
+{
+  RecordSocketPriv *priv = base->priv;
+  GByteArray *data;
+
+  while ((data = g_queue_pop_head (&priv->sent)) != NULL) {
+    guint8 buf[STUN_MAX_MESSAGE_SIZE];
+    StunMessage msg;
+
+    g_assert_cmpuint (data->len, <=, sizeof (buf));
+    memcpy (buf, data->data, data->len);
+    g_assert_cmpint (stun_agent_validate (server, &msg, buf, data->len, NULL,
+        NULL), ==, STUN_VALIDATION_SUCCESS);
+    if (stun_message_get_class (&msg) == STUN_REQUEST)
+      respond_success (turnsock, server, server_addr, &msg);
+
+    g_byte_array_unref (data);
+  }
+}
+
+#define N_TIMED_CHANNEL_MESSAGES 20000
+
+/* Sets up a permission and a channel for each of @n_peers peers, and then
+ * times sending and receiving ChannelData spread over all of them. Returns
+ * the cost of a send plus a receive, in nanoseconds. */
+static gdouble
+time_channel_data (guint n_peers)
+{
+  NiceSocket *base, *turnsock;
+  RecordSocketPriv *base_priv;
+  NiceAddress server_addr;
+  NiceAddress *peers;
+  StunAgent server;
+  guint16 *channels;
+  guint8 payload[100] = { 0, };
+  guint8 frame[4 + sizeof (payload)];
+  guint8 recv_payload[sizeof (payload)];
+  gint64 start, send_time, recv_time;
+  guint i;
+
+  base = record_socket_new ();
+  base_priv = base->priv;
+  turnsock = turn_pipelining_socket_new (base, &server_addr, &server);
+  nice_udp_turn_socket_set_max_transactions (turnsock, n_peers);
+
+  peers = g_new (NiceAddress, n_peers);
+  channels = g_new (guint16, n_peers);
+
+  /* A ChannelBind does not install a permission here, so data is sent to
+   * each peer first */
+  for (i = 0; i < n_peers; i++) {
+    gchar *ip = g_strdup_printf ("10.0.%u.%u", i / 250, i % 250 + 1);
+
+    g_assert (nice_address_set_from_string (&peers[i], ip));
+    nice_address_set_port (&peers[i], 5000);
+    g_free (ip);
+    g_assert_cmpint (nice_socket_send (turnsock, &peers[i], sizeof (payload),
+        (gchar *) payload), ==, sizeof (payload));
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+  answer_requests (turnsock, base, &server, &server_addr);
+
+  for (i = 0; i < n_peers; i++)
+    g_assert (nice_udp_turn_socket_set_peer (turnsock, &peers[i]));
+  while (g_main_context_iteration (NULL, FALSE));
+  answer_requests (turnsock, base, &server, &server_addr);
+
+  /* Every peer now gets ChannelData, which tells its channel */
+  for (i = 0; i < n_peers; i++) {
+    GByteArray *data;
+
+    g_assert_cmpint (nice_socket_send (turnsock, &peers[i], sizeof (payload),
+        (gchar *) payload), ==, sizeof (payload));
+    data = g_queue_pop_head (&base_priv->sent);
+    g_assert (data != NULL);
+    g_assert_cmpuint (data->len, ==, sizeof (frame));
+    channels[i] = (data->data[0] << 8) | data->data[1];
+    g_assert_cmpuint (channels[i], >=, 0x4000);
+    g_byte_array_unref (data);
+  }
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < N_TIMED_CHANNEL_MESSAGES; i++)
+    g_assert_cmpint (nice_socket_send (turnsock, &peers[i % n_peers],
+        sizeof (payload), (gchar *) payload), ==, sizeof (payload));
+  send_time = g_get_monotonic_time () - start;
+  g_assert_cmpuint (n_sent_messages (base), ==, N_TIMED_CHANNEL_MESSAGES);
+
+  memset (frame, 0, sizeof (frame));
+  frame[2] = sizeof (payload) >> 8;
+  frame[3] = sizeof (payload) & 0xff;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < N_TIMED_CHANNEL_MESSAGES; i++) {
+    NiceSocket *from_sock = NULL;
+    NiceAddress from;
+
+    frame[0] = channels[i % n_peers] >> 8;
+    frame[1] = channels[i % n_peers] & 0xff;
+    g_assert_cmpuint (nice_udp_turn_socket_parse_recv (turnsock, &from_sock,
+        &from, sizeof (recv_payload), recv_payload, &server_addr, frame,
+        sizeof (frame)), ==, sizeof (payload));
+    g_assert (nice_address_equal (&from, &peers[i % n_peers]));
+  }
+  recv_time = g_get_monotonic_time () - start;
+
+  g_test_minimized_result (send_time * 1000.0 / N_TIMED_CHANNEL_MESSAGES,
+      "udp-turn: ChannelData send with %u peers: ns", n_peers);
+  g_test_minimized_result (recv_time * 1000.0 / N_TIMED_CHANNEL_MESSAGES,
+      "udp-turn: ChannelData receive with %u peers: ns", n_peers);
+
+  g_free (channels);
+  g_free (peers);
+  nice_socket_free (turnsock);
+  nice_socket_free (base);
+
+  return (send_time + recv_time) * 1000.0 / N_TIMED_CHANNEL_MESSAGES;
+}
+
+static void
+channel_lookup_timing (void)
+{
+  /* Channels and permissions are found through hash tables, so the cost
+   * per message should not grow with the number of peers. A linear search
+   * would make 512 peers about 64 times as slow as 8; the margin covers
+   * cache misses over the larger tables. */
+  gdouble few, many;
+
+  few = time_channel_data (8);
+  many = time_channel_data (512);
+
+  g_assert_cmpfloat (many, <, few * 4);
+}
+
+#define N_MEMORY_SOCKETS 32
+#define N_MEMORY_PEERS 32
+
+/* Returns the size of the data segment of the process, heap and anonymous
+ * mappings included, or -1 if the platform does not tell */
+static gssize
+get_data_size (void)
+{
+  gchar *status = NULL;
+  const gchar *line;
+  gssize size = -1;
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return -1;
+
+  line = strstr (status, "\nVmData:");
+  if (line != NULL)
+    size = g_ascii_strtoll (line + strlen ("\nVmData:"), NULL, 10) * 1024;
+  g_free (status);
+
+  return size;
+}
+
+static void
+in_flight_message_memory (void)
+{
+  /* Each request in flight is built in an MTU-sized slab, rather than in a
+   * buffer of STUN_MAX_MESSAGE_SIZE, so sockets with many peers stay small */
+  NiceSocket *bases[N_MEMORY_SOCKETS], *turnsocks[N_MEMORY_SOCKETS];
+  NiceAddress server_addr, peer;
+  StunAgent server;
+  gssize before, after;
+  guint n_messages = N_MEMORY_SOCKETS * N_MEMORY_PEERS;
+  guint i, j;
+
+  before = get_data_size ();
+
+  g_assert (nice_address_set_from_string (&peer, "127.0.0.2"));
+  for (i = 0; i < N_MEMORY_SOCKETS; i++) {
+    bases[i] = record_socket_new ();
+    turnsocks[i] = turn_pipelining_socket_new (bases[i], &server_addr,
+        &server);
+    nice_udp_turn_socket_set_max_transactions (turnsocks[i], N_MEMORY_PEERS);
+
+    for (j = 0; j < N_MEMORY_PEERS; j++) {
+      nice_address_set_port (&peer, 5000 + j);
+      nice_udp_turn_socket_set_peer (turnsocks[i], &peer);
+    }
+  }
+  while (g_main_context_iteration (NULL, FALSE));
+
+  for (i = 0; i < N_MEMORY_SOCKETS; i++)
+    g_assert_cmpuint (n_sent_messages (bases[i]), ==, N_MEMORY_PEERS);
+
+  after = get_data_size ();
+
+  if (before < 0 || after < 0) {
+    g_test_skip ("the size of the data segment is unknown");
+  } else {
+    g_test_minimized_result ((gdouble) (after - before) / n_messages,
+        "udp-turn: data segment growth per ChannelBind request in flight, "
+        "with %u in flight: bytes", n_messages);
+
+    /* 64 KiB each before, everything the sockets hold included */
+    g_assert_cmpint (after - before, <, (gssize) n_messages * 16 * 1024);
+  }
+
+  for (i = 0; i < N_MEMORY_SOCKETS; i++) {
+    nice_socket_free (turnsocks[i]);
+    nice_socket_free (bases[i]);
+  }
+}
+
+#define N_TIMED_RELAYED_SENDS 20000
+
+typedef struct {
+  NiceSocket *base;
+  NiceSocket *turnsock;
+  NiceAddress peer;
+} RelayedSender;
+
+static gpointer
+relayed_send_thread (gpointer data)
+{
+  RelayedSender *sender = data;
+  guint8 payload[100] = { 0, };
+  guint i;
+
+  for (i = 0; i < N_TIMED_RELAYED_SENDS; i++)
+    g_assert_cmpint (nice_socket_send (sender->turnsock, &sender->peer,
+        sizeof (payload), (gchar *) payload), ==, sizeof (payload));
+
+  return NULL;
+}
+
+/* Sends on @n_threads TURN sockets at once, one per thread, and returns the
+ * aggregate number of sends per second */
+static gdouble
+time_relayed_sends (RelayedSender *senders, guint n_threads)
+{
+  GThread *threads[16];
+  gint64 start, elapsed;
+  guint i;
+
+  start = g_get_monotonic_time ();
+  for (i = 0; i < n_threads; i++)
+    threads[i] = g_thread_new ("relayed-send", relayed_send_thread,
+        &senders[i]);
+  for (i = 0; i < n_threads; i++)
+    g_thread_join (threads[i]);
+  elapsed = g_get_monotonic_time () - start;
+
+  return n_threads * N_TIMED_RELAYED_SENDS * (gdouble) G_USEC_PER_SEC /
+      MAX (elapsed, 1);
+}
+
+static void
+threaded_relayed_send (void)
+{
+  /* TURN sockets of different agents share no lock, so relayed sends from
+   * several threads scale with the number of cores. Send indications of
+   * DRAFT9 need no permission, so each send goes straight to the server. */
+  RelayedSender senders[16];
+  NiceSocket *server;
+  NiceAddress server_addr;
+  guint n_threads = CLAMP (g_get_num_processors (), 2, G_N_ELEMENTS (senders));
+  gdouble single_rate, threaded_rate;
+  guint i;
+
+  /* Never read, the kernel drops what does not fit in its receive buffer */
+  server = nice_udp_bsd_socket_new (NULL);
+  g_assert (server != NULL);
+  g_assert (nice_address_set_from_string (&server_addr, "127.0.0.1"));
+  nice_address_set_port (&server_addr, nice_address_get_port (&server->addr));
+
+  for (i = 0; i < n_threads; i++) {
+    senders[i].base = nice_udp_bsd_socket_new (NULL);
+    g_assert (senders[i].base != NULL);
+    senders[i].turnsock = nice_udp_turn_socket_new (NULL, &server_addr,
+        senders[i].base, &server_addr, "username", "password",
+        NICE_TURN_SOCKET_COMPATIBILITY_DRAFT9);
+    g_assert (senders[i].turnsock != NULL);
+    g_assert (nice_address_set_from_string (&senders[i].peer, "127.0.0.2"));
+    nice_address_set_port (&senders[i].peer, 5000 + i);
+  }
+
+  single_rate = time_relayed_sends (senders, 1);
+  threaded_rate = time_relayed_sends (senders, n_threads);
+
+  g_test_maximized_result (single_rate, "udp-turn: relayed sends/s, 1 thread");
+  g_test_maximized_result (threaded_rate, "udp-turn: relayed sends/s, %u "
+      "threads", n_threads);
+
+  /* With no lock shared between the sockets, the threads run in parallel */
+  if (g_get_num_processors () > 1)
+    g_assert_cmpfloat (threaded_rate, >, single_rate);
+
+  for (i = 0; i < n_threads; i++) {
+    nice_socket_free (senders[i].turnsock);
+    nice_socket_free (senders[i].base);
+  }
+  nice_socket_free (server);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -217,6 +1122,18 @@ main (int argc, char *argv[])
   mainloop = g_main_loop_new (NULL, TRUE);
 
   g_test_add_func ("/udp-turn/tcp-fragmentation", tcp_turn_fragmentation);
+  g_test_add_func ("/udp-turn-over-tcp/frames", tcp_turn_frames);
+  g_test_add_func ("/udp-turn/send-queue-bound", send_queue_bound);
+  g_test_add_func ("/udp-turn/concurrent-channel-binds",
+      concurrent_channel_binds);
+  g_test_add_func ("/udp-turn/multi-peer-permission", multi_peer_permission);
+  g_test_add_func ("/udp-turn/in-flight-message-memory",
+      in_flight_message_memory);
+
+  if (g_test_perf ()) {
+    g_test_add_func ("/udp-turn/channel-lookup-timing", channel_lookup_timing);
+    g_test_add_func ("/udp-turn/threaded-relayed-send", threaded_relayed_send);
+  }
 
   g_test_run ();
 